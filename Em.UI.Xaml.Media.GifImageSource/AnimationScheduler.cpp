@@ -0,0 +1,123 @@
+﻿#include "pch.h"
+
+#include <algorithm>
+
+#include "AnimationScheduler.h"
+#include "GifImageSource.h"
+#include "GifStatistics.h"
+
+using namespace Em::UI::Xaml::Media;
+
+using namespace Windows::UI::Xaml;
+using namespace Windows::Foundation;
+
+namespace
+{
+    // Created on first use on the UI thread and never destroyed, so there's no teardown of XAML
+    // objects during process exit
+    AnimationScheduler *s_pInstance = nullptr;
+}
+
+AnimationScheduler &AnimationScheduler::GetInstance()
+{
+    if (s_pInstance == nullptr)
+    {
+        s_pInstance = new AnimationScheduler();
+    }
+    return *s_pInstance;
+}
+
+INT64 AnimationScheduler::Now()
+{
+    // The same clock statistics are recorded against, so tick jitter is measured consistently
+    return Em::Gif::GifStatistics::Now();
+}
+
+AnimationScheduler::AnimationScheduler()
+    : m_dispatching(false)
+{
+    m_timer = ref new DispatcherTimer();
+    m_timer->Tick += ref new EventHandler<Object^>([this](Object^, Object^)
+    {
+        OnTick();
+    });
+}
+
+uint32_t AnimationScheduler::Register(GifImageSource ^source)
+{
+    auto id = m_scheduler.Register();
+    m_sources.insert(std::make_pair(id, Platform::WeakReference(source)));
+    return id;
+}
+
+void AnimationScheduler::Unregister(uint32_t id)
+{
+    m_scheduler.Unregister(id);
+    m_sources.erase(id);
+    UpdateTimer();
+}
+
+void AnimationScheduler::Schedule(uint32_t id, INT64 deadline)
+{
+    m_scheduler.Schedule(id, deadline);
+    UpdateTimer();
+}
+
+void AnimationScheduler::Cancel(uint32_t id)
+{
+    m_scheduler.Cancel(id);
+    UpdateTimer();
+}
+
+void AnimationScheduler::UpdateTimer()
+{
+    // Sources rescheduling themselves from OnTick are picked up once dispatch finishes
+    if (m_dispatching)
+        return;
+
+    INT64 wakeup;
+    if (!m_scheduler.GetNextWakeup(wakeup))
+    {
+        m_timer->Stop();
+        return;
+    }
+
+    auto interval = TimeSpan();
+    interval.Duration = std::max<INT64>(0, wakeup - Now());
+
+    m_timer->Interval = interval;
+    if (!m_timer->IsEnabled)
+    {
+        m_timer->Start();
+    }
+}
+
+void AnimationScheduler::OnTick()
+{
+    auto now = Now();
+    m_scheduler.PopDue(now, m_due);
+
+    m_dispatching = true;
+
+    for (auto &tick : m_due)
+    {
+        auto it = m_sources.find(tick.id);
+        if (it == m_sources.end())
+            continue;
+
+        auto source = it->second.Resolve<GifImageSource>();
+        if (source == nullptr)
+        {
+            // The image source was collected without being stopped
+            m_scheduler.Unregister(tick.id);
+            m_sources.erase(it);
+            continue;
+        }
+
+        source->OnScheduledTick(tick.deadline, now);
+    }
+
+    m_dispatching = false;
+
+    UpdateTimer();
+}
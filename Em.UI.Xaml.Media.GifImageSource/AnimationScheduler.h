@@ -0,0 +1,65 @@
+﻿#pragma once
+
+#include "GifScheduler.h"
+
+namespace Em {
+    namespace UI {
+        namespace Xaml {
+            namespace Media
+            {
+                ref class GifImageSource;
+
+                /// <summary>
+                /// Drives every GifImageSource on the UI thread from a single DispatcherTimer. The timer
+                /// is only ever set for the earliest pending deadline, and animations falling due on the
+                /// same display refresh are all advanced from one wakeup.
+                /// </summary>
+                /// <remarks>
+                /// Must only be used from the UI thread.
+                /// </remarks>
+                class AnimationScheduler
+                {
+                public:
+                    static AnimationScheduler &GetInstance();
+
+                    /// <summary>
+                    /// Gets the current time in 100ns ticks of a monotonic clock.
+                    /// </summary>
+                    static INT64 Now();
+
+                    /// <summary>
+                    /// Adds an image source. It's only weakly referenced, and is dropped once it's gone.
+                    /// </summary>
+                    uint32_t Register(GifImageSource ^source);
+                    void Unregister(uint32_t id);
+
+                    /// <summary>
+                    /// Asks for the image source's OnScheduledTick to be called at the deadline.
+                    /// </summary>
+                    void Schedule(uint32_t id, INT64 deadline);
+                    void Cancel(uint32_t id);
+
+                    /// <summary>
+                    /// Gets how far an image source moves on at a deadline, as GifScheduler::GetElapsed.
+                    /// </summary>
+                    INT64 GetElapsed(INT64 lastTick, INT64 deadline, INT64 now) const { return m_scheduler.GetElapsed(lastTick, deadline, now); }
+
+                    Em::Gif::GifSchedulerStatistics GetStatistics() const { return m_scheduler.GetStatistics(); }
+
+                private:
+                    AnimationScheduler();
+
+                    void UpdateTimer();
+                    void OnTick();
+
+                    Em::Gif::GifScheduler m_scheduler;
+                    std::unordered_map<uint32_t, Platform::WeakReference> m_sources;
+                    std::vector<Em::Gif::GifScheduledTick> m_due;
+                    bool m_dispatching;
+
+                    Windows::UI::Xaml::DispatcherTimer^ m_timer;
+                };
+            }
+        }
+    }
+}
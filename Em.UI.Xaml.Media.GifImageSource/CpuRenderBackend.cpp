@@ -0,0 +1,109 @@
+﻿#include "CpuRenderBackend.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+using namespace Em::Gif;
+
+CpuRenderBackend::CpuRenderBackend()
+    : m_width(0),
+    m_height(0),
+    m_hasContents(false),
+    m_presentedFrames(0),
+    m_updatedPixels(0)
+{
+    m_updateRect = {};
+}
+
+void CpuRenderBackend::SetSize(uint32_t width, uint32_t height)
+{
+    auto resized = width != m_width || height != m_height;
+
+    m_width = width;
+    m_height = height;
+    m_target.assign(static_cast<size_t>(width) * height, 0);
+    m_hasContents = false;
+    ReleaseFrames();
+
+    if (resized)
+        ReleaseSpareFrames();
+}
+
+void CpuRenderBackend::ReserveFrames(uint32_t frameCount)
+{
+    m_slab.reserve(frameCount * m_target.size());
+}
+
+void CpuRenderBackend::StoreFrame(uint32_t frameIndex, const uint32_t *pPixels)
+{
+    StoreFrames(frameIndex, 1, pPixels);
+}
+
+void CpuRenderBackend::StoreFrames(uint32_t firstFrame, uint32_t frameCount, const uint32_t *pPixels)
+{
+    auto cPixels = m_target.size();
+    auto cEnd = (firstFrame + frameCount) * cPixels;
+    if (cEnd > m_slab.size())
+        m_slab.resize(cEnd);
+
+    std::memcpy(m_slab.data() + firstFrame * cPixels, pPixels, frameCount * cPixels * sizeof(uint32_t));
+}
+
+void CpuRenderBackend::ReleaseFrames()
+{
+    m_slab.clear();
+}
+
+void CpuRenderBackend::ReleaseSpareFrames()
+{
+    m_slab.shrink_to_fit();
+}
+
+bool CpuRenderBackend::BeginDraw(const GifRect &updateRect)
+{
+    if (m_hasContents)
+    {
+        m_updateRect = updateRect;
+    }
+    else
+    {
+        GifRect full = { 0, 0, m_width, m_height };
+        m_updateRect = full;
+    }
+
+    auto &rect = m_updateRect;
+    for (uint32_t y = rect.top; y < rect.top + rect.height; y++)
+    {
+        auto pRow = m_target.data() + static_cast<size_t>(y) * m_width + rect.left;
+        std::fill(pRow, pRow + rect.width, 0);
+    }
+
+    m_updatedPixels += static_cast<uint64_t>(rect.width) * rect.height;
+    return true;
+}
+
+void CpuRenderBackend::DrawStoredFrame(uint32_t frameIndex)
+{
+    auto cPixels = m_target.size();
+    if ((frameIndex + 1) * cPixels > m_slab.size())
+        throw std::out_of_range("frame not stored");
+
+    DrawPixels(m_slab.data() + frameIndex * cPixels);
+}
+
+void CpuRenderBackend::DrawPixels(const uint32_t *pPixels)
+{
+    auto &rect = m_updateRect;
+    for (uint32_t y = rect.top; y < rect.top + rect.height; y++)
+    {
+        auto offset = static_cast<size_t>(y) * m_width + rect.left;
+        std::memcpy(m_target.data() + offset, pPixels + offset, rect.width * sizeof(uint32_t));
+    }
+}
+
+void CpuRenderBackend::EndDraw()
+{
+    m_hasContents = true;
+    m_presentedFrames++;
+}
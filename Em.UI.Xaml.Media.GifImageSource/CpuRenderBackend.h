@@ -0,0 +1,69 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "GifRenderBackend.h"
+
+namespace Em {
+    namespace Gif
+    {
+        /// <summary>
+        /// Software backend that presents into a plain BGRA buffer. Needs no device, so the whole
+        /// load, compose and playback pipeline can run headless. Stored frames are kept back to back
+        /// in one slab.
+        /// </summary>
+        class CpuRenderBackend : public GifRenderBackend
+        {
+        public:
+            CpuRenderBackend();
+
+            virtual void SetSize(uint32_t width, uint32_t height) override;
+            virtual void ReserveFrames(uint32_t frameCount) override;
+            virtual void StoreFrame(uint32_t frameIndex, const uint32_t *pPixels) override;
+            virtual void StoreFrames(uint32_t firstFrame, uint32_t frameCount, const uint32_t *pPixels) override;
+            virtual void ReleaseFrames() override;
+            virtual void ReleaseSpareFrames() override;
+            virtual bool BeginDraw(const GifRect &updateRect) override;
+            virtual bool CheckFramesLost() override { return false; }
+            virtual void DrawStoredFrame(uint32_t frameIndex) override;
+            virtual void DrawPixels(const uint32_t *pPixels) override;
+            virtual void EndDraw() override;
+
+            /// <summary>
+            /// Gets the last presented frame.
+            /// </summary>
+            const uint32_t *GetPixels() const { return m_target.data(); }
+            uint32_t GetWidth() const { return m_width; }
+            uint32_t GetHeight() const { return m_height; }
+
+            uint64_t GetPresentedFrameCount() const { return m_presentedFrames; }
+
+            /// <summary>
+            /// Gets the number of target pixels every presented frame so far has updated, in total.
+            /// </summary>
+            uint64_t GetUpdatedPixelCount() const { return m_updatedPixels; }
+
+            /// <summary>
+            /// Gets the number of bytes held by stored frames, not counting spares.
+            /// </summary>
+            size_t GetStoredBytes() const { return m_slab.size() * sizeof(uint32_t); }
+
+        private:
+            uint32_t m_width;
+            uint32_t m_height;
+            std::vector<uint32_t> m_target;
+
+            // Set once a frame has been presented since SetSize, so the target holds it
+            bool m_hasContents;
+            GifRect m_updateRect;
+
+            // Frame i starts at i * width * height. Released frames only clear it, so its capacity
+            // is the spare storage.
+            std::vector<uint32_t> m_slab;
+            uint64_t m_presentedFrames;
+            uint64_t m_updatedPixels;
+        };
+    }
+}
@@ -0,0 +1,456 @@
+﻿#include "pch.h"
+
+#include <algorithm>
+
+#include "D2DRenderBackend.h"
+
+using namespace Em::UI::Xaml::Media;
+
+using namespace Microsoft::WRL;
+
+namespace
+{
+    D2D1_BITMAP_PROPERTIES FrameBitmapProperties()
+    {
+        return D2D1::BitmapProperties(
+            D2D1::PixelFormat(DXGI_FORMAT_B8G8R8A8_UNORM, D2D1_ALPHA_MODE_PREMULTIPLIED));
+    }
+}
+
+D2DRenderBackend::D2DRenderBackend(IUnknown *pSurfaceImageSource, Em::Gif::GifStatistics *pStatistics)
+    : m_pSurfaceImageSource(pSurfaceImageSource),
+    m_pStatistics(pStatistics),
+    m_width(0),
+    m_height(0),
+    m_useAtlas(true),
+    m_atlasLayout(true),
+    m_framesPerAtlas(0),
+    m_reservedFrames(0),
+    m_storedFrames(0),
+    m_framesLost(false),
+    m_hasContents(false)
+{
+    m_updateRect = RECT();
+    CreateDeviceResources();
+}
+
+void D2DRenderBackend::SetSize(uint32_t width, uint32_t height)
+{
+    auto resized = width != m_width || height != m_height;
+
+    m_width = width;
+    m_height = height;
+    m_hasContents = false;
+
+    ReleaseFrames();
+    if (resized)
+    {
+        ReleaseSpareFrames();
+        m_frameBitmap = nullptr;
+    }
+}
+
+void D2DRenderBackend::SetAtlasLayout(bool useAtlas)
+{
+    m_useAtlas = useAtlas;
+}
+
+void D2DRenderBackend::ReserveFrames(uint32_t frameCount)
+{
+    m_reservedFrames = frameCount;
+}
+
+void D2DRenderBackend::StoreFrame(uint32_t frameIndex, const uint32_t *pPixels)
+{
+    StoreFrames(frameIndex, 1, pPixels);
+}
+
+void D2DRenderBackend::StoreFrames(uint32_t firstFrame, uint32_t frameCount, const uint32_t *pPixels)
+{
+    auto cPixels = static_cast<size_t>(m_width) * m_height;
+    m_storedFrames = std::max(m_storedFrames, firstFrame + frameCount);
+
+    if (!m_atlasLayout || GetFramesPerAtlas() == 1)
+    {
+        // Store each displayable frame into an ID2D1Bitmap of its own
+        if (firstFrame + frameCount > m_bitmaps.size())
+            m_bitmaps.resize(firstFrame + frameCount);
+
+        for (uint32_t i = 0; i < frameCount; i++)
+        {
+            m_bitmaps.at(firstFrame + i) = CreateFrameBitmap(D2D1::SizeU(m_width, m_height), pPixels + i * cPixels);
+        }
+    }
+    else
+    {
+        // A run of frames in one atlas is a single copy, or a single creation if the run fills it
+        for (uint32_t i = 0; i < frameCount;)
+        {
+            auto frameIndex = firstFrame + i;
+            auto atlasIndex = frameIndex / m_framesPerAtlas;
+            auto row = frameIndex % m_framesPerAtlas;
+            auto cRows = std::min<UINT>(frameCount - i, m_framesPerAtlas - row);
+            auto pRun = pPixels + i * cPixels;
+
+            if (atlasIndex >= m_bitmaps.size())
+                m_bitmaps.resize(atlasIndex + 1);
+
+            auto &atlas = m_bitmaps.at(atlasIndex);
+            auto atlasSize = D2D1::SizeU(m_width, GetAtlasFrameCount(atlasIndex) * m_height);
+            if (atlas == nullptr && row == 0 && cRows * m_height == atlasSize.height)
+            {
+                atlas = CreateFrameBitmap(atlasSize, pRun);
+            }
+            else
+            {
+                if (atlas == nullptr)
+                    atlas = CreateFrameBitmap(atlasSize, nullptr);
+
+                auto rect = D2D1::RectU(0, row * m_height, m_width, (row + cRows) * m_height);
+                DX::ThrowIfFailed(
+                    atlas->CopyFromMemory(&rect, pRun, m_width * sizeof(uint32_t)));
+            }
+
+            i += cRows;
+        }
+    }
+
+    // Once frames are stored they're drawn from the device, so the upload bitmap can hold the
+    // next stored frame instead
+    if (m_frameBitmap != nullptr)
+    {
+        m_spareBitmaps.push_back(m_frameBitmap);
+        m_frameBitmap = nullptr;
+    }
+}
+
+void D2DRenderBackend::ReleaseFrames()
+{
+    while (!m_bitmaps.empty())
+    {
+        if (m_bitmaps.back() != nullptr)
+            m_spareBitmaps.push_back(m_bitmaps.back());
+
+        m_bitmaps.back() = nullptr;
+        m_bitmaps.pop_back();
+    }
+
+    // Nothing is stored, so this is where a change of layout can take effect
+    m_atlasLayout = m_useAtlas;
+    m_framesPerAtlas = 0;
+    m_reservedFrames = 0;
+    m_storedFrames = 0;
+}
+
+void D2DRenderBackend::ReleaseSpareFrames()
+{
+    std::vector<ComPtr<ID2D1Bitmap>>().swap(m_spareBitmaps);
+
+    // The last atlas was sized for the frames reserved. If fewer were stored, e.g. because the
+    // player stored repeated frames once, it's copied into one just big enough for them.
+    if (!m_atlasLayout || m_framesPerAtlas <= 1 || m_storedFrames == 0)
+        return;
+
+    auto atlasIndex = (m_storedFrames - 1) / m_framesPerAtlas;
+    auto &atlas = m_bitmaps.at(atlasIndex);
+    auto cRows = m_storedFrames - atlasIndex * m_framesPerAtlas;
+    if (atlas == nullptr || atlas->GetPixelSize().height <= cRows * m_height)
+        return;
+
+    auto trimmed = CreateFrameBitmap(D2D1::SizeU(m_width, cRows * m_height), nullptr);
+    auto origin = D2D1::Point2U(0, 0);
+    auto rect = D2D1::RectU(0, 0, m_width, cRows * m_height);
+    DX::ThrowIfFailed(
+        trimmed->CopyFromBitmap(&origin, atlas.Get(), &rect));
+
+    atlas = trimmed;
+    m_reservedFrames = m_storedFrames;
+}
+
+// Atlases stack frames in a single column, as many as the device's largest bitmap holds. A run of
+// frames in an atlas then has the same layout as the frames back to back in memory.
+UINT D2DRenderBackend::GetFramesPerAtlas()
+{
+    if (m_framesPerAtlas == 0)
+    {
+        m_framesPerAtlas = std::max<UINT>(1, m_d2dContext->GetMaximumBitmapSize() / std::max<UINT>(1, m_height));
+    }
+    return m_framesPerAtlas;
+}
+
+// The last atlas only needs room for the frames left over, if we were told how many there are
+UINT D2DRenderBackend::GetAtlasFrameCount(UINT atlasIndex) const
+{
+    auto firstFrame = atlasIndex * m_framesPerAtlas;
+    if (m_reservedFrames > firstFrame && m_reservedFrames - firstFrame < m_framesPerAtlas)
+        return m_reservedFrames - firstFrame;
+
+    return m_framesPerAtlas;
+}
+
+// Takes a spare bitmap of the size if there is one, or creates one. Pixels may be null for a
+// bitmap whose contents are copied in later.
+ComPtr<ID2D1Bitmap> D2DRenderBackend::CreateFrameBitmap(D2D1_SIZE_U size, const uint32_t *pPixels)
+{
+    ComPtr<ID2D1Bitmap> pBitmap;
+    for (auto it = m_spareBitmaps.begin(); it != m_spareBitmaps.end(); ++it)
+    {
+        auto spareSize = (*it)->GetPixelSize();
+        if (spareSize.width == size.width && spareSize.height == size.height)
+        {
+            pBitmap = *it;
+            m_spareBitmaps.erase(it);
+
+            if (pPixels != nullptr)
+            {
+                DX::ThrowIfFailed(
+                    pBitmap->CopyFromMemory(nullptr, pPixels, size.width * sizeof(uint32_t)));
+            }
+            return pBitmap;
+        }
+    }
+
+    DX::ThrowIfFailed(
+        m_d2dContext->CreateBitmap(
+        size,
+        pPixels,
+        pPixels != nullptr ? size.width * sizeof(uint32_t) : 0,
+        FrameBitmapProperties(),
+        &pBitmap));
+    return pBitmap;
+}
+
+void D2DRenderBackend::ReleaseDeviceResources()
+{
+    ReleaseFrames();
+    ReleaseSpareFrames();
+    m_frameBitmap = nullptr;
+    m_hasContents = false;
+
+    m_surfaceBitmap = nullptr;
+    m_sisNative = nullptr;
+    m_d2dContext = nullptr;
+    m_d2dDevice = nullptr;
+    m_d3dDevice = nullptr;
+}
+
+void D2DRenderBackend::DrawStoredFrame(uint32_t frameIndex)
+{
+    if (!m_atlasLayout || m_framesPerAtlas == 1)
+    {
+        m_d2dContext->DrawImage(m_bitmaps.at(frameIndex).Get());
+        return;
+    }
+
+    // Draw the frame's strip of its atlas at the origin, pixel for pixel
+    auto top = static_cast<float>((frameIndex % m_framesPerAtlas) * m_height);
+    auto offset = D2D1::Point2F(0, 0);
+    auto rect = D2D1::RectF(0, top, static_cast<float>(m_width), top + m_height);
+    m_d2dContext->DrawImage(m_bitmaps.at(frameIndex / m_framesPerAtlas).Get(), &offset, &rect, D2D1_INTERPOLATION_MODE_NEAREST_NEIGHBOR);
+}
+
+void D2DRenderBackend::DrawPixels(const uint32_t *pPixels)
+{
+    if (m_frameBitmap == nullptr)
+    {
+        m_frameBitmap = CreateFrameBitmap(D2D1::SizeU(m_width, m_height), nullptr);
+    }
+
+    // Only the update rectangle gets past the clip, so only it needs uploading
+    auto &rect = m_updateRect;
+    auto destRect = D2D1::RectU(rect.left, rect.top, rect.right, rect.bottom);
+    DX::ThrowIfFailed(
+        m_frameBitmap->CopyFromMemory(&destRect, pPixels + rect.top * m_width + rect.left, m_width * sizeof(uint32_t)));
+
+    m_d2dContext->DrawImage(m_frameBitmap.Get());
+}
+
+void D2DRenderBackend::CreateDeviceResources()
+{
+    // This flag adds support for surfaces with a different color channel ordering 
+    // than the API default. It is required for compatibility with Direct2D. 
+    UINT creationFlags = D3D11_CREATE_DEVICE_BGRA_SUPPORT;
+
+#if defined(_DEBUG)     
+    // If the project is in a debug build, enable debugging via SDK Layers. 
+    creationFlags |= D3D11_CREATE_DEVICE_DEBUG;
+#endif 
+
+    // This array defines the set of DirectX hardware feature levels this app will support. 
+    // Note the ordering should be preserved. 
+    // Don't forget to declare your application's minimum required feature level in its 
+    // description.  All applications are assumed to support 9.1 unless otherwise stated. 
+    const D3D_FEATURE_LEVEL featureLevels [] =
+    {
+        D3D_FEATURE_LEVEL_11_1,
+        D3D_FEATURE_LEVEL_11_0,
+        D3D_FEATURE_LEVEL_10_1,
+        D3D_FEATURE_LEVEL_10_0,
+        D3D_FEATURE_LEVEL_9_3,
+        D3D_FEATURE_LEVEL_9_2,
+        D3D_FEATURE_LEVEL_9_1,
+    };
+
+    // Create the Direct3D 11 API device object. 
+    DX::ThrowIfFailed(
+        D3D11CreateDevice(
+        nullptr,                        // Specify nullptr to use the default adapter. 
+        D3D_DRIVER_TYPE_HARDWARE,
+        nullptr,
+        creationFlags,                  // Set debug and Direct2D compatibility flags. 
+        featureLevels,                  // List of feature levels this app can support. 
+        ARRAYSIZE(featureLevels),
+        D3D11_SDK_VERSION,              // Always set this to D3D11_SDK_VERSION for Windows Store apps. 
+        &m_d3dDevice,                   // Returns the Direct3D device created. 
+        nullptr,
+        nullptr
+        )
+        );
+
+    // Get the Direct3D 11.1 API device. 
+    ComPtr<IDXGIDevice> dxgiDevice;
+    DX::ThrowIfFailed(
+        m_d3dDevice.As(&dxgiDevice));
+
+    // Create the Direct2D device object and a corresponding context. 
+    DX::ThrowIfFailed(
+        D2D1CreateDevice(
+        dxgiDevice.Get(),
+        nullptr,
+        &m_d2dDevice));
+
+    DX::ThrowIfFailed(
+        m_d2dDevice->CreateDeviceContext(
+        D2D1_DEVICE_CONTEXT_OPTIONS_NONE,
+        &m_d2dContext));
+
+    // Query for ISurfaceImageSourceNative interface. 
+    DX::ThrowIfFailed(
+        m_pSurfaceImageSource->QueryInterface(IID_PPV_ARGS(&m_sisNative)));
+
+    // Associate the DXGI device with the SurfaceImageSource. 
+    DX::ThrowIfFailed(
+        m_sisNative->SetDevice(dxgiDevice.Get()));
+}
+
+bool D2DRenderBackend::BeginDraw(const Em::Gif::GifRect &rect)
+{
+    ComPtr<IDXGISurface> surface;
+    RECT updateRect = { 0, 0, m_width, m_height };
+    POINT offset = { 0 };
+
+    if (m_sisNative == nullptr)
+    {
+        CreateDeviceResources();
+    }
+
+    // The surface keeps what was drawn into it outside the update rectangle, unless nothing has
+    // been yet, or the device it was drawn with is gone
+    if (m_hasContents)
+    {
+        updateRect.left = rect.left;
+        updateRect.top = rect.top;
+        updateRect.right = rect.left + rect.width;
+        updateRect.bottom = rect.top + rect.height;
+    }
+    m_updateRect = updateRect;
+
+    // Begin drawing - returns a target surface and an offset to use as the top left origin when drawing. 
+    HRESULT beginDrawHR = m_sisNative->BeginDraw(updateRect, &surface, &offset);
+
+    if (SUCCEEDED(beginDrawHR))
+    {
+        // Create render target. 
+        DX::ThrowIfFailed(
+            m_d2dContext->CreateBitmapFromDxgiSurface(surface.Get(), nullptr, &m_surfaceBitmap));
+
+        // Set context's render target. 
+        m_d2dContext->SetTarget(m_surfaceBitmap.Get());
+
+        // Begin drawing using D2D context. 
+        m_d2dContext->BeginDraw();
+
+        // Apply a clip and transform to constrain updates to the target update area. 
+        // This is required to ensure coordinates within the target surface remain 
+        // consistent by taking into account the offset returned by BeginDraw, and 
+        // can also improve performance by optimizing the area that is drawn by D2D. 
+        // Apps should always account for the offset output parameter returned by  
+        // BeginDraw, since it may not match the passed updateRect input parameter's location. 
+        m_d2dContext->PushAxisAlignedClip(
+            D2D1::RectF(
+            static_cast<float>(offset.x),
+            static_cast<float>(offset.y),
+            static_cast<float>(offset.x + updateRect.right - updateRect.left),
+            static_cast<float>(offset.y + updateRect.bottom - updateRect.top)
+            ),
+            D2D1_ANTIALIAS_MODE_ALIASED);
+
+        // Frames are drawn whole at the origin; shift them so the update rectangle lands on the
+        // offset, and the clip throws away the rest
+        m_d2dContext->SetTransform(
+            D2D1::Matrix3x2F::Translation(
+            static_cast<float>(offset.x - updateRect.left),
+            static_cast<float>(offset.y - updateRect.top)));
+
+        m_d2dContext->Clear();
+    }
+    else if (beginDrawHR == DXGI_ERROR_DEVICE_REMOVED || beginDrawHR == DXGI_ERROR_DEVICE_RESET)
+    {
+        // If the device has been removed or reset, attempt to recreate it and continue drawing. 
+        if (m_pStatistics)
+        {
+            m_pStatistics->RecordDeviceLost();
+        }
+
+        // Every bitmap belongs to the old device and can't be drawn on the new one: stored frames,
+        // spares and the upload bitmap alike
+        auto hadFrames = m_storedFrames != 0;
+        ReleaseFrames();
+        std::vector<ComPtr<ID2D1Bitmap>>().swap(m_spareBitmaps);
+        m_frameBitmap = nullptr;
+
+        CreateDeviceResources();
+        m_hasContents = false;
+
+        // The player has to store its frames again before it can draw any of them
+        if (hadFrames)
+        {
+            m_framesLost = true;
+            return false;
+        }
+        return BeginDraw(rect);
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+bool D2DRenderBackend::CheckFramesLost()
+{
+    auto framesLost = m_framesLost;
+    m_framesLost = false;
+    return framesLost;
+}
+
+void D2DRenderBackend::EndDraw()
+{
+    // Remove the transform and clip applied in BeginDraw since 
+    // the target area can change on every update. 
+    m_d2dContext->SetTransform(D2D1::IdentityMatrix());
+    m_d2dContext->PopAxisAlignedClip();
+
+    // Remove the render target and end drawing. 
+    DX::ThrowIfFailed(
+        m_d2dContext->EndDraw());
+
+    m_d2dContext->SetTarget(nullptr);
+    m_surfaceBitmap = nullptr;
+
+    DX::ThrowIfFailed(
+        m_sisNative->EndDraw());
+
+    m_hasContents = true;
+}
@@ -0,0 +1,96 @@
+﻿#pragma once
+
+#include "GifRenderBackend.h"
+#include "GifStatistics.h"
+
+namespace Em {
+    namespace UI {
+        namespace Xaml {
+            namespace Media
+            {
+                /// <summary>
+                /// Presents frames into a SurfaceImageSource through Direct2D. Stored frames are kept
+                /// as device bitmaps, packed into a few atlases by default; other frames are uploaded
+                /// into a single presentation bitmap.
+                /// </summary>
+                class D2DRenderBackend : public Em::Gif::GifRenderBackend
+                {
+                public:
+                    /// <param name="pSurfaceImageSource">
+                    /// The SurfaceImageSource to draw into. Not referenced; it must outlive the backend.
+                    /// </param>
+                    /// <param name="pStatistics">
+                    /// Where to count device losses, or null. Not owned; it must outlive the backend.
+                    /// </param>
+                    D2DRenderBackend(IUnknown *pSurfaceImageSource, Em::Gif::GifStatistics *pStatistics);
+
+                    virtual void SetSize(uint32_t width, uint32_t height) override;
+                    virtual void ReserveFrames(uint32_t frameCount) override;
+                    virtual void StoreFrame(uint32_t frameIndex, const uint32_t *pPixels) override;
+                    virtual void StoreFrames(uint32_t firstFrame, uint32_t frameCount, const uint32_t *pPixels) override;
+                    virtual void ReleaseFrames() override;
+                    virtual void ReleaseSpareFrames() override;
+                    virtual bool BeginDraw(const Em::Gif::GifRect &updateRect) override;
+                    virtual bool CheckFramesLost() override;
+                    virtual void DrawStoredFrame(uint32_t frameIndex) override;
+                    virtual void DrawPixels(const uint32_t *pPixels) override;
+                    virtual void EndDraw() override;
+
+                    /// <summary>
+                    /// Sets whether stored frames are packed into atlas bitmaps, drawn from by source
+                    /// rectangle, or each kept in a bitmap of its own. Takes effect the next time
+                    /// frames are released.
+                    /// </summary>
+                    void SetAtlasLayout(bool useAtlas);
+                    bool GetAtlasLayout() const { return m_useAtlas; }
+
+                    /// <summary>
+                    /// Releases every bitmap and the device itself.
+                    /// </summary>
+                    void ReleaseDeviceResources();
+
+                private:
+                    void CreateDeviceResources();
+                    UINT GetFramesPerAtlas();
+                    UINT GetAtlasFrameCount(UINT atlasIndex) const;
+                    Microsoft::WRL::ComPtr<ID2D1Bitmap> CreateFrameBitmap(D2D1_SIZE_U size, const uint32_t *pPixels);
+
+                    IUnknown *m_pSurfaceImageSource;
+                    Em::Gif::GifStatistics *m_pStatistics;
+
+                    Microsoft::WRL::ComPtr<ID3D11Device>                m_d3dDevice;
+                    Microsoft::WRL::ComPtr<ID2D1Device>                 m_d2dDevice;
+                    Microsoft::WRL::ComPtr<ID2D1DeviceContext>          m_d2dContext;
+                    Microsoft::WRL::ComPtr<ISurfaceImageSourceNative>   m_sisNative;
+                    Microsoft::WRL::ComPtr<ID2D1Bitmap1>                m_surfaceBitmap;
+
+                    UINT m_width;
+                    UINT m_height;
+
+                    // A bitmap per stored frame, or per atlas of stored frames
+                    std::vector<Microsoft::WRL::ComPtr<ID2D1Bitmap>> m_bitmaps;
+
+                    bool m_useAtlas;            // as last set
+                    bool m_atlasLayout;         // as the stored frames are laid out
+                    UINT m_framesPerAtlas;      // 0 until frames are stored
+                    UINT m_reservedFrames;
+                    UINT m_storedFrames;        // one past the highest frame stored
+                    bool m_framesLost;          // with the device, since CheckFramesLost was last called
+
+                    // Bitmaps of released frames, all of the current size, waiting to be reused
+                    std::vector<Microsoft::WRL::ComPtr<ID2D1Bitmap>> m_spareBitmaps;
+
+                    // Presentation bitmap for frames that aren't stored
+                    Microsoft::WRL::ComPtr<ID2D1Bitmap> m_frameBitmap;
+
+                    // Set once a frame has been presented into the surface on the current device
+                    // and at the current size, so it's safe to update only part of it
+                    bool m_hasContents;
+
+                    // The part of the surface being drawn, in frame coordinates
+                    RECT m_updateRect;
+                };
+            }
+        }
+    }
+}
@@ -0,0 +1,40 @@
+﻿#pragma once
+
+#include <atomic>
+#include <stdexcept>
+
+namespace Em {
+    namespace Gif
+    {
+        /// <summary>
+        /// Thrown out of a load that was cancelled part way through.
+        /// </summary>
+        class GifCancelledException : public std::runtime_error
+        {
+        public:
+            GifCancelledException() : std::runtime_error("load cancelled") {}
+        };
+
+        /// <summary>
+        /// Lets one thread ask a load running on another to stop. Loads check it between frames,
+        /// so they stop within about a frame's decoding time of being asked. Thread-safe.
+        /// </summary>
+        class GifCancellation
+        {
+        public:
+            GifCancellation() : m_cancelled(false) {}
+
+            void Cancel() { m_cancelled = true; }
+            bool IsCancelled() const { return m_cancelled; }
+
+            void ThrowIfCancelled() const
+            {
+                if (m_cancelled)
+                    throw GifCancelledException();
+            }
+
+        private:
+            std::atomic<bool> m_cancelled;
+        };
+    }
+}
@@ -0,0 +1,156 @@
+﻿#include "GifCompositor.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "GifPixelKernels.h"
+
+using namespace Em::Gif;
+
+GifCompositor::GifCompositor(uint32_t width, uint32_t height)
+    : m_width(width),
+    m_height(height),
+    m_canvas(static_cast<size_t>(width) * height, 0),
+    m_disposal(GifDisposal::None)
+{
+    m_disposalRect.left = 0;
+    m_disposalRect.top = 0;
+    m_disposalRect.width = 0;
+    m_disposalRect.height = 0;
+}
+
+void GifCompositor::Reset()
+{
+    std::fill(m_canvas.begin(), m_canvas.end(), 0);
+    m_disposal = GifDisposal::None;
+}
+
+GifCompositor::Rect GifCompositor::ClipFrame(const GifFrame &frame) const
+{
+    // Frames are allowed to hang off the edge of the logical screen; clip them
+    Rect rect = { frame.left, frame.top, 0, 0 };
+    if (frame.left < m_width && frame.top < m_height)
+    {
+        rect.width = std::min(frame.width, m_width - frame.left);
+        rect.height = std::min(frame.height, m_height - frame.top);
+    }
+    return rect;
+}
+
+void GifCompositor::DisposePrevious()
+{
+    auto &rect = m_disposalRect;
+
+    if (m_disposal == GifDisposal::RestoreBackground)
+    {
+        // Like every browser, we restore to transparent rather than the background color
+        for (uint32_t y = 0; y < rect.height; y++)
+        {
+            auto pDest = m_canvas.data() + static_cast<size_t>(rect.top + y) * m_width + rect.left;
+            std::fill(pDest, pDest + rect.width, 0);
+        }
+    }
+    else if (m_disposal == GifDisposal::RestorePrevious)
+    {
+        auto pSource = m_saved.data();
+        for (uint32_t y = 0; y < rect.height; y++, pSource += rect.width)
+        {
+            auto pDest = m_canvas.data() + static_cast<size_t>(rect.top + y) * m_width + rect.left;
+            std::memcpy(pDest, pSource, rect.width * sizeof(uint32_t));
+        }
+    }
+
+    m_disposal = GifDisposal::None;
+}
+
+void GifCompositor::DrawFrame(const GifFrame &frame)
+{
+    DisposePrevious();
+
+    auto rect = ClipFrame(frame);
+
+    if (frame.disposal == GifDisposal::RestorePrevious)
+    {
+        // Only the area this frame covers can change, so that's all we need to keep
+        m_saved.resize(static_cast<size_t>(rect.width) * rect.height);
+        auto pDest = m_saved.data();
+        for (uint32_t y = 0; y < rect.height; y++, pDest += rect.width)
+        {
+            auto pSource = m_canvas.data() + static_cast<size_t>(rect.top + y) * m_width + rect.left;
+            std::memcpy(pDest, pSource, rect.width * sizeof(uint32_t));
+        }
+    }
+
+    m_disposal = frame.disposal;
+    m_disposalRect = rect;
+
+    if (frame.pixels.empty())
+        return;
+
+    auto pPalette = frame.palette->data();
+
+    for (uint32_t y = 0; y < rect.height; y++)
+    {
+        auto pSource = frame.pixels.data() + static_cast<size_t>(y) * frame.width;
+        auto pDest = m_canvas.data() + static_cast<size_t>(rect.top + y) * m_width + rect.left;
+
+        if (frame.hasTransparency)
+            BlendIndices(pSource, pPalette, frame.transparentIndex, pDest, rect.width);
+        else
+            ExpandIndices(pSource, pPalette, pDest, rect.width);
+    }
+}
+
+// std::max and std::min take their arguments by reference, so the constants need definitions
+const uint32_t GifCompositorCheckpoints::DefaultInterval;
+const uint32_t GifCompositorCheckpoints::MaxCheckpoints;
+
+GifCompositorCheckpoints::GifCompositorCheckpoints(uint32_t frameCount)
+    : m_interval(std::max(DefaultInterval, (frameCount + MaxCheckpoints - 1) / MaxCheckpoints)),
+    m_checkpoints(MaxCheckpoints + 1)
+{
+}
+
+void GifCompositorCheckpoints::Save(uint32_t frameIndex, const GifCompositor &compositor, size_t position)
+{
+    if (frameIndex == 0 || frameIndex % m_interval != 0)
+        return;
+
+    // Frames past the last checkpoint (only possible while the frame count is still growing)
+    // resume from the last one
+    auto i = frameIndex / m_interval;
+    if (i < m_checkpoints.size() && !m_checkpoints[i])
+    {
+        m_checkpoints[i].reset(new Checkpoint(compositor, position));
+    }
+}
+
+uint32_t GifCompositorCheckpoints::Find(uint32_t frameIndex) const
+{
+    for (auto i = std::min<size_t>(frameIndex / m_interval, m_checkpoints.size() - 1); i > 0; i--)
+    {
+        if (m_checkpoints[i])
+            return static_cast<uint32_t>(i * m_interval);
+    }
+    return 0;
+}
+
+size_t GifCompositorCheckpoints::Restore(uint32_t frameIndex, GifCompositor &compositor) const
+{
+    auto &checkpoint = *m_checkpoints.at(frameIndex / m_interval);
+    compositor = checkpoint.compositor;
+    return checkpoint.position;
+}
+
+size_t GifCompositorCheckpoints::GetResidentBytes() const
+{
+    size_t cbResident = 0;
+    for (auto &pCheckpoint : m_checkpoints)
+    {
+        if (pCheckpoint)
+        {
+            cbResident += pCheckpoint->compositor.GetResidentBytes();
+        }
+    }
+    return cbResident;
+}
@@ -0,0 +1,121 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "GifDecoder.h"
+
+namespace Em {
+    namespace Gif
+    {
+        /// <summary>
+        /// Composes decoded frames onto a persistent premultiplied BGRA canvas the size of the
+        /// logical screen. Frames must be drawn in order; each one costs only its own area, plus
+        /// the previous frame's disposal.
+        /// </summary>
+        class GifCompositor
+        {
+        public:
+            GifCompositor(uint32_t width, uint32_t height);
+
+            /// <summary>
+            /// Clears the canvas to transparent, ready for the first frame.
+            /// </summary>
+            void Reset();
+
+            /// <summary>
+            /// Disposes of the previously drawn frame as it requested, then draws this frame on top
+            /// of the canvas. Transparent pixels leave the canvas untouched.
+            /// </summary>
+            void DrawFrame(const GifFrame &frame);
+
+            const uint32_t *GetPixels() const { return m_canvas.data(); }
+
+            /// <summary>
+            /// Gets the number of bytes held by the canvas and the area saved for restoring.
+            /// </summary>
+            size_t GetResidentBytes() const { return (m_canvas.capacity() + m_saved.capacity()) * sizeof(uint32_t); }
+            uint32_t GetWidth() const { return m_width; }
+            uint32_t GetHeight() const { return m_height; }
+
+        private:
+            struct Rect
+            {
+                uint32_t left;
+                uint32_t top;
+                uint32_t width;
+                uint32_t height;
+            };
+
+            Rect ClipFrame(const GifFrame &frame) const;
+            void DisposePrevious();
+
+            uint32_t m_width;
+            uint32_t m_height;
+            std::vector<uint32_t> m_canvas;
+
+            // Disposal owed by the last frame drawn, applied before the next one
+            GifDisposal m_disposal;
+            Rect m_disposalRect;
+
+            // Canvas contents under m_disposalRect before the last frame was drawn; only
+            // captured when that frame asked to be restored to previous
+            std::vector<uint32_t> m_saved;
+        };
+
+        /// <summary>
+        /// Copies of a compositor taken every so many frames as it works through an animation, so
+        /// composing an arbitrary frame can resume from a nearby checkpoint instead of replaying
+        /// from the first frame. Each checkpoint is kept the first time composition passes it.
+        /// </summary>
+        class GifCompositorCheckpoints
+        {
+        public:
+            static const uint32_t DefaultInterval = 32;
+            static const uint32_t MaxCheckpoints = 8;
+
+            /// <summary>
+            /// Spaces checkpoints DefaultInterval frames apart, or further for long animations so
+            /// there are no more than MaxCheckpoints of them.
+            /// </summary>
+            explicit GifCompositorCheckpoints(uint32_t frameCount);
+
+            /// <summary>
+            /// Call with a compositor that is about to draw the given frame. Keeps a copy of it if
+            /// the frame is a checkpoint that hasn't been kept yet, along with an arbitrary
+            /// position (e.g. where a decoder reads the frame from).
+            /// </summary>
+            void Save(uint32_t frameIndex, const GifCompositor &compositor, size_t position = 0);
+
+            /// <summary>
+            /// Gets the latest kept checkpoint at or before the given frame; 0 if there is none and
+            /// composition has to start from the first frame.
+            /// </summary>
+            uint32_t Find(uint32_t frameIndex) const;
+
+            /// <summary>
+            /// Puts the compositor back the way it was at a checkpoint returned by Find, ready to
+            /// draw that frame, and returns the position saved with it.
+            /// </summary>
+            size_t Restore(uint32_t frameIndex, GifCompositor &compositor) const;
+
+            size_t GetResidentBytes() const;
+
+        private:
+            struct Checkpoint
+            {
+                Checkpoint(const GifCompositor &compositor, size_t position) : compositor(compositor), position(position) {}
+
+                GifCompositor compositor;
+                size_t position;
+            };
+
+            uint32_t m_interval;
+
+            // Checkpoint i is for frame i * m_interval; the first frame needs none
+            std::vector<std::unique_ptr<Checkpoint>> m_checkpoints;
+        };
+    }
+}
@@ -0,0 +1,641 @@
+﻿#include "GifDecoder.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "GifPixelKernels.h"
+#include "GifScratchPool.h"
+
+using namespace Em::Gif;
+
+namespace
+{
+    const uint8_t IntroducerExtension = 0x21;
+    const uint8_t IntroducerImage = 0x2C;
+    const uint8_t IntroducerTrailer = 0x3B;
+
+    const uint8_t LabelGraphicControl = 0xF9;
+    const uint8_t LabelApplication = 0xFF;
+
+    const uint32_t MaxLzwCodes = 4096;
+
+    // Refuse anything that would need more than 256M pixels for a single frame
+    const uint64_t MaxFramePixels = 1ull << 28;
+
+    inline uint16_t ReadUInt16(const uint8_t *p)
+    {
+        return static_cast<uint16_t>(p[0] | (p[1] << 8));
+    }
+
+    // Downscaled pixel x samples the encoded pixel under its center, (x + 0.5) * source / dest
+    inline uint32_t SampleAt(uint32_t x, uint32_t source, uint32_t dest)
+    {
+        return static_cast<uint32_t>((2ull * x + 1) * source / (2ull * dest));
+    }
+
+    // The first downscaled pixel that samples at or after encoded coordinate c. Frame edges go
+    // through here so neighboring frames still meet exactly.
+    inline uint32_t ScaleEdge(uint32_t c, uint32_t source, uint32_t dest)
+    {
+        auto twice = 2ull * c * dest;
+        if (twice <= source)
+            return 0;
+        return static_cast<uint32_t>((twice - source + 2ull * source - 1) / (2ull * source));
+    }
+}
+
+GifDecoder::GifDecoder(const uint8_t *pData, size_t cbData)
+    : m_pData(pData),
+    m_cbData(cbData),
+    m_screenWidth(0),
+    m_screenHeight(0),
+    m_position(0),
+    m_firstBlock(0),
+    m_ended(false),
+    m_pendingDelay(0),
+    m_pendingDisposal(GifDisposal::Unspecified),
+    m_pendingHasTransparency(false),
+    m_pendingTransparentIndex(0)
+{
+    if (pData == nullptr)
+        throw GifFormatException("no data");
+
+    m_info.width = 0;
+    m_info.height = 0;
+    m_info.isAnimated = false;
+    m_info.loopCount = 0;
+    m_info.backgroundIndex = 0;
+
+    ReadHeader();
+}
+
+void GifDecoder::ReadHeader()
+{
+    // "GIF87a" or "GIF89a", followed by the 7 byte logical screen descriptor
+    if (m_cbData < 13 || std::memcmp(m_pData, "GIF", 3) != 0)
+        throw GifFormatException("not a GIF");
+
+    auto pScreen = m_pData + 6;
+    m_info.width = m_screenWidth = ReadUInt16(pScreen);
+    m_info.height = m_screenHeight = ReadUInt16(pScreen + 2);
+    auto flags = pScreen[4];
+    m_info.backgroundIndex = pScreen[5];
+    m_position = 13;
+
+    if (flags & 0x80)
+    {
+        m_info.globalPalette = ReadColorTable(2u << (flags & 0x07));
+        if (!m_info.globalPalette)
+            throw GifFormatException("truncated global color table");
+    }
+
+    m_firstBlock = m_position;
+}
+
+std::shared_ptr<const GifPalette> GifDecoder::ReadColorTable(uint32_t dwEntries)
+{
+    if (m_cbData - m_position < dwEntries * 3)
+        return nullptr;
+
+    auto pPalette = std::make_shared<GifPalette>(256, 0xFF000000);
+    auto pRgb = m_pData + m_position;
+    for (uint32_t i = 0; i < dwEntries; i++, pRgb += 3)
+    {
+        (*pPalette)[i] = 0xFF000000 | (pRgb[0] << 16) | (pRgb[1] << 8) | pRgb[2];
+    }
+
+    m_position += dwEntries * 3;
+    return pPalette;
+}
+
+void GifDecoder::Rewind()
+{
+    m_position = m_firstBlock;
+    m_ended = false;
+    m_pendingDelay = 0;
+    m_pendingDisposal = GifDisposal::Unspecified;
+    m_pendingHasTransparency = false;
+    m_pendingTransparentIndex = 0;
+}
+
+void GifDecoder::SetMaxDecodeSize(uint32_t maxWidth, uint32_t maxHeight)
+{
+    FitDecodeSize(m_screenWidth, m_screenHeight, maxWidth, maxHeight, m_info.width, m_info.height);
+}
+
+void GifDecoder::FitDecodeSize(uint32_t width, uint32_t height, uint32_t maxWidth, uint32_t maxHeight, uint32_t &decodeWidth, uint32_t &decodeHeight)
+{
+    decodeWidth = width;
+    decodeHeight = height;
+    if (width == 0 || height == 0)
+        return;
+
+    // Scale by whichever bound is tighter; 0 means no bound
+    if (maxWidth != 0 && maxWidth < width && (maxHeight == 0 || static_cast<uint64_t>(maxWidth) * height <= static_cast<uint64_t>(maxHeight) * width))
+    {
+        decodeWidth = maxWidth;
+        decodeHeight = static_cast<uint32_t>(std::max<uint64_t>(1, (static_cast<uint64_t>(height) * maxWidth + width / 2) / width));
+    }
+    else if (maxHeight != 0 && maxHeight < height)
+    {
+        decodeHeight = maxHeight;
+        decodeWidth = static_cast<uint32_t>(std::max<uint64_t>(1, (static_cast<uint64_t>(width) * maxHeight + height / 2) / height));
+    }
+}
+
+void GifDecoder::Seek(size_t position)
+{
+    if (position < m_firstBlock || position > m_cbData)
+        throw GifFormatException("seek out of range");
+
+    Rewind();
+    m_position = position;
+}
+
+void GifDecoder::SetData(const uint8_t *pData, size_t cbData)
+{
+    if (pData == nullptr || cbData < m_cbData)
+        throw GifFormatException("data shrank");
+
+    m_pData = pData;
+    m_cbData = cbData;
+}
+
+bool GifDecoder::HasCompleteHeader(const uint8_t *pData, size_t cbData)
+{
+    if (cbData < 13)
+        return false;
+
+    auto flags = pData[10];
+    return !(flags & 0x80) || cbData - 13 >= 3 * (2u << (flags & 0x07));
+}
+
+bool GifDecoder::HasCompleteFrame() const
+{
+    auto position = m_position;
+
+    // Skips a chain of sub-blocks, returning false if it runs past the end of the data
+    auto skipSubBlocks = [this, &position]() -> bool
+    {
+        while (position < m_cbData)
+        {
+            size_t cbBlock = m_pData[position++];
+            if (cbBlock == 0)
+                return true;
+            position += cbBlock;
+        }
+        return false;
+    };
+
+    while (!m_ended && position < m_cbData)
+    {
+        switch (m_pData[position++])
+        {
+        case IntroducerExtension:
+            // Label, then sub-blocks
+            if (++position > m_cbData || !skipSubBlocks())
+                return false;
+            break;
+
+        case IntroducerImage:
+        {
+            if (m_cbData - position < 9)
+                return false;
+
+            auto flags = m_pData[position + 8];
+            position += 9;
+            if (flags & 0x80)
+                position += 3 * (2u << (flags & 0x07));
+
+            // LZW minimum code size, then sub-blocks
+            return ++position <= m_cbData && skipSubBlocks();
+        }
+
+        default:
+            // The trailer, or something ReadFrame will stop at anyway
+            return true;
+        }
+    }
+
+    return m_ended;
+}
+
+bool GifDecoder::ReadFrame(GifFrame &frame, bool decodePixels)
+{
+    if (!ReadNextFrame(frame, decodePixels ? &m_image : nullptr))
+        return false;
+
+    if (decodePixels)
+        m_lzw.DecodeFrame(m_image, frame);
+    return true;
+}
+
+bool GifDecoder::ReadFrame(GifFrame &frame, GifCompressedImage &image)
+{
+    return ReadNextFrame(frame, &image);
+}
+
+bool GifDecoder::ReadNextFrame(GifFrame &frame, GifCompressedImage *pImage)
+{
+    while (!m_ended)
+    {
+        // A missing trailer is common enough that we simply treat end of data as the end of the image
+        if (m_position >= m_cbData)
+            break;
+
+        switch (m_pData[m_position++])
+        {
+        case IntroducerExtension:
+            if (!ReadExtension())
+                m_ended = true;
+            break;
+
+        case IntroducerImage:
+            if (ReadImage(frame, pImage))
+                return true;
+            m_ended = true;
+            break;
+
+        default:
+            // Trailer, or garbage we can't make sense of. Either way, there's nothing more to show.
+            m_ended = true;
+            break;
+        }
+    }
+
+    m_ended = true;
+    return false;
+}
+
+bool GifDecoder::ReadExtension()
+{
+    if (m_position >= m_cbData)
+        return false;
+
+    auto label = m_pData[m_position++];
+    if (label == LabelGraphicControl && m_position < m_cbData && m_pData[m_position] >= 4 && m_cbData - m_position >= 5)
+    {
+        auto pBlock = m_pData + m_position + 1;
+        m_pendingDisposal = static_cast<GifDisposal>((pBlock[0] >> 2) & 0x07);
+        m_pendingHasTransparency = (pBlock[0] & 0x01) != 0;
+        m_pendingDelay = ReadUInt16(pBlock + 1);
+        m_pendingTransparentIndex = pBlock[3];
+    }
+    else if (label == LabelApplication && m_position < m_cbData && m_pData[m_position] == 11 && m_cbData - m_position >= 12)
+    {
+        auto pIdentifier = m_pData + m_position + 1;
+        if (std::memcmp(pIdentifier, "NETSCAPE2.0", 11) == 0 || std::memcmp(pIdentifier, "ANIMEXTS1.0", 11) == 0)
+        {
+            // Data sub-block: length (3), sub-block id (1 = looping), iteration count (LSB, MSB)
+            auto dataPosition = m_position + 12;
+            if (dataPosition + 1 < m_cbData)
+            {
+                auto count = m_pData[dataPosition];
+                m_info.isAnimated = m_pData[dataPosition + 1] != 0;
+                if (count == 3 && dataPosition + 3 < m_cbData)
+                {
+                    m_info.loopCount = ReadUInt16(m_pData + dataPosition + 2);
+                }
+            }
+        }
+    }
+
+    // Every extension, including the ones we understand, ends with a chain of sub-blocks
+    return ReadSubBlocks(nullptr);
+}
+
+bool GifDecoder::ReadSubBlocks(std::vector<uint8_t> *pOut)
+{
+    if (pOut != nullptr)
+    {
+        // Add up the blocks first, so the data is copied into a buffer of the right size once
+        size_t cbTotal = 0;
+        for (auto position = m_position; position < m_cbData;)
+        {
+            size_t cbBlock = m_pData[position++];
+            if (cbBlock == 0)
+                break;
+
+            cbBlock = std::min(cbBlock, m_cbData - position);
+            cbTotal += cbBlock;
+            position += cbBlock;
+        }
+        GifScratchPool::GetInstance().Reserve(*pOut, pOut->size() + cbTotal);
+    }
+
+    while (m_position < m_cbData)
+    {
+        size_t cbBlock = m_pData[m_position++];
+        if (cbBlock == 0)
+            return true;
+
+        auto cbAvailable = std::min(cbBlock, m_cbData - m_position);
+        if (pOut != nullptr)
+            pOut->insert(pOut->end(), m_pData + m_position, m_pData + m_position + cbAvailable);
+        m_position += cbAvailable;
+    }
+
+    return false;
+}
+
+bool GifDecoder::ReadImage(GifFrame &frame, GifCompressedImage *pImage)
+{
+    if (m_cbData - m_position < 9)
+        return false;
+
+    auto pDescriptor = m_pData + m_position;
+    frame.left = ReadUInt16(pDescriptor);
+    frame.top = ReadUInt16(pDescriptor + 2);
+    frame.width = ReadUInt16(pDescriptor + 4);
+    frame.height = ReadUInt16(pDescriptor + 6);
+    auto flags = pDescriptor[8];
+    m_position += 9;
+
+    frame.interlaced = (flags & 0x40) != 0;
+    frame.delay = m_pendingDelay;
+    frame.disposal = m_pendingDisposal;
+    frame.hasTransparency = m_pendingHasTransparency;
+    frame.transparentIndex = m_pendingTransparentIndex;
+
+    m_pendingDelay = 0;
+    m_pendingDisposal = GifDisposal::Unspecified;
+    m_pendingHasTransparency = false;
+    m_pendingTransparentIndex = 0;
+
+    if (flags & 0x80)
+    {
+        frame.palette = ReadColorTable(2u << (flags & 0x07));
+        if (!frame.palette)
+            return false;
+    }
+    else if (m_info.globalPalette)
+    {
+        frame.palette = m_info.globalPalette;
+    }
+    else
+    {
+        frame.palette = std::make_shared<GifPalette>(256, 0xFF000000);
+    }
+
+    if (m_position >= m_cbData)
+        return false;
+
+    uint32_t minCodeSize = m_pData[m_position++];
+    if (minCodeSize < 1 || minCodeSize > 11)
+        throw GifFormatException("invalid LZW minimum code size");
+
+    uint64_t cPixels = static_cast<uint64_t>(frame.width) * frame.height;
+    if (cPixels > MaxFramePixels)
+        throw GifFormatException("frame too large");
+
+    frame.pixels.clear();
+    if (pImage != nullptr)
+    {
+        pImage->minCodeSize = minCodeSize;
+        pImage->width = frame.width;
+        pImage->height = frame.height;
+        pImage->columns.clear();
+        pImage->rows.clear();
+        pImage->data.clear();
+    }
+
+    if (m_info.width != m_screenWidth || m_info.height != m_screenHeight)
+    {
+        // Move the frame's edges to the first decoded pixels whose centers fall inside it, and
+        // work out which encoded pixel each decoded one samples
+        auto sourceLeft = frame.left;
+        auto sourceTop = frame.top;
+        frame.left = ScaleEdge(sourceLeft, m_screenWidth, m_info.width);
+        frame.top = ScaleEdge(sourceTop, m_screenHeight, m_info.height);
+        frame.width = ScaleEdge(sourceLeft + frame.width, m_screenWidth, m_info.width) - frame.left;
+        frame.height = ScaleEdge(sourceTop + frame.height, m_screenHeight, m_info.height) - frame.top;
+
+        if (pImage != nullptr)
+        {
+            pImage->columns.resize(frame.width);
+            for (uint32_t x = 0; x < frame.width; x++)
+            {
+                pImage->columns[x] = SampleAt(frame.left + x, m_screenWidth, m_info.width) - sourceLeft;
+            }
+
+            pImage->rows.resize(frame.height);
+            for (uint32_t y = 0; y < frame.height; y++)
+            {
+                pImage->rows[y] = SampleAt(frame.top + y, m_screenHeight, m_info.height) - sourceTop;
+            }
+        }
+    }
+
+    // If the file ended part way through this frame, show what we have and stop afterwards
+    if (!ReadSubBlocks(pImage != nullptr ? &pImage->data : nullptr))
+        m_ended = true;
+
+    return true;
+}
+
+GifLzwDecoder::GifLzwDecoder()
+    : m_table(GifScratchPool::GetInstance().AcquireTable())
+{
+}
+
+GifLzwDecoder::~GifLzwDecoder()
+{
+    auto &pool = GifScratchPool::GetInstance();
+    pool.Release(std::move(m_table));
+    pool.Release(m_scratch);
+    pool.Release(m_unscaled);
+}
+
+void GifLzwDecoder::DecodeFrame(const GifCompressedImage &image, GifFrame &frame)
+{
+    auto cPixels = static_cast<size_t>(image.width) * image.height;
+    auto scaled = !image.columns.empty() || !image.rows.empty();
+
+    // Pixels the data doesn't cover (truncated or damaged frames) are left transparent if we can,
+    // so whatever was underneath still shows through
+    uint8_t fill = frame.hasTransparency ? frame.transparentIndex : 0;
+
+    // Decode at the encoded size, straight into the frame unless it still needs downscaling
+    auto &pool = GifScratchPool::GetInstance();
+    auto &pixels = scaled ? m_unscaled : frame.pixels;
+    pool.Reserve(pixels, cPixels);
+    pixels.assign(cPixels, fill);
+
+    if (frame.interlaced)
+    {
+        pool.Reserve(m_scratch, cPixels);
+        m_scratch.assign(cPixels, fill);
+        DecodeLzw(image.data.data(), image.data.size(), image.minCodeSize, m_scratch.data(), m_scratch.size());
+        Deinterlace(m_scratch.data(), pixels.data(), image.width, image.height);
+    }
+    else
+    {
+        DecodeLzw(image.data.data(), image.data.size(), image.minCodeSize, pixels.data(), pixels.size());
+    }
+
+    if (scaled)
+    {
+        pool.Reserve(frame.pixels, image.columns.size() * image.rows.size());
+        frame.pixels.resize(image.columns.size() * image.rows.size());
+        auto pDest = frame.pixels.data();
+        for (auto row : image.rows)
+        {
+            auto pSource = m_unscaled.data() + static_cast<size_t>(row) * image.width;
+            for (auto column : image.columns)
+            {
+                *pDest++ = pSource[column];
+            }
+        }
+    }
+}
+
+// Table-driven LZW decoder. Each table entry records its length and first byte, which lets us
+// write a code's string straight into the output back-to-front instead of going through a stack.
+size_t GifLzwDecoder::DecodeLzw(const uint8_t *pData, size_t cbData, uint32_t minCodeSize, uint8_t *pOut, size_t cbOut)
+{
+    auto &table = *m_table;
+
+    const uint32_t clearCode = 1u << minCodeSize;
+    const uint32_t endCode = clearCode + 1;
+
+    for (uint32_t i = 0; i < clearCode; i++)
+    {
+        table.suffix[i] = static_cast<uint8_t>(i);
+        table.first[i] = static_cast<uint8_t>(i);
+        table.length[i] = 1;
+    }
+
+    uint32_t codeSize = minCodeSize + 1;
+    uint32_t codeMask = (1u << codeSize) - 1;
+    uint32_t nextCode = endCode + 1;
+    uint32_t prevCode = MaxLzwCodes;    // none
+
+    uint32_t bits = 0;
+    uint32_t cBits = 0;
+    auto pIn = pData;
+    auto pInEnd = pData + cbData;
+    size_t written = 0;
+
+    while (written < cbOut)
+    {
+        while (cBits < codeSize)
+        {
+            if (pIn == pInEnd)
+                return written;
+            bits |= static_cast<uint32_t>(*pIn++) << cBits;
+            cBits += 8;
+        }
+
+        uint32_t code = bits & codeMask;
+        bits >>= codeSize;
+        cBits -= codeSize;
+
+        if (code == clearCode)
+        {
+            codeSize = minCodeSize + 1;
+            codeMask = (1u << codeSize) - 1;
+            nextCode = endCode + 1;
+            prevCode = MaxLzwCodes;
+            continue;
+        }
+
+        if (code == endCode)
+            break;
+
+        if (prevCode == MaxLzwCodes)
+        {
+            // First code after a clear must be a literal
+            if (code >= clearCode)
+                break;
+
+            pOut[written++] = static_cast<uint8_t>(code);
+            prevCode = code;
+            continue;
+        }
+
+        if (code > nextCode || (code == nextCode && nextCode == MaxLzwCodes))
+            break; // corrupt stream; keep what we have
+
+        if (nextCode < MaxLzwCodes)
+        {
+            // For the KwKwK case (code == nextCode) the new entry's suffix is its own first byte,
+            // which is the first byte of the previous string
+            table.prefix[nextCode] = static_cast<uint16_t>(prevCode);
+            table.suffix[nextCode] = table.first[code == nextCode ? prevCode : code];
+            table.first[nextCode] = table.first[prevCode];
+            table.length[nextCode] = table.length[prevCode] + 1;
+            nextCode++;
+
+            if (nextCode > codeMask && codeSize < 12)
+            {
+                codeSize++;
+                codeMask = (1u << codeSize) - 1;
+            }
+        }
+
+        size_t cbString = table.length[code];
+        if (cbString <= cbOut - written)
+        {
+            auto p = pOut + written + cbString - 1;
+            auto c = code;
+            while (c > endCode)
+            {
+                *p-- = table.suffix[c];
+                c = table.prefix[c];
+            }
+            *p = static_cast<uint8_t>(c);
+            written += cbString;
+        }
+        else
+        {
+            // Frame data overruns the frame; decode the string aside and keep the part that fits
+            uint8_t string[MaxLzwCodes];
+            auto p = string + cbString - 1;
+            auto c = code;
+            while (c > endCode)
+            {
+                *p-- = table.suffix[c];
+                c = table.prefix[c];
+            }
+            *p = static_cast<uint8_t>(c);
+            std::memcpy(pOut + written, string, cbOut - written);
+            written = cbOut;
+        }
+
+        prevCode = code;
+    }
+
+    return written;
+}
+
+void GifLzwDecoder::Deinterlace(const uint8_t *pSource, uint8_t *pDest, uint32_t width, uint32_t height)
+{
+    // Interlaced rows are stored in four passes: every 8th row from 0, every 8th from 4,
+    // every 4th from 2 and finally every 2nd from 1
+    static const uint32_t starts[] = { 0, 4, 2, 1 };
+    static const uint32_t steps[] = { 8, 8, 4, 2 };
+
+    for (int pass = 0; pass < 4; pass++)
+    {
+        for (uint32_t y = starts[pass]; y < height; y += steps[pass])
+        {
+            std::memcpy(pDest + static_cast<size_t>(y) * width, pSource, width);
+            pSource += width;
+        }
+    }
+}
+
+void Em::Gif::ExpandFrame(const GifFrame &frame, uint32_t *pDest, size_t destStride)
+{
+    // Copy the palette so the transparent entry can be zeroed; the inner loop is then a plain lookup
+    uint32_t lut[256];
+    std::memcpy(lut, frame.palette->data(), sizeof(lut));
+    if (frame.hasTransparency)
+        lut[frame.transparentIndex] = 0;
+
+    auto pSource = frame.pixels.data();
+    for (uint32_t y = 0; y < frame.height; y++, pSource += frame.width, pDest += destStride)
+    {
+        ExpandIndices(pSource, lut, pDest, frame.width);
+    }
+}
@@ -0,0 +1,256 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+// Portable GIF decoder core. Nothing in here may depend on WinRT, COM or Direct2D; it must
+// build with any C++11 compiler so the decode path can be exercised off-device.
+
+namespace Em {
+    namespace Gif
+    {
+        /// <summary>
+        /// A color table. Always holds 256 opaque BGRA entries; unused entries are black.
+        /// </summary>
+        typedef std::vector<uint32_t> GifPalette;
+
+        /// <summary>
+        /// What to do with a frame's area before the next frame is drawn.
+        /// </summary>
+        enum class GifDisposal : uint8_t
+        {
+            Unspecified = 0,
+            None = 1,
+            RestoreBackground = 2,
+            RestorePrevious = 3
+        };
+
+        /// <summary>
+        /// Image-wide properties from the header and the NETSCAPE2.0 application extension.
+        /// </summary>
+        struct GifImageInfo
+        {
+            uint32_t width;
+            uint32_t height;
+            bool isAnimated;        // true if the NETSCAPE2.0 looping extension is present
+            uint16_t loopCount;     // 0 means loop forever
+            uint8_t backgroundIndex;
+            std::shared_ptr<const GifPalette> globalPalette;
+        };
+
+        /// <summary>
+        /// A single decoded frame. Pixels are palette indices, one byte per pixel, row-major and
+        /// already de-interlaced.
+        /// </summary>
+        struct GifFrame
+        {
+            uint32_t left;
+            uint32_t top;
+            uint32_t width;
+            uint32_t height;
+            uint16_t delay;         // hundredths of a second
+            GifDisposal disposal;
+            bool hasTransparency;
+            uint8_t transparentIndex;
+            bool interlaced;
+            std::shared_ptr<const GifPalette> palette;
+            std::vector<uint8_t> pixels;
+        };
+
+        /// <summary>
+        /// A frame's LZW-compressed image data, gathered from its sub-blocks.
+        /// </summary>
+        struct GifCompressedImage
+        {
+            uint32_t minCodeSize;
+
+            // Size the image was encoded at. Differs from the frame's size when decoding downscaled.
+            uint32_t width;
+            uint32_t height;
+
+            // When decoding downscaled, the encoded column and row each of the frame's columns and
+            // rows is sampled from; empty otherwise
+            std::vector<uint32_t> columns;
+            std::vector<uint32_t> rows;
+
+            std::vector<uint8_t> data;
+        };
+
+        /// <summary>
+        /// Thrown when the data is not a GIF or is damaged beyond recovery.
+        /// </summary>
+        class GifFormatException : public std::runtime_error
+        {
+        public:
+            explicit GifFormatException(const char *message) : std::runtime_error(message) {}
+        };
+
+        /// <summary>
+        /// An LZW code table. Each entry records its string's length and first byte as well as
+        /// its prefix and suffix.
+        /// </summary>
+        struct GifLzwTable
+        {
+            uint16_t prefix[4096];
+            uint8_t suffix[4096];
+            uint8_t first[4096];
+            uint16_t length[4096];
+        };
+
+        /// <summary>
+        /// Decompresses frames' image data. Frames decompress independently of each other, so any
+        /// number of these can work on the frames of one GIF at once; each holds its own code table.
+        /// The table and scratch rows come from GifScratchPool and go back to it on destruction.
+        /// </summary>
+        class GifLzwDecoder
+        {
+        public:
+            GifLzwDecoder();
+            ~GifLzwDecoder();
+
+            /// <summary>
+            /// Decompresses the image into the frame's pixels, de-interlacing them if needed. Pixels
+            /// the data doesn't cover are filled with the transparent index.
+            /// </summary>
+            void DecodeFrame(const GifCompressedImage &image, GifFrame &frame);
+
+        private:
+            size_t DecodeLzw(const uint8_t *pData, size_t cbData, uint32_t minCodeSize, uint8_t *pOut, size_t cbOut);
+            static void Deinterlace(const uint8_t *pSource, uint8_t *pDest, uint32_t width, uint32_t height);
+
+            std::unique_ptr<GifLzwTable> m_table;
+            std::vector<uint8_t> m_scratch;
+            std::vector<uint8_t> m_unscaled;
+        };
+
+        /// <summary>
+        /// Streaming GIF decoder over an in-memory buffer. Frames are decoded one at a time, in
+        /// file order; the buffer must outlive the decoder.
+        /// </summary>
+        class GifDecoder
+        {
+        public:
+            /// <summary>
+            /// Parses the header, logical screen descriptor and global color table.
+            /// </summary>
+            GifDecoder(const uint8_t *pData, size_t cbData);
+
+            /// <summary>
+            /// Gets the image-wide properties. Loop information is only final once the
+            /// last frame has been read.
+            /// </summary>
+            const GifImageInfo &GetInfo() const { return m_info; }
+
+            /// <summary>
+            /// Decodes frames downscaled to fit within the given size, keeping the aspect ratio.
+            /// 0 leaves a dimension unbounded. Images are never scaled up, and images with a
+            /// zero-sized logical screen aren't scaled at all. Call before reading any frames.
+            /// </summary>
+            /// <remarks>
+            /// Frame rectangles and the size in GetInfo are reported at the decoded size. Every
+            /// decoded pixel takes the palette index of the encoded pixel under its center, so
+            /// composing downscaled frames gives exactly the point-sampled full-size composition,
+            /// while only costing memory and compositing time at the decoded size.
+            /// </remarks>
+            void SetMaxDecodeSize(uint32_t maxWidth, uint32_t maxHeight);
+
+            /// <summary>
+            /// Works out the size SetMaxDecodeSize decodes an image of the given size at.
+            /// </summary>
+            static void FitDecodeSize(uint32_t width, uint32_t height, uint32_t maxWidth, uint32_t maxHeight, uint32_t &decodeWidth, uint32_t &decodeHeight);
+
+            /// <summary>
+            /// Decodes the next frame. If decodePixels is false only the frame's metadata is read
+            /// and its image data is skipped without running LZW.
+            /// </summary>
+            /// <returns>
+            /// False once the trailer (or the end of a truncated file) has been reached.
+            /// </returns>
+            bool ReadFrame(GifFrame &frame, bool decodePixels = true);
+
+            /// <summary>
+            /// Reads the next frame's metadata and its compressed image data, leaving the pixels to
+            /// be decompressed later, possibly on another thread, by a GifLzwDecoder.
+            /// </summary>
+            /// <returns>
+            /// False once the trailer (or the end of a truncated file) has been reached.
+            /// </returns>
+            bool ReadFrame(GifFrame &frame, GifCompressedImage &image);
+
+            /// <summary>
+            /// Moves back to the first frame.
+            /// </summary>
+            void Rewind();
+
+            /// <summary>
+            /// Gets the offset of the block the next ReadFrame will start at. Taken between frames,
+            /// this is where the next frame's blocks (its graphic control extension included) begin.
+            /// </summary>
+            size_t GetPosition() const { return m_position; }
+
+            /// <summary>
+            /// Moves to a position previously returned by GetPosition, so the next ReadFrame reads
+            /// the frame that followed it.
+            /// </summary>
+            void Seek(size_t position);
+
+            /// <summary>
+            /// Points the decoder at a buffer that has grown, and possibly moved, since it was last
+            /// given one. Everything up to the old size must be unchanged.
+            /// </summary>
+            void SetData(const uint8_t *pData, size_t cbData);
+
+            /// <summary>
+            /// Checks whether the data holds all of the next frame (or the trailer), so ReadFrame
+            /// won't run off the end of it. Only walks the block structure; nothing is decoded.
+            /// </summary>
+            bool HasCompleteFrame() const;
+
+            /// <summary>
+            /// Checks whether the data is long enough for the constructor to parse the header and
+            /// global color table.
+            /// </summary>
+            static bool HasCompleteHeader(const uint8_t *pData, size_t cbData);
+
+        private:
+            void ReadHeader();
+            bool ReadNextFrame(GifFrame &frame, GifCompressedImage *pImage);
+            std::shared_ptr<const GifPalette> ReadColorTable(uint32_t dwEntries);
+            bool ReadExtension();
+            bool ReadImage(GifFrame &frame, GifCompressedImage *pImage);   // pImage may be null to skip the data
+            bool ReadSubBlocks(std::vector<uint8_t> *pOut);
+
+            const uint8_t *m_pData;
+            size_t m_cbData;
+
+            // Logical screen size as encoded; m_info holds the decoded size
+            uint32_t m_screenWidth;
+            uint32_t m_screenHeight;
+
+            size_t m_position;
+            size_t m_firstBlock;
+            bool m_ended;
+
+            GifImageInfo m_info;
+
+            // Graphic control extension state; applies to the next image only
+            uint16_t m_pendingDelay;
+            GifDisposal m_pendingDisposal;
+            bool m_pendingHasTransparency;
+            uint8_t m_pendingTransparentIndex;
+
+            // Used when frames are decoded as they're read
+            GifLzwDecoder m_lzw;
+            GifCompressedImage m_image;
+        };
+
+        /// <summary>
+        /// Expands a frame's palette indices into premultiplied BGRA. Transparent pixels
+        /// become zero. destStride is in pixels.
+        /// </summary>
+        void ExpandFrame(const GifFrame &frame, uint32_t *pDest, size_t destStride);
+    }
+}
@@ -0,0 +1,858 @@
+﻿#include "GifDiskCache.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace Em::Gif;
+
+namespace
+{
+    // Constructed during module initialization, so there's no lazy-initialization race
+    GifDiskCache s_instance;
+
+    const uint32_t FileMagic = 0x43464947;     // "GIFC"
+    const uint32_t IndexMagic = 0x49464947;    // "GIFI"
+    const char IndexName[] = "index.gifcache";
+
+#ifdef _WIN32
+    const char PathSeparator = '\\';
+
+    std::wstring Widen(const std::string &path)
+    {
+        if (path.empty())
+            return std::wstring();
+
+        auto cch = MultiByteToWideChar(CP_UTF8, 0, path.data(), static_cast<int>(path.size()), nullptr, 0);
+        std::wstring result(cch, L'\0');
+        MultiByteToWideChar(CP_UTF8, 0, path.data(), static_cast<int>(path.size()), &result[0], cch);
+        return result;
+    }
+
+    FILE *OpenFile(const std::string &path, bool write)
+    {
+        FILE *pFile = nullptr;
+        _wfopen_s(&pFile, Widen(path).c_str(), write ? L"wb" : L"rb");
+        return pFile;
+    }
+
+    // A file that's already gone counts as deleted
+    bool DeleteFileAt(const std::string &path)
+    {
+        return _wremove(Widen(path).c_str()) == 0 || errno == ENOENT;
+    }
+
+    bool RenameFile(const std::string &from, const std::string &to)
+    {
+        // Renaming over an existing file fails on Windows
+        _wremove(Widen(to).c_str());
+        return _wrename(Widen(from).c_str(), Widen(to).c_str()) == 0;
+    }
+
+    void MakeDirectory(const std::string &path)
+    {
+        _wmkdir(Widen(path).c_str());
+    }
+#else
+    const char PathSeparator = '/';
+
+    FILE *OpenFile(const std::string &path, bool write)
+    {
+        return std::fopen(path.c_str(), write ? "wb" : "rb");
+    }
+
+    bool DeleteFileAt(const std::string &path)
+    {
+        return std::remove(path.c_str()) == 0 || errno == ENOENT;
+    }
+
+    bool RenameFile(const std::string &from, const std::string &to)
+    {
+        return std::rename(from.c_str(), to.c_str()) == 0;
+    }
+
+    void MakeDirectory(const std::string &path)
+    {
+        mkdir(path.c_str(), 0777);
+    }
+#endif
+
+    // A read-only view of a whole file. Frame sets loaded from the cache point into it, and keep
+    // it alive for as long as they live.
+    class MappedFile
+    {
+    public:
+        MappedFile() : m_pView(nullptr), m_cbView(0) {}
+
+        ~MappedFile()
+        {
+            if (m_pView == nullptr)
+                return;
+
+#ifdef _WIN32
+            UnmapViewOfFile(m_pView);
+#else
+            munmap(m_pView, m_cbView);
+#endif
+        }
+
+        bool Open(const std::string &path)
+        {
+#ifdef _WIN32
+            auto widePath = Widen(path);
+#if WINAPI_FAMILY_PARTITION(WINAPI_PARTITION_DESKTOP)
+            auto hFile = CreateFileW(widePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+#else
+            auto hFile = CreateFile2(widePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, OPEN_EXISTING, nullptr);
+#endif
+            if (hFile == INVALID_HANDLE_VALUE)
+                return false;
+
+            LARGE_INTEGER cbFile;
+            if (!GetFileSizeEx(hFile, &cbFile) || cbFile.QuadPart == 0 || static_cast<uint64_t>(cbFile.QuadPart) > SIZE_MAX)
+            {
+                CloseHandle(hFile);
+                return false;
+            }
+
+#if WINAPI_FAMILY_PARTITION(WINAPI_PARTITION_DESKTOP)
+            auto hMapping = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+#else
+            auto hMapping = CreateFileMappingFromApp(hFile, nullptr, PAGE_READONLY, 0, nullptr);
+#endif
+            CloseHandle(hFile);
+            if (hMapping == nullptr)
+                return false;
+
+            // The view keeps the mapping, and with it the file, open
+#if WINAPI_FAMILY_PARTITION(WINAPI_PARTITION_DESKTOP)
+            m_pView = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+#else
+            m_pView = MapViewOfFileFromApp(hMapping, FILE_MAP_READ, 0, 0);
+#endif
+            CloseHandle(hMapping);
+            if (m_pView == nullptr)
+                return false;
+
+            m_cbView = static_cast<size_t>(cbFile.QuadPart);
+            return true;
+#else
+            auto fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return false;
+
+            struct stat status;
+            if (fstat(fd, &status) != 0 || status.st_size <= 0)
+            {
+                close(fd);
+                return false;
+            }
+
+            auto pView = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (pView == MAP_FAILED)
+                return false;
+
+            m_pView = pView;
+            m_cbView = static_cast<size_t>(status.st_size);
+            return true;
+#endif
+        }
+
+        const uint8_t *GetData() const { return static_cast<const uint8_t *>(m_pView); }
+        size_t GetSize() const { return m_cbView; }
+
+    private:
+        MappedFile(const MappedFile &);
+        MappedFile &operator=(const MappedFile &);
+
+        void *m_pView;
+        size_t m_cbView;
+    };
+
+    // Leads every cached file. Followed by the frame delays, then the frames in the set's
+    // storage; every part starts on an 8-byte boundary, each frame of an indexed or delta set
+    // included, so frames can be read in place whatever the image's size.
+    struct FileHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t hash;
+        uint64_t size;
+        uint32_t width;
+        uint32_t height;
+        uint32_t frameCount;
+        uint8_t storage;
+        uint8_t isAnimated;
+        uint16_t loopCount;
+        uint64_t cbFile;        // catches files cut short
+    };
+
+    // How each frame of an indexed set is stored
+    struct IndexedFrameHeader
+    {
+        uint32_t paletteSize;   // 0 if the frame is kept as BGRA
+        uint32_t reserved;
+    };
+
+    struct DeltaFrameHeader
+    {
+        uint32_t left;
+        uint32_t top;
+        uint32_t width;
+        uint32_t height;
+    };
+
+    struct IndexHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t entryCount;
+        uint32_t reserved;
+    };
+
+    struct IndexEntry
+    {
+        uint64_t hash;
+        uint64_t size;
+        uint32_t width;
+        uint32_t height;
+        uint32_t storage;
+        uint32_t reserved;
+        uint64_t cbSize;
+    };
+
+    class FileWriter
+    {
+    public:
+        explicit FileWriter(FILE *pFile) : m_pFile(pFile), m_cbWritten(0), m_failed(pFile == nullptr) {}
+
+        void Write(const void *pData, size_t cbData)
+        {
+            if (m_failed || cbData == 0)
+                return;
+
+            m_failed = std::fwrite(pData, 1, cbData, m_pFile) != cbData;
+            m_cbWritten += cbData;
+        }
+
+        void Align()
+        {
+            static const uint8_t zeros[8] = { 0 };
+            Write(zeros, static_cast<size_t>((8 - m_cbWritten % 8) % 8));
+        }
+
+        // Overwrites what was written at the start of the file
+        void Rewrite(const void *pData, size_t cbData)
+        {
+            if (m_failed)
+                return;
+
+            m_failed = std::fseek(m_pFile, 0, SEEK_SET) != 0 || std::fwrite(pData, 1, cbData, m_pFile) != cbData;
+        }
+
+        uint64_t GetSize() const { return m_cbWritten; }
+        bool Failed() const { return m_failed; }
+
+    private:
+        FILE *m_pFile;
+        uint64_t m_cbWritten;
+        bool m_failed;
+    };
+
+    // Bounds-checked reads from a mapped file. Once anything is out of bounds every later read
+    // fails too, so callers only need to check at the end.
+    class FileReader
+    {
+    public:
+        FileReader(const uint8_t *pData, size_t cbData) : m_pData(pData), m_cbData(cbData), m_position(0), m_failed(false) {}
+
+        const uint8_t *Take(uint64_t cbTake)
+        {
+            if (m_failed || cbTake > m_cbData - m_position)
+            {
+                m_failed = true;
+                return nullptr;
+            }
+
+            auto pResult = m_pData + m_position;
+            m_position += static_cast<size_t>(cbTake);
+            return pResult;
+        }
+
+        bool Read(void *pOut, size_t cbOut)
+        {
+            auto pData = Take(cbOut);
+            if (pData != nullptr)
+            {
+                std::memcpy(pOut, pData, cbOut);
+            }
+            return pData != nullptr;
+        }
+
+        void Align()
+        {
+            Take((8 - m_position % 8) % 8);
+        }
+
+        bool Failed() const { return m_failed; }
+
+    private:
+        const uint8_t *m_pData;
+        size_t m_cbData;
+        size_t m_position;
+        bool m_failed;
+    };
+
+    void WriteFrameSet(FileWriter &writer, const GifCacheKey &key, const GifFrameSet &frameSet)
+    {
+        auto cPixels = static_cast<size_t>(frameSet.width) * frameSet.height;
+        auto frameCount = frameSet.GetFrameCount();
+
+        FileHeader header = {};
+        header.magic = FileMagic;
+        header.version = GifDiskCache::FormatVersion;
+        header.hash = key.hash;
+        header.size = key.size;
+        header.width = frameSet.width;
+        header.height = frameSet.height;
+        header.frameCount = frameCount;
+        header.storage = static_cast<uint8_t>(frameSet.storage);
+        header.isAnimated = frameSet.isAnimated ? 1 : 0;
+        header.loopCount = frameSet.loopCount;
+        writer.Write(&header, sizeof(header));
+
+        writer.Write(frameSet.delays.data(), frameCount * sizeof(uint16_t));
+        writer.Align();
+
+        if (frameSet.storage == GifFrameStorage::Bgra)
+        {
+            auto pComposed = frameSet.mappedComposed ? frameSet.mappedComposed.get() : frameSet.composed.data();
+            writer.Write(pComposed, cPixels * frameCount * sizeof(uint32_t));
+        }
+        else if (frameSet.storage == GifFrameStorage::Indexed)
+        {
+            for (auto &frame : frameSet.indexed)
+            {
+                IndexedFrameHeader frameHeader = { static_cast<uint32_t>(frame.pixels.empty() ? 0 : frame.palette.size()), 0 };
+                writer.Write(&frameHeader, sizeof(frameHeader));
+            }
+
+            for (auto &frame : frameSet.indexed)
+            {
+                if (frame.pixels.empty())
+                {
+                    writer.Write(frame.bgra.data(), cPixels * sizeof(uint32_t));
+                }
+                else
+                {
+                    writer.Write(frame.palette.data(), frame.palette.size() * sizeof(uint32_t));
+                    writer.Write(frame.pixels.data(), cPixels);
+                }
+                writer.Align();
+            }
+        }
+        else
+        {
+            writer.Write(frameSet.keyframes.data(), frameSet.keyframes.size() * sizeof(uint32_t));
+            writer.Align();
+
+            for (auto &delta : frameSet.deltas)
+            {
+                DeltaFrameHeader frameHeader = { delta.left, delta.top, delta.width, delta.height };
+                writer.Write(&frameHeader, sizeof(frameHeader));
+            }
+
+            for (auto &delta : frameSet.deltas)
+            {
+                writer.Write(delta.pixels.data(), delta.pixels.size() * sizeof(uint32_t));
+                writer.Align();
+            }
+        }
+
+        header.cbFile = writer.GetSize();
+        writer.Rewrite(&header, sizeof(header));
+    }
+
+    // Returns null if the file isn't a complete set written by this version for this key
+    std::shared_ptr<GifFrameSet> ReadFrameSet(const std::shared_ptr<MappedFile> &pFile, const GifCacheKey &key)
+    {
+        FileReader reader(pFile->GetData(), pFile->GetSize());
+
+        FileHeader header;
+        if (!reader.Read(&header, sizeof(header)))
+            return nullptr;
+
+        if (header.magic != FileMagic || header.version != GifDiskCache::FormatVersion || header.cbFile != pFile->GetSize() ||
+            header.hash != key.hash || header.size != key.size || header.storage != static_cast<uint8_t>(key.storage) ||
+            header.frameCount == 0 || header.width == 0 || header.height == 0 || header.storage > static_cast<uint8_t>(GifFrameStorage::Delta))
+            return nullptr;
+
+        // The key holds the size asked for at load time, which is 0 by 0 for a GIF whose
+        // logical screen is empty
+        if ((key.width != 0 || key.height != 0) && (header.width != key.width || header.height != key.height))
+            return nullptr;
+
+        auto pSet = std::make_shared<GifFrameSet>();
+        pSet->width = header.width;
+        pSet->height = header.height;
+        pSet->isAnimated = header.isAnimated != 0;
+        pSet->loopCount = header.loopCount;
+        pSet->storage = static_cast<GifFrameStorage>(header.storage);
+
+        auto frameCount = header.frameCount;
+        auto cPixels = static_cast<uint64_t>(header.width) * header.height;
+
+        pSet->delays.resize(frameCount);
+        reader.Read(pSet->delays.data(), frameCount * sizeof(uint16_t));
+        reader.Align();
+
+        if (pSet->storage == GifFrameStorage::Bgra)
+        {
+            auto pComposed = reader.Take(cPixels * frameCount * sizeof(uint32_t));
+            if (pComposed == nullptr)
+                return nullptr;
+
+            // Shares ownership of the mapping while pointing into it
+            pSet->mappedComposed = std::shared_ptr<const uint32_t>(pFile, reinterpret_cast<const uint32_t *>(pComposed));
+        }
+        else if (pSet->storage == GifFrameStorage::Indexed)
+        {
+            std::vector<IndexedFrameHeader> frameHeaders(frameCount);
+            if (!reader.Read(frameHeaders.data(), frameCount * sizeof(IndexedFrameHeader)))
+                return nullptr;
+
+            pSet->indexed.resize(frameCount);
+            for (uint32_t i = 0; i < frameCount; i++)
+            {
+                auto &frame = pSet->indexed[i];
+                auto paletteSize = frameHeaders[i].paletteSize;
+                if (paletteSize > 256)
+                    return nullptr;
+
+                if (paletteSize == 0)
+                {
+                    auto pBgra = reinterpret_cast<const uint32_t *>(reader.Take(cPixels * sizeof(uint32_t)));
+                    if (pBgra == nullptr)
+                        return nullptr;
+                    frame.bgra.assign(pBgra, pBgra + cPixels);
+                }
+                else
+                {
+                    frame.palette.resize(paletteSize);
+                    reader.Read(frame.palette.data(), paletteSize * sizeof(uint32_t));
+
+                    auto pPixels = reader.Take(cPixels);
+                    if (pPixels == nullptr)
+                        return nullptr;
+                    frame.pixels.assign(pPixels, pPixels + cPixels);
+                }
+                reader.Align();
+            }
+        }
+        else
+        {
+            auto cKeyframes = (frameCount + GifFrameSet::DeltaKeyframeInterval - 1) / GifFrameSet::DeltaKeyframeInterval;
+            auto pKeyframes = reinterpret_cast<const uint32_t *>(reader.Take(cPixels * cKeyframes * sizeof(uint32_t)));
+            if (pKeyframes == nullptr)
+                return nullptr;
+            pSet->keyframes.assign(pKeyframes, pKeyframes + cPixels * cKeyframes);
+            reader.Align();
+
+            std::vector<DeltaFrameHeader> frameHeaders(frameCount);
+            if (!reader.Read(frameHeaders.data(), frameCount * sizeof(DeltaFrameHeader)))
+                return nullptr;
+
+            pSet->deltas.resize(frameCount);
+            for (uint32_t i = 0; i < frameCount; i++)
+            {
+                auto &frameHeader = frameHeaders[i];
+                if (frameHeader.left > header.width || frameHeader.width > header.width - frameHeader.left ||
+                    frameHeader.top > header.height || frameHeader.height > header.height - frameHeader.top)
+                    return nullptr;
+
+                auto &delta = pSet->deltas[i];
+                delta.left = frameHeader.left;
+                delta.top = frameHeader.top;
+                delta.width = frameHeader.width;
+                delta.height = frameHeader.height;
+
+                auto cDeltaPixels = static_cast<size_t>(delta.width) * delta.height;
+                auto pPixels = reinterpret_cast<const uint32_t *>(reader.Take(cDeltaPixels * sizeof(uint32_t)));
+                if (pPixels == nullptr)
+                    return nullptr;
+                delta.pixels.assign(pPixels, pPixels + cDeltaPixels);
+                reader.Align();
+            }
+        }
+
+        if (reader.Failed())
+            return nullptr;
+
+        return pSet;
+    }
+
+    void AppendHex(std::string &text, uint64_t value)
+    {
+        static const char digits[] = "0123456789abcdef";
+
+        char buffer[16];
+        auto cDigits = 0;
+        do
+        {
+            buffer[cDigits++] = digits[value & 0xF];
+            value >>= 4;
+        } while (value != 0);
+
+        while (cDigits > 0)
+        {
+            text += buffer[--cDigits];
+        }
+    }
+}
+
+GifDiskCache &GifDiskCache::GetInstance()
+{
+    return s_instance;
+}
+
+GifDiskCache::GifDiskCache()
+    : m_isOrderSaved(true),
+    m_quota(DefaultQuota),
+    m_diskBytes(0),
+    m_hits(0),
+    m_misses(0),
+    m_writes(0),
+    m_evictions(0),
+    m_nextTemporary(0)
+{
+}
+
+GifDiskCache::~GifDiskCache()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_directory.empty() && !m_isOrderSaved)
+    {
+        SaveIndex();
+    }
+}
+
+void GifDiskCache::SetDirectory(const std::string &directory)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_directory = directory;
+    while (!m_directory.empty() && (m_directory.back() == '/' || m_directory.back() == PathSeparator))
+    {
+        m_directory.pop_back();
+    }
+
+    m_entries.clear();
+    m_index.clear();
+    m_diskBytes = 0;
+
+    if (m_directory.empty())
+        return;
+
+    MakeDirectory(m_directory);
+    LoadIndex();
+
+    // The quota may be smaller than it was last time
+    Trim();
+    SaveIndex();
+}
+
+std::string GifDiskCache::GetDirectory() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_directory;
+}
+
+void GifDiskCache::SetQuota(uint64_t cbQuota)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_quota = cbQuota;
+
+    if (!m_directory.empty())
+    {
+        Trim();
+        SaveIndex();
+    }
+}
+
+uint64_t GifDiskCache::GetQuota() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_quota;
+}
+
+std::shared_ptr<const GifFrameSet> GifDiskCache::Find(const GifCacheKey &key)
+{
+    std::string path;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_directory.empty())
+            return nullptr;
+
+        if (m_index.find(key) == m_index.end())
+        {
+            m_misses++;
+            return nullptr;
+        }
+
+        path = GetPath(key);
+    }
+
+    // Mapping only reads the file's first page; the frames come in as they're touched
+    std::shared_ptr<GifFrameSet> pFrameSet;
+    {
+        auto pFile = std::make_shared<MappedFile>();
+        if (pFile->Open(path))
+        {
+            pFrameSet = ReadFrameSet(pFile, key);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // The directory may have changed, or the entry been evicted, while the file was open
+    auto it = m_index.find(key);
+    if (it == m_index.end() || GetPath(key) != path)
+        return pFrameSet;
+
+    if (!pFrameSet)
+    {
+        // Damaged, or written by another version
+        m_misses++;
+        auto entry = it->second;
+        Evict(entry);
+        SaveIndex();
+        return nullptr;
+    }
+
+    // Writing the index out on every hit would make each one wait on the disk, and every other
+    // lookup wait on it
+    m_hits++;
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+    m_isOrderSaved = false;
+    return pFrameSet;
+}
+
+void GifDiskCache::Add(const GifCacheKey &key, const GifFrameSet &frameSet)
+{
+    if (!key.composed || !frameSet.IsComposed())
+        return;
+
+    auto cbSize = frameSet.GetByteSize();
+
+    std::string path;
+    std::string temporaryPath;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_directory.empty() || m_index.find(key) != m_index.end() || cbSize > m_quota)
+            return;
+
+        path = GetPath(key);
+        temporaryPath = path + ".";
+        AppendHex(temporaryPath, m_nextTemporary++);
+        temporaryPath += ".tmp";
+    }
+
+    // Big sets take a while to write, so other loads mustn't wait on it
+    uint64_t cbFile = 0;
+    auto written = false;
+    {
+        auto pFile = OpenFile(temporaryPath, true);
+        FileWriter writer(pFile);
+        WriteFrameSet(writer, key, frameSet);
+
+        cbFile = writer.GetSize();
+        written = !writer.Failed();
+        if (pFile != nullptr)
+        {
+            written = std::fclose(pFile) == 0 && written;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // Two loads of the same GIF may race each other here; the first one wins
+    if (!written || cbFile > m_quota || m_index.find(key) != m_index.end() || GetPath(key) != path || !RenameFile(temporaryPath, path))
+    {
+        DeleteFileAt(temporaryPath);
+        return;
+    }
+
+    Entry entry = { key, cbFile };
+    m_entries.push_front(entry);
+    m_index[key] = m_entries.begin();
+    m_diskBytes += cbFile;
+    m_writes++;
+
+    Trim();
+    SaveIndex();
+}
+
+GifDiskCacheStatistics GifDiskCache::GetStatistics() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    GifDiskCacheStatistics statistics;
+    statistics.hits = m_hits;
+    statistics.misses = m_misses;
+    statistics.writes = m_writes;
+    statistics.evictions = m_evictions;
+    statistics.diskBytes = m_diskBytes;
+    statistics.quota = m_quota;
+    statistics.entryCount = static_cast<uint32_t>(m_entries.size());
+    return statistics;
+}
+
+void GifDiskCache::Clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_directory.empty())
+        return;
+
+    for (auto it = m_entries.begin(); it != m_entries.end();)
+    {
+        if (!Evict(it))
+            ++it;
+    }
+    SaveIndex();
+}
+
+// Must be called with the lock held
+std::string GifDiskCache::GetPath(const GifCacheKey &key) const
+{
+    auto path = m_directory + PathSeparator;
+    AppendHex(path, key.hash);
+    path += '-';
+    AppendHex(path, key.size);
+    path += '-';
+    AppendHex(path, key.width);
+    path += 'x';
+    AppendHex(path, key.height);
+    path += '-';
+    AppendHex(path, static_cast<uint64_t>(key.storage));
+    path += ".gifcache";
+    return path;
+}
+
+// Must be called with the lock held
+std::string GifDiskCache::GetIndexPath() const
+{
+    return m_directory + PathSeparator + IndexName;
+}
+
+// Must be called with the lock held. An index that's missing or unreadable leaves the cache
+// empty; the files it listed are overwritten as the same GIFs are cached again.
+void GifDiskCache::LoadIndex()
+{
+    auto pFile = OpenFile(GetIndexPath(), false);
+    if (pFile == nullptr)
+        return;
+
+    IndexHeader header;
+    if (std::fread(&header, sizeof(header), 1, pFile) == 1 && header.magic == IndexMagic && header.version == FormatVersion)
+    {
+        for (uint32_t i = 0; i < header.entryCount; i++)
+        {
+            IndexEntry indexEntry;
+            if (std::fread(&indexEntry, sizeof(indexEntry), 1, pFile) != 1)
+                break;
+
+            Entry entry;
+            entry.key.hash = indexEntry.hash;
+            entry.key.size = indexEntry.size;
+            entry.key.width = indexEntry.width;
+            entry.key.height = indexEntry.height;
+            entry.key.composed = true;
+            entry.key.storage = static_cast<GifFrameStorage>(indexEntry.storage);
+            entry.cbSize = indexEntry.cbSize;
+
+            if (m_index.find(entry.key) != m_index.end())
+                continue;
+
+            m_entries.push_back(entry);
+            m_index[entry.key] = std::prev(m_entries.end());
+            m_diskBytes += entry.cbSize;
+        }
+    }
+
+    std::fclose(pFile);
+}
+
+// Must be called with the lock held
+void GifDiskCache::SaveIndex()
+{
+    auto path = GetIndexPath();
+    auto temporaryPath = path + ".tmp";
+
+    auto pFile = OpenFile(temporaryPath, true);
+    FileWriter writer(pFile);
+
+    IndexHeader header = { IndexMagic, FormatVersion, static_cast<uint32_t>(m_entries.size()), 0 };
+    writer.Write(&header, sizeof(header));
+
+    for (auto &entry : m_entries)
+    {
+        IndexEntry indexEntry = {};
+        indexEntry.hash = entry.key.hash;
+        indexEntry.size = entry.key.size;
+        indexEntry.width = entry.key.width;
+        indexEntry.height = entry.key.height;
+        indexEntry.storage = static_cast<uint32_t>(entry.key.storage);
+        indexEntry.cbSize = entry.cbSize;
+        writer.Write(&indexEntry, sizeof(indexEntry));
+    }
+
+    auto written = !writer.Failed();
+    if (pFile != nullptr)
+    {
+        written = std::fclose(pFile) == 0 && written;
+    }
+
+    if (!written || !RenameFile(temporaryPath, path))
+    {
+        DeleteFileAt(temporaryPath);
+        return;
+    }
+    m_isOrderSaved = true;
+}
+
+// Must be called with the lock held
+void GifDiskCache::Trim()
+{
+    // A file that's still mapped may refuse to be deleted; it stays listed, and counted, until
+    // a later trim gets it
+    for (auto it = m_entries.end(); m_diskBytes > m_quota && it != m_entries.begin();)
+    {
+        --it;
+        Evict(it);
+    }
+}
+
+// Must be called with the lock held. On success moves the iterator on to the next entry.
+bool GifDiskCache::Evict(EntryList::iterator &it)
+{
+    if (!DeleteFileAt(GetPath(it->key)))
+        return false;
+
+    m_diskBytes -= it->cbSize;
+    m_evictions++;
+    m_index.erase(it->key);
+    it = m_entries.erase(it);
+    return true;
+}
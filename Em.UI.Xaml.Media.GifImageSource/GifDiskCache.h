@@ -0,0 +1,125 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "GifFrameCache.h"
+
+namespace Em {
+    namespace Gif
+    {
+        struct GifDiskCacheStatistics
+        {
+            uint64_t hits;
+            uint64_t misses;
+            uint64_t writes;
+            uint64_t evictions;
+            uint64_t diskBytes;
+            uint64_t quota;
+            uint32_t entryCount;
+        };
+
+        /// <summary>
+        /// Process-wide cache of composed frame sets kept in files, so GIFs shown by an earlier run
+        /// of the app don't have to be decoded and composed again. Bounded by a quota on the bytes
+        /// in its directory, least recently used sets going first. Disabled until it's given a
+        /// directory. All members are thread-safe.
+        /// </summary>
+        /// <remarks>
+        /// Found sets are memory-mapped rather than read. BGRA frames are used straight from the
+        /// mapping, so only the pages of frames being shown are ever resident; indexed and delta
+        /// sets are compact enough to copy out whole. Files carry a format version and the key
+        /// they were written for, and any that don't match are deleted when they're found. They
+        /// hold native byte order and are never meant to leave the device.
+        /// </remarks>
+        class GifDiskCache
+        {
+        public:
+            static const uint64_t DefaultQuota = 64 * 1024 * 1024;
+
+            /// <summary>
+            /// Bumped whenever the file layout changes, which discards everything cached before.
+            /// </summary>
+            static const uint32_t FormatVersion = 2;
+
+            static GifDiskCache &GetInstance();
+
+            GifDiskCache();
+            ~GifDiskCache();
+
+            /// <summary>
+            /// Sets the directory to keep the cache in, creating it if need be, and picks up what
+            /// an earlier run left there. The path is UTF-8. Empty disables the cache.
+            /// </summary>
+            void SetDirectory(const std::string &directory);
+            std::string GetDirectory() const;
+
+            /// <summary>
+            /// Sets the number of bytes the cache's files may take up, deleting files to fit.
+            /// </summary>
+            void SetQuota(uint64_t cbQuota);
+            uint64_t GetQuota() const;
+
+            /// <summary>
+            /// Maps the frame set stored for the key, or returns null and counts a miss.
+            /// </summary>
+            std::shared_ptr<const GifFrameSet> Find(const GifCacheKey &key);
+
+            /// <summary>
+            /// Stores a composed frame set, unless one is already stored for the key or the set
+            /// would take up more than the whole quota. The file is written under a temporary name
+            /// and only renamed once it's complete, so a crash never leaves a partial set behind.
+            /// </summary>
+            void Add(const GifCacheKey &key, const GifFrameSet &frameSet);
+
+            GifDiskCacheStatistics GetStatistics() const;
+
+            /// <summary>
+            /// Deletes every file in the cache. Sets mapped from them stay valid; on platforms that
+            /// can't delete a mapped file, those files go the next time the cache is trimmed.
+            /// </summary>
+            void Clear();
+
+        private:
+            struct Entry
+            {
+                GifCacheKey key;
+                uint64_t cbSize;
+            };
+
+            typedef std::list<Entry> EntryList;
+
+            std::string GetPath(const GifCacheKey &key) const;
+            std::string GetIndexPath() const;
+            void LoadIndex();
+            void SaveIndex();
+            void Trim();
+            bool Evict(EntryList::iterator &it);
+
+            mutable std::mutex m_mutex;
+            std::string m_directory;
+
+            // Most recently used first. Saved to an index file in the directory whenever entries
+            // are added or removed, so the order survives from one run to the next. Hits only
+            // reorder it in memory, to be saved along with the next change.
+            EntryList m_entries;
+            std::unordered_map<GifCacheKey, EntryList::iterator, GifCacheKeyHasher> m_index;
+            bool m_isOrderSaved;
+
+            uint64_t m_quota;
+            uint64_t m_diskBytes;
+            uint64_t m_hits;
+            uint64_t m_misses;
+            uint64_t m_writes;
+            uint64_t m_evictions;
+
+            // Tells apart the temporary files of sets being written at the same time
+            uint32_t m_nextTemporary;
+        };
+    }
+}
@@ -0,0 +1,240 @@
+﻿#include "GifFrameCache.h"
+
+#include <chrono>
+#include <cstring>
+#include <iterator>
+
+using namespace Em::Gif;
+
+namespace
+{
+    // Constructed during module initialization, so there's no lazy-initialization race
+    GifFrameCache s_instance;
+
+    inline uint64_t Mix(uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        return h;
+    }
+}
+
+GifFrameCache &GifFrameCache::GetInstance()
+{
+    return s_instance;
+}
+
+GifCacheKey GifFrameCache::ComputeKey(const uint8_t *pData, size_t cbData, uint32_t width, uint32_t height, bool composed, GifFrameStorage storage)
+{
+    // Word-at-a-time multiply/xor hash. It only has to tell GIFs apart, not resist attackers,
+    // and it runs over every byte of every GIF we load, so speed matters more than anything.
+    const uint64_t prime = 0x9E3779B97F4A7C15ull;
+    uint64_t h = cbData * prime;
+
+    size_t i = 0;
+    for (; i + 8 <= cbData; i += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, pData + i, sizeof(word));
+        h = (h ^ Mix(word)) * prime;
+    }
+
+    uint64_t tail = 0;
+    for (size_t shift = 0; i < cbData; i++, shift += 8)
+    {
+        tail |= static_cast<uint64_t>(pData[i]) << shift;
+    }
+
+    GifCacheKey key;
+    key.hash = Mix(h ^ Mix(tail));
+    key.size = cbData;
+    key.width = width;
+    key.height = height;
+    key.composed = composed;
+
+    // Raw frames are always palette indices, whatever storage was asked for
+    key.storage = composed ? storage : GifFrameStorage::Bgra;
+    return key;
+}
+
+GifFrameCache::GifFrameCache()
+    : m_capacity(DefaultCapacity),
+    m_residentBytes(0),
+    m_hits(0),
+    m_misses(0),
+    m_merged(0),
+    m_evictions(0)
+{
+}
+
+std::shared_ptr<const GifFrameSet> GifFrameCache::Find(const GifCacheKey &key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_index.find(key);
+    if (it == m_index.end())
+    {
+        m_misses++;
+        return nullptr;
+    }
+
+    m_hits++;
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+    return it->second->frameSet;
+}
+
+void GifFrameCache::Add(const GifCacheKey &key, const std::shared_ptr<const GifFrameSet> &pFrameSet)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Insert(key, pFrameSet);
+}
+
+std::shared_ptr<const GifFrameSet> GifFrameCache::FindOrBeginDecode(const GifCacheKey &key, bool &mustDecode, const GifCancellation *pCancellation)
+{
+    mustDecode = false;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;)
+    {
+        auto it = m_index.find(key);
+        if (it != m_index.end())
+        {
+            m_hits++;
+            m_entries.splice(m_entries.begin(), m_entries, it->second);
+            return it->second->frameSet;
+        }
+
+        auto pending = m_pending.find(key);
+        if (pending == m_pending.end())
+        {
+            PendingDecode decode = { false, nullptr };
+            m_pending[key] = std::make_shared<PendingDecode>(decode);
+            m_misses++;
+            mustDecode = true;
+            return nullptr;
+        }
+
+        // Cancellation doesn't signal the condition, so look for it every so often
+        auto pDecode = pending->second;
+        while (!pDecode->done)
+        {
+            if (pCancellation != nullptr)
+                pCancellation->ThrowIfCancelled();
+
+            m_decodeEnded.wait_for(lock, std::chrono::milliseconds(50));
+        }
+
+        if (pDecode->frameSet)
+        {
+            m_merged++;
+            return pDecode->frameSet;
+        }
+
+        // The decode failed or was cancelled; try again, likely decoding ourselves
+    }
+}
+
+void GifFrameCache::EndDecode(const GifCacheKey &key, const std::shared_ptr<const GifFrameSet> &pFrameSet)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto pending = m_pending.find(key);
+    if (pending != m_pending.end())
+    {
+        pending->second->done = true;
+        pending->second->frameSet = pFrameSet;
+        m_pending.erase(pending);
+        m_decodeEnded.notify_all();
+    }
+
+    if (pFrameSet)
+        Insert(key, pFrameSet);
+}
+
+// Must be called with the lock held
+void GifFrameCache::Insert(const GifCacheKey &key, const std::shared_ptr<const GifFrameSet> &pFrameSet)
+{
+    auto cbSize = pFrameSet->GetByteSize();
+
+    // Two loads of the same GIF may race each other here; the first one wins
+    auto it = m_index.find(key);
+    if (it != m_index.end())
+    {
+        m_entries.splice(m_entries.begin(), m_entries, it->second);
+        return;
+    }
+
+    if (cbSize > m_capacity)
+        return;
+
+    Entry entry = { key, pFrameSet, cbSize };
+    m_entries.push_front(entry);
+    m_index[key] = m_entries.begin();
+    m_residentBytes += cbSize;
+
+    Trim();
+}
+
+void GifFrameCache::SetCapacity(size_t cbCapacity)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_capacity = cbCapacity;
+    Trim();
+}
+
+size_t GifFrameCache::GetCapacity() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_capacity;
+}
+
+GifCacheStatistics GifFrameCache::GetStatistics() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    GifCacheStatistics statistics;
+    statistics.hits = m_hits;
+    statistics.misses = m_misses;
+    statistics.merged = m_merged;
+    statistics.evictions = m_evictions;
+    statistics.residentBytes = m_residentBytes;
+    statistics.capacity = m_capacity;
+    statistics.entryCount = static_cast<uint32_t>(m_entries.size());
+    return statistics;
+}
+
+void GifFrameCache::Clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.clear();
+    m_index.clear();
+    m_residentBytes = 0;
+}
+
+// Must be called with the lock held
+void GifFrameCache::Trim()
+{
+    // Evicting a set that's still attached to a player frees nothing, so go after the least
+    // recently used sets nobody else holds first
+    for (auto it = m_entries.end(); m_residentBytes > m_capacity && it != m_entries.begin();)
+    {
+        --it;
+        if (it->frameSet.use_count() == 1)
+            it = Evict(it);
+    }
+
+    while (m_residentBytes > m_capacity && !m_entries.empty())
+    {
+        Evict(std::prev(m_entries.end()));
+    }
+}
+
+// Must be called with the lock held
+GifFrameCache::EntryList::iterator GifFrameCache::Evict(EntryList::iterator it)
+{
+    m_residentBytes -= it->cbSize;
+    m_evictions++;
+    m_index.erase(it->key);
+    return m_entries.erase(it);
+}
@@ -0,0 +1,156 @@
+﻿#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "GifCancellation.h"
+#include "GifFrameSet.h"
+
+namespace Em {
+    namespace Gif
+    {
+        /// <summary>
+        /// Identifies a frame set by the content it was decoded from.
+        /// </summary>
+        struct GifCacheKey
+        {
+            uint64_t hash;
+            uint64_t size;
+            uint32_t width;         // decoded size, which differs from the GIF's when downscaling
+            uint32_t height;
+            bool composed;
+            GifFrameStorage storage;
+
+            bool operator==(const GifCacheKey &other) const
+            {
+                return hash == other.hash && size == other.size && width == other.width && height == other.height &&
+                    composed == other.composed && storage == other.storage;
+            }
+        };
+
+        struct GifCacheKeyHasher
+        {
+            size_t operator()(const GifCacheKey &key) const
+            {
+                return static_cast<size_t>(key.hash ^ (key.size << 1) ^ (key.composed ? 1 : 0) ^ (static_cast<uint64_t>(key.storage) << 1) ^
+                    (static_cast<uint64_t>(key.width) << 32) ^ (static_cast<uint64_t>(key.height) << 16));
+            }
+        };
+
+        struct GifCacheStatistics
+        {
+            uint64_t hits;
+            uint64_t misses;
+            uint64_t merged;        // loads that waited for another's decode instead of decoding
+            uint64_t evictions;
+            size_t residentBytes;
+            size_t capacity;
+            uint32_t entryCount;
+        };
+
+        /// <summary>
+        /// Process-wide LRU cache of decoded frame sets, keyed by content hash and bounded by a byte
+        /// budget. Frame sets are reference counted; evicting one that is still in use only stops it
+        /// from being shared further. All members are thread-safe.
+        /// </summary>
+        class GifFrameCache
+        {
+        public:
+            static const size_t DefaultCapacity = 32 * 1024 * 1024;
+
+            static GifFrameCache &GetInstance();
+
+            /// <summary>
+            /// Computes the key for a GIF's data decoded at the given size. Composed and raw sets of
+            /// the same data are cached separately, as are composed sets in different storage.
+            /// </summary>
+            static GifCacheKey ComputeKey(const uint8_t *pData, size_t cbData, uint32_t width, uint32_t height, bool composed, GifFrameStorage storage = GifFrameStorage::Bgra);
+
+            GifFrameCache();
+
+            /// <summary>
+            /// Returns the cached frame set for the key, or null, and counts the hit or miss.
+            /// </summary>
+            std::shared_ptr<const GifFrameSet> Find(const GifCacheKey &key);
+
+            /// <summary>
+            /// Adds a frame set, evicting least recently used sets as needed to stay within
+            /// capacity. Sets larger than the whole capacity are not cached.
+            /// </summary>
+            void Add(const GifCacheKey &key, const std::shared_ptr<const GifFrameSet> &pFrameSet);
+
+            /// <summary>
+            /// Like Find, but merges loads of the same key. If another thread is already decoding
+            /// the key, waits for it and returns its frame set. Otherwise returns null with
+            /// mustDecode set, and the caller must call EndDecode once it's done, whether or not
+            /// the decode succeeds.
+            /// </summary>
+            /// <param name="pCancellation">
+            /// Stops the wait, throwing GifCancelledException. May be null.
+            /// </param>
+            std::shared_ptr<const GifFrameSet> FindOrBeginDecode(const GifCacheKey &key, bool &mustDecode, const GifCancellation *pCancellation = nullptr);
+
+            /// <summary>
+            /// Finishes a decode begun with FindOrBeginDecode: adds the frame set and hands it to
+            /// every load waiting for it. Null means the decode failed, and one of the waiting
+            /// loads decodes instead.
+            /// </summary>
+            void EndDecode(const GifCacheKey &key, const std::shared_ptr<const GifFrameSet> &pFrameSet);
+
+            /// <summary>
+            /// Sets the byte budget. 0 disables the cache.
+            /// </summary>
+            void SetCapacity(size_t cbCapacity);
+            size_t GetCapacity() const;
+
+            GifCacheStatistics GetStatistics() const;
+
+            /// <summary>
+            /// Drops every entry. Frame sets still in use stay alive with their users.
+            /// </summary>
+            void Clear();
+
+        private:
+            struct Entry
+            {
+                GifCacheKey key;
+                std::shared_ptr<const GifFrameSet> frameSet;
+                size_t cbSize;
+            };
+
+            typedef std::list<Entry> EntryList;
+
+            struct PendingDecode
+            {
+                bool done;
+                std::shared_ptr<const GifFrameSet> frameSet;
+            };
+
+            void Insert(const GifCacheKey &key, const std::shared_ptr<const GifFrameSet> &pFrameSet);
+            void Trim();
+            EntryList::iterator Evict(EntryList::iterator it);
+
+            mutable std::mutex m_mutex;
+
+            // Most recently used first
+            EntryList m_entries;
+            std::unordered_map<GifCacheKey, EntryList::iterator, GifCacheKeyHasher> m_index;
+
+            // Decodes in progress, and a signal for the loads waiting on them
+            std::unordered_map<GifCacheKey, std::shared_ptr<PendingDecode>, GifCacheKeyHasher> m_pending;
+            std::condition_variable m_decodeEnded;
+
+            size_t m_capacity;
+            size_t m_residentBytes;
+            uint64_t m_hits;
+            uint64_t m_misses;
+            uint64_t m_merged;
+            uint64_t m_evictions;
+        };
+    }
+}
@@ -0,0 +1,50 @@
+﻿#include "GifFrameIndex.h"
+
+#include <algorithm>
+
+using namespace Em::Gif;
+
+GifFrameIndex GifFrameIndex::Build(const uint8_t *pData, size_t cbData, uint32_t maxDecodeWidth, uint32_t maxDecodeHeight)
+{
+    GifDecoder decoder(pData, cbData);
+    decoder.SetMaxDecodeSize(maxDecodeWidth, maxDecodeHeight);
+    GifFrameIndex index;
+
+    GifFrame frame;
+    for (;;)
+    {
+        auto offset = decoder.GetPosition();
+        if (!decoder.ReadFrame(frame, false))
+            break;
+
+        GifFrameIndexEntry entry;
+        entry.offset = offset;
+        entry.left = frame.left;
+        entry.top = frame.top;
+        entry.width = frame.width;
+        entry.height = frame.height;
+        entry.delay = frame.delay;
+        entry.disposal = frame.disposal;
+        entry.hasTransparency = frame.hasTransparency;
+        entry.transparentIndex = frame.transparentIndex;
+        entry.interlaced = frame.interlaced;
+        index.frames.push_back(entry);
+    }
+
+    // Loop information can follow the first frame, so it's only final now
+    index.info = decoder.GetInfo();
+    index.width = index.info.width;
+    index.height = index.info.height;
+
+    // Same fallback as GifFrameSet for encoders that write a zero-sized logical screen
+    if (index.width == 0 || index.height == 0)
+    {
+        for (auto &entry : index.frames)
+        {
+            index.width = std::max(index.width, entry.left + entry.width);
+            index.height = std::max(index.height, entry.top + entry.height);
+        }
+    }
+
+    return index;
+}
@@ -0,0 +1,58 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "GifDecoder.h"
+
+namespace Em {
+    namespace Gif
+    {
+        /// <summary>
+        /// Where a frame is in the data and everything about it except its pixels.
+        /// </summary>
+        struct GifFrameIndexEntry
+        {
+            // Offset of the frame's first block, for GifDecoder::Seek
+            size_t offset;
+
+            uint32_t left;
+            uint32_t top;
+            uint32_t width;
+            uint32_t height;
+            uint16_t delay;         // hundredths of a second
+            GifDisposal disposal;
+            bool hasTransparency;
+            uint8_t transparentIndex;
+            bool interlaced;
+        };
+
+        /// <summary>
+        /// Every frame of a GIF, found by one pass over the block structure with no LZW decoding.
+        /// Enough to size, time and budget an image before any pixels are decoded, and to decode
+        /// any frame on its own later.
+        /// </summary>
+        struct GifFrameIndex
+        {
+            // Image-wide properties, including the looping extension
+            GifImageInfo info;
+
+            // Canvas size. The same as the logical screen, unless that was zero, in which case it's
+            // just big enough to hold every frame.
+            uint32_t width;
+            uint32_t height;
+
+            std::vector<GifFrameIndexEntry> frames;
+
+            uint32_t GetFrameCount() const { return static_cast<uint32_t>(frames.size()); }
+
+            /// <summary>
+            /// Scans the data. Throws GifFormatException if it isn't a GIF; a truncated file is
+            /// indexed as far as it goes. Given a maximum decode size, sizes and frame rectangles are
+            /// those of frames decoded with GifDecoder::SetMaxDecodeSize.
+            /// </summary>
+            static GifFrameIndex Build(const uint8_t *pData, size_t cbData, uint32_t maxDecodeWidth = 0, uint32_t maxDecodeHeight = 0);
+        };
+    }
+}
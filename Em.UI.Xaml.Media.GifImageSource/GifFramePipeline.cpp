@@ -0,0 +1,138 @@
+﻿#include "GifFramePipeline.h"
+
+#include <chrono>
+#include <stdexcept>
+
+#include "GifWorkerPool.h"
+
+using namespace Em::Gif;
+
+std::shared_ptr<GifFramePipeline> GifFramePipeline::Start(std::vector<uint8_t> data, uint32_t maxDecodeWidth, uint32_t maxDecodeHeight, GifFrameStorage storage, FinishedHandler finished)
+{
+    std::shared_ptr<GifFramePipeline> pPipeline(new GifFramePipeline(std::move(data), maxDecodeWidth, maxDecodeHeight, storage, std::move(finished)));
+
+    // The worker keeps the pipeline alive, so whoever started it can let go of it at any time
+    GifWorkerPool::GetInstance().Submit([pPipeline] { pPipeline->Run(); });
+    return pPipeline;
+}
+
+GifFramePipeline::GifFramePipeline(std::vector<uint8_t> data, uint32_t maxDecodeWidth, uint32_t maxDecodeHeight, GifFrameStorage storage, FinishedHandler finished) :
+    m_data(std::move(data)),
+    m_maxDecodeWidth(maxDecodeWidth),
+    m_maxDecodeHeight(maxDecodeHeight),
+    m_storage(storage),
+    m_finished(std::move(finished)),
+    m_cComposed(0),
+    m_cbFrameSet(0),
+    m_isFinished(false)
+{
+}
+
+void GifFramePipeline::Run()
+{
+    std::shared_ptr<const GifFrameSet> pFrameSet;
+    try
+    {
+        GifDecoder decoder(m_data.data(), m_data.size());
+        decoder.SetMaxDecodeSize(m_maxDecodeWidth, m_maxDecodeHeight);
+        pFrameSet = GifFrameSet::Decode(decoder, true, m_storage, &GifWorkerPool::GetInstance(), &m_cancellation,
+            [this](const std::shared_ptr<const GifFrameSet> &pSet, uint32_t cComposed)
+        {
+            Publish(pSet, cComposed);
+        });
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_error = std::current_exception();
+    }
+
+    // Before anyone sees the pipeline finished, so a load that does finds the set in the cache
+    if (m_finished)
+    {
+        m_finished(pFrameSet);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (pFrameSet)
+        {
+            m_cbFrameSet = pFrameSet->GetByteSize();
+        }
+        m_isFinished = true;
+    }
+    m_changed.notify_all();
+}
+
+// Runs on the worker, between frames
+void GifFramePipeline::Publish(const std::shared_ptr<const GifFrameSet> &pSet, uint32_t cComposed)
+{
+    // Safe here, where the set is written; readers only ever get the total
+    auto cbFrameSet = pSet->GetByteSize();
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_frameSet = pSet;
+        m_cComposed = cComposed;
+        m_cbFrameSet = cbFrameSet;
+    }
+    m_changed.notify_all();
+}
+
+void GifFramePipeline::WaitForFrames(uint32_t cFrames, const GifCancellation *pCancellation)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_cComposed < cFrames && !m_isFinished)
+    {
+        if (pCancellation != nullptr && pCancellation->IsCancelled())
+        {
+            m_cancellation.Cancel();
+            throw GifCancelledException();
+        }
+
+        // Cancellation doesn't signal the condition, so look for it every so often
+        m_changed.wait_for(lock, std::chrono::milliseconds(50));
+    }
+
+    if (m_cComposed < cFrames && m_error)
+        std::rethrow_exception(m_error);
+}
+
+std::shared_ptr<const GifFrameSet> GifFramePipeline::GetFrameSet() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_frameSet;
+}
+
+uint32_t GifFramePipeline::GetComposedFrameCount() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_cComposed;
+}
+
+bool GifFramePipeline::IsFinished() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_isFinished;
+}
+
+bool GifFramePipeline::HasFailed() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_error != nullptr;
+}
+
+size_t GifFramePipeline::GetResidentBytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_data.capacity() + m_cbFrameSet;
+}
+
+std::vector<uint8_t> GifFramePipeline::TakeData()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_isFinished)
+        throw std::logic_error("frames are still being composed");
+
+    return std::move(m_data);
+}
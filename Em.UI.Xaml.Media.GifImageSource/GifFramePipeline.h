@@ -0,0 +1,114 @@
+﻿#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "GifCancellation.h"
+#include "GifFrameSet.h"
+
+namespace Em {
+    namespace Gif
+    {
+        /// <summary>
+        /// Decodes and composes a GIF's frames in the background, as a pipeline: the compressed data
+        /// of every frame is gathered, frames are decompressed on the worker pool a few at a time
+        /// ahead of composition, and composed in order into the storage asked for. Each frame can be
+        /// presented as soon as it's composed, so playback can start after a single frame's work
+        /// while the rest streams in behind it.
+        /// The work runs on one thread while frames are read from another; all members are
+        /// thread-safe.
+        /// </summary>
+        class GifFramePipeline
+        {
+        public:
+            /// <summary>
+            /// Called on the worker once the pipeline stops, with the complete frame set, or null if
+            /// it failed or was cancelled. Must not throw.
+            /// </summary>
+            typedef std::function<void(const std::shared_ptr<const GifFrameSet> &pSet)> FinishedHandler;
+
+            /// <summary>
+            /// Starts decoding on a pool worker, downscaled as GifDecoder::SetMaxDecodeSize. The
+            /// pipeline holds on to the data until TakeData. With no pool workers, everything is
+            /// done before this returns.
+            /// </summary>
+            static std::shared_ptr<GifFramePipeline> Start(std::vector<uint8_t> data, uint32_t maxDecodeWidth, uint32_t maxDecodeHeight, GifFrameStorage storage, FinishedHandler finished);
+
+            /// <summary>
+            /// Blocks until the first cFrames frames have been composed or the pipeline stops. Throws
+            /// whatever stopped it if that was before the frames were composed.
+            /// </summary>
+            /// <param name="pCancellation">
+            /// Lets another thread give up waiting, which cancels the pipeline as well and throws
+            /// GifCancelledException. May be null.
+            /// </param>
+            void WaitForFrames(uint32_t cFrames, const GifCancellation *pCancellation = nullptr);
+
+            /// <summary>
+            /// Asks the pipeline to stop at the next frame, without waiting for it to.
+            /// </summary>
+            void Cancel() { m_cancellation.Cancel(); }
+
+            /// <summary>
+            /// Gets the frame set being built, or null before the first frame has been composed.
+            /// Until the pipeline has finished, only the frames GetComposedFrameCount counts may be
+            /// read from it, along with its size and delays.
+            /// </summary>
+            std::shared_ptr<const GifFrameSet> GetFrameSet() const;
+
+            uint32_t GetComposedFrameCount() const;
+
+            /// <summary>
+            /// Whether the pipeline has stopped, whether or not it composed every frame.
+            /// </summary>
+            bool IsFinished() const;
+
+            /// <summary>
+            /// Whether the pipeline stopped before composing every frame.
+            /// </summary>
+            bool HasFailed() const;
+
+            /// <summary>
+            /// Gets the number of bytes held: the data and the frame set as composed so far.
+            /// </summary>
+            size_t GetResidentBytes() const;
+
+            /// <summary>
+            /// Once finished, moves the data out of the pipeline.
+            /// </summary>
+            std::vector<uint8_t> TakeData();
+
+        private:
+            GifFramePipeline(std::vector<uint8_t> data, uint32_t maxDecodeWidth, uint32_t maxDecodeHeight, GifFrameStorage storage, FinishedHandler finished);
+            GifFramePipeline(const GifFramePipeline &);
+            GifFramePipeline &operator=(const GifFramePipeline &);
+
+            void Run();
+            void Publish(const std::shared_ptr<const GifFrameSet> &pSet, uint32_t cComposed);
+
+            mutable std::mutex m_mutex;
+            std::condition_variable m_changed;
+
+            // Read by the worker until it finishes, and only moved out after that
+            std::vector<uint8_t> m_data;
+
+            uint32_t m_maxDecodeWidth;
+            uint32_t m_maxDecodeHeight;
+            GifFrameStorage m_storage;
+            FinishedHandler m_finished;
+            GifCancellation m_cancellation;
+
+            std::shared_ptr<const GifFrameSet> m_frameSet;
+            uint32_t m_cComposed;
+            size_t m_cbFrameSet;
+            bool m_isFinished;
+            std::exception_ptr m_error;
+        };
+    }
+}
@@ -0,0 +1,540 @@
+﻿#include "GifFrameSet.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <mutex>
+
+#include "GifCompositor.h"
+#include "GifPixelKernels.h"
+#include "GifScratchPool.h"
+#include "GifWorkerPool.h"
+
+using namespace Em::Gif;
+
+namespace
+{
+    // Builds an exact palette for a composed frame and maps every pixel to it. Gives up as soon as
+    // a 257th color turns up; nothing is ever approximated.
+    bool IndexPixels(const uint32_t *pPixels, size_t cPixels, GifIndexedFrame &frame)
+    {
+        // Open-addressed table of the colors seen so far, four times the size of the largest
+        // palette so probes stay short
+        const uint32_t TableSize = 1024;
+        uint32_t colors[TableSize];
+        int16_t slots[TableSize];
+        std::fill(slots, slots + TableSize, static_cast<int16_t>(-1));
+
+        frame.palette.clear();
+        frame.pixels.resize(cPixels);
+
+        // GIF frames are mostly runs of one color, so remember the last lookup
+        uint32_t lastColor = 0;
+        int lastIndex = -1;
+
+        for (size_t i = 0; i < cPixels; i++)
+        {
+            auto color = pPixels[i];
+            if (color != lastColor || lastIndex < 0)
+            {
+                auto slot = (color * 0x9E3779B1u) >> 22;
+                while (slots[slot] >= 0 && colors[slot] != color)
+                {
+                    slot = (slot + 1) & (TableSize - 1);
+                }
+
+                if (slots[slot] < 0)
+                {
+                    if (frame.palette.size() == 256)
+                        return false;
+
+                    colors[slot] = color;
+                    slots[slot] = static_cast<int16_t>(frame.palette.size());
+                    frame.palette.push_back(color);
+                }
+
+                lastColor = color;
+                lastIndex = slots[slot];
+            }
+
+            frame.pixels[i] = static_cast<uint8_t>(lastIndex);
+        }
+
+        return true;
+    }
+
+    // Finds the smallest rectangle holding every pixel that differs between two frames
+    void DiffFrames(const uint32_t *pPrevious, const uint32_t *pCurrent, uint32_t width, uint32_t height, GifDeltaFrame &delta)
+    {
+        auto cbRow = width * sizeof(uint32_t);
+
+        uint32_t top = 0;
+        while (top < height && std::memcmp(pPrevious + top * width, pCurrent + top * width, cbRow) == 0)
+        {
+            top++;
+        }
+
+        if (top == height)
+        {
+            delta.left = delta.top = delta.width = delta.height = 0;
+            return;
+        }
+
+        uint32_t bottom = height;
+        while (std::memcmp(pPrevious + (bottom - 1) * width, pCurrent + (bottom - 1) * width, cbRow) == 0)
+        {
+            bottom--;
+        }
+
+        uint32_t left = width;
+        uint32_t right = 0;
+        for (uint32_t y = top; y < bottom; y++)
+        {
+            auto pPreviousRow = pPrevious + y * width;
+            auto pCurrentRow = pCurrent + y * width;
+
+            for (uint32_t x = 0; x < left; x++)
+            {
+                if (pPreviousRow[x] != pCurrentRow[x])
+                {
+                    left = x;
+                    break;
+                }
+            }
+
+            for (uint32_t x = width; x > right; x--)
+            {
+                if (pPreviousRow[x - 1] != pCurrentRow[x - 1])
+                {
+                    right = x;
+                    break;
+                }
+            }
+        }
+
+        delta.left = left;
+        delta.top = top;
+        delta.width = right - left;
+        delta.height = bottom - top;
+
+        delta.pixels.resize(static_cast<size_t>(delta.width) * delta.height);
+        for (uint32_t y = 0; y < delta.height; y++)
+        {
+            std::memcpy(delta.pixels.data() + y * delta.width, pCurrent + (top + y) * width + left, delta.width * sizeof(uint32_t));
+        }
+    }
+
+    void ApplyDelta(const GifDeltaFrame &delta, uint32_t *pCanvas, uint32_t width)
+    {
+        for (uint32_t y = 0; y < delta.height; y++)
+        {
+            std::memcpy(pCanvas + (delta.top + y) * width + delta.left, delta.pixels.data() + y * delta.width, delta.width * sizeof(uint32_t));
+        }
+    }
+
+    // Frames whose pixels are being decompressed by several threads at once. Frames are claimed
+    // in file order, so the ones composition needs first are ready first, and never more than
+    // cAhead past the frame composition is waiting for, so only a few decoded frames are held at
+    // a time. Pool workers hold a reference, since some may only get to run after the decode is
+    // over; by then there's nothing left to claim and they return straight away.
+    class ParallelFrameDecode
+    {
+    public:
+        ParallelFrameDecode(GifFrame *pFrames, const GifCompressedImage *pImages, size_t cFrames, size_t cAhead) :
+            m_pFrames(pFrames),
+            m_pImages(pImages),
+            m_cFrames(cFrames),
+            m_cAhead(cAhead),
+            m_next(0),
+            m_limit(cAhead),
+            m_cInFlight(0),
+            m_done(cFrames, 0)
+        {
+        }
+
+        // Runs on a pool worker
+        void Work()
+        {
+            try
+            {
+                GifLzwDecoder lzw;
+                std::unique_lock<std::mutex> lock(m_mutex);
+                while (m_next != m_cFrames && !m_error)
+                {
+                    // Out in front of composition; wait for it to catch up
+                    if (!DecodeNext(lzw, lock))
+                        m_changed.wait(lock);
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (!m_error)
+                    m_error = std::current_exception();
+                m_changed.notify_all();
+            }
+        }
+
+        // Blocks until the frame is ready, helping with the remaining frames rather than waiting
+        // on workers that may be busy with other images
+        void WaitFor(size_t frameIndex, GifLzwDecoder &lzw)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            // Everything before the frame has been composed, so decoding may move on
+            if (frameIndex + m_cAhead > m_limit)
+            {
+                m_limit = frameIndex + m_cAhead;
+                m_changed.notify_all();
+            }
+
+            while (!m_done[frameIndex] && !m_error)
+            {
+                if (!DecodeNext(lzw, lock))
+                    m_changed.wait(lock);
+            }
+
+            if (m_error)
+                std::rethrow_exception(m_error);
+        }
+
+        // Stops handing out frames and waits for the ones already claimed
+        void Cancel()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_next = m_cFrames;
+            m_changed.notify_all();
+            m_changed.wait(lock, [this] { return m_cInFlight == 0; });
+        }
+
+    private:
+        // Called with the lock held; returns false if there was nothing it may claim yet
+        bool DecodeNext(GifLzwDecoder &lzw, std::unique_lock<std::mutex> &lock)
+        {
+            if (m_next == m_cFrames || m_next >= m_limit || m_error)
+                return false;
+
+            auto i = m_next++;
+            m_cInFlight++;
+            lock.unlock();
+
+            try
+            {
+                lzw.DecodeFrame(m_pImages[i], m_pFrames[i]);
+            }
+            catch (...)
+            {
+                lock.lock();
+                m_cInFlight--;
+                m_changed.notify_all();
+                throw;
+            }
+
+            lock.lock();
+            m_done[i] = 1;
+            m_cInFlight--;
+            m_changed.notify_all();
+            return true;
+        }
+
+        std::mutex m_mutex;
+
+        // Signalled when a frame is done, an error is hit, or the limit moves
+        std::condition_variable m_changed;
+
+        GifFrame *m_pFrames;
+        const GifCompressedImage *m_pImages;
+        size_t m_cFrames;
+        size_t m_cAhead;
+        size_t m_next;
+        size_t m_limit;
+        size_t m_cInFlight;
+        std::vector<uint8_t> m_done;
+        std::exception_ptr m_error;
+    };
+
+    // Builds a frame set, calling waitForFrame(i) before anything looks at frame i's pixels. The
+    // frames are moved into the set if it isn't composed, and freed as they're composed if it is.
+    std::shared_ptr<GifFrameSet> BuildFrameSet(const GifImageInfo &info, std::vector<GifFrame> &frames, bool compose, GifFrameStorage storage, const std::function<void(size_t)> &waitForFrame, const GifFrameSet::ProgressHandler &progress)
+    {
+        auto pSet = std::make_shared<GifFrameSet>();
+        pSet->storage = storage;
+
+        for (auto &rawFrame : frames)
+        {
+            pSet->delays.push_back(rawFrame.delay);
+        }
+
+        pSet->isAnimated = info.isAnimated;
+        pSet->loopCount = info.loopCount;
+        pSet->width = info.width;
+        pSet->height = info.height;
+
+        // A zero-sized logical screen isn't valid, but some encoders write one anyway. Make the
+        // canvas just big enough to hold every frame.
+        if (pSet->width == 0 || pSet->height == 0)
+        {
+            for (auto &rawFrame : frames)
+            {
+                pSet->width = std::max(pSet->width, rawFrame.left + rawFrame.width);
+                pSet->height = std::max(pSet->height, rawFrame.top + rawFrame.height);
+            }
+        }
+
+        if (compose && !frames.empty())
+        {
+            auto cPixels = static_cast<size_t>(pSet->width) * pSet->height;
+            auto cFrames = frames.size();
+            std::vector<uint32_t> previous;
+
+            if (storage == GifFrameStorage::Bgra)
+            {
+                pSet->composed.resize(cPixels * cFrames);
+            }
+            else if (storage == GifFrameStorage::Indexed)
+            {
+                pSet->indexed.resize(cFrames);
+            }
+            else
+            {
+                pSet->keyframes.resize(cPixels * ((cFrames + GifFrameSet::DeltaKeyframeInterval - 1) / GifFrameSet::DeltaKeyframeInterval));
+                pSet->deltas.resize(cFrames);
+                previous.assign(cPixels, 0);
+            }
+
+            GifCompositor compositor(pSet->width, pSet->height);
+            for (size_t i = 0; i < frames.size(); i++)
+            {
+                waitForFrame(i);
+                compositor.DrawFrame(frames[i]);
+
+                if (storage == GifFrameStorage::Bgra)
+                {
+                    std::memcpy(pSet->composed.data() + i * cPixels, compositor.GetPixels(), cPixels * sizeof(uint32_t));
+                }
+                else if (storage == GifFrameStorage::Delta)
+                {
+                    auto pPixels = compositor.GetPixels();
+                    if (i % GifFrameSet::DeltaKeyframeInterval == 0)
+                    {
+                        std::memcpy(pSet->keyframes.data() + (i / GifFrameSet::DeltaKeyframeInterval) * cPixels, pPixels, cPixels * sizeof(uint32_t));
+                    }
+
+                    // The first frame is always rebuilt from its keyframe, so it needs no delta
+                    if (i != 0)
+                    {
+                        DiffFrames(previous.data(), pPixels, pSet->width, pSet->height, pSet->deltas[i]);
+                    }
+                    std::memcpy(previous.data(), pPixels, cPixels * sizeof(uint32_t));
+                }
+                else
+                {
+                    auto &indexedFrame = pSet->indexed[i];
+                    if (!IndexPixels(compositor.GetPixels(), cPixels, indexedFrame))
+                    {
+                        indexedFrame.pixels.clear();
+                        indexedFrame.pixels.shrink_to_fit();
+                        indexedFrame.palette.clear();
+                        indexedFrame.bgra.assign(compositor.GetPixels(), compositor.GetPixels() + cPixels);
+                    }
+                    indexedFrame.palette.shrink_to_fit();
+                }
+
+                // Drop each raw frame as soon as it's composed, so peak memory stays close to the
+                // composed size. Its buffer goes back to the pool for the next load to decode into.
+                GifScratchPool::GetInstance().Release(frames[i].pixels);
+
+                if (progress)
+                {
+                    progress(pSet, static_cast<uint32_t>(i + 1));
+                }
+            }
+
+            frames.clear();
+            frames.shrink_to_fit();
+        }
+        else
+        {
+            for (size_t i = 0; i < frames.size(); i++)
+            {
+                waitForFrame(i);
+            }
+            pSet->frames = std::move(frames);
+        }
+
+        return pSet;
+    }
+}
+
+const uint32_t *GifFrameSet::GetComposedFrame(uint32_t frameIndex, GifFrameBuffer &buffer) const
+{
+    auto cPixels = static_cast<size_t>(width) * height;
+
+    if (storage == GifFrameStorage::Bgra)
+        return (mappedComposed ? mappedComposed.get() : composed.data()) + frameIndex * cPixels;
+
+    if (buffer.frameIndex == frameIndex)
+        return buffer.pixels.data();
+
+    buffer.pixels.resize(cPixels);
+
+    if (storage == GifFrameStorage::Delta)
+    {
+        // Start from the nearest keyframe at or before the frame, unless the buffer already
+        // holds a frame between the two
+        auto keyframe = frameIndex - frameIndex % DeltaKeyframeInterval;
+        uint32_t start;
+        if (buffer.frameIndex != GifFrameBuffer::NoFrame && buffer.frameIndex >= keyframe && buffer.frameIndex < frameIndex)
+        {
+            start = buffer.frameIndex + 1;
+        }
+        else
+        {
+            auto pKeyframe = keyframes.data() + (keyframe / DeltaKeyframeInterval) * cPixels;
+            std::memcpy(buffer.pixels.data(), pKeyframe, cPixels * sizeof(uint32_t));
+            start = keyframe + 1;
+        }
+
+        for (auto i = start; i <= frameIndex; i++)
+        {
+            ApplyDelta(deltas.at(i), buffer.pixels.data(), width);
+        }
+
+        buffer.frameIndex = frameIndex;
+        return buffer.pixels.data();
+    }
+
+    auto &frame = indexed.at(frameIndex);
+    if (frame.pixels.empty())
+    {
+        // Not expanded into the buffer, so it no longer holds any particular frame
+        buffer.frameIndex = GifFrameBuffer::NoFrame;
+        return frame.bgra.data();
+    }
+
+    // Copy the palette so the inner loop is a plain lookup into a full table
+    uint32_t lut[256] = { 0 };
+    std::copy(frame.palette.begin(), frame.palette.end(), lut);
+
+    ExpandIndices(frame.pixels.data(), lut, buffer.pixels.data(), cPixels);
+
+    buffer.frameIndex = frameIndex;
+    return buffer.pixels.data();
+}
+
+size_t GifFrameSet::GetByteSize() const
+{
+    auto cbSize = sizeof(GifFrameSet) + delays.size() * sizeof(uint16_t) + (composed.size() + keyframes.size()) * sizeof(uint32_t);
+    for (auto &frame : frames)
+    {
+        cbSize += sizeof(GifFrame) + frame.pixels.size();
+    }
+    for (auto &frame : indexed)
+    {
+        cbSize += sizeof(GifIndexedFrame) + frame.palette.size() * sizeof(uint32_t) + frame.pixels.size() + frame.bgra.size() * sizeof(uint32_t);
+    }
+    for (auto &delta : deltas)
+    {
+        cbSize += sizeof(GifDeltaFrame) + delta.pixels.size() * sizeof(uint32_t);
+    }
+    return cbSize;
+}
+
+std::shared_ptr<GifFrameSet> GifFrameSet::Decode(GifDecoder &decoder, bool compose, GifFrameStorage storage, GifWorkerPool *pPool, const GifCancellation *pCancellation, const ProgressHandler &progress)
+{
+    std::vector<GifFrame> frames;
+    auto checkCancelled = [pCancellation]
+    {
+        if (pCancellation != nullptr)
+            pCancellation->ThrowIfCancelled();
+    };
+    auto noWait = [&](size_t) { checkCancelled(); };
+
+    if (pPool == nullptr || pPool->GetWorkerCount() == 0)
+    {
+        GifFrame frame;
+        checkCancelled();
+        while (decoder.ReadFrame(frame))
+        {
+            frames.push_back(std::move(frame));
+            checkCancelled();
+        }
+
+        return BuildFrameSet(decoder.GetInfo(), frames, compose, storage, noWait, progress);
+    }
+
+    // Gathering the compressed data is cheap next to decompressing it, so do all of it up front.
+    // That also settles the loop information, which can come after the first frame.
+    std::vector<GifCompressedImage> images;
+
+    // Declared before the workers are started, so the compressed data is only given back once
+    // they've all stopped
+    struct ReleaseOnExit
+    {
+        std::vector<GifCompressedImage> *pImages;
+        ~ReleaseOnExit()
+        {
+            for (auto &image : *pImages)
+            {
+                GifScratchPool::GetInstance().Release(image.data);
+            }
+        }
+    } releaseOnExit = { &images };
+
+    {
+        GifFrame frame;
+        GifCompressedImage image;
+        checkCancelled();
+        while (decoder.ReadFrame(frame, image))
+        {
+            frames.push_back(std::move(frame));
+            images.push_back(std::move(image));
+            checkCancelled();
+        }
+    }
+
+    if (frames.size() < 2)
+    {
+        GifLzwDecoder lzw;
+        for (size_t i = 0; i < frames.size(); i++)
+        {
+            checkCancelled();
+            lzw.DecodeFrame(images[i], frames[i]);
+        }
+
+        return BuildFrameSet(decoder.GetInfo(), frames, compose, storage, noWait, progress);
+    }
+
+    // The calling thread decodes too, so one fewer worker keeps every core busy. Letting each
+    // thread get a couple of frames ahead of composition keeps them all busy too, without holding
+    // every decoded frame of a long animation at once.
+    auto cWorkers = std::min<size_t>(pPool->GetWorkerCount(), frames.size() - 1);
+    auto pDecode = std::make_shared<ParallelFrameDecode>(frames.data(), images.data(), frames.size(), 2 * (cWorkers + 1));
+
+    // Whatever happens, cancellation included, no worker may still be writing into frames once we
+    // return
+    struct CancelOnExit
+    {
+        ParallelFrameDecode *pDecode;
+        ~CancelOnExit() { pDecode->Cancel(); }
+    } cancelOnExit = { pDecode.get() };
+
+    for (size_t i = 0; i < cWorkers; i++)
+    {
+        pPool->Submit([pDecode] { pDecode->Work(); });
+    }
+
+    GifLzwDecoder lzw;
+    return BuildFrameSet(decoder.GetInfo(), frames, compose, storage, [&](size_t frameIndex)
+    {
+        checkCancelled();
+        pDecode->WaitFor(frameIndex, lzw);
+    }, progress);
+}
+
+std::shared_ptr<GifFrameSet> GifFrameSet::Create(const GifImageInfo &info, std::vector<GifFrame> frames, bool compose, GifFrameStorage storage)
+{
+    return BuildFrameSet(info, frames, compose, storage, [](size_t) {}, GifFrameSet::ProgressHandler());
+}
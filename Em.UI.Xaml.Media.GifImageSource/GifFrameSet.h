@@ -0,0 +1,170 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "GifCancellation.h"
+#include "GifDecoder.h"
+
+namespace Em {
+    namespace Gif
+    {
+        class GifWorkerPool;
+
+        /// <summary>
+        /// How composed frames are kept in memory.
+        /// </summary>
+        enum class GifFrameStorage : uint8_t
+        {
+            // Premultiplied BGRA, ready to present
+            Bgra = 0,
+
+            // One byte per pixel plus a palette per frame, expanded to BGRA as each frame is
+            // presented. A quarter of the memory, at the cost of a lookup per pixel per frame.
+            Indexed = 1,
+
+            // Periodic full keyframes plus, for every frame, the rectangle that changed since the
+            // frame before it. Frames are rebuilt by applying deltas to the nearest keyframe, which
+            // during playback means applying one delta per frame.
+            Delta = 2
+        };
+
+        /// <summary>
+        /// A composed frame in indexed storage. Composition can bring colors from several
+        /// palettes together; a frame that ends up with more than 256 of them is kept as BGRA.
+        /// </summary>
+        struct GifIndexedFrame
+        {
+            // Premultiplied BGRA, at most 256 entries
+            std::vector<uint32_t> palette;
+
+            // Indices into palette, width * height; empty if the frame is kept as BGRA
+            std::vector<uint8_t> pixels;
+
+            // Premultiplied BGRA, width * height; only used by frames with too many colors
+            std::vector<uint32_t> bgra;
+        };
+
+        /// <summary>
+        /// A composed frame in delta storage: the pixels inside the rectangle that differ from the
+        /// previous composed frame. Empty if nothing changed.
+        /// </summary>
+        struct GifDeltaFrame
+        {
+            uint32_t left;
+            uint32_t top;
+            uint32_t width;
+            uint32_t height;
+
+            // Premultiplied BGRA, width * height
+            std::vector<uint32_t> pixels;
+        };
+
+        /// <summary>
+        /// Where a player rebuilds or expands composed frames that aren't stored as plain BGRA.
+        /// Remembers which frame it holds, so moving on to the next frame in delta storage only
+        /// costs that frame's delta.
+        /// </summary>
+        struct GifFrameBuffer
+        {
+            static const uint32_t NoFrame = UINT32_MAX;
+
+            GifFrameBuffer() : frameIndex(NoFrame) {}
+
+            void Clear()
+            {
+                std::vector<uint32_t>().swap(pixels);
+                frameIndex = NoFrame;
+            }
+
+            std::vector<uint32_t> pixels;
+            uint32_t frameIndex;
+        };
+
+        /// <summary>
+        /// Everything needed to play a GIF back, decoded once and immutable afterwards so it can be
+        /// shared between any number of players. Holds either the raw frames or, if the set was
+        /// composed, every displayable frame.
+        /// </summary>
+        struct GifFrameSet
+        {
+            uint32_t width;
+            uint32_t height;
+            bool isAnimated;
+            uint16_t loopCount;
+            std::vector<uint16_t> delays;
+
+            // Raw frames as decoded; empty if the set is composed
+            std::vector<GifFrame> frames;
+
+            // How the composed frames are stored
+            GifFrameStorage storage;
+
+            // Composed premultiplied BGRA frames, width * height each, back to back. Only used
+            // with Bgra storage.
+            std::vector<uint32_t> composed;
+
+            // The same, for a set loaded from the disk cache: the frames stay in the mapped file,
+            // which this keeps alive, and only the pages of frames being shown are resident
+            std::shared_ptr<const uint32_t> mappedComposed;
+
+            // Composed frames, only used with Indexed storage
+            std::vector<GifIndexedFrame> indexed;
+
+            // Every DeltaKeyframeInterval-th composed frame in full, back to back, and the change
+            // every frame makes to the one before it. Only used with Delta storage.
+            std::vector<uint32_t> keyframes;
+            std::vector<GifDeltaFrame> deltas;
+
+            /// <summary>
+            /// Frames between keyframes in delta storage. Bounds the number of deltas applied to
+            /// rebuild a frame out of order.
+            /// </summary>
+            static const uint32_t DeltaKeyframeInterval = 32;
+
+            uint32_t GetFrameCount() const { return static_cast<uint32_t>(delays.size()); }
+            bool IsComposed() const { return !composed.empty() || mappedComposed || !indexed.empty() || !deltas.empty(); }
+
+            /// <summary>
+            /// Gets a composed frame as premultiplied BGRA. Frames in BGRA storage are returned in
+            /// place; others are expanded or rebuilt into the buffer, which must only be used with
+            /// this frame set.
+            /// </summary>
+            const uint32_t *GetComposedFrame(uint32_t frameIndex, GifFrameBuffer &buffer) const;
+
+            /// <summary>
+            /// Gets the approximate number of bytes this set keeps resident. Mapped frames aren't
+            /// counted; the system can drop their pages whenever it needs the memory.
+            /// </summary>
+            size_t GetByteSize() const;
+
+            /// <summary>
+            /// Told about each frame Decode composes, with the set being built and the number of
+            /// frames composed so far. From then on another thread may read those frames through
+            /// GetComposedFrame, along with the set's size and delays; the rest of the set is still
+            /// being written until Decode returns.
+            /// </summary>
+            typedef std::function<void(const std::shared_ptr<const GifFrameSet> &pSet, uint32_t cComposed)> ProgressHandler;
+
+            /// <summary>
+            /// Decodes every remaining frame from the decoder and, if compose is true, composes them
+            /// into displayable frames kept in the given storage and drops the raw frames.
+            /// </summary>
+            /// <remarks>
+            /// Given a pool, frames are decompressed on its workers as well as on the calling thread,
+            /// no more than a few frames ahead of composition, and composed in order as they become
+            /// ready. Given a cancellation, it's checked before each frame is read and before each is
+            /// composed, throwing GifCancelledException.
+            /// </remarks>
+            static std::shared_ptr<GifFrameSet> Decode(GifDecoder &decoder, bool compose, GifFrameStorage storage = GifFrameStorage::Bgra, GifWorkerPool *pPool = nullptr, const GifCancellation *pCancellation = nullptr, const ProgressHandler &progress = ProgressHandler());
+
+            /// <summary>
+            /// Builds a set from frames that have already been decoded, composing them if asked to.
+            /// </summary>
+            static std::shared_ptr<GifFrameSet> Create(const GifImageInfo &info, std::vector<GifFrame> frames, bool compose, GifFrameStorage storage = GifFrameStorage::Bgra);
+        };
+    }
+}
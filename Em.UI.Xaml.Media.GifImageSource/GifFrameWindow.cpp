@@ -0,0 +1,117 @@
+﻿#include "GifFrameWindow.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace Em::Gif;
+
+GifFrameWindow::GifFrameWindow(const uint8_t *pData, size_t cbData, uint32_t width, uint32_t height, uint32_t frameCount, uint32_t capacity, uint32_t maxDecodeWidth, uint32_t maxDecodeHeight)
+    : m_decoder(pData, cbData),
+    m_compositor(width, height),
+    m_checkpoints(frameCount),
+    m_width(width),
+    m_height(height),
+    m_frameCount(frameCount),
+    m_capacity(std::max(1u, std::min(capacity, frameCount))),
+    m_first(0),
+    m_firstSlot(0),
+    m_count(0),
+    m_nextDecode(0),
+    m_slots(static_cast<size_t>(m_capacity) * width * height)
+{
+    if (frameCount == 0)
+        throw GifFormatException("no frames");
+
+    m_decoder.SetMaxDecodeSize(maxDecodeWidth, maxDecodeHeight);
+}
+
+size_t GifFrameWindow::GetResidentBytes() const
+{
+    return m_slots.size() * sizeof(uint32_t) + m_compositor.GetResidentBytes() + m_checkpoints.GetResidentBytes();
+}
+
+uint32_t *GifFrameWindow::GetSlot(uint32_t position)
+{
+    return m_slots.data() + static_cast<size_t>(position % m_capacity) * m_width * m_height;
+}
+
+const uint32_t *GifFrameWindow::GetFrame(uint32_t frameIndex)
+{
+    frameIndex %= m_frameCount;
+
+    // Release everything the playhead has already passed
+    auto distance = (frameIndex + m_frameCount - m_first) % m_frameCount;
+    if (distance < m_count)
+    {
+        m_first = frameIndex;
+        m_firstSlot = (m_firstSlot + distance) % m_capacity;
+        m_count -= distance;
+    }
+    else
+    {
+        // Not buffered (we jumped, or playback overtook the window). Drop the window and
+        // compose forward from wherever the decoder is, or from the closest checkpoint if the
+        // frame is behind it or the checkpoint is closer.
+        auto checkpoint = m_checkpoints.Find(frameIndex);
+        if (frameIndex < m_nextDecode || m_nextDecode == 0 || checkpoint > m_nextDecode)
+        {
+            if (checkpoint == 0)
+            {
+                m_decoder.Rewind();
+                m_compositor.Reset();
+            }
+            else
+            {
+                m_decoder.Seek(m_checkpoints.Restore(checkpoint, m_compositor));
+            }
+            m_nextDecode = checkpoint;
+        }
+
+        while (m_nextDecode < frameIndex)
+        {
+            DrawNext();
+        }
+
+        m_first = frameIndex;
+        m_firstSlot = 0;
+        m_count = 0;
+        ComposeNext();
+    }
+
+    return GetSlot(m_firstSlot);
+}
+
+void GifFrameWindow::Fill()
+{
+    while (m_count < m_capacity)
+    {
+        ComposeNext();
+    }
+}
+
+void GifFrameWindow::ComposeNext()
+{
+    // Wrapping around to the first frame starts a fresh loop of the animation
+    if (m_nextDecode == m_frameCount || m_nextDecode == 0)
+    {
+        m_decoder.Rewind();
+        m_compositor.Reset();
+        m_nextDecode = 0;
+    }
+
+    DrawNext();
+
+    std::memcpy(GetSlot(m_firstSlot + m_count), m_compositor.GetPixels(), static_cast<size_t>(m_width) * m_height * sizeof(uint32_t));
+    m_count++;
+}
+
+void GifFrameWindow::DrawNext()
+{
+    m_checkpoints.Save(m_nextDecode, m_compositor, m_decoder.GetPosition());
+
+    if (!m_decoder.ReadFrame(m_frame))
+        throw GifFormatException("frame count changed");
+
+    m_compositor.DrawFrame(m_frame);
+    m_nextDecode++;
+}
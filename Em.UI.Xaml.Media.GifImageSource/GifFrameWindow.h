@@ -0,0 +1,78 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "GifCompositor.h"
+#include "GifDecoder.h"
+
+namespace Em {
+    namespace Gif
+    {
+        /// <summary>
+        /// Bounded buffer of composed frames for playback of GIFs too large to prerender in full.
+        /// Only a fixed number of upcoming frames are kept; they are decoded and composed in order
+        /// from the compressed data, and recycled once the playhead has moved past them.
+        /// </summary>
+        class GifFrameWindow
+        {
+        public:
+            /// <param name="pData">The GIF data. Must outlive the window.</param>
+            /// <param name="frameCount">Number of frames in the GIF, as found by a metadata scan.</param>
+            /// <param name="capacity">Number of composed frames to hold at once.</param>
+            /// <param name="maxDecodeWidth">Maximum decode width, as GifDecoder::SetMaxDecodeSize.</param>
+            /// <param name="maxDecodeHeight">Maximum decode height, as GifDecoder::SetMaxDecodeSize.</param>
+            GifFrameWindow(const uint8_t *pData, size_t cbData, uint32_t width, uint32_t height, uint32_t frameCount, uint32_t capacity, uint32_t maxDecodeWidth = 0, uint32_t maxDecodeHeight = 0);
+
+            /// <summary>
+            /// Gets the composed pixels for a frame, composing it now if it isn't buffered yet.
+            /// Frames buffered before it are released. A frame outside the window is composed from
+            /// the nearest checkpoint before it, so jumping around costs a bounded number of frames.
+            /// </summary>
+            /// <returns>
+            /// Premultiplied BGRA pixels, width * height, valid until the next call that changes
+            /// the window.
+            /// </returns>
+            const uint32_t *GetFrame(uint32_t frameIndex);
+
+            /// <summary>
+            /// Composes frames ahead of the playhead until the window is full.
+            /// </summary>
+            void Fill();
+
+            uint32_t GetCapacity() const { return m_capacity; }
+
+            /// <summary>
+            /// Gets the number of bytes held by buffered frames, the working canvas and checkpoints.
+            /// </summary>
+            size_t GetResidentBytes() const;
+
+        private:
+            void ComposeNext();
+            void DrawNext();
+            uint32_t *GetSlot(uint32_t position);
+
+            GifDecoder m_decoder;
+            GifCompositor m_compositor;
+            GifCompositorCheckpoints m_checkpoints;
+            GifFrame m_frame;
+
+            uint32_t m_width;
+            uint32_t m_height;
+            uint32_t m_frameCount;
+            uint32_t m_capacity;
+
+            // Buffered frames are m_first, m_first + 1, ... (modulo frame count), m_count of them,
+            // stored in slots m_firstSlot, m_firstSlot + 1, ... (modulo capacity)
+            uint32_t m_first;
+            uint32_t m_firstSlot;
+            uint32_t m_count;
+
+            // Index of the frame the decoder will return next
+            uint32_t m_nextDecode;
+
+            std::vector<uint32_t> m_slots;
+        };
+    }
+}
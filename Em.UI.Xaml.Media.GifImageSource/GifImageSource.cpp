@@ -1,78 +1,215 @@
 ﻿#include "pch.h"
 
+#include <algorithm>
+#include <exception>
 #include <ppltasks.h>
+#include <robuffer.h>
 #include <wincodec.h>
 #include <shcore.h>
 
 #include "windows.graphics.imaging.h"
 #include "windows.ui.xaml.media.imaging.h"
 
+#include "AnimationScheduler.h"
+#include "GifDiskCache.h"
+#include "GifFrameCache.h"
 #include "GifImageSource.h"
+#include "GifMemoryGovernor.h"
+#include "GifWorkerPool.h"
 
 using namespace Em::UI::Xaml::Media;
 
 using namespace concurrency;
 using namespace Microsoft::WRL;
 using namespace Windows::Storage::Streams;
+using namespace Windows::UI::Core;
 using namespace Windows::UI::Xaml;
 using namespace Windows::Foundation;
 
+namespace
+{
+    // How often to look for new frames when playback has caught up with the ones that have arrived
+    const INT64 DataWaitInterval = 500000; // 50ms
+
+    // What CreateFromStreamAsync learns off the UI thread before it creates the image source
+    struct StreamContents
+    {
+        std::vector<uint8_t> data;
+        Em::Gif::GifFrameIndex index;
+    };
+
+    std::vector<uint8_t> ReadStream(IRandomAccessStream^ pStream)
+    {
+        ComPtr<IStream> pIStream;
+        DX::ThrowIfFailed(
+            CreateStreamOverRandomAccessStream(
+            reinterpret_cast<IUnknown*>(pStream),
+            IID_PPV_ARGS(&pIStream)));
+
+        // The decoder works on a contiguous buffer, so pull the whole stream into memory first.
+        // The stream may already have been read by someone else (e.g. a BitmapDecoder), so rewind it.
+        STATSTG stat = { 0 };
+        DX::ThrowIfFailed(pIStream->Stat(&stat, STATFLAG_NONAME));
+
+        LARGE_INTEGER zero = { 0 };
+        DX::ThrowIfFailed(pIStream->Seek(zero, STREAM_SEEK_SET, nullptr));
+
+        std::vector<uint8_t> data(static_cast<size_t>(stat.cbSize.QuadPart));
+        size_t cbTotal = 0;
+        while (cbTotal < data.size())
+        {
+            ULONG cbRead = 0;
+            DX::ThrowIfFailed(pIStream->Read(data.data() + cbTotal, static_cast<ULONG>(data.size() - cbTotal), &cbRead));
+            if (cbRead == 0)
+                break;
+            cbTotal += cbRead;
+        }
+        data.resize(cbTotal);
+
+        return data;
+    }
+
+    Em::Gif::GifFrameIndex IndexImage(const std::vector<uint8_t> &data, uint32_t maxDecodeWidth, uint32_t maxDecodeHeight)
+    {
+        try
+        {
+            auto index = Em::Gif::GifFrameIndex::Build(data.data(), data.size(), maxDecodeWidth, maxDecodeHeight);
+            if (index.frames.empty())
+                throw Em::Gif::GifFormatException("no frames");
+            return index;
+        }
+        catch (const Em::Gif::GifFormatException &)
+        {
+            throw Platform::Exception::CreateException(WINCODEC_ERR_BADIMAGE);
+        }
+    }
+
+    std::string ToUtf8(Platform::String^ text)
+    {
+        if (text == nullptr || text->IsEmpty())
+            return std::string();
+
+        auto cb = WideCharToMultiByte(CP_UTF8, 0, text->Data(), static_cast<int>(text->Length()), nullptr, 0, nullptr, nullptr);
+        std::string result(cb, '\0');
+        WideCharToMultiByte(CP_UTF8, 0, text->Data(), static_cast<int>(text->Length()), &result[0], cb, nullptr, nullptr);
+        return result;
+    }
+
+    Platform::String^ FromUtf8(const std::string &text)
+    {
+        if (text.empty())
+            return ref new Platform::String();
+
+        auto cch = MultiByteToWideChar(CP_UTF8, 0, text.data(), static_cast<int>(text.size()), nullptr, 0);
+        std::wstring result(cch, L'\0');
+        MultiByteToWideChar(CP_UTF8, 0, text.data(), static_cast<int>(text.size()), &result[0], cch);
+        return ref new Platform::String(result.data(), static_cast<unsigned int>(result.size()));
+    }
+
+    TimeSpan ToTimeSpan(int64_t ticks)
+    {
+        TimeSpan timeSpan;
+        timeSpan.Duration = ticks;
+        return timeSpan;
+    }
+
+    PlaybackStatistics ToPlaybackStatistics(const Em::Gif::GifPlaybackStatistics &statistics)
+    {
+        PlaybackStatistics result;
+        result.LoadCount = statistics.loadCount;
+        result.LoadDuration = ToTimeSpan(statistics.loadTime);
+        result.DecodeDuration = ToTimeSpan(statistics.decodeTime);
+        result.PrerenderDuration = ToTimeSpan(statistics.prerenderTime);
+        result.ResidentFrameBytes = statistics.residentBytes;
+        result.FramesPresented = statistics.framesPresented;
+        result.Ticks = statistics.ticks;
+        result.LateTicks = statistics.lateTicks;
+        result.SkippedTicks = statistics.skippedTicks;
+        result.MeanTickJitter = ToTimeSpan(statistics.ticks != 0 ? statistics.totalTickJitter / static_cast<int64_t>(statistics.ticks) : 0);
+        result.MaxTickJitter = ToTimeSpan(statistics.maxTickJitter);
+        result.DeviceLostRecoveries = statistics.deviceLostRecoveries;
+        result.SwallowedExceptions = statistics.swallowedExceptions;
+        return result;
+    }
+}
+
 GifImageSource::GifImageSource(int width, int height)
     : SurfaceImageSource(width, height),
-    m_width(width),
-    m_height(height),
-    m_dwFrameCount(0),
-    m_bitmaps(NULL),
-    m_offsets(NULL),
-    m_delays(NULL),
-    m_dwCurrentFrame(0),
-    m_completedPrerender(false),
     m_completedLoop(false),
-    m_loopCount(0),
-    m_isAnimatedGif(false),
-    m_prerender(false)
+    m_isVisible(true),
+    m_animationId(0),
+    m_isRunning(false),
+    m_nextInterval(0),
+    m_lastTick(0)
 {
     if (width < 0 || height < 0)
         throw ref new Platform::InvalidArgumentException();
 
-    CreateDeviceResources();
+    m_statistics.reset(new Em::Gif::GifStatistics());
+    m_backend.reset(new D2DRenderBackend(reinterpret_cast<IUnknown*>(this), m_statistics.get()));
+    m_player.reset(new Em::Gif::GifPlayer(m_backend.get(), width, height));
+    m_player->SetStatistics(m_statistics.get());
 
-    m_timer = ref new DispatcherTimer();
-    m_timer->Tick += ref new EventHandler<Object^>(this, &GifImageSource::OnTick);
+    // The memory governor asks from whatever thread went over the budget; a paused image gets
+    // no ticks to pick the request up in, so it's posted to the UI thread
+    auto window = CoreWindow::GetForCurrentThread();
+    if (window != nullptr)
+    {
+        auto dispatcher = window->Dispatcher;
+        Platform::WeakReference weakThis(this);
+        m_player->SetMemoryRequestHandler([dispatcher, weakThis]()
+        {
+            dispatcher->RunAsync(CoreDispatcherPriority::Low, ref new DispatchedHandler([weakThis]()
+            {
+                auto source = weakThis.Resolve<GifImageSource>();
+                if (source != nullptr)
+                {
+                    source->ApplyMemoryLevel();
+                }
+            }));
+        });
+    }
 }
 
-void GifImageSource::ClearResources()
+void GifImageSource::ApplyMemoryLevel()
 {
-    if (m_timer != nullptr)
+    try
     {
-        m_timer->Stop();
-        m_timer = nullptr;
+        m_player->ApplyMemoryLevel();
     }
-
-    while (!m_bitmaps.empty())
+    catch (Platform::Exception^)
     {
-        m_bitmaps.back() = nullptr;
-        m_bitmaps.pop_back();
+        m_statistics->RecordSwallowedException();
     }
+    catch (const std::exception &)
+    {
+        // The player couldn't go to the new level, and may not be able to show frames any more
+        m_statistics->RecordSwallowedException();
+        Stop();
+    }
+}
 
-    m_offsets.clear();
-    m_delays.clear();
+void GifImageSource::IsVisible::set(bool value)
+{
+    m_isVisible = value;
+    m_player->SetVisible(value);
+}
 
-    m_width = 0;
-    m_height = 0;
-    m_loopCount = 0;
-    m_isAnimatedGif = false;
+void GifImageSource::ClearResources()
+{
+    Stop();
+
+    if (m_animationId != 0)
+    {
+        AnimationScheduler::GetInstance().Unregister(m_animationId);
+        m_animationId = 0;
+    }
+
+    m_player->Clear();
+    m_progressive = nullptr;
     m_completedLoop = false;
-    m_completedPrerender = false;
-    m_prerender = false;
-    m_dwFrameCount = 0;
-    m_dwCurrentFrame = 0;
 
-    m_surfaceBitmap = nullptr;
-    m_sisNative = nullptr;
-    m_d2dContext = nullptr;
-    m_d2dDevice = nullptr;
-    m_d3dDevice = nullptr;
+    m_backend->ReleaseDeviceResources();
 }
 
 Windows::Foundation::IAsyncAction^ GifImageSource::SetSourceAsync(IRandomAccessStream^ pStream)
@@ -80,450 +217,480 @@ Windows::Foundation::IAsyncAction^ GifImageSource::SetSourceAsync(IRandomAccessS
     if (pStream == nullptr)
         throw ref new Platform::InvalidArgumentException();
 
-    return create_async([this, pStream]() -> void
+    return create_async([this, pStream](cancellation_token token) -> void
     {
-        m_completedPrerender = false;
-        m_dwCurrentFrame = 0;
         m_completedLoop = false;
+        m_nextInterval = 0;
 
-        ComPtr<IStream> pIStream;
-        DX::ThrowIfFailed(
-            CreateStreamOverRandomAccessStream(
-            reinterpret_cast<IUnknown*>(pStream),
-            IID_PPV_ARGS(&pIStream)));
+        auto data = ReadStream(pStream);
+        if (token.is_canceled())
+            cancel_current_task();
 
-        LoadImage(pIStream.Get());
+        auto index = IndexImage(data, m_player->GetMaxDecodeWidth(), m_player->GetMaxDecodeHeight());
+        LoadImage(std::move(data), std::move(index), token);
     });
 }
 
-bool GifImageSource::RenderFrame()
+IAsyncOperation<GifImageSource^>^ GifImageSource::CreateFromStreamAsync(IRandomAccessStream^ pStream, bool enablePrerender, int decodePixelWidth, int decodePixelHeight)
 {
-    if (m_prerender && !m_completedPrerender)
+    if (pStream == nullptr || decodePixelWidth < 0 || decodePixelHeight < 0)
+        throw ref new Platform::InvalidArgumentException();
+
+    // A SurfaceImageSource has to be created on the UI thread; everything else happens off it
+    auto uiContext = task_continuation_context::use_current();
+
+    return create_async([pStream, enablePrerender, decodePixelWidth, decodePixelHeight, uiContext](cancellation_token token) -> task<GifImageSource^>
     {
-        PrerenderBitmaps();
-        m_completedPrerender = true;
-    }
+        auto pContents = std::make_shared<StreamContents>();
+
+        // Each stage is skipped once the operation is cancelled, and the load itself stops part way
+        return create_task([pStream, pContents, decodePixelWidth, decodePixelHeight, token]()
+        {
+            pContents->data = ReadStream(pStream);
+            if (token.is_canceled())
+                cancel_current_task();
+
+            pContents->index = IndexImage(pContents->data, decodePixelWidth, decodePixelHeight);
+        }, token).then([pContents, enablePrerender, decodePixelWidth, decodePixelHeight]()
+        {
+            auto source = ref new GifImageSource(pContents->index.width, pContents->index.height);
+            source->EnablePrerender = enablePrerender;
+            source->DecodePixelWidth = decodePixelWidth;
+            source->DecodePixelHeight = decodePixelHeight;
+            return source;
+        }, token, uiContext).then([pContents, token](GifImageSource^ source)
+        {
+            source->LoadImage(std::move(pContents->data), std::move(pContents->index), token);
+            return source;
+        }, token, task_continuation_context::use_arbitrary());
+    });
+}
+
+void GifImageSource::BeginProgressiveLoad()
+{
+    Stop();
+    m_completedLoop = false;
+    m_nextInterval = 0;
+
+    m_progressive = std::make_shared<Em::Gif::GifProgressiveSource>();
+    m_player->LoadProgressive(m_progressive);
+}
+
+IAsyncAction^ GifImageSource::AppendDataAsync(IBuffer^ pBuffer)
+{
+    if (pBuffer == nullptr)
+        throw ref new Platform::InvalidArgumentException();
 
-    auto bCanDraw = BeginDraw();
+    auto pSource = m_progressive;
+    if (pSource == nullptr)
+        throw ref new Platform::FailureException();
 
-    if (bCanDraw)
+    return create_async([pSource, pBuffer]() -> void
     {
-        m_d2dContext->Clear();
+        ComPtr<IBufferByteAccess> pByteAccess;
+        DX::ThrowIfFailed(
+            reinterpret_cast<IUnknown*>(pBuffer)->QueryInterface(IID_PPV_ARGS(&pByteAccess)));
+
+        byte *pBytes = nullptr;
+        DX::ThrowIfFailed(pByteAccess->Buffer(&pBytes));
 
-        if (m_prerender)
+        try
         {
-            m_d2dContext->DrawImage(m_bitmaps.at(m_dwCurrentFrame).Get());
+            pSource->Append(pBytes, pBuffer->Length);
         }
-        else
+        catch (const Em::Gif::GifFormatException &)
         {
-            for (UINT i = 0; i <= m_dwCurrentFrame; i++)
-            {
-                m_d2dContext->DrawImage(m_bitmaps.at(i).Get(), m_offsets.at(i));
-            }
+            throw Platform::Exception::CreateException(WINCODEC_ERR_BADIMAGE);
         }
+    });
+}
 
-        SetNextInterval();
-        m_dwCurrentFrame = (m_dwCurrentFrame + 1) % m_dwFrameCount;
+IAsyncAction^ GifImageSource::CompleteProgressiveLoadAsync()
+{
+    auto pSource = m_progressive;
+    if (pSource == nullptr)
+        throw ref new Platform::FailureException();
 
-        EndDraw();
-    }
-    else
-    {
-    }
+    // The player lets go of the source once it sees it's finished; so can we
+    m_progressive = nullptr;
 
-    // Returns true if we just completed a loop
-    return m_dwCurrentFrame == 0;
+    return create_async([pSource]() -> void
+    {
+        try
+        {
+            pSource->Finish();
+        }
+        catch (const Em::Gif::GifFormatException &)
+        {
+            throw Platform::Exception::CreateException(WINCODEC_ERR_BADIMAGE);
+        }
+    });
 }
 
-// Convert raw frames into final displayable frames
-// This conversion is necessary because a raw frame is usually rendered by drawing it on top of
-// the previous frame. Each displayable frame is therefore the composition of the current frame
-// and all the frames that were drawn before it.
-void GifImageSource::PrerenderBitmaps()
+int GifImageSource::LoadedFrameCount::get()
 {
-    ComPtr<IWICImagingFactory> pFactory;
-
-    HRESULT hr = CoCreateInstance(CLSID_WICImagingFactory,
-        NULL,
-        CLSCTX_INPROC_SERVER,
-        IID_IWICImagingFactory,
-        (LPVOID*) &pFactory);
+    m_player->Update();
+    return static_cast<int>(m_player->GetFrameCount());
+}
 
-    D2D1_POINT_2U dest = { 0, 0 };
-    D2D1_RECT_U src = { 1, 2, m_width + 1, m_height + 2 }; // not sure why this (1,2) offset is needed... 
+TimeSpan GifImageSource::Duration::get()
+{
+    m_player->Update();
+    return ToTimeSpan(m_player->GetLoopDuration());
+}
 
-    BeginDraw();
+TimeSpan GifImageSource::Position::get()
+{
+    return ToTimeSpan(m_player->GetPosition());
+}
 
-    m_d2dContext->Clear();
+bool GifImageSource::RenderFrame()
+{
+    if (m_player->Update())
+    {
+        // The rest of the frames arrived while playback was waiting past the last one, which has
+        // already been on screen for its full delay
+        m_nextInterval = 0;
+        return true;
+    }
 
-    for (UINT dwIndex = 0; dwIndex < m_dwFrameCount; dwIndex++)
+    if (m_player->IsWaitingForData())
     {
-        // Draw current frame on top of the previous frames with accounting for transparency
-        m_d2dContext->DrawImage(m_bitmaps.at(dwIndex).Get(), m_offsets.at(dwIndex));
-        m_d2dContext->Flush();
+        m_nextInterval = DataWaitInterval;
+        return false;
+    }
 
-        ComPtr<IWICBitmap> pWicBitmap;
-        hr = pFactory->CreateBitmap(m_width, m_height, GUID_WICPixelFormat32bppPBGRA, WICBitmapCacheOnDemand, &pWicBitmap);
+    if (m_player->GetFrameCount() == 0)
+        return false;
 
-        ComPtr<ID2D1Bitmap> pBitmap;
-        hr = m_d2dContext->CreateBitmapFromWicBitmap(pWicBitmap.Get(), &pBitmap);
+    // The scheduler waits out the delay of the frame being shown before moving on
+    auto completedLoop = m_player->RenderFrame();
+    SetNextInterval();
 
-        // Take a snapshot of the current image and store it into the ID2D1Bitmap.
-        // This is the final displayable frame at this frame index.
-        hr = pBitmap->CopyFromBitmap(&dest, m_surfaceBitmap.Get(), &src);
+    return completedLoop;
+}
 
-        m_bitmaps.at(dwIndex) = pBitmap;
-    }
+void GifImageSource::Seek(TimeSpan position)
+{
+    if (position.Duration < 0)
+        throw ref new Platform::InvalidArgumentException();
 
-    EndDraw();
+    m_player->Update();
+    m_player->Seek(position.Duration);
+    ShowSeekedFrame();
 }
 
-HRESULT GifImageSource::QueryMetadata(IWICMetadataQueryReader *pQueryReader)
+void GifImageSource::SeekToFrame(int frameIndex)
 {
-    HRESULT hr = S_OK;
-    PROPVARIANT var;
-    PropVariantInit(&var);
-
-    // Default to non-animated gif
-    m_isAnimatedGif = false;
+    m_player->Update();
+    if (frameIndex < 0 || static_cast<UINT>(frameIndex) >= m_player->GetFrameCount())
+        throw ref new Platform::InvalidArgumentException();
 
-    hr = pQueryReader->GetMetadataByName(L"/appext/Application", &var);
-    if (FAILED(hr))
-        return hr;
+    m_player->SeekToFrame(frameIndex);
+    ShowSeekedFrame();
+}
 
-    if (var.vt != (VT_UI1 | VT_VECTOR))
-        return S_FALSE;
-    if (var.caub.cElems != 0x0B) // must be exactly 11 bytes long
-        return S_FALSE;
+void GifImageSource::ShowSeekedFrame()
+{
+    if (m_player->Advance(0))
+    {
+        m_completedLoop = true;
+        if (!m_player->IsAnimated())
+        {
+            Stop();
+        }
+    }
+    SetNextInterval();
 
-    static LPCSTR strNetscape = "NETSCAPE2.0";
-    for (ULONG i = 0; i < var.caub.cElems; i++)
+    // Playback carries on from the new position, which gets the rest of its frame's delay
+    if (m_isRunning)
     {
-        // Manual strcmp
-        if (*(var.caub.pElems + i) != strNetscape[i])
-            return S_FALSE;
+        m_lastTick = AnimationScheduler::Now();
+        AnimationScheduler::GetInstance().Schedule(m_animationId, m_lastTick + m_nextInterval);
     }
+}
+
+void GifImageSource::LoadImage(std::vector<uint8_t> data, Em::Gif::GifFrameIndex index, cancellation_token token)
+{
+    // The player polls a flag of its own, which the token sets when it's cancelled
+    auto pCancellation = std::make_shared<Em::Gif::GifCancellation>();
 
-    PropVariantClear(&var);
-    hr = pQueryReader->GetMetadataByName(L"/appext/Data", &var);
-    if (FAILED(hr))
-        return hr;
+    struct DeregisterOnExit
+    {
+        cancellation_token token;
+        cancellation_token_registration registration;
+        ~DeregisterOnExit()
+        {
+            if (token.is_cancelable())
+                token.deregister_callback(registration);
+        }
+    } deregister = { token, cancellation_token_registration() };
 
-    // Only handle case where the application data block is exactly 4 bytes long
-    if (var.caub.cElems != 4)
-        return S_FALSE;
+    if (token.is_cancelable())
+    {
+        deregister.registration = token.register_callback([pCancellation] { pCancellation->Cancel(); });
+    }
 
-    auto count = *var.caub.pElems; // Data length; we generally expect this value to be 3
-    if (count >= 1)
+    try
     {
-        m_isAnimatedGif = *(var.caub.pElems + 1) != 0; // is animated gif; we generally expect this byte to be 1
+        m_player->Load(std::move(data), std::move(index), pCancellation.get());
     }
-    if (count == 3)
+    catch (const Em::Gif::GifFormatException &)
     {
-        // iteration count; 2nd element is LSB, 3rd element is MSB
-        // we generally expect this value to be 0
-        m_loopCount = (*(var.caub.pElems + 3) << 8) + *(var.caub.pElems + 2);
+        throw Platform::Exception::CreateException(WINCODEC_ERR_BADIMAGE);
     }
+    catch (const Em::Gif::GifCancelledException &)
+    {
+        cancel_current_task();
+    }
+}
+
+unsigned int GifImageSource::FrameCacheCapacity::get()
+{
+    return static_cast<unsigned int>(Em::Gif::GifFrameCache::GetInstance().GetCapacity());
+}
 
-    return hr;
+void GifImageSource::FrameCacheCapacity::set(unsigned int value)
+{
+    Em::Gif::GifFrameCache::GetInstance().SetCapacity(value);
 }
 
-void GifImageSource::LoadImage(IStream *pStream)
+Size GifImageSource::GetDecodedSize(int width, int height, int decodePixelWidth, int decodePixelHeight)
 {
-    HRESULT hr = S_OK;
-    PROPVARIANT var;
-    PropVariantInit(&var);
+    if (width < 0 || height < 0 || decodePixelWidth < 0 || decodePixelHeight < 0)
+        throw ref new Platform::InvalidArgumentException();
 
-    // IWICImagingFactory is where it all begins
-    ComPtr<IWICImagingFactory> pFactory;
-    hr = CoCreateInstance(CLSID_WICImagingFactory,
-        NULL,
-        CLSCTX_INPROC_SERVER,
-        IID_IWICImagingFactory,
-        (LPVOID*) &pFactory);
+    uint32_t decodeWidth;
+    uint32_t decodeHeight;
+    Em::Gif::GifDecoder::FitDecodeSize(width, height, decodePixelWidth, decodePixelHeight, decodeWidth, decodeHeight);
 
-    // IWICBitmapDecoder is roughly analogous to BitmapDecoder
-    ComPtr<IWICBitmapDecoder> pDecoder;
-    hr = pFactory->CreateDecoderFromStream(pStream, NULL, WICDecodeMetadataCacheOnDemand, &pDecoder);
+    return Size(static_cast<float>(decodeWidth), static_cast<float>(decodeHeight));
+}
 
-    // IWICMetadataQueryReader is roughly analogous to BitmapPropertiesView
-    ComPtr<IWICMetadataQueryReader> pQueryReader;
-    hr = pDecoder->GetMetadataQueryReader(&pQueryReader);
+void GifImageSource::DecodePixelWidth::set(int value)
+{
+    if (value < 0)
+        throw ref new Platform::InvalidArgumentException();
 
-    // Get image metadata
-    hr = QueryMetadata(pQueryReader.Get());
+    m_player->SetMaxDecodeSize(value, m_player->GetMaxDecodeHeight());
+}
 
-    // Get frame count
-    UINT dwFrameCount = 0;
-    hr = pDecoder->GetFrameCount(&dwFrameCount);
+void GifImageSource::DecodePixelHeight::set(int value)
+{
+    if (value < 0)
+        throw ref new Platform::InvalidArgumentException();
 
-    m_dwFrameCount = dwFrameCount;
-    m_bitmaps = std::vector<ComPtr<ID2D1Bitmap>>(m_dwFrameCount);
-    m_offsets = std::vector<D2D1_POINT_2F>(m_dwFrameCount);
-    m_delays = std::vector<USHORT>(m_dwFrameCount);
+    m_player->SetMaxDecodeSize(m_player->GetMaxDecodeWidth(), value);
+}
 
-    // Get and convert each frame bitmap into ID2D1Bitmap
-    for (UINT dwFrameIndex = 0; dwFrameIndex < dwFrameCount; dwFrameIndex++)
-    {
-        // IWICBitmapFrameDecode is roughly analogous to BitmapFrame
-        ComPtr<IWICBitmapFrameDecode> pFrameDecode;
-        hr = pDecoder->GetFrame(dwFrameIndex, &pFrameDecode);
+unsigned int GifImageSource::DecodeWorkerCount::get()
+{
+    return Em::Gif::GifWorkerPool::GetInstance().GetWorkerCount();
+}
 
-        // Need to get delay and offset metadata for each frame
-        ComPtr<IWICMetadataQueryReader> pFrameQueryReader;
-        hr = pFrameDecode->GetMetadataQueryReader(&pFrameQueryReader);
+void GifImageSource::DecodeWorkerCount::set(unsigned int value)
+{
+    Em::Gif::GifWorkerPool::GetInstance().SetWorkerCount(value);
+}
 
-        FLOAT fOffsetX = 0.0;
-        FLOAT fOffsetY = 0.0;
-        USHORT dwDelay = 10; // default to 10 hundredths of a second (100 ms)
+FrameCacheStatistics GifImageSource::GetFrameCacheStatistics()
+{
+    auto statistics = Em::Gif::GifFrameCache::GetInstance().GetStatistics();
 
-        // Get delay
-        PropVariantClear(&var);
-        hr = pFrameQueryReader->GetMetadataByName(L"/grctlext/Delay", &var);
-        dwDelay = var.uiVal;
+    FrameCacheStatistics result;
+    result.Hits = statistics.hits;
+    result.Misses = statistics.misses;
+    result.MergedLoads = statistics.merged;
+    result.Evictions = statistics.evictions;
+    result.ResidentBytes = statistics.residentBytes;
+    result.EntryCount = statistics.entryCount;
 
-        if (dwFrameIndex == 0)
-        {
-            // If this is the first frame, use the size of this frame as the size of the
-            // entire image. Assume offset is (0,0).
-            hr = pFrameDecode->GetSize((UINT*) &m_width, (UINT*) &m_height);
-        }
-        else
-        {
-            // Get offset
-            PropVariantClear(&var);
-            hr = pFrameQueryReader->GetMetadataByName(L"/imgdesc/Left", &var);
-            fOffsetX = var.uiVal;
-
-            PropVariantClear(&var);
-            hr = pFrameQueryReader->GetMetadataByName(L"/imgdesc/Top", &var);
-            fOffsetY = var.uiVal;
-        }
+    auto lookups = statistics.hits + statistics.misses;
+    result.HitRate = lookups != 0 ? static_cast<double>(statistics.hits) / lookups : 0.0;
 
-        // Set up converter 
-        ComPtr<IWICFormatConverter> pConvertedBitmap;
-        hr = pFactory->CreateFormatConverter(&pConvertedBitmap);
+    return result;
+}
 
-        // Convert bitmap to B8G8R8A8
-        hr = pConvertedBitmap->Initialize(pFrameDecode.Get(), GUID_WICPixelFormat32bppPBGRA, WICBitmapDitherTypeNone, NULL, 0, WICBitmapPaletteTypeCustom);
+PlaybackStatistics GifImageSource::GetStatistics()
+{
+    return ToPlaybackStatistics(m_statistics->Get());
+}
 
-        // Store converted bitmap into IWICBitmap so D2D can use it
-        ComPtr<IWICBitmap> pWicBitmap;
-        hr = pFactory->CreateBitmapFromSource(pConvertedBitmap.Get(), WICBitmapCacheOnDemand, &pWicBitmap);
+PlaybackStatistics GifImageSource::GetProcessStatistics()
+{
+    return ToPlaybackStatistics(Em::Gif::GifStatistics::GetProcessStatistics());
+}
 
-        // Finally, get ID2D1Bitmap for this frame
-        ComPtr<ID2D1Bitmap> pBitmap;
-        hr = m_d2dContext->CreateBitmapFromWicBitmap(pWicBitmap.Get(), &pBitmap);
+void GifImageSource::ClearFrameCache()
+{
+    Em::Gif::GifFrameCache::GetInstance().Clear();
+}
 
-        // Push raw frames into bitmaps array. These need to be processed into proper frames before being drawn to screen.
-        m_bitmaps[dwFrameIndex] = pBitmap;
-        m_offsets[dwFrameIndex] = { fOffsetX, fOffsetY };
-        m_delays[dwFrameIndex] = dwDelay;
-    }
+Platform::String^ GifImageSource::DiskCacheFolder::get()
+{
+    return FromUtf8(Em::Gif::GifDiskCache::GetInstance().GetDirectory());
+}
 
-    PropVariantClear(&var);
+void GifImageSource::DiskCacheFolder::set(Platform::String^ value)
+{
+    Em::Gif::GifDiskCache::GetInstance().SetDirectory(ToUtf8(value));
 }
 
-void GifImageSource::CreateDeviceResources()
+unsigned long long GifImageSource::DiskCacheQuota::get()
 {
-    // This flag adds support for surfaces with a different color channel ordering 
-    // than the API default. It is required for compatibility with Direct2D. 
-    UINT creationFlags = D3D11_CREATE_DEVICE_BGRA_SUPPORT;
+    return Em::Gif::GifDiskCache::GetInstance().GetQuota();
+}
 
-#if defined(_DEBUG)     
-    // If the project is in a debug build, enable debugging via SDK Layers. 
-    creationFlags |= D3D11_CREATE_DEVICE_DEBUG;
-#endif 
+void GifImageSource::DiskCacheQuota::set(unsigned long long value)
+{
+    Em::Gif::GifDiskCache::GetInstance().SetQuota(value);
+}
 
-    // This array defines the set of DirectX hardware feature levels this app will support. 
-    // Note the ordering should be preserved. 
-    // Don't forget to declare your application's minimum required feature level in its 
-    // description.  All applications are assumed to support 9.1 unless otherwise stated. 
-    const D3D_FEATURE_LEVEL featureLevels [] =
-    {
-        D3D_FEATURE_LEVEL_11_1,
-        D3D_FEATURE_LEVEL_11_0,
-        D3D_FEATURE_LEVEL_10_1,
-        D3D_FEATURE_LEVEL_10_0,
-        D3D_FEATURE_LEVEL_9_3,
-        D3D_FEATURE_LEVEL_9_2,
-        D3D_FEATURE_LEVEL_9_1,
-    };
+unsigned long long GifImageSource::MemoryBudget::get()
+{
+    return Em::Gif::GifMemoryGovernor::GetInstance().GetBudget();
+}
 
-    // Create the Direct3D 11 API device object. 
-    DX::ThrowIfFailed(
-        D3D11CreateDevice(
-        nullptr,                        // Specify nullptr to use the default adapter. 
-        D3D_DRIVER_TYPE_HARDWARE,
-        nullptr,
-        creationFlags,                  // Set debug and Direct2D compatibility flags. 
-        featureLevels,                  // List of feature levels this app can support. 
-        ARRAYSIZE(featureLevels),
-        D3D11_SDK_VERSION,              // Always set this to D3D11_SDK_VERSION for Windows Store apps. 
-        &m_d3dDevice,                   // Returns the Direct3D device created. 
-        nullptr,
-        nullptr
-        )
-        );
-
-    // Get the Direct3D 11.1 API device. 
-    ComPtr<IDXGIDevice> dxgiDevice;
-    DX::ThrowIfFailed(
-        m_d3dDevice.As(&dxgiDevice));
-
-    // Create the Direct2D device object and a corresponding context. 
-    DX::ThrowIfFailed(
-        D2D1CreateDevice(
-        dxgiDevice.Get(),
-        nullptr,
-        &m_d2dDevice));
-
-    DX::ThrowIfFailed(
-        m_d2dDevice->CreateDeviceContext(
-        D2D1_DEVICE_CONTEXT_OPTIONS_NONE,
-        &m_d2dContext));
-
-    // Query for ISurfaceImageSourceNative interface. 
-    DX::ThrowIfFailed(
-        reinterpret_cast<IUnknown*>(this)->QueryInterface(IID_PPV_ARGS(&m_sisNative)));
-
-    // Associate the DXGI device with the SurfaceImageSource. 
-    DX::ThrowIfFailed(
-        m_sisNative->SetDevice(dxgiDevice.Get()));
-}
-
-bool GifImageSource::BeginDraw()
-{
-    ComPtr<IDXGISurface> surface;
-    RECT updateRect = { 0, 0, m_width, m_height };
-    POINT offset = { 0 };
-
-    // Begin drawing - returns a target surface and an offset to use as the top left origin when drawing. 
-    HRESULT beginDrawHR = m_sisNative->BeginDraw(updateRect, &surface, &offset);
-
-    if (SUCCEEDED(beginDrawHR))
-    {
-        // Create render target. 
-        DX::ThrowIfFailed(
-            m_d2dContext->CreateBitmapFromDxgiSurface(surface.Get(), nullptr, &m_surfaceBitmap));
-
-        // Set context's render target. 
-        m_d2dContext->SetTarget(m_surfaceBitmap.Get());
-
-        // Begin drawing using D2D context. 
-        m_d2dContext->BeginDraw();
-
-        // Apply a clip and transform to constrain updates to the target update area. 
-        // This is required to ensure coordinates within the target surface remain 
-        // consistent by taking into account the offset returned by BeginDraw, and 
-        // can also improve performance by optimizing the area that is drawn by D2D. 
-        // Apps should always account for the offset output parameter returned by  
-        // BeginDraw, since it may not match the passed updateRect input parameter's location. 
-        m_d2dContext->PushAxisAlignedClip(
-            D2D1::RectF(
-            static_cast<float>(offset.x),
-            static_cast<float>(offset.y),
-            static_cast<float>(offset.x + updateRect.right),
-            static_cast<float>(offset.y + updateRect.bottom)
-            ),
-            D2D1_ANTIALIAS_MODE_ALIASED);
-
-        m_d2dContext->SetTransform(
-            D2D1::Matrix3x2F::Translation(static_cast<float>(offset.x), static_cast<float>(offset.y)));
-    }
-    else if (beginDrawHR == DXGI_ERROR_DEVICE_REMOVED || beginDrawHR == DXGI_ERROR_DEVICE_RESET)
-    {
-        // If the device has been removed or reset, attempt to recreate it and continue drawing. 
-        CreateDeviceResources();
-        BeginDraw();
-    }
-    else
-    {
-        return false;
-    }
+void GifImageSource::MemoryBudget::set(unsigned long long value)
+{
+    Em::Gif::GifMemoryGovernor::GetInstance().SetBudget(static_cast<size_t>(std::min<unsigned long long>(value, SIZE_MAX)));
+}
 
-    return true;
+MemoryBudgetStatistics GifImageSource::GetMemoryBudgetStatistics()
+{
+    auto statistics = Em::Gif::GifMemoryGovernor::GetInstance().GetStatistics();
+
+    MemoryBudgetStatistics result;
+    result.Budget = statistics.budget;
+    result.ResidentBytes = statistics.residentBytes;
+    result.ImageCount = statistics.imageCount;
+    result.ShrunkImageCount = statistics.degradedCount;
+    result.Shrinks = statistics.degradations;
+    result.Restores = statistics.restorations;
+    return result;
 }
 
-void GifImageSource::EndDraw()
+DiskCacheStatistics GifImageSource::GetDiskCacheStatistics()
 {
-    // Remove the transform and clip applied in BeginDraw since 
-    // the target area can change on every update. 
-    m_d2dContext->SetTransform(D2D1::IdentityMatrix());
-    m_d2dContext->PopAxisAlignedClip();
+    auto statistics = Em::Gif::GifDiskCache::GetInstance().GetStatistics();
 
-    // Remove the render target and end drawing. 
-    DX::ThrowIfFailed(
-        m_d2dContext->EndDraw());
+    DiskCacheStatistics result;
+    result.Hits = statistics.hits;
+    result.Misses = statistics.misses;
+    result.Writes = statistics.writes;
+    result.Evictions = statistics.evictions;
+    result.DiskBytes = statistics.diskBytes;
+    result.EntryCount = statistics.entryCount;
 
-    m_d2dContext->SetTarget(nullptr);
-    m_surfaceBitmap = nullptr;
+    auto lookups = statistics.hits + statistics.misses;
+    result.HitRate = lookups != 0 ? static_cast<double>(statistics.hits) / lookups : 0.0;
 
-    DX::ThrowIfFailed(
-        m_sisNative->EndDraw());
+    return result;
 }
 
+void GifImageSource::ClearDiskCache()
+{
+    Em::Gif::GifDiskCache::GetInstance().Clear();
+}
 
 void GifImageSource::Restart()
 {
-    m_dwCurrentFrame = 0;
+    m_player->Restart();
     m_completedLoop = false;
 }
 
 void GifImageSource::SetNextInterval()
 {
-    auto delay = m_delays.at(m_dwCurrentFrame);
-    if (delay < 3)
+    // Nothing is due until more of a progressive load arrives
+    m_nextInterval = m_player->GetTimeToNextFrame();
+    if (m_nextInterval == 0)
     {
-        delay = 10; // default to 100ms if delay is too short
+        m_nextInterval = DataWaitInterval;
     }
-
-    auto timespan = TimeSpan();
-    timespan.Duration = 80000L * delay; // 8ms * delay. (should be 10ms, but this gives the impression of awesome perf)
-
-    m_timer->Interval = timespan;
 }
 
 void GifImageSource::Start()
 {
-    if (m_timer->IsEnabled)
+    m_player->Update();
+
+    if (m_isRunning || m_player->GetFrameCount() == 0)
         return;
 
-    if (m_isAnimatedGif || !m_completedLoop)
+    if (m_player->IsAnimated() || !m_completedLoop)
     {
-        m_timer->Start();
+        auto &scheduler = AnimationScheduler::GetInstance();
+        if (m_animationId == 0)
+        {
+            m_animationId = scheduler.Register(this);
+        }
+
+        // The frame on screen (if any) still gets the rest of its delay
+        m_isRunning = true;
+        m_lastTick = AnimationScheduler::Now();
+        scheduler.Schedule(m_animationId, m_lastTick + m_nextInterval);
     }
 }
 
 void GifImageSource::Stop()
 {
-    m_timer->Stop();
+    if (!m_isRunning)
+        return;
+
+    m_isRunning = false;
+    AnimationScheduler::GetInstance().Cancel(m_animationId);
 }
 
-void GifImageSource::OnTick(Object ^sender, Object ^args)
+void GifImageSource::OnScheduledTick(INT64 deadline, INT64 now)
 {
-    // Timer might've been stopped just prior to OnTick
-    if (m_timer == nullptr || !m_timer->IsEnabled)
+    // Might've been stopped by another image source ticking just before this one
+    if (!m_isRunning)
     {
         return;
     }
 
+    m_statistics->RecordTick(deadline, now);
+
+    // Ticks run up to a refresh early when they're coalesced with others; the frame they show is
+    // on screen from the deadline. After a long stall playback carries on from the frame that was
+    // due, and the clock starts again from now.
+    auto time = deadline > now ? deadline : now;
+    auto elapsed = AnimationScheduler::GetInstance().GetElapsed(m_lastTick, deadline, time);
+    m_lastTick = time;
+
     try
     {
-        auto completedLoop = RenderFrame();
+        // Frames whose time passed while the tick was late are skipped, and the next tick falls
+        // when the frame now on screen ends, so lateness never accumulates
+        auto completedLoop = m_player->Advance(elapsed);
+        SetNextInterval();
+
         if (completedLoop)
         {
             // Allow gif to play through at least once, no matter what
             m_completedLoop = true;
 
             // Stop animation if this is not a looping gif
-            if (!m_isAnimatedGif)
+            if (!m_player->IsAnimated())
             {
-                m_timer->Stop();
+                m_isRunning = false;
+                return;
             }
         }
     }
     catch (Platform::Exception^)
     {
+        // Keep animating, but leave a trace of what went wrong
+        m_statistics->RecordSwallowedException();
+        m_statistics->RecordSkippedTick();
+    }
+    catch (const std::exception &)
+    {
+        // A bad frame, or out of memory; ticking again would only fail the same way
+        m_statistics->RecordSwallowedException();
+        m_statistics->RecordSkippedTick();
+        Stop();
+        return;
     }
+
+    AnimationScheduler::GetInstance().Schedule(m_animationId, time + m_nextInterval);
 }
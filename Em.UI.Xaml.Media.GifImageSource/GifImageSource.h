@@ -4,11 +4,99 @@
 #include <wincodec.h>
 #include "windows.foundation.h"
 
+#include "GifPlayer.h"
+#include "D2DRenderBackend.h"
+
 namespace Em {
     namespace UI {
         namespace Xaml {
             namespace Media
             {
+                /// <summary>
+                /// Counters for the process-wide decoded frame cache.
+                /// </summary>
+                public value struct FrameCacheStatistics
+                {
+                    UINT64 Hits;
+                    UINT64 Misses;
+                    UINT64 MergedLoads;         // loads that shared another load's decode of the same GIF
+                    UINT64 Evictions;
+                    UINT64 ResidentBytes;
+                    UINT32 EntryCount;
+                    double HitRate;
+                };
+
+                /// <summary>
+                /// Counters for the process-wide disk cache of composed frames.
+                /// </summary>
+                public value struct DiskCacheStatistics
+                {
+                    UINT64 Hits;
+                    UINT64 Misses;
+                    UINT64 Writes;
+                    UINT64 Evictions;
+                    UINT64 DiskBytes;
+                    UINT32 EntryCount;
+                    double HitRate;
+                };
+
+                /// <summary>
+                /// Counters for the process-wide memory budget.
+                /// </summary>
+                public value struct MemoryBudgetStatistics
+                {
+                    UINT64 Budget;
+                    UINT64 ResidentBytes;       // frames shared through the frame cache count once per image
+                    UINT32 ImageCount;
+                    UINT32 ShrunkImageCount;
+                    UINT64 Shrinks;
+                    UINT64 Restores;
+                };
+
+                /// <summary>
+                /// How an image's loading and playback have gone, or the totals over every image in the process.
+                /// </summary>
+                public value struct PlaybackStatistics
+                {
+                    UINT32 LoadCount;
+                    Windows::Foundation::TimeSpan LoadDuration;         // totals over every load
+                    Windows::Foundation::TimeSpan DecodeDuration;
+                    Windows::Foundation::TimeSpan PrerenderDuration;
+                    UINT64 ResidentFrameBytes;
+                    UINT64 FramesPresented;
+                    UINT64 Ticks;
+                    UINT64 LateTicks;                                   // ran over a display refresh late
+                    UINT64 SkippedTicks;                                // presented nothing
+                    Windows::Foundation::TimeSpan MeanTickJitter;
+                    Windows::Foundation::TimeSpan MaxTickJitter;
+                    UINT32 DeviceLostRecoveries;
+                    UINT32 SwallowedExceptions;
+                };
+
+                /// <summary>
+                /// How prerendered frames are kept in memory.
+                /// </summary>
+                public enum class FrameStorageMode
+                {
+                    /// <summary>
+                    /// Every frame in full 32-bit color, ready to present.
+                    /// </summary>
+                    Full = 0,
+
+                    /// <summary>
+                    /// Every frame as 8-bit palette indices, expanded to color as it's shown. Roughly a
+                    /// quarter of the memory of Full.
+                    /// </summary>
+                    Indexed = 1,
+
+                    /// <summary>
+                    /// Periodic full keyframes plus only the area each frame changed. Most GIF frames
+                    /// change a small part of the image, so this is usually a fraction of the memory of
+                    /// Full, for one small copy per frame during playback.
+                    /// </summary>
+                    Delta = 2
+                };
+
                 public ref class GifImageSource sealed : Windows::UI::Xaml::Media::Imaging::SurfaceImageSource
                 {
                 public:
@@ -17,8 +105,80 @@ namespace Em {
                     /// <summary>
                     /// Loads the image from the specified image stream.
                     /// </summary>
+                    /// <remarks>
+                    /// Cancelling the action stops the load between frames and leaves the source empty.
+                    /// Sources prerendering the same image at the same time share a single decode. When
+                    /// prerendering, the action completes as soon as the first frame can be shown; the
+                    /// rest are composed in the background and play as they become ready.
+                    /// </remarks>
                     Windows::Foundation::IAsyncAction^ SetSourceAsync(Windows::Storage::Streams::IRandomAccessStream^ pStream);
 
+                    /// <summary>
+                    /// Creates a GifImageSource the size of the image in the specified stream, and loads the
+                    /// image into it. Call from the UI thread.
+                    /// </summary>
+                    /// <remarks>
+                    /// The stream is read once. Its frames are indexed without decoding any pixels, which
+                    /// gives the size, and the index is then handed straight to the loader, so there's no
+                    /// need to open the image with a separate decoder first. The decode size arguments
+                    /// work as DecodePixelWidth and DecodePixelHeight, and the source is created at the
+                    /// decoded size. Cancelling the operation stops it at the next stage or frame. As
+                    /// with SetSourceAsync, a prerendering load completes once the first frame is ready.
+                    /// </remarks>
+                    static Windows::Foundation::IAsyncOperation<GifImageSource^>^ CreateFromStreamAsync(Windows::Storage::Streams::IRandomAccessStream^ pStream, bool enablePrerender, int decodePixelWidth, int decodePixelHeight);
+
+                    /// <summary>
+                    /// Gets the size an image of the given size is decoded at, with the given
+                    /// DecodePixelWidth and DecodePixelHeight. Use it to create a source of the right size.
+                    /// </summary>
+                    static Windows::Foundation::Size GetDecodedSize(int width, int height, int decodePixelWidth, int decodePixelHeight);
+
+                    /// <summary>
+                    /// Starts loading an image whose data will be supplied piece by piece with AppendDataAsync.
+                    /// </summary>
+                    /// <remarks>
+                    /// Each frame is decoded as soon as all of its data has been appended, and can be shown
+                    /// straight away. Playback waits whenever it gets ahead of the data.
+                    /// </remarks>
+                    void BeginProgressiveLoad();
+
+                    /// <summary>
+                    /// Appends the next piece of the image started with BeginProgressiveLoad, decoding every
+                    /// frame it completes. Await each call before making the next.
+                    /// </summary>
+                    Windows::Foundation::IAsyncAction^ AppendDataAsync(Windows::Storage::Streams::IBuffer^ pBuffer);
+
+                    /// <summary>
+                    /// Marks the end of the image started with BeginProgressiveLoad. A truncated last frame is
+                    /// shown as far as it goes.
+                    /// </summary>
+                    Windows::Foundation::IAsyncAction^ CompleteProgressiveLoadAsync();
+
+                    /// <summary>
+                    /// Gets the number of frames decoded so far. Only grows during a progressive load, or
+                    /// while a prerendering load composes frames in the background.
+                    /// </summary>
+                    property int LoadedFrameCount
+                    {
+                        int get();
+                    }
+
+                    /// <summary>
+                    /// Gets the length of one loop of the animation, counting only frames decoded so far.
+                    /// </summary>
+                    property Windows::Foundation::TimeSpan Duration
+                    {
+                        Windows::Foundation::TimeSpan get();
+                    }
+
+                    /// <summary>
+                    /// Gets the playback position within the current loop.
+                    /// </summary>
+                    property Windows::Foundation::TimeSpan Position
+                    {
+                        Windows::Foundation::TimeSpan get();
+                    }
+
                     /// <summary>
                     /// Clears all resources currently held in-memory.
                     /// </summary>
@@ -29,7 +189,7 @@ namespace Em {
                     /// </summary>
                     property int Width
                     {
-                        int get() { return m_width; }
+                        int get() { return m_player->GetWidth(); }
                     }
 
                     /// <summary>
@@ -37,21 +197,222 @@ namespace Em {
                     /// </summary>
                     property int Height
                     {
-                        int get() { return m_height; }
+                        int get() { return m_player->GetHeight(); }
                     }
 
                     /// <summary>
-                    /// Sets whether to pre-compose raw frames into displayable frames.
+                    /// Sets whether to pre-compose raw frames into displayable frames. Takes effect
+                    /// the next time an image is loaded.
                     /// </summary>
                     /// <remarks>
                     /// Generally speaking, set this to true.
                     /// </remarks>
                     property bool EnablePrerender
                     {
-                        bool get() { return m_prerender; }
-                        void set(bool value) { m_prerender = value; }
+                        bool get() { return m_player->GetPrerender(); }
+                        void set(bool value) { m_player->SetPrerender(value); }
                     }
 
+                    /// <summary>
+                    /// Sets the maximum number of bytes to spend on prerendered frames, or 0 for no limit.
+                    /// </summary>
+                    /// <remarks>
+                    /// If prerendering every frame would exceed this, only a rolling window of upcoming
+                    /// frames is kept and refilled as the animation plays. Takes effect on the next
+                    /// call to SetSourceAsync.
+                    /// </remarks>
+                    property unsigned int PrerenderMemoryLimit
+                    {
+                        unsigned int get() { return static_cast<unsigned int>(m_player->GetPrerenderMemoryLimit()); }
+                        void set(unsigned int value) { m_player->SetPrerenderMemoryLimit(value); }
+                    }
+
+                    /// <summary>
+                    /// Sets how prerendered frames are kept in memory.
+                    /// </summary>
+                    /// <remarks>
+                    /// Indexed and Delta storage trade a little CPU per frame for a large cut in resident
+                    /// memory, which helps on memory-constrained devices. Takes effect on the next call
+                    /// to SetSourceAsync.
+                    /// </remarks>
+                    property FrameStorageMode FrameStorage
+                    {
+                        FrameStorageMode get() { return static_cast<FrameStorageMode>(m_player->GetFrameStorage()); }
+                        void set(FrameStorageMode value) { m_player->SetFrameStorage(static_cast<Em::Gif::GifFrameStorage>(value)); }
+                    }
+
+                    /// <summary>
+                    /// Sets whether prerendered frames are packed into a few large atlas bitmaps on the
+                    /// device rather than kept in a bitmap each. True by default.
+                    /// </summary>
+                    /// <remarks>
+                    /// Atlases cut the number of device objects from one per frame to a handful, and
+                    /// upload runs of frames in single copies. Takes effect on the next call to
+                    /// SetSourceAsync.
+                    /// </remarks>
+                    property bool EnableFrameAtlas
+                    {
+                        bool get() { return m_backend->GetAtlasLayout(); }
+                        void set(bool value) { m_backend->SetAtlasLayout(value); }
+                    }
+
+                    /// <summary>
+                    /// Sets the width to decode the image at, or 0 to leave the width unconstrained.
+                    /// </summary>
+                    /// <remarks>
+                    /// Larger images are scaled down during decoding to fit within DecodePixelWidth and
+                    /// DecodePixelHeight, keeping their aspect ratio, so memory use and drawing cost follow
+                    /// the decoded size rather than the image's. Width and Height report the decoded size,
+                    /// which the source should have been created at (see GetDecodedSize). Takes effect on
+                    /// the next call to SetSourceAsync or BeginProgressiveLoad.
+                    /// </remarks>
+                    property int DecodePixelWidth
+                    {
+                        int get() { return static_cast<int>(m_player->GetMaxDecodeWidth()); }
+                        void set(int value);
+                    }
+
+                    /// <summary>
+                    /// Sets the height to decode the image at, or 0 to leave the height unconstrained.
+                    /// </summary>
+                    /// <remarks>
+                    /// See DecodePixelWidth.
+                    /// </remarks>
+                    property int DecodePixelHeight
+                    {
+                        int get() { return static_cast<int>(m_player->GetMaxDecodeHeight()); }
+                        void set(int value);
+                    }
+
+                    /// <summary>
+                    /// Gets or sets the number of bytes the process-wide decoded frame cache may hold.
+                    /// </summary>
+                    /// <remarks>
+                    /// GifImageSources loading identical data share one set of decoded (and, when
+                    /// prerendering, composed) frames through this cache instead of decoding again.
+                    /// Set to 0 to disable caching.
+                    /// </remarks>
+                    static property unsigned int FrameCacheCapacity
+                    {
+                        unsigned int get();
+                        void set(unsigned int value);
+                    }
+
+                    /// <summary>
+                    /// Gets or sets the number of background threads used to decode frames.
+                    /// </summary>
+                    /// <remarks>
+                    /// Defaults to one per processor. Frames of a prerendered image are decompressed on
+                    /// these threads and the loading thread together, so load time scales with the
+                    /// number of cores. Lower it to save power or leave cores free on phones; 0 decodes
+                    /// on the loading thread only.
+                    /// </remarks>
+                    static property unsigned int DecodeWorkerCount
+                    {
+                        unsigned int get();
+                        void set(unsigned int value);
+                    }
+
+                    /// <summary>
+                    /// Gets the hit, miss and eviction counts and resident size of the frame cache.
+                    /// </summary>
+                    static FrameCacheStatistics GetFrameCacheStatistics();
+
+                    /// <summary>
+                    /// Gets this image's load times, memory use and playback counters.
+                    /// </summary>
+                    /// <remarks>
+                    /// Resident frame bytes include frames shared with other images through the frame
+                    /// cache. Ticks are animation timer callbacks; their jitter is how far each ran from
+                    /// its deadline. Exceptions thrown while rendering a tick are swallowed to keep the
+                    /// animation going, and are counted here.
+                    /// </remarks>
+                    PlaybackStatistics GetStatistics();
+
+                    /// <summary>
+                    /// Gets the totals of GetStatistics over every GifImageSource in the process, including
+                    /// ones that have been released. Resident frame bytes only count live images.
+                    /// </summary>
+                    static PlaybackStatistics GetProcessStatistics();
+
+                    /// <summary>
+                    /// Removes every entry from the frame cache. Frames in use stay alive until released.
+                    /// </summary>
+                    static void ClearFrameCache();
+
+                    /// <summary>
+                    /// Gets or sets the folder that composed frames are kept in between runs of the app, or
+                    /// an empty string to keep them in memory only. Off by default.
+                    /// </summary>
+                    /// <remarks>
+                    /// Prerendered GIFs are written out once they've been composed. Loading the same data
+                    /// again, at the same decode size and with the same FrameStorage, maps the file instead
+                    /// of decoding, so a GIF seen in an earlier run loads almost for free. The app's local
+                    /// cache or temporary folder is a good place for it.
+                    /// </remarks>
+                    static property Platform::String^ DiskCacheFolder
+                    {
+                        Platform::String^ get();
+                        void set(Platform::String^ value);
+                    }
+
+                    /// <summary>
+                    /// Gets or sets the number of bytes the disk cache's files may take up. Least recently
+                    /// used GIFs are deleted to make room.
+                    /// </summary>
+                    static property unsigned long long DiskCacheQuota
+                    {
+                        unsigned long long get();
+                        void set(unsigned long long value);
+                    }
+
+                    /// <summary>
+                    /// Gets or sets the number of bytes every GifImageSource in the process together may
+                    /// hold in decoded and composed frames, or 0 (the default) for no limit.
+                    /// </summary>
+                    /// <remarks>
+                    /// Over the budget, images that aren't visible, then visible ones that haven't shown a
+                    /// frame for a second (paused ones), least recently shown first, give up their
+                    /// prerendered frames and compose frames as they're shown instead; if that isn't
+                    /// enough, they keep nothing but the compressed data. An image gets its frames back
+                    /// when it becomes visible or is shown again. Images loaded while there's no budget
+                    /// don't keep the compressed data to fall back on, so set this before loading any.
+                    /// </remarks>
+                    static property unsigned long long MemoryBudget
+                    {
+                        unsigned long long get();
+                        void set(unsigned long long value);
+                    }
+
+                    /// <summary>
+                    /// Gets the resident size of every image against the memory budget, and how often
+                    /// images have been shrunk and restored.
+                    /// </summary>
+                    static MemoryBudgetStatistics GetMemoryBudgetStatistics();
+
+                    /// <summary>
+                    /// Gets or sets whether the image is on screen. True by default.
+                    /// </summary>
+                    /// <remarks>
+                    /// Only used by the memory budget: images that aren't visible are the first to give
+                    /// up memory, and are restored when they become visible again.
+                    /// </remarks>
+                    property bool IsVisible
+                    {
+                        bool get() { return m_isVisible; }
+                        void set(bool value);
+                    }
+
+                    /// <summary>
+                    /// Gets the hit, miss, write and eviction counts and size of the disk cache.
+                    /// </summary>
+                    static DiskCacheStatistics GetDiskCacheStatistics();
+
+                    /// <summary>
+                    /// Deletes every file in the disk cache.
+                    /// </summary>
+                    static void ClearDiskCache();
+
                     /// <summary>
                     /// Starts the animation, if image is animated.
                     /// </summary>
@@ -67,6 +428,22 @@ namespace Em {
                     /// </summary>
                     void Restart();
                     
+                    /// <summary>
+                    /// Shows the frame at the given time within the animation straight away, and carries on
+                    /// playing from there if the animation is running.
+                    /// </summary>
+                    /// <remarks>
+                    /// Times past the end wrap around to the start. Seeking costs at most the composition of
+                    /// a few frames, never a replay from the first frame.
+                    /// </remarks>
+                    void Seek(Windows::Foundation::TimeSpan position);
+
+                    /// <summary>
+                    /// Shows the given frame straight away, and carries on playing from there if the
+                    /// animation is running.
+                    /// </summary>
+                    void SeekToFrame(int frameIndex);
+
                     /// <summary>
                     /// Renders a single frame and increments the current frame index.
                     /// </summary>
@@ -75,42 +452,41 @@ namespace Em {
                     /// </returns>
                     bool RenderFrame();
 
-                private:
-                    void CreateDeviceResources();
-                    bool BeginDraw();
-                    void EndDraw();
+                internal:
+                    /// <summary>
+                    /// Called by the AnimationScheduler when the current frame's deadline is due.
+                    /// </summary>
+                    void OnScheduledTick(INT64 deadline, INT64 now);
 
+                private:
+                    void ShowSeekedFrame();
                     void SetNextInterval();
                     void CheckTimer();
+                    void ApplyMemoryLevel();
 
-                    void LoadImage(IStream *pStream);
-                    HRESULT QueryMetadata(IWICMetadataQueryReader *pQueryReader);
-                    void PrerenderBitmaps();
-
-                    Microsoft::WRL::ComPtr<ID3D11Device>                m_d3dDevice;
-                    Microsoft::WRL::ComPtr<ID2D1Device>                 m_d2dDevice;
-                    Microsoft::WRL::ComPtr<ID2D1DeviceContext>          m_d2dContext;
-                    Microsoft::WRL::ComPtr<ISurfaceImageSourceNative>   m_sisNative;
-                    Microsoft::WRL::ComPtr<ID2D1Bitmap1>                m_surfaceBitmap;
+                    void LoadImage(std::vector<uint8_t> data, Em::Gif::GifFrameIndex index, concurrency::cancellation_token token);
 
-                    UINT m_width;
-                    UINT m_height;
-                    UINT m_dwFrameCount;
-                    UINT m_loopCount;
-                    bool m_isAnimatedGif;
+                    // Playback logic lives in the portable player; this class only owns the
+                    // Direct2D backend it presents through and the timer that drives it. Both record
+                    // into the statistics, so they go first.
+                    std::unique_ptr<Em::Gif::GifStatistics> m_statistics;
+                    std::unique_ptr<D2DRenderBackend> m_backend;
+                    std::unique_ptr<Em::Gif::GifPlayer> m_player;
 
-                    bool m_prerender;
-                    bool m_completedPrerender;
+                    // Receives data during a progressive load
+                    std::shared_ptr<Em::Gif::GifProgressiveSource> m_progressive;
 
-                    std::vector<Microsoft::WRL::ComPtr<ID2D1Bitmap>> m_bitmaps;
-                    std::vector<D2D1_POINT_2F> m_offsets;
-                    std::vector<USHORT> m_delays;
-
-                    UINT m_dwCurrentFrame;
                     bool m_completedLoop;
+                    bool m_isVisible;
+
+                    // Animation is driven by the shared AnimationScheduler rather than a timer per instance
+                    uint32_t m_animationId;
+                    bool m_isRunning;
+                    INT64 m_nextInterval;
 
-                    Windows::UI::Xaml::DispatcherTimer^ m_timer;
-                    void OnTick(Platform::Object ^sender, Platform::Object ^args);
+                    // Time the player's position was last brought up to. Frames are picked by how much
+                    // time has passed since, so a late tick skips frames instead of slowing playback.
+                    INT64 m_lastTick;
                 };
             }
         }
@@ -0,0 +1,267 @@
+﻿#include "GifMemoryGovernor.h"
+
+#include <algorithm>
+
+#include "GifStatistics.h"
+
+using namespace Em::Gif;
+
+namespace
+{
+    // Constructed during module initialization, so there's no lazy-initialization race
+    GifMemoryGovernor s_instance;
+
+    struct Candidate
+    {
+        GifMemoryClient *pClient;
+        bool visible;
+        int64_t lastShown;
+    };
+
+    // Images off screen go first, then the ones shown longest ago
+    bool ShrinksFirst(const Candidate &a, const Candidate &b)
+    {
+        if (a.visible != b.visible)
+            return !a.visible;
+
+        return a.lastShown < b.lastShown;
+    }
+}
+
+GifMemoryGovernor &GifMemoryGovernor::GetInstance()
+{
+    return s_instance;
+}
+
+GifMemoryGovernor::GifMemoryGovernor()
+    : m_budget(0),
+    m_degradations(0),
+    m_restorations(0)
+{
+}
+
+void GifMemoryGovernor::SetBudget(size_t cbBudget)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_budget = cbBudget;
+
+    // Without a budget nothing has a reason to stay shrunk
+    if (m_budget == 0)
+    {
+        for (auto &entry : m_clients)
+        {
+            Restore(entry.first, entry.second);
+        }
+    }
+    Balance();
+}
+
+size_t GifMemoryGovernor::GetBudget() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_budget;
+}
+
+void GifMemoryGovernor::Register(GifMemoryClient *pClient)
+{
+    Client client;
+    client.target = GifMemoryLevel::Full;
+    client.level = GifMemoryLevel::Full;
+    client.usage.residentBytes = 0;
+    client.usage.composeOnDemandBytes = 0;
+    client.usage.compressedBytes = 0;
+    client.visible = true;
+    client.loading = false;
+    client.lastShown = GifStatistics::Now();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_clients[pClient] = client;
+}
+
+void GifMemoryGovernor::Unregister(GifMemoryClient *pClient)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_clients.erase(pClient);
+}
+
+void GifMemoryGovernor::Report(GifMemoryClient *pClient, GifMemoryLevel level, const GifMemoryUsage &usage)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_clients.find(pClient);
+    if (it == m_clients.end())
+        return;
+
+    it->second.level = level;
+    it->second.usage = usage;
+    Balance();
+}
+
+void GifMemoryGovernor::SetVisible(GifMemoryClient *pClient, bool visible)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_clients.find(pClient);
+    if (it == m_clients.end() || it->second.visible == visible)
+        return;
+
+    it->second.visible = visible;
+    if (visible)
+    {
+        Restore(pClient, it->second);
+    }
+    else
+    {
+        Balance();
+    }
+}
+
+void GifMemoryGovernor::RecordShown(GifMemoryClient *pClient)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_clients.find(pClient);
+    if (it == m_clients.end())
+        return;
+
+    it->second.lastShown = GifStatistics::Now();
+    if (it->second.visible)
+    {
+        Restore(pClient, it->second);
+    }
+}
+
+void GifMemoryGovernor::ResetLevel(GifMemoryClient *pClient)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_clients.find(pClient);
+    if (it != m_clients.end())
+    {
+        it->second.target = GifMemoryLevel::Full;
+        it->second.level = GifMemoryLevel::Full;
+    }
+}
+
+void GifMemoryGovernor::SetLoading(GifMemoryClient *pClient, bool loading)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_clients.find(pClient);
+    if (it == m_clients.end())
+        return;
+
+    // What the image reported while it was loading was left out of balancing
+    it->second.loading = loading;
+    if (!loading)
+    {
+        Balance();
+    }
+}
+
+GifMemoryStatistics GifMemoryGovernor::GetStatistics() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    GifMemoryStatistics statistics;
+    statistics.budget = m_budget;
+    statistics.residentBytes = 0;
+    statistics.imageCount = static_cast<uint32_t>(m_clients.size());
+    statistics.degradedCount = 0;
+    statistics.degradations = m_degradations;
+    statistics.restorations = m_restorations;
+
+    for (auto &entry : m_clients)
+    {
+        statistics.residentBytes += entry.second.usage.residentBytes;
+        if (entry.second.target != GifMemoryLevel::Full)
+        {
+            statistics.degradedCount++;
+        }
+    }
+    return statistics;
+}
+
+// Gets what a client will hold once it has reached the level it was asked for. Must be called
+// with the lock held.
+size_t GifMemoryGovernor::GetExpectedBytes(const Client &client) const
+{
+    if (client.target <= client.level)
+        return client.usage.residentBytes;
+
+    auto cbExpected = client.target == GifMemoryLevel::Compressed ? client.usage.compressedBytes : client.usage.composeOnDemandBytes;
+    return std::min(cbExpected, client.usage.residentBytes);
+}
+
+// Must be called with the lock held
+void GifMemoryGovernor::Restore(GifMemoryClient *pClient, Client &client)
+{
+    if (client.target == GifMemoryLevel::Full)
+        return;
+
+    // The client reports what it holds once it's restored, which may push others down
+    client.target = GifMemoryLevel::Full;
+    pClient->RequestMemoryLevel(GifMemoryLevel::Full);
+    m_restorations++;
+}
+
+// Asks images to shrink, a level at a time, until the total is expected to be within the budget.
+// Must be called with the lock held.
+void GifMemoryGovernor::Balance()
+{
+    if (m_budget == 0)
+        return;
+
+    size_t cbTotal = 0;
+    for (auto &entry : m_clients)
+    {
+        cbTotal += GetExpectedBytes(entry.second);
+    }
+    if (cbTotal <= m_budget)
+        return;
+
+    // Visible images that are still being shown are what the user is looking at. Images still
+    // loading can't change level until they're done.
+    auto now = GifStatistics::Now();
+    std::vector<Candidate> candidates;
+    for (auto &entry : m_clients)
+    {
+        auto &client = entry.second;
+        if ((client.visible && now - client.lastShown < ActiveInterval) || client.loading)
+            continue;
+
+        Candidate candidate = { entry.first, client.visible, client.lastShown };
+        candidates.push_back(candidate);
+    }
+    std::sort(candidates.begin(), candidates.end(), ShrinksFirst);
+
+    // Everything drops its prerendered frames before anything drops its canvas
+    const GifMemoryLevel levels[] = { GifMemoryLevel::ComposeOnDemand, GifMemoryLevel::Compressed };
+    for (auto level : levels)
+    {
+        for (auto &candidate : candidates)
+        {
+            if (cbTotal <= m_budget)
+                return;
+
+            auto &client = m_clients[candidate.pClient];
+            if (client.target >= level)
+                continue;
+
+            auto cbBefore = GetExpectedBytes(client);
+            auto previousTarget = client.target;
+            client.target = level;
+            auto cbAfter = GetExpectedBytes(client);
+            if (cbAfter >= cbBefore)
+            {
+                // Nothing to gain; the image can't shrink any further this way
+                client.target = previousTarget;
+                continue;
+            }
+
+            cbTotal -= cbBefore - cbAfter;
+            candidate.pClient->RequestMemoryLevel(level);
+            m_degradations++;
+        }
+    }
+}
@@ -0,0 +1,151 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace Em {
+    namespace Gif
+    {
+        /// <summary>
+        /// How much of an image a player holds on to, from most to least.
+        /// </summary>
+        enum class GifMemoryLevel : uint8_t
+        {
+            // Whatever the player's settings call for: every frame prerendered, if asked to
+            Full = 0,
+
+            // Prerendered frames dropped; frames are composed from the compressed data as they're shown
+            ComposeOnDemand = 1,
+
+            // Only the compressed data kept; the canvas and its checkpoints are dropped too
+            Compressed = 2
+        };
+
+        /// <summary>
+        /// What an image holds now, and about what it would hold at each lower level.
+        /// </summary>
+        struct GifMemoryUsage
+        {
+            size_t residentBytes;
+            size_t composeOnDemandBytes;
+            size_t compressedBytes;
+        };
+
+        struct GifMemoryStatistics
+        {
+            size_t budget;
+            size_t residentBytes;       // over every image, counting frame sets they share once per image
+            uint32_t imageCount;
+            uint32_t degradedCount;     // images currently asked to hold less than Full
+            uint64_t degradations;
+            uint64_t restorations;
+        };
+
+        /// <summary>
+        /// An image whose memory the governor can ask to shrink or grow back.
+        /// </summary>
+        class GifMemoryClient
+        {
+        public:
+            /// <summary>
+            /// Asks the image to move to a level. Called on whichever thread reported to the governor,
+            /// with the governor's lock held, so it must only note the request (and perhaps schedule
+            /// it on the image's own thread) without calling back into the governor.
+            /// </summary>
+            virtual void RequestMemoryLevel(GifMemoryLevel level) = 0;
+
+        protected:
+            ~GifMemoryClient() {}
+        };
+
+        /// <summary>
+        /// Keeps the memory of every live image in the process within one budget. Images report
+        /// what they hold whenever it changes; while the total is over the budget, images that
+        /// aren't visible, then visible ones that haven't been shown for a while (paused ones),
+        /// least recently shown first, are asked to drop their prerendered frames, and then to
+        /// drop everything but their compressed data. An image is asked to restore itself when it
+        /// becomes visible or is shown again. No budget (the default) governs nothing. All members
+        /// are thread-safe.
+        /// </summary>
+        class GifMemoryGovernor
+        {
+        public:
+            /// <summary>
+            /// Visible images shown within this long are taken to be playing, and are left alone.
+            /// In 100ns ticks.
+            /// </summary>
+            static const int64_t ActiveInterval = 10000000;
+
+            static GifMemoryGovernor &GetInstance();
+
+            GifMemoryGovernor();
+
+            /// <summary>
+            /// Sets the number of bytes every image together may hold, or 0 for no limit. Lowering
+            /// it asks images to shrink straight away.
+            /// </summary>
+            void SetBudget(size_t cbBudget);
+            size_t GetBudget() const;
+
+            void Register(GifMemoryClient *pClient);
+            void Unregister(GifMemoryClient *pClient);
+
+            /// <summary>
+            /// Records what an image holds now, at the level it has actually reached, and asks
+            /// images to shrink if that takes the total over the budget.
+            /// </summary>
+            void Report(GifMemoryClient *pClient, GifMemoryLevel level, const GifMemoryUsage &usage);
+
+            /// <summary>
+            /// Records whether an image is on screen. Images are visible until they say otherwise.
+            /// Becoming visible restores a shrunk image.
+            /// </summary>
+            void SetVisible(GifMemoryClient *pClient, bool visible);
+
+            /// <summary>
+            /// Records that an image has just presented a frame. A visible image that was shrunk
+            /// is asked to restore itself.
+            /// </summary>
+            void RecordShown(GifMemoryClient *pClient);
+
+            /// <summary>
+            /// Forgets any level an image was asked to move to, for when it loads a new image.
+            /// </summary>
+            void ResetLevel(GifMemoryClient *pClient);
+
+            /// <summary>
+            /// Records whether an image is loading, which may be on another thread than the one it
+            /// applies levels on. What it reports while loading counts towards the total, but it
+            /// isn't asked to shrink until the load is done.
+            /// </summary>
+            void SetLoading(GifMemoryClient *pClient, bool loading);
+
+            GifMemoryStatistics GetStatistics() const;
+
+        private:
+            struct Client
+            {
+                GifMemoryLevel target;      // level last asked for
+                GifMemoryLevel level;       // level last reported
+                GifMemoryUsage usage;
+                bool visible;
+                bool loading;
+                int64_t lastShown;
+            };
+
+            size_t GetExpectedBytes(const Client &client) const;
+            void Restore(GifMemoryClient *pClient, Client &client);
+            void Balance();
+
+            mutable std::mutex m_mutex;
+            std::unordered_map<GifMemoryClient *, Client> m_clients;
+
+            size_t m_budget;
+            uint64_t m_degradations;
+            uint64_t m_restorations;
+        };
+    }
+}
@@ -0,0 +1,411 @@
+﻿#include "GifPixelKernels.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define GIF_KERNELS_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(_M_ARM) || defined(_M_ARM64) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define GIF_KERNELS_NEON 1
+#include <arm_neon.h>
+#endif
+
+// MSVC allows any intrinsic anywhere; GCC and Clang only inside functions built for it
+#if defined(GIF_KERNELS_X86) && defined(__GNUC__)
+#define GIF_TARGET_SSE2 __attribute__((target("sse2")))
+#define GIF_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define GIF_TARGET_SSE2
+#define GIF_TARGET_AVX2
+#endif
+
+using namespace Em::Gif;
+
+namespace
+{
+    typedef void (*ExpandFunction)(const uint8_t *pSource, const uint32_t *pLut, uint32_t *pDest, size_t count);
+    typedef void (*BlendFunction)(const uint8_t *pSource, const uint32_t *pLut, uint8_t transparentIndex, uint32_t *pDest, size_t count);
+
+    // The reference every other version must match exactly
+    void ExpandScalar(const uint8_t *pSource, const uint32_t *pLut, uint32_t *pDest, size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            pDest[i] = pLut[pSource[i]];
+        }
+    }
+
+    void BlendScalar(const uint8_t *pSource, const uint32_t *pLut, uint8_t transparentIndex, uint32_t *pDest, size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            auto index = pSource[i];
+            if (index != transparentIndex)
+                pDest[i] = pLut[index];
+        }
+    }
+
+    // The vector versions work through 16 indices at a time. GIF pixels mostly come in runs, so
+    // a block that's all one index is filled with a single color, and in blending a block that's
+    // all transparent is skipped without touching the destination at all.
+
+#ifdef GIF_KERNELS_X86
+    GIF_TARGET_SSE2 inline bool IsRun(const uint8_t *pSource, __m128i indices)
+    {
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(indices, _mm_set1_epi8(static_cast<char>(pSource[0])))) == 0xFFFF;
+    }
+
+    GIF_TARGET_SSE2 inline __m128i LookUp4(const uint8_t *pSource, const uint32_t *pLut)
+    {
+        return _mm_setr_epi32(static_cast<int>(pLut[pSource[0]]), static_cast<int>(pLut[pSource[1]]),
+            static_cast<int>(pLut[pSource[2]]), static_cast<int>(pLut[pSource[3]]));
+    }
+
+    GIF_TARGET_SSE2 inline void ExpandBlockSse2(const uint8_t *pSource, __m128i indices, const uint32_t *pLut, uint32_t *pDest)
+    {
+        auto pBlock = reinterpret_cast<__m128i *>(pDest);
+        if (IsRun(pSource, indices))
+        {
+            auto color = _mm_set1_epi32(static_cast<int>(pLut[pSource[0]]));
+            _mm_storeu_si128(pBlock, color);
+            _mm_storeu_si128(pBlock + 1, color);
+            _mm_storeu_si128(pBlock + 2, color);
+            _mm_storeu_si128(pBlock + 3, color);
+            return;
+        }
+
+        for (auto j = 0; j < 4; j++)
+        {
+            _mm_storeu_si128(pBlock + j, LookUp4(pSource + j * 4, pLut));
+        }
+    }
+
+    GIF_TARGET_SSE2 void ExpandSse2(const uint8_t *pSource, const uint32_t *pLut, uint32_t *pDest, size_t count)
+    {
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            auto indices = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pSource + i));
+            ExpandBlockSse2(pSource + i, indices, pLut, pDest + i);
+        }
+
+        ExpandScalar(pSource + i, pLut, pDest + i, count - i);
+    }
+
+    GIF_TARGET_SSE2 void BlendSse2(const uint8_t *pSource, const uint32_t *pLut, uint8_t transparentIndex, uint32_t *pDest, size_t count)
+    {
+        auto transparent = _mm_set1_epi8(static_cast<char>(transparentIndex));
+        auto transparent32 = _mm_set1_epi32(transparentIndex);
+
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            auto indices = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pSource + i));
+            auto mask = _mm_movemask_epi8(_mm_cmpeq_epi8(indices, transparent));
+            if (mask == 0xFFFF)
+                continue;
+
+            if (mask == 0)
+            {
+                ExpandBlockSse2(pSource + i, indices, pLut, pDest + i);
+                continue;
+            }
+
+            // Keep the destination wherever the index is transparent
+            for (auto j = 0; j < 16; j += 4)
+            {
+                auto p = pSource + i + j;
+                auto pBlock = reinterpret_cast<__m128i *>(pDest + i + j);
+                auto keep = _mm_cmpeq_epi32(_mm_setr_epi32(p[0], p[1], p[2], p[3]), transparent32);
+                auto colors = LookUp4(p, pLut);
+                _mm_storeu_si128(pBlock, _mm_or_si128(_mm_and_si128(keep, _mm_loadu_si128(pBlock)), _mm_andnot_si128(keep, colors)));
+            }
+        }
+
+        BlendScalar(pSource + i, pLut, transparentIndex, pDest + i, count - i);
+    }
+
+    // AVX2 can gather from the table, eight pixels at a time
+    GIF_TARGET_AVX2 inline void ExpandBlockAvx2(const uint8_t *pSource, __m128i indices, const uint32_t *pLut, uint32_t *pDest)
+    {
+        auto pBlock = reinterpret_cast<__m256i *>(pDest);
+        if (IsRun(pSource, indices))
+        {
+            auto color = _mm256_set1_epi32(static_cast<int>(pLut[pSource[0]]));
+            _mm256_storeu_si256(pBlock, color);
+            _mm256_storeu_si256(pBlock + 1, color);
+            return;
+        }
+
+        auto pTable = reinterpret_cast<const int *>(pLut);
+        _mm256_storeu_si256(pBlock, _mm256_i32gather_epi32(pTable, _mm256_cvtepu8_epi32(indices), 4));
+        _mm256_storeu_si256(pBlock + 1, _mm256_i32gather_epi32(pTable, _mm256_cvtepu8_epi32(_mm_srli_si128(indices, 8)), 4));
+    }
+
+    GIF_TARGET_AVX2 void ExpandAvx2(const uint8_t *pSource, const uint32_t *pLut, uint32_t *pDest, size_t count)
+    {
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            auto indices = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pSource + i));
+            ExpandBlockAvx2(pSource + i, indices, pLut, pDest + i);
+        }
+
+        ExpandScalar(pSource + i, pLut, pDest + i, count - i);
+    }
+
+    GIF_TARGET_AVX2 void BlendAvx2(const uint8_t *pSource, const uint32_t *pLut, uint8_t transparentIndex, uint32_t *pDest, size_t count)
+    {
+        auto pTable = reinterpret_cast<const int *>(pLut);
+        auto transparent = _mm_set1_epi8(static_cast<char>(transparentIndex));
+        auto transparent32 = _mm256_set1_epi32(transparentIndex);
+
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            auto indices = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pSource + i));
+            auto mask = _mm_movemask_epi8(_mm_cmpeq_epi8(indices, transparent));
+            if (mask == 0xFFFF)
+                continue;
+
+            if (mask == 0)
+            {
+                ExpandBlockAvx2(pSource + i, indices, pLut, pDest + i);
+                continue;
+            }
+
+            auto pBlock = reinterpret_cast<__m256i *>(pDest + i);
+            for (auto j = 0; j < 2; j++, indices = _mm_srli_si128(indices, 8))
+            {
+                auto indices32 = _mm256_cvtepu8_epi32(indices);
+                auto colors = _mm256_i32gather_epi32(pTable, indices32, 4);
+                auto keep = _mm256_cmpeq_epi32(indices32, transparent32);
+                _mm256_storeu_si256(pBlock + j, _mm256_blendv_epi8(colors, _mm256_loadu_si256(pBlock + j), keep));
+            }
+        }
+
+        BlendScalar(pSource + i, pLut, transparentIndex, pDest + i, count - i);
+    }
+
+    bool HasSse2()
+    {
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 1);
+        return (info[3] & (1 << 26)) != 0;
+#else
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2") != 0;
+#endif
+    }
+
+    bool HasAvx2()
+    {
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7)
+            return false;
+
+        // The processor has to support AVX, and the OS has to save the upper halves of the
+        // registers on a context switch
+        __cpuid(info, 1);
+        const int OsXsave = 1 << 27;
+        const int Avx = 1 << 28;
+        if ((info[2] & (OsXsave | Avx)) != (OsXsave | Avx) || (_xgetbv(0) & 6) != 6)
+            return false;
+
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+#else
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") != 0;
+#endif
+    }
+#endif
+
+#ifdef GIF_KERNELS_NEON
+    // ARMv7 has no horizontal reductions, so fold the comparison in half and read it as one
+    // 64-bit lane
+    inline bool AllSet(uint8x16_t mask)
+    {
+        auto folded = vand_u8(vget_low_u8(mask), vget_high_u8(mask));
+        return vget_lane_u64(vreinterpret_u64_u8(folded), 0) == UINT64_MAX;
+    }
+
+    inline bool NoneSet(uint8x16_t mask)
+    {
+        auto folded = vorr_u8(vget_low_u8(mask), vget_high_u8(mask));
+        return vget_lane_u64(vreinterpret_u64_u8(folded), 0) == 0;
+    }
+
+    inline void ExpandBlockNeon(const uint8_t *pSource, uint8x16_t indices, const uint32_t *pLut, uint32_t *pDest)
+    {
+        if (AllSet(vceqq_u8(indices, vdupq_n_u8(pSource[0]))))
+        {
+            auto color = vdupq_n_u32(pLut[pSource[0]]);
+            vst1q_u32(pDest, color);
+            vst1q_u32(pDest + 4, color);
+            vst1q_u32(pDest + 8, color);
+            vst1q_u32(pDest + 12, color);
+            return;
+        }
+
+        ExpandScalar(pSource, pLut, pDest, 16);
+    }
+
+    void ExpandNeon(const uint8_t *pSource, const uint32_t *pLut, uint32_t *pDest, size_t count)
+    {
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            ExpandBlockNeon(pSource + i, vld1q_u8(pSource + i), pLut, pDest + i);
+        }
+
+        ExpandScalar(pSource + i, pLut, pDest + i, count - i);
+    }
+
+    void BlendNeon(const uint8_t *pSource, const uint32_t *pLut, uint8_t transparentIndex, uint32_t *pDest, size_t count)
+    {
+        auto transparent = vdupq_n_u8(transparentIndex);
+
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            auto indices = vld1q_u8(pSource + i);
+            auto mask = vceqq_u8(indices, transparent);
+            if (AllSet(mask))
+                continue;
+
+            if (NoneSet(mask))
+            {
+                ExpandBlockNeon(pSource + i, indices, pLut, pDest + i);
+                continue;
+            }
+
+            BlendScalar(pSource + i, pLut, transparentIndex, pDest + i, 16);
+        }
+
+        BlendScalar(pSource + i, pLut, transparentIndex, pDest + i, count - i);
+    }
+#endif
+
+    struct Kernels
+    {
+        GifSimdLevel level;
+        ExpandFunction expand;
+        BlendFunction blend;
+    };
+
+    bool IsSupported(GifSimdLevel level)
+    {
+        switch (level)
+        {
+        case GifSimdLevel::Scalar:
+            return true;
+#ifdef GIF_KERNELS_X86
+        case GifSimdLevel::Sse2:
+            return HasSse2();
+        case GifSimdLevel::Avx2:
+            return HasAvx2();
+#endif
+#ifdef GIF_KERNELS_NEON
+        case GifSimdLevel::Neon:
+            // Every ARM device Windows runs on has NEON
+            return true;
+#endif
+        default:
+            return false;
+        }
+    }
+
+    Kernels GetKernels(GifSimdLevel level)
+    {
+        Kernels kernels = { GifSimdLevel::Scalar, ExpandScalar, BlendScalar };
+        switch (level)
+        {
+#ifdef GIF_KERNELS_X86
+        case GifSimdLevel::Sse2:
+            kernels.level = level;
+            kernels.expand = ExpandSse2;
+            kernels.blend = BlendSse2;
+            break;
+        case GifSimdLevel::Avx2:
+            kernels.level = level;
+            kernels.expand = ExpandAvx2;
+            kernels.blend = BlendAvx2;
+            break;
+#endif
+#ifdef GIF_KERNELS_NEON
+        case GifSimdLevel::Neon:
+            kernels.level = level;
+            kernels.expand = ExpandNeon;
+            kernels.blend = BlendNeon;
+            break;
+#endif
+        default:
+            break;
+        }
+        return kernels;
+    }
+
+    GifSimdLevel GetBestSupportedLevel()
+    {
+        const GifSimdLevel preferred[] = { GifSimdLevel::Avx2, GifSimdLevel::Neon, GifSimdLevel::Sse2 };
+        for (auto level : preferred)
+        {
+            if (IsSupported(level))
+                return level;
+        }
+        return GifSimdLevel::Scalar;
+    }
+
+    // Chosen during module initialization, before anything can decode
+    Kernels s_kernels = GetKernels(GetBestSupportedLevel());
+}
+
+GifSimdLevel Em::Gif::GetSimdLevel()
+{
+    return s_kernels.level;
+}
+
+bool Em::Gif::SetSimdLevel(GifSimdLevel level)
+{
+    if (!IsSupported(level))
+        return false;
+
+    s_kernels = GetKernels(level);
+    return true;
+}
+
+bool Em::Gif::IsSimdLevelSupported(GifSimdLevel level)
+{
+    return IsSupported(level);
+}
+
+const char *Em::Gif::GetSimdLevelName(GifSimdLevel level)
+{
+    switch (level)
+    {
+    case GifSimdLevel::Sse2:
+        return "sse2";
+    case GifSimdLevel::Avx2:
+        return "avx2";
+    case GifSimdLevel::Neon:
+        return "neon";
+    default:
+        return "scalar";
+    }
+}
+
+void Em::Gif::ExpandIndices(const uint8_t *pSource, const uint32_t *pLut, uint32_t *pDest, size_t count)
+{
+    s_kernels.expand(pSource, pLut, pDest, count);
+}
+
+void Em::Gif::BlendIndices(const uint8_t *pSource, const uint32_t *pLut, uint8_t transparentIndex, uint32_t *pDest, size_t count)
+{
+    s_kernels.blend(pSource, pLut, transparentIndex, pDest, count);
+}
@@ -0,0 +1,54 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// The innermost loops of decoding and composition: turning palette indices into BGRA. Each one
+// has a plain C++ version and vector versions for the instruction sets we ship on, picked at
+// run time. All of them produce exactly the same pixels; they're lookups and selects, with no
+// arithmetic to round differently.
+
+namespace Em {
+    namespace Gif
+    {
+        /// <summary>
+        /// Instruction sets the pixel kernels can be built for.
+        /// </summary>
+        enum class GifSimdLevel : uint8_t
+        {
+            Scalar = 0,
+            Sse2 = 1,
+            Avx2 = 2,
+            Neon = 3
+        };
+
+        /// <summary>
+        /// Gets the instruction set the kernels use. Starts as the best one the processor
+        /// supports, worked out when the module loads.
+        /// </summary>
+        GifSimdLevel GetSimdLevel();
+
+        /// <summary>
+        /// Switches the kernels to another instruction set, to compare them against each other.
+        /// Must not be called while anything is decoding or composing.
+        /// </summary>
+        /// <returns>
+        /// False, leaving the kernels alone, if the processor doesn't support the instruction set.
+        /// </returns>
+        bool SetSimdLevel(GifSimdLevel level);
+
+        bool IsSimdLevelSupported(GifSimdLevel level);
+        const char *GetSimdLevelName(GifSimdLevel level);
+
+        /// <summary>
+        /// Looks every index up in a 256-entry table of premultiplied BGRA colors.
+        /// </summary>
+        void ExpandIndices(const uint8_t *pSource, const uint32_t *pLut, uint32_t *pDest, size_t count);
+
+        /// <summary>
+        /// Looks every index up like ExpandIndices, but leaves the destination pixel alone wherever
+        /// the index is the transparent one, so what's underneath shows through.
+        /// </summary>
+        void BlendIndices(const uint8_t *pSource, const uint32_t *pLut, uint8_t transparentIndex, uint32_t *pDest, size_t count);
+    }
+}
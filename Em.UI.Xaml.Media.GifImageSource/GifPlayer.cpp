@@ -0,0 +1,1241 @@
+﻿#include "GifPlayer.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "GifDiskCache.h"
+#include "GifFrameCache.h"
+#include "GifMemoryGovernor.h"
+#include "GifScratchPool.h"
+#include "GifWorkerPool.h"
+
+using namespace Em::Gif;
+
+namespace
+{
+    const uint32_t NoFrame = UINT32_MAX;
+
+    // Shorter delays than this are taken as DefaultDelay; in hundredths of a second
+    const uint16_t MinimumDelay = 3;
+    const uint16_t DefaultDelay = 10;
+
+    bool IsEmpty(const GifRect &rect)
+    {
+        return rect.width == 0 || rect.height == 0;
+    }
+
+    GifRect UnionRect(const GifRect &a, const GifRect &b)
+    {
+        if (IsEmpty(a))
+            return b;
+        if (IsEmpty(b))
+            return a;
+
+        auto left = std::min(a.left, b.left);
+        auto top = std::min(a.top, b.top);
+        auto right = std::max(a.left + a.width, b.left + b.width);
+        auto bottom = std::max(a.top + a.height, b.top + b.height);
+        GifRect rect = { left, top, right - left, bottom - top };
+        return rect;
+    }
+
+    // The part of the rectangle within a width x height canvas, possibly empty
+    GifRect ClipRect(const GifRect &rect, uint32_t width, uint32_t height)
+    {
+        GifRect clipped = {};
+        if (rect.left < width && rect.top < height)
+        {
+            clipped.left = rect.left;
+            clipped.top = rect.top;
+            clipped.width = std::min(rect.width, width - rect.left);
+            clipped.height = std::min(rect.height, height - rect.top);
+        }
+        return clipped;
+    }
+
+    // The part of the canvas drawing a frame can change: the frame's own rectangle, and whatever
+    // the frame before it disposes of. Works on raw frames and index entries alike.
+    template <typename TFrame>
+    GifRect GetChangedRect(const TFrame &frame, const TFrame *pPrevious)
+    {
+        GifRect rect = { frame.left, frame.top, frame.width, frame.height };
+        if (pPrevious != nullptr &&
+            (pPrevious->disposal == GifDisposal::RestoreBackground || pPrevious->disposal == GifDisposal::RestorePrevious))
+        {
+            GifRect disposed = { pPrevious->left, pPrevious->top, pPrevious->width, pPrevious->height };
+            rect = UnionRect(rect, disposed);
+        }
+        return rect;
+    }
+}
+
+GifPlayer::GifPlayer(GifRenderBackend *pBackend, uint32_t width, uint32_t height)
+    : m_pBackend(pBackend),
+    m_pStatistics(nullptr),
+    m_width(width),
+    m_height(height),
+    m_isAnimated(false),
+    m_loopCount(0),
+    m_nextPrerender(false),
+    m_prerender(false),
+    m_completedPrerender(false),
+    m_prerenderMemoryLimit(0),
+    m_storage(GifFrameStorage::Bgra),
+    m_maxDecodeWidth(0),
+    m_maxDecodeHeight(0),
+    m_composedFrame(NoFrame),
+    m_currentFrame(0),
+    m_shownFrame(NoFrame),
+    m_position(0),
+    m_presentedFrame(NoFrame),
+    m_reachedLastFrame(false),
+    m_memoryLevel(GifMemoryLevel::Full),
+    m_requestedLevel(static_cast<uint8_t>(GifMemoryLevel::Full))
+{
+    m_pBackend->SetSize(width, height);
+    GifMemoryGovernor::GetInstance().Register(this);
+}
+
+GifPlayer::~GifPlayer()
+{
+    if (m_pipeline)
+    {
+        m_pipeline->Cancel();
+    }
+    if (m_rebuild)
+    {
+        m_rebuild->Cancel();
+    }
+    GifMemoryGovernor::GetInstance().Unregister(this);
+}
+
+void GifPlayer::ResetImage()
+{
+    m_pBackend->ReleaseFrames();
+
+    m_frameSet = nullptr;
+    m_delays.clear();
+    m_frameEnds.clear();
+    m_dirtyRects.clear();
+    m_compositor.reset();
+    m_checkpoints.reset();
+    m_composedFrame = NoFrame;
+    m_buffer.Clear();
+    m_window.reset();
+    std::vector<uint8_t>().swap(m_data);
+    m_index = GifFrameIndex();
+    m_decoder.reset();
+    GifScratchPool::GetInstance().Release(m_decodedFrame.pixels);
+    m_progressive = nullptr;
+
+    // The pipeline owns everything it works on, so there's no need to wait for it to stop
+    if (m_pipeline)
+    {
+        m_pipeline->Cancel();
+        m_pipeline = nullptr;
+    }
+    if (m_rebuild)
+    {
+        m_rebuild->Cancel();
+        m_rebuild = nullptr;
+    }
+    m_frameSlots.clear();
+
+    m_memoryLevel = GifMemoryLevel::Full;
+    m_requestedLevel = static_cast<uint8_t>(GifMemoryLevel::Full);
+    GifMemoryGovernor::GetInstance().ResetLevel(this);
+
+    m_isAnimated = false;
+    m_loopCount = 0;
+    m_prerender = m_nextPrerender;
+    m_completedPrerender = false;
+    m_currentFrame = 0;
+    m_shownFrame = NoFrame;
+    m_position = 0;
+    m_presentedFrame = NoFrame;
+    m_reachedLastFrame = false;
+
+    UpdateResidentBytes();
+}
+
+void GifPlayer::AddFrameDelay(uint16_t delay)
+{
+    m_delays.push_back(delay);
+
+    auto duration = 100000LL * (delay < MinimumDelay ? DefaultDelay : delay);
+    m_frameEnds.push_back(GetLoopDuration() + duration);
+}
+
+void GifPlayer::UpdateResidentBytes()
+{
+    auto cbResident = GetResidentBytes();
+    if (m_pStatistics)
+    {
+        m_pStatistics->SetResidentBytes(cbResident);
+    }
+
+    // Without the compressed data there's nothing to fall back on, so nothing to gain by shrinking
+    GifMemoryUsage usage = { cbResident, cbResident, cbResident };
+    if (!m_data.empty() && !m_progressive)
+    {
+        size_t cbFrame = static_cast<size_t>(m_width) * m_height * sizeof(uint32_t);
+        auto cCheckpoints = std::min<size_t>(GifCompositorCheckpoints::MaxCheckpoints, GetFrameCount() / GifCompositorCheckpoints::DefaultInterval);
+
+        // Composing on demand takes the canvas, its checkpoints and a frame's palette indices
+        usage.compressedBytes = std::min(cbResident, m_data.capacity());
+        usage.composeOnDemandBytes = std::min(cbResident, m_data.capacity() + cbFrame * (1 + cCheckpoints) + cbFrame / sizeof(uint32_t));
+    }
+    GifMemoryGovernor::GetInstance().Report(this, m_memoryLevel, usage);
+}
+
+size_t GifPlayer::GetResidentBytes() const
+{
+    size_t cbFrame = static_cast<size_t>(m_width) * m_height * sizeof(uint32_t);
+
+    size_t cbResident = m_data.capacity() + m_decodedFrame.pixels.capacity() + m_buffer.pixels.capacity() * sizeof(uint32_t);
+    if (m_pipeline)
+    {
+        // The set is still being written, and the pipeline holds the data
+        cbResident += m_pipeline->GetResidentBytes();
+    }
+    else if (m_frameSet)
+    {
+        cbResident += m_frameSet->GetByteSize();
+    }
+    if (m_rebuild)
+    {
+        cbResident += m_rebuild->GetResidentBytes();
+    }
+    if (m_compositor)
+    {
+        cbResident += m_compositor->GetResidentBytes() + m_checkpoints->GetResidentBytes();
+    }
+    if (m_window)
+    {
+        cbResident += m_window->GetResidentBytes();
+    }
+    else
+    {
+        cbResident += cbFrame * GetSlotCount();
+    }
+    return cbResident;
+}
+
+void GifPlayer::Clear()
+{
+    ResetImage();
+    m_pBackend->ReleaseSpareFrames();
+
+    m_width = 0;
+    m_height = 0;
+    m_nextPrerender = false;
+    m_prerender = false;
+    m_prerenderMemoryLimit = 0;
+    m_storage = GifFrameStorage::Bgra;
+    m_maxDecodeWidth = 0;
+    m_maxDecodeHeight = 0;
+}
+
+void GifPlayer::Load(std::vector<uint8_t> data, const GifCancellation *pCancellation)
+{
+    auto startTime = GifStatistics::Now();
+    auto index = GifFrameIndex::Build(data.data(), data.size(), m_maxDecodeWidth, m_maxDecodeHeight);
+    LoadIndexed(std::move(data), std::move(index), startTime, pCancellation);
+}
+
+void GifPlayer::Load(std::vector<uint8_t> data, GifFrameIndex index, const GifCancellation *pCancellation)
+{
+    LoadIndexed(std::move(data), std::move(index), GifStatistics::Now(), pCancellation);
+}
+
+void GifPlayer::LoadIndexed(std::vector<uint8_t> data, GifFrameIndex index, int64_t startTime, const GifCancellation *pCancellation)
+{
+    // Loads usually run on another thread than playback, where ApplyMemoryLevel would race with
+    // them, so the governor leaves the image alone until the load is done
+    auto &governor = GifMemoryGovernor::GetInstance();
+    governor.SetLoading(this, true);
+    ResetImage();
+
+    // A load that fails or is cancelled part way leaves nothing of itself behind
+    try
+    {
+        LoadFrames(std::move(data), std::move(index), startTime, pCancellation);
+    }
+    catch (...)
+    {
+        ResetImage();
+        governor.SetLoading(this, false);
+        throw;
+    }
+    governor.SetLoading(this, false);
+}
+
+void GifPlayer::LoadFrames(std::vector<uint8_t> data, GifFrameIndex index, int64_t startTime, const GifCancellation *pCancellation)
+{
+    if (pCancellation != nullptr)
+        pCancellation->ThrowIfCancelled();
+
+    if (index.frames.empty())
+        throw GifFormatException("no frames");
+
+    if (index.width != 0 && index.height != 0)
+    {
+        m_width = index.width;
+        m_height = index.height;
+    }
+
+    for (auto &entry : index.frames)
+    {
+        AddFrameDelay(entry.delay);
+    }
+
+    // Worked out now, while the index is at hand; it's not kept once frames are decoded
+    m_dirtyRects.reserve(index.frames.size());
+    for (size_t i = 0; i < index.frames.size(); i++)
+    {
+        m_dirtyRects.push_back(GetChangedRect(index.frames[i], i > 0 ? &index.frames[i - 1] : nullptr));
+    }
+
+    m_isAnimated = index.info.isAnimated;
+    m_loopCount = index.info.loopCount;
+
+    m_data = std::move(data);
+    m_index = std::move(index);
+    auto decodeTime = PrepareFrames(pCancellation, true);
+
+    if (m_pipeline)
+    {
+        // Playback starts with the frames composed so far. Update picks up the rest as they're
+        // done, and stores them in the backend, which only the player's own thread may do.
+        auto frameCount = m_pipeline->GetComposedFrameCount();
+        m_delays.clear();
+        m_frameEnds.clear();
+        for (uint32_t i = 0; i < frameCount; i++)
+        {
+            AddFrameDelay(m_frameSet->delays[i]);
+        }
+    }
+
+    // The data is only kept when frames are decoded from it as they're shown, unless the memory
+    // governor may need to fall back on it. Frames prerendered into the backend are rebuilt from
+    // it if the backend loses them.
+    auto storesFrames = m_prerender && m_storage == GifFrameStorage::Bgra;
+    if (m_frameSet && !storesFrames && GifMemoryGovernor::GetInstance().GetBudget() == 0)
+    {
+        std::vector<uint8_t>().swap(m_data);
+        m_index = GifFrameIndex();
+    }
+
+    m_pBackend->SetSize(m_width, m_height);
+
+    // The previous image's frames are kept for this one to be stored into, unless it never will be
+    if (!m_prerender || m_completedPrerender || m_storage != GifFrameStorage::Bgra)
+        m_pBackend->ReleaseSpareFrames();
+
+    if (m_pStatistics)
+    {
+        m_pStatistics->RecordLoad(GifStatistics::Now() - startTime, decodeTime);
+    }
+    UpdateResidentBytes();
+}
+
+// Sets up whatever playback takes frames from: a rolling window, a decoded (and maybe composed)
+// frame set, or a decoder over the data. A composed set that has to be decoded is streamed if
+// asked to, in which case this returns once its first frame is composed. Returns the time spent
+// decoding.
+int64_t GifPlayer::PrepareFrames(const GifCancellation *pCancellation, bool stream)
+{
+    int64_t decodeTime = 0;
+
+    if (IsOverPrerenderLimit())
+    {
+        auto decodeStartTime = GifStatistics::Now();
+
+        // Keep as many composed frames as the budget allows, but never fewer than the frame on
+        // screen and the one after it. Frames are decoded from the compressed data as the window
+        // moves, so that's all we hold on to.
+        uint64_t cbFrame = static_cast<uint64_t>(m_width) * m_height * sizeof(uint32_t);
+        auto capacity = static_cast<uint32_t>(std::max<uint64_t>(2, m_prerenderMemoryLimit / cbFrame));
+
+        m_window.reset(new GifFrameWindow(m_data.data(), m_data.size(), m_width, m_height, GetFrameCount(), capacity, m_maxDecodeWidth, m_maxDecodeHeight));
+        m_window->Fill();
+        decodeTime = GifStatistics::Now() - decodeStartTime;
+
+        m_completedPrerender = true;
+    }
+
+    if (!m_window)
+    {
+        // Another player may already have decoded (and composed) these exact bytes
+        auto &cache = GifFrameCache::GetInstance();
+        auto key = GifFrameCache::ComputeKey(m_data.data(), m_data.size(), m_index.width, m_index.height, m_prerender, m_storage);
+
+        bool mustDecode = false;
+        if (m_prerender)
+        {
+            // If another player is decoding them right now, this waits for its frames
+            m_frameSet = cache.FindOrBeginDecode(key, mustDecode, pCancellation);
+        }
+        else
+        {
+            m_frameSet = cache.Find(key);
+        }
+
+        if (mustDecode)
+        {
+            // Whatever happens, players waiting on this decode must hear how it went
+            struct EndDecodeOnExit
+            {
+                const GifCacheKey *pKey;
+                std::shared_ptr<const GifFrameSet> frameSet;
+                ~EndDecodeOnExit()
+                {
+                    if (pKey != nullptr)
+                        GifFrameCache::GetInstance().EndDecode(*pKey, frameSet);
+                }
+            } endDecode = { &key, nullptr };
+
+            // Failing that, an earlier run of the app may have left the composed frames on disk
+            auto &diskCache = GifDiskCache::GetInstance();
+            std::shared_ptr<const GifFrameSet> pFrameSet = diskCache.Find(key);
+            if (!pFrameSet && stream)
+            {
+                // The pipeline ends the decode once every frame is composed, and writes the set
+                // out as below
+                auto finished = [key](const std::shared_ptr<const GifFrameSet> &pFinishedSet)
+                {
+                    GifFrameCache::GetInstance().EndDecode(key, pFinishedSet);
+                    if (pFinishedSet && !GifDiskCache::GetInstance().GetDirectory().empty())
+                    {
+                        GifDiskCache::GetInstance().Add(key, *pFinishedSet);
+                    }
+                };
+
+                auto decodeStartTime = GifStatistics::Now();
+                m_pipeline = GifFramePipeline::Start(std::move(m_data), m_maxDecodeWidth, m_maxDecodeHeight, m_storage, finished);
+                endDecode.pKey = nullptr;
+
+                m_pipeline->WaitForFrames(1, pCancellation);
+                m_frameSet = m_pipeline->GetFrameSet();
+                return GifStatistics::Now() - decodeStartTime;
+            }
+
+            if (!pFrameSet)
+            {
+                // Composing here (off the UI thread) leaves PrerenderFrames with nothing to do but store
+                auto decodeStartTime = GifStatistics::Now();
+                GifDecoder decoder(m_data.data(), m_data.size());
+                decoder.SetMaxDecodeSize(m_maxDecodeWidth, m_maxDecodeHeight);
+                pFrameSet = GifFrameSet::Decode(decoder, true, m_storage, &GifWorkerPool::GetInstance(), pCancellation);
+                decodeTime = GifStatistics::Now() - decodeStartTime;
+
+                // Writing the set out can take as long as decoding it, so it's left to a worker
+                if (!diskCache.GetDirectory().empty())
+                {
+                    GifWorkerPool::GetInstance().Submit([key, pFrameSet]
+                    {
+                        GifDiskCache::GetInstance().Add(key, *pFrameSet);
+                    });
+                }
+            }
+
+            endDecode.frameSet = pFrameSet;
+            m_frameSet = pFrameSet;
+        }
+
+        if (!m_frameSet)
+        {
+            // Nothing to decode up front; GetRawFrame decodes each frame as it's composed
+            m_decoder.reset(new GifDecoder(m_data.data(), m_data.size()));
+            m_decoder->SetMaxDecodeSize(m_maxDecodeWidth, m_maxDecodeHeight);
+        }
+    }
+
+    return decodeTime;
+}
+
+// Whether prerendering every frame would go over the memory limit, in which case playback takes
+// frames from a rolling window instead
+bool GifPlayer::IsOverPrerenderLimit() const
+{
+    if (!m_prerender || m_prerenderMemoryLimit == 0)
+        return false;
+
+    // A delta can't be bigger than the frame's own area plus whatever the previous frame disposed
+    // of, so that bounds delta storage without composing anything
+    uint64_t cDeltaPixels = 0;
+    uint64_t cPreviousDisposed = 0;
+    for (auto &entry : m_index.frames)
+    {
+        uint64_t cFramePixels = static_cast<uint64_t>(entry.width) * entry.height;
+        cDeltaPixels += cFramePixels + cPreviousDisposed;
+        cPreviousDisposed = entry.disposal == GifDisposal::RestoreBackground || entry.disposal == GifDisposal::RestorePrevious ? cFramePixels : 0;
+    }
+
+    // The window always holds BGRA, but indexed storage only takes a byte per pixel
+    uint64_t cbFrame = static_cast<uint64_t>(m_width) * m_height * sizeof(uint32_t);
+    uint64_t cbStored = cbFrame * m_delays.size();
+    if (m_storage == GifFrameStorage::Indexed)
+    {
+        cbStored /= sizeof(uint32_t);
+    }
+    else if (m_storage == GifFrameStorage::Delta)
+    {
+        auto cKeyframes = (m_delays.size() + GifFrameSet::DeltaKeyframeInterval - 1) / GifFrameSet::DeltaKeyframeInterval;
+        cbStored = std::min(cbStored, cbFrame * cKeyframes + cDeltaPixels * sizeof(uint32_t));
+    }
+    return cbStored > m_prerenderMemoryLimit;
+}
+
+void GifPlayer::SetVisible(bool visible)
+{
+    GifMemoryGovernor::GetInstance().SetVisible(this, visible);
+}
+
+void GifPlayer::RequestMemoryLevel(GifMemoryLevel level)
+{
+    m_requestedLevel = static_cast<uint8_t>(level);
+    if (m_memoryRequestHandler)
+    {
+        m_memoryRequestHandler();
+    }
+}
+
+void GifPlayer::ApplyMemoryLevel()
+{
+    auto level = static_cast<GifMemoryLevel>(m_requestedLevel.load());
+
+    // Frames being composed again are given up on if the governor changes its mind
+    if (m_rebuild && level != GifMemoryLevel::Full)
+    {
+        m_rebuild->Cancel();
+        m_rebuild = nullptr;
+    }
+
+    // Shrinking falls back on the compressed data, which images that never kept it don't have
+    if (level == m_memoryLevel || m_delays.empty() || IsStreaming() || m_data.empty())
+        return;
+
+    if (level == GifMemoryLevel::Full)
+    {
+        if (m_rebuild)
+            return;
+
+        // Composing every frame again takes as long as it did to load, so unless another player
+        // still has them cached, they're composed in the background like a load's. Until Update
+        // picks them up, playback stays at the level it's at.
+        std::shared_ptr<const GifFrameSet> pFrameSet;
+        if (m_prerender && !IsOverPrerenderLimit())
+        {
+            auto key = GifFrameCache::ComputeKey(m_data.data(), m_data.size(), m_index.width, m_index.height, true, m_storage);
+            pFrameSet = GifFrameCache::GetInstance().Find(key);
+            if (!pFrameSet)
+            {
+                auto finished = [key](const std::shared_ptr<const GifFrameSet> &pFinishedSet)
+                {
+                    if (pFinishedSet)
+                    {
+                        GifFrameCache::GetInstance().Add(key, pFinishedSet);
+                    }
+                };
+
+                // The copy stays with the pipeline, as playback still composes from the data
+                m_rebuild = GifFramePipeline::Start(m_data, m_maxDecodeWidth, m_maxDecodeHeight, m_storage, finished);
+                UpdateResidentBytes();
+                return;
+            }
+        }
+        RestoreFullLevel(pFrameSet);
+    }
+    else
+    {
+        m_pBackend->ReleaseFrames();
+        m_pBackend->ReleaseSpareFrames();
+        m_frameSlots.clear();
+        m_completedPrerender = false;
+        m_frameSet = nullptr;
+        m_window.reset();
+        m_buffer.Clear();
+
+        if (level == GifMemoryLevel::Compressed)
+        {
+            m_compositor.reset();
+            m_checkpoints.reset();
+            m_composedFrame = NoFrame;
+            GifScratchPool::GetInstance().Release(m_decodedFrame.pixels);
+        }
+
+        if (!m_decoder)
+        {
+            m_decoder.reset(new GifDecoder(m_data.data(), m_data.size()));
+            m_decoder->SetMaxDecodeSize(m_maxDecodeWidth, m_maxDecodeHeight);
+        }
+        m_memoryLevel = level;
+    }
+
+    UpdateResidentBytes();
+}
+
+// Goes back to the full level from a lower one, with the composed frames if they're at hand, or
+// whatever PrepareFrames sets up otherwise
+void GifPlayer::RestoreFullLevel(std::shared_ptr<const GifFrameSet> pFrameSet)
+{
+    // Prerendering happens again when the next frame is presented, and needs no canvas
+    m_decoder.reset();
+    GifScratchPool::GetInstance().Release(m_decodedFrame.pixels);
+    if (m_prerender)
+    {
+        m_compositor.reset();
+        m_checkpoints.reset();
+        m_composedFrame = NoFrame;
+    }
+    m_memoryLevel = GifMemoryLevel::Full;
+
+    m_frameSet = std::move(pFrameSet);
+    if (!m_frameSet)
+    {
+        PrepareFrames(nullptr, false);
+    }
+}
+
+void GifPlayer::LoadProgressive(std::shared_ptr<GifProgressiveSource> pSource)
+{
+    ResetImage();
+    m_pBackend->ReleaseSpareFrames();
+
+    pSource->SetMaxDecodeSize(m_maxDecodeWidth, m_maxDecodeHeight);
+    m_progressive = pSource;
+}
+
+bool GifPlayer::Update()
+{
+    if (m_rebuild)
+    {
+        UpdateRebuild();
+        return false;
+    }
+
+    if (m_pipeline)
+        return UpdatePipeline();
+
+    if (!m_progressive)
+        return false;
+
+    // Check for the end first; no frames are added after it
+    auto finished = m_progressive->IsFinished();
+
+    if (m_delays.empty() && m_progressive->HasInfo())
+    {
+        auto info = m_progressive->GetInfo();
+        if (info.width != 0 && info.height != 0 && (info.width != m_width || info.height != m_height))
+        {
+            m_width = info.width;
+            m_height = info.height;
+            m_pBackend->SetSize(m_width, m_height);
+        }
+    }
+
+    auto frameCount = m_progressive->GetFrameCount();
+    for (auto i = GetFrameCount(); i < frameCount; i++)
+    {
+        auto &frame = m_progressive->GetFrame(i);
+        AddFrameDelay(frame.delay);
+        m_dirtyRects.push_back(GetChangedRect(frame, i > 0 ? &m_progressive->GetFrame(i - 1) : nullptr));
+    }
+
+    if (!finished)
+    {
+        if (!m_delays.empty())
+        {
+            // The looping extension comes before the first frame, so it's known by now
+            auto info = m_progressive->GetInfo();
+            m_isAnimated = info.isAnimated;
+            m_loopCount = info.loopCount;
+        }
+        return false;
+    }
+
+    // Everything has arrived. From here on this is an ordinary raw frame set, shared through the
+    // cache like any other. The frames are the same ones the compositor has been drawing, so
+    // playback carries on where it is.
+    std::shared_ptr<const GifFrameSet> pFrameSet = m_progressive->TakeFrameSet();
+
+    auto &data = m_progressive->GetData();
+    auto key = GifFrameCache::ComputeKey(data.data(), data.size(), pFrameSet->width, pFrameSet->height, false);
+    GifFrameCache::GetInstance().Add(key, pFrameSet);
+    m_frameSet = pFrameSet;
+    m_progressive = nullptr;
+
+    m_isAnimated = m_frameSet->isAnimated;
+    m_loopCount = m_frameSet->loopCount;
+    if (m_frameSet->width != m_width || m_frameSet->height != m_height)
+    {
+        m_width = m_frameSet->width;
+        m_height = m_frameSet->height;
+        m_pBackend->SetSize(m_width, m_height);
+        m_compositor.reset();
+        m_checkpoints.reset();
+    }
+    UpdateResidentBytes();
+
+    if (m_delays.empty() || m_currentFrame < GetFrameCount())
+        return false;
+
+    m_currentFrame = 0;
+    return true;
+}
+
+// The upload stage of a load whose frames are being composed in the background: new frames become
+// playable, and are stored in the backend if that's where they're presented from
+bool GifPlayer::UpdatePipeline()
+{
+    // Check for the end first; no frames are composed after it
+    auto finished = m_pipeline->IsFinished();
+
+    auto frameCount = m_pipeline->GetComposedFrameCount();
+    if (frameCount == GetFrameCount() && !finished)
+        return false;
+
+    for (auto i = GetFrameCount(); i < frameCount; i++)
+    {
+        AddFrameDelay(m_frameSet->delays[i]);
+    }
+
+    // Composed BGRA frames are back to back, so each batch goes to the backend in as few copies
+    // as its repeated frames allow. How many of the rest repeat isn't known yet, so room is
+    // reserved for all of them; ReleaseSpareFrames gives back what isn't used.
+    auto storedFrames = static_cast<uint32_t>(m_frameSlots.size());
+    if (m_storage == GifFrameStorage::Bgra && frameCount > storedFrames)
+    {
+        auto startTime = GifStatistics::Now();
+        if (storedFrames == 0)
+        {
+            m_pBackend->ReserveFrames(m_frameSet->GetFrameCount());
+        }
+        auto pPixels = m_frameSet->GetComposedFrame(storedFrames, m_buffer);
+        StoreFrames(pPixels, frameCount - storedFrames, storedFrames > 0 ? pPixels - static_cast<size_t>(m_width) * m_height : nullptr);
+
+        if (m_pStatistics)
+        {
+            m_pStatistics->RecordPrerender(GifStatistics::Now() - startTime);
+        }
+    }
+
+    if (!finished)
+    {
+        UpdateResidentBytes();
+        return false;
+    }
+
+    // Every frame is composed, or as many as could be if the pipeline failed part way; playback
+    // keeps those, as it would the frames of a truncated file. From here on this is an ordinary
+    // composed frame set, shared through the cache like any other.
+    if (!m_pipeline->HasFailed() && (m_storage == GifFrameStorage::Bgra || GifMemoryGovernor::GetInstance().GetBudget() != 0))
+    {
+        m_data = m_pipeline->TakeData();
+    }
+    else
+    {
+        m_index = GifFrameIndex();
+    }
+    m_pipeline = nullptr;
+
+    if (m_storage == GifFrameStorage::Bgra)
+    {
+        // As after PrerenderFrames, every displayable frame is in the backend now and the set
+        // stays in the cache (if it fit) for the next player. A set that failed part way can't be
+        // rebuilt from the data, so it's kept in case the backend loses its frames.
+        m_pBackend->ReleaseSpareFrames();
+        m_completedPrerender = true;
+        if (!m_data.empty())
+        {
+            m_frameSet = nullptr;
+        }
+    }
+    UpdateResidentBytes();
+
+    if (m_currentFrame < GetFrameCount())
+        return false;
+
+    m_currentFrame = 0;
+    return true;
+}
+
+// Goes back to the full level once the frames being composed again are all done. If they can't
+// be, the image stays at the level it's at, and the governor's request is dropped rather than
+// failing the same way at every tick.
+void GifPlayer::UpdateRebuild()
+{
+    if (!m_rebuild->IsFinished())
+        return;
+
+    auto pFrameSet = m_rebuild->HasFailed() ? nullptr : m_rebuild->GetFrameSet();
+    m_rebuild = nullptr;
+    if (pFrameSet)
+    {
+        RestoreFullLevel(pFrameSet);
+    }
+    else
+    {
+        // Unless the governor has asked for something else since
+        auto requested = static_cast<uint8_t>(GifMemoryLevel::Full);
+        m_requestedLevel.compare_exchange_strong(requested, static_cast<uint8_t>(m_memoryLevel));
+    }
+    UpdateResidentBytes();
+}
+
+bool GifPlayer::RenderFrame()
+{
+    ApplyMemoryLevel();
+    Update();
+
+    if (m_delays.empty() || IsWaitingForData())
+        return false;
+
+    PresentFrame(m_currentFrame);
+
+    // Returns true if we just completed a loop
+    return m_currentFrame == 0;
+}
+
+bool GifPlayer::Advance(int64_t elapsed)
+{
+    // While playback holds at the end of the frames that have arrived the clock stops, so frames
+    // that arrive late still get their full delay
+    if (IsStreaming() && m_position >= GetLoopDuration())
+    {
+        elapsed = 0;
+    }
+
+    ApplyMemoryLevel();
+    Update();
+
+    if (m_delays.empty())
+        return false;
+
+    auto lastFrame = GetFrameCount() - 1;
+    auto loopDuration = GetLoopDuration();
+    auto position = m_position + std::max<int64_t>(elapsed, 0);
+
+    int64_t loops = 0;
+    if (position >= loopDuration)
+    {
+        if (m_isAnimated && !IsStreaming())
+        {
+            loops = position / loopDuration;
+            position %= loopDuration;
+        }
+        else
+        {
+            position = loopDuration;
+        }
+    }
+    m_position = position;
+
+    // A loop is complete once its last frame has been shown or skipped over
+    auto completedLoop = false;
+    if (loops != 0)
+    {
+        completedLoop = loops > 1 || !m_reachedLastFrame;
+        m_reachedLastFrame = false;
+    }
+
+    auto frameIndex = GetFrameAt(position);
+    if (frameIndex != m_shownFrame)
+    {
+        PresentFrame(frameIndex);
+    }
+
+    if (frameIndex == lastFrame && !IsStreaming() && !m_reachedLastFrame)
+    {
+        m_reachedLastFrame = true;
+        completedLoop = true;
+    }
+
+    return completedLoop;
+}
+
+int64_t GifPlayer::GetTimeToNextFrame() const
+{
+    if (m_position >= GetLoopDuration())
+        return 0;
+
+    // Nothing new is shown until the end of a run of repeated frames, so there's no need to wake
+    // up any sooner
+    auto frameIndex = GetFrameAt(m_position);
+    auto lastFrame = frameIndex;
+    while (lastFrame + 1 < m_frameSlots.size() && m_frameSlots[lastFrame + 1] == m_frameSlots[frameIndex])
+    {
+        lastFrame++;
+    }
+
+    return m_frameEnds[lastFrame] - m_position;
+}
+
+// The part of the target that presenting a frame changes: whatever changes between the frame the
+// target holds and this one, going forwards or backwards. Everything, if there's no telling.
+GifRect GifPlayer::GetUpdateRect(uint32_t frameIndex) const
+{
+    GifRect full = { 0, 0, m_width, m_height };
+    if (m_presentedFrame == NoFrame || m_presentedFrame == frameIndex)
+        return full;
+
+    auto first = std::min(frameIndex, m_presentedFrame) + 1;
+    auto last = std::max(frameIndex, m_presentedFrame);
+    if (last >= m_dirtyRects.size())
+        return full;
+
+    auto rect = m_dirtyRects[first];
+    for (auto i = first + 1; i <= last; i++)
+    {
+        rect = UnionRect(rect, m_dirtyRects[i]);
+    }
+
+    // Frames may hang off the canvas. If nothing changes, the backend still has to be given
+    // something to draw.
+    rect = ClipRect(rect, m_width, m_height);
+    return IsEmpty(rect) ? full : rect;
+}
+
+// Presents a frame and moves the current frame on past it
+bool GifPlayer::PresentFrame(uint32_t frameIndex)
+{
+    // Indexed frames stay in the frame set and are expanded as they're presented. Frames of a
+    // progressive load are composed as they're shown until they've all arrived, and so are those
+    // of an image the memory governor has shrunk. Frames composed in the background are stored
+    // by Update as they arrive.
+    if (m_prerender && !m_completedPrerender && m_storage == GifFrameStorage::Bgra && !IsStreaming() && m_memoryLevel == GifMemoryLevel::Full && m_frameSet)
+    {
+        auto startTime = GifStatistics::Now();
+        PrerenderFrames();
+        m_completedPrerender = true;
+
+        if (m_pStatistics)
+        {
+            m_pStatistics->RecordPrerender(GifStatistics::Now() - startTime);
+        }
+        UpdateResidentBytes();
+    }
+
+    // A stored frame that repeats the one the target holds is already on screen
+    auto isRepeat = m_presentedFrame != NoFrame && frameIndex < m_frameSlots.size() && m_presentedFrame < m_frameSlots.size() &&
+        m_frameSlots[frameIndex] == m_frameSlots[m_presentedFrame];
+
+    if (!isRepeat && !m_pBackend->BeginDraw(GetUpdateRect(frameIndex)))
+    {
+        if (m_pBackend->CheckFramesLost())
+        {
+            RestoreLostFrames();
+        }
+
+        if (m_pStatistics)
+        {
+            m_pStatistics->RecordSkippedTick();
+        }
+        return false;
+    }
+
+    // Unless the frame has been prerendered, it's composed on the CPU (or taken from the rolling
+    // window) and handed to the backend as pixels
+    if (!isRepeat)
+    {
+        if (m_window)
+        {
+            m_pBackend->DrawPixels(m_window->GetFrame(frameIndex));
+        }
+        else if (frameIndex < m_frameSlots.size())
+        {
+            m_pBackend->DrawStoredFrame(m_frameSlots[frameIndex]);
+        }
+        else
+        {
+            m_pBackend->DrawPixels(ComposeFrame(frameIndex));
+        }
+    }
+
+    m_shownFrame = frameIndex;
+    m_presentedFrame = frameIndex;
+    if (m_position < GetFrameStart(frameIndex) || m_position >= m_frameEnds[frameIndex])
+    {
+        m_position = GetFrameStart(frameIndex);
+    }
+
+    // While frames are still arriving, stay past the last one rather than going back to the
+    // first; Update decides once the data is complete
+    m_currentFrame = frameIndex + 1;
+    if (m_currentFrame == GetFrameCount() && !IsStreaming())
+    {
+        m_currentFrame = 0;
+    }
+
+    if (!isRepeat)
+    {
+        m_pBackend->EndDraw();
+
+        if (m_pStatistics)
+        {
+            m_pStatistics->RecordPresent();
+        }
+    }
+
+    if (m_window)
+    {
+        // Top the window back up now that the playhead has moved past a frame
+        m_window->Fill();
+    }
+    GifMemoryGovernor::GetInstance().RecordShown(this);
+    return true;
+}
+
+// Gets ready to store frames again after the backend lost them, along with whatever it was showing.
+// The pipeline stores its frames again from the first as Update picks them up; prerendered frames
+// are stored again by the next present, from the frame set if it's still around or else from the
+// data.
+void GifPlayer::RestoreLostFrames()
+{
+    m_frameSlots.clear();
+    m_presentedFrame = NoFrame;
+    m_shownFrame = NoFrame;
+
+    if (m_pipeline || m_window || !m_completedPrerender)
+        return;
+
+    m_completedPrerender = false;
+    if (!m_frameSet)
+    {
+        PrepareFrames(nullptr, false);
+    }
+    UpdateResidentBytes();
+}
+
+void GifPlayer::Restart()
+{
+    m_currentFrame = 0;
+    m_shownFrame = NoFrame;
+    m_position = 0;
+    m_reachedLastFrame = false;
+}
+
+void GifPlayer::SeekToFrame(uint32_t frameIndex)
+{
+    if (frameIndex >= GetFrameCount())
+        throw std::out_of_range("frameIndex");
+
+    Restart();
+    m_currentFrame = frameIndex;
+    m_position = GetFrameStart(frameIndex);
+}
+
+void GifPlayer::Seek(int64_t time)
+{
+    auto loopDuration = GetLoopDuration();
+    if (loopDuration == 0)
+        return;
+
+    time = std::max<int64_t>(time, 0);
+    if (time >= loopDuration)
+    {
+        time = IsStreaming() ? GetFrameStart(GetFrameCount() - 1) : time % loopDuration;
+    }
+
+    SeekToFrame(GetFrameAt(time));
+    m_position = time;
+}
+
+int64_t GifPlayer::GetFrameStart(uint32_t frameIndex) const
+{
+    return frameIndex == 0 ? 0 : m_frameEnds.at(frameIndex - 1);
+}
+
+int64_t GifPlayer::GetFrameDuration(uint32_t frameIndex) const
+{
+    return m_frameEnds.at(frameIndex) - GetFrameStart(frameIndex);
+}
+
+uint32_t GifPlayer::GetFrameAt(int64_t time) const
+{
+    auto it = std::upper_bound(m_frameEnds.begin(), m_frameEnds.end(), time);
+    if (it == m_frameEnds.end())
+        return GetFrameCount() - 1;
+
+    return static_cast<uint32_t>(it - m_frameEnds.begin());
+}
+
+// Brings the persistent canvas up to the given frame. During playback this draws exactly one
+// frame per call; going back, or jumping far ahead, starts again from the nearest checkpoint.
+const uint32_t *GifPlayer::ComposeFrame(uint32_t frameIndex)
+{
+    // A composed frame set already holds every displayable frame
+    if (m_frameSet && m_frameSet->IsComposed())
+    {
+        auto cbBuffer = m_buffer.pixels.capacity();
+        auto pPixels = m_frameSet->GetComposedFrame(frameIndex, m_buffer);
+        if (m_buffer.pixels.capacity() != cbBuffer)
+        {
+            UpdateResidentBytes();
+        }
+        return pPixels;
+    }
+
+    if (!m_compositor)
+    {
+        m_compositor.reset(new GifCompositor(m_width, m_height));
+        m_checkpoints.reset(new GifCompositorCheckpoints(GetFrameCount()));
+        m_composedFrame = NoFrame;
+        UpdateResidentBytes();
+    }
+
+    if (m_composedFrame != frameIndex)
+    {
+        uint32_t start = m_composedFrame + 1;
+        auto checkpoint = m_checkpoints->Find(frameIndex);
+        if (m_composedFrame == NoFrame || frameIndex < start || checkpoint > start)
+        {
+            if (checkpoint == 0)
+            {
+                m_compositor->Reset();
+            }
+            else
+            {
+                m_checkpoints->Restore(checkpoint, *m_compositor);
+            }
+            start = checkpoint;
+        }
+
+        auto cbCheckpoints = m_checkpoints->GetResidentBytes();
+        for (uint32_t i = start; i <= frameIndex; i++)
+        {
+            m_checkpoints->Save(i, *m_compositor);
+            m_compositor->DrawFrame(GetRawFrame(i));
+        }
+
+        m_composedFrame = frameIndex;
+        if (m_checkpoints->GetResidentBytes() != cbCheckpoints)
+        {
+            UpdateResidentBytes();
+        }
+    }
+
+    return m_compositor->GetPixels();
+}
+
+const GifFrame &GifPlayer::GetRawFrame(uint32_t frameIndex)
+{
+    if (m_progressive)
+        return m_progressive->GetFrame(frameIndex);
+
+    if (m_frameSet)
+        return m_frameSet->frames.at(frameIndex);
+
+    // The index says where every frame starts, so frames decode in any order
+    m_decoder->Seek(m_index.frames.at(frameIndex).offset);
+    if (!m_decoder->ReadFrame(m_decodedFrame))
+        throw GifFormatException("frame count changed");
+
+    return m_decodedFrame;
+}
+
+// Convert raw frames into final displayable frames
+// This conversion is necessary because a raw frame is usually rendered by drawing it on top of
+// the previous frame. Each displayable frame is therefore the composition of the current frame
+// and all the frames that were drawn before it, subject to their disposal methods.
+void GifPlayer::PrerenderFrames()
+{
+    // Room for every frame; ReleaseSpareFrames gives back what repeated frames leave unused
+    m_frameSlots.clear();
+    m_pBackend->ReserveFrames(GetFrameCount());
+
+    // Frame sets loaded with prerendering enabled were composed during Load. BGRA frames are kept
+    // back to back, so they go to the backend in as few copies as repeated frames allow.
+    if (m_frameSet->IsComposed() && m_frameSet->storage == GifFrameStorage::Bgra)
+    {
+        StoreFrames(m_frameSet->GetComposedFrame(0, m_buffer), GetFrameCount(), nullptr);
+    }
+    else
+    {
+        // Each frame is composed over the last, so that one's kept aside to compare against
+        std::vector<uint32_t> previous;
+        GifCompositor compositor(m_width, m_height);
+        for (uint32_t i = 0; i < GetFrameCount(); i++)
+        {
+            const uint32_t *pPixels;
+            if (m_frameSet->IsComposed())
+            {
+                pPixels = m_frameSet->GetComposedFrame(i, m_buffer);
+            }
+            else
+            {
+                compositor.DrawFrame(m_frameSet->frames.at(i));
+                pPixels = compositor.GetPixels();
+            }
+
+            StoreFrames(pPixels, 1, previous.empty() ? nullptr : previous.data());
+            previous.assign(pPixels, pPixels + static_cast<size_t>(m_width) * m_height);
+        }
+    }
+
+    // Every displayable frame is in the backend now. The frame set stays in the shared cache (if
+    // it fit) for the next player showing the same GIF.
+    m_pBackend->ReleaseSpareFrames();
+    m_frameSet = nullptr;
+    m_compositor.reset();
+    m_checkpoints.reset();
+}
+
+// Stores the next frames in the backend. They're composed, back to back in memory, and pPrevious
+// is the frame before the first, or null if there is none. A frame that repeats the one before it
+// takes that frame's slot instead of being stored again; each run of frames between repeats goes
+// to the backend in one copy.
+void GifPlayer::StoreFrames(const uint32_t *pPixels, uint32_t frameCount, const uint32_t *pPrevious)
+{
+    auto cPixels = static_cast<size_t>(m_width) * m_height;
+    auto firstFrame = static_cast<uint32_t>(m_frameSlots.size());
+
+    uint32_t runStart = 0;
+    for (uint32_t i = 0; i <= frameCount; i++)
+    {
+        auto isRepeat = false;
+        if (i < frameCount)
+        {
+            auto pBefore = i > 0 ? pPixels + (i - 1) * cPixels : pPrevious;
+            isRepeat = pBefore != nullptr && IsRepeatFrame(firstFrame + i, pBefore, pPixels + i * cPixels);
+            if (!isRepeat)
+                continue;
+        }
+
+        if (i > runStart)
+        {
+            auto slot = GetSlotCount();
+            m_pBackend->StoreFrames(slot, i - runStart, pPixels + runStart * cPixels);
+            for (auto j = runStart; j < i; j++)
+            {
+                m_frameSlots.push_back(slot + (j - runStart));
+            }
+        }
+
+        if (isRepeat)
+        {
+            m_frameSlots.push_back(m_frameSlots.back());
+        }
+        runStart = i + 1;
+    }
+}
+
+// Whether a composed frame is identical to the one before it. The two can only differ within the
+// frame's dirty rectangle, so that's all that's compared, and the first difference ends it.
+bool GifPlayer::IsRepeatFrame(uint32_t frameIndex, const uint32_t *pPrevious, const uint32_t *pPixels) const
+{
+    GifRect rect = { 0, 0, m_width, m_height };
+    if (frameIndex < m_dirtyRects.size())
+    {
+        rect = ClipRect(m_dirtyRects[frameIndex], m_width, m_height);
+    }
+
+    for (uint32_t y = rect.top; y < rect.top + rect.height; y++)
+    {
+        auto offset = static_cast<size_t>(y) * m_width + rect.left;
+        if (std::memcmp(pPrevious + offset, pPixels + offset, rect.width * sizeof(uint32_t)) != 0)
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,371 @@
+﻿#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "GifCancellation.h"
+#include "GifCompositor.h"
+#include "GifFrameIndex.h"
+#include "GifFramePipeline.h"
+#include "GifFrameSet.h"
+#include "GifFrameWindow.h"
+#include "GifMemoryGovernor.h"
+#include "GifProgressiveSource.h"
+#include "GifRenderBackend.h"
+#include "GifStatistics.h"
+
+namespace Em {
+    namespace Gif
+    {
+        /// <summary>
+        /// Loads a GIF, composes its frames and steps through the animation, presenting through a
+        /// render backend. Knows nothing about timers or the platform; whoever owns the player
+        /// decides when to call RenderFrame or Advance.
+        /// </summary>
+        /// <remarks>
+        /// Times are in 100ns ticks. Frames last their delay, except that delays under 30ms are
+        /// taken as 100ms, as browsers do.
+        /// </remarks>
+        class GifPlayer : public GifMemoryClient
+        {
+        public:
+            /// <param name="pBackend">Backend to present through. Not owned; must outlive the player.</param>
+            /// <param name="width">Initial width, used if the GIF doesn't specify one.</param>
+            /// <param name="height">Initial height, used if the GIF doesn't specify one.</param>
+            GifPlayer(GifRenderBackend *pBackend, uint32_t width, uint32_t height);
+            ~GifPlayer();
+
+            /// <summary>
+            /// Loads a GIF, replacing whatever was loaded before. Throws GifFormatException if the
+            /// data can't be decoded.
+            /// </summary>
+            /// <remarks>
+            /// Only prerendering decodes pixels here. Otherwise each frame is decoded from the data
+            /// as it's composed for display. Players prerendering the same GIF at once share one
+            /// decode through GifFrameCache. A prerendering load that has to decode returns as soon
+            /// as the first frame is composed; the rest are composed in the background and become
+            /// playable as they're done, as in a progressive load.
+            /// </remarks>
+            /// <param name="pCancellation">
+            /// Lets another thread stop the load, which then throws GifCancelledException and leaves
+            /// the player empty. May be null.
+            /// </param>
+            void Load(std::vector<uint8_t> data, const GifCancellation *pCancellation = nullptr);
+
+            /// <summary>
+            /// Loads a GIF whose frame index has already been built, with the same maximum decode
+            /// size, saving a pass over the data.
+            /// </summary>
+            void Load(std::vector<uint8_t> data, GifFrameIndex index, const GifCancellation *pCancellation = nullptr);
+
+            /// <summary>
+            /// Starts playing a GIF that is still arriving, replacing whatever was loaded before.
+            /// Frames become playable as the source decodes them; once the source is finished the
+            /// player carries on as if the whole GIF had been given to Load, except that frames are
+            /// composed as they're shown rather than prerendered. The source must not have been given
+            /// any data yet.
+            /// </summary>
+            void LoadProgressive(std::shared_ptr<GifProgressiveSource> pSource);
+
+            /// <summary>
+            /// Picks up frames decoded or composed since the last call, storing composed frames in the
+            /// backend. Only does anything while frames are still arriving, or are being composed
+            /// again for ApplyMemoryLevel; RenderFrame and Advance call this themselves.
+            /// </summary>
+            /// <returns>
+            /// True if the last frame just arrived while playback was waiting past the one before,
+            /// completing a loop without another frame being rendered.
+            /// </returns>
+            bool Update();
+
+            /// <summary>
+            /// Whether frames are still arriving, from a progressive load or from a load composing
+            /// them in the background.
+            /// </summary>
+            bool IsStreaming() const { return m_progressive || m_pipeline; }
+
+            /// <summary>
+            /// Whether playback has caught up with the frames that have arrived and the next one
+            /// hasn't yet.
+            /// </summary>
+            bool IsWaitingForData() const { return IsStreaming() && m_currentFrame >= GetFrameCount(); }
+
+            /// <summary>
+            /// Releases the image and every resource held for it, and resets all settings.
+            /// </summary>
+            void Clear();
+
+            /// <summary>
+            /// Presents the current frame and advances to the next one.
+            /// </summary>
+            /// <returns>
+            /// True if an animation loop was just completed, false otherwise.
+            /// </returns>
+            bool RenderFrame();
+
+            /// <summary>
+            /// Moves the animation on by the given time and presents the frame due then. Frames
+            /// whose time passed in between are skipped rather than drawn late, and nothing is drawn
+            /// if the frame on screen is still due. Images that don't loop stop on their last frame;
+            /// while frames are still arriving playback holds on the last one that has, and the
+            /// clock stops until the next one does.
+            /// </summary>
+            /// <returns>
+            /// True if an animation loop was completed, false otherwise.
+            /// </returns>
+            bool Advance(int64_t elapsed);
+
+            /// <summary>
+            /// Gets the time until the frame on screen is due to be replaced by a different picture,
+            /// or 0 if playback is holding at the end of the frames there are. Stored frames that
+            /// repeat the one on screen don't count as replacing it.
+            /// </summary>
+            int64_t GetTimeToNextFrame() const;
+
+            /// <summary>
+            /// Resets the animation to the first frame.
+            /// </summary>
+            void Restart();
+
+            /// <summary>
+            /// Moves playback to the start of a frame, which the next RenderFrame or Advance presents.
+            /// Costs at most the composition of a few frames: composed frames are stored, delta
+            /// frames are rebuilt from their keyframe, and otherwise composition resumes from the
+            /// canvas or the nearest checkpoint. Throws std::out_of_range for a frame that doesn't
+            /// exist (yet).
+            /// </summary>
+            void SeekToFrame(uint32_t frameIndex);
+
+            /// <summary>
+            /// Moves playback to a time within the animation, as SeekToFrame. Times past the end
+            /// wrap around to the start, or stop at the last frame that has arrived while frames are
+            /// still arriving.
+            /// </summary>
+            void Seek(int64_t time);
+
+            /// <summary>
+            /// Gets the playback position within the current loop.
+            /// </summary>
+            int64_t GetPosition() const { return m_position; }
+
+            /// <summary>
+            /// Gets the length of one loop of the animation, counting only frames that have arrived.
+            /// </summary>
+            int64_t GetLoopDuration() const { return m_frameEnds.empty() ? 0 : m_frameEnds.back(); }
+
+            /// <summary>
+            /// Gets how long a frame is shown for.
+            /// </summary>
+            int64_t GetFrameDuration(uint32_t frameIndex) const;
+
+            /// <summary>
+            /// Gets the time a frame starts at, from the start of the loop.
+            /// </summary>
+            int64_t GetFrameStart(uint32_t frameIndex) const;
+
+            /// <summary>
+            /// Gets the frame shown at a time within the first loop.
+            /// </summary>
+            uint32_t GetFrameAt(int64_t time) const;
+
+            /// <summary>
+            /// Whether to pre-compose every frame up front rather than composing as frames are shown.
+            /// Takes effect on the next Load; the image playing now keeps the frames it was loaded
+            /// with.
+            /// </summary>
+            bool GetPrerender() const { return m_nextPrerender; }
+            void SetPrerender(bool prerender) { m_nextPrerender = prerender; }
+
+            /// <summary>
+            /// Maximum number of bytes to spend on prerendered frames, or 0 for no limit. Over the
+            /// limit, only a rolling window of upcoming frames is kept. Takes effect on the next Load.
+            /// </summary>
+            size_t GetPrerenderMemoryLimit() const { return m_prerenderMemoryLimit; }
+            void SetPrerenderMemoryLimit(size_t cbLimit) { m_prerenderMemoryLimit = cbLimit; }
+
+            /// <summary>
+            /// How prerendered frames are kept. With Indexed or Delta storage they stay in the frame
+            /// set and are expanded or rebuilt as they're presented, instead of being stored in the
+            /// backend as BGRA. Takes effect on the next Load.
+            /// </summary>
+            GifFrameStorage GetFrameStorage() const { return m_storage; }
+            void SetFrameStorage(GifFrameStorage storage) { m_storage = storage; }
+
+            /// <summary>
+            /// Size to decode images down to, as GifDecoder::SetMaxDecodeSize; 0 for no limit.
+            /// Frames are then decoded, composed, stored and presented at the smaller size. Takes
+            /// effect on the next Load or LoadProgressive.
+            /// </summary>
+            uint32_t GetMaxDecodeWidth() const { return m_maxDecodeWidth; }
+            uint32_t GetMaxDecodeHeight() const { return m_maxDecodeHeight; }
+            void SetMaxDecodeSize(uint32_t maxWidth, uint32_t maxHeight) { m_maxDecodeWidth = maxWidth; m_maxDecodeHeight = maxHeight; }
+
+            /// <summary>
+            /// Tells the memory governor whether the image is on screen. Images off screen are the
+            /// first to be shrunk when the process is over its budget, and are restored once they're
+            /// back on screen.
+            /// </summary>
+            void SetVisible(bool visible);
+
+            /// <summary>
+            /// Notes a level asked for by the memory governor, and calls the request handler so the
+            /// owner can have ApplyMemoryLevel called on the player's thread. Safe on any thread.
+            /// </summary>
+            virtual void RequestMemoryLevel(GifMemoryLevel level);
+
+            /// <summary>
+            /// Moves to the memory level the governor last asked for: dropping prerendered frames
+            /// and composing from the compressed data as frames are shown, dropping the canvas as
+            /// well, or decoding and prerendering again. Frames to prerender are composed again in
+            /// the background, and the image stays at the lower level until Update picks them up.
+            /// RenderFrame and Advance call this first, so only images that aren't being played
+            /// need it called for them. Players only keep the compressed data to fall back on while
+            /// the governor has a budget, so images loaded without one stay as they are.
+            /// </summary>
+            void ApplyMemoryLevel();
+
+            GifMemoryLevel GetMemoryLevel() const { return m_memoryLevel; }
+
+            /// <summary>
+            /// Sets what to call, on any thread, when the governor asks for a new memory level. May
+            /// be empty, in which case the level is applied at the next RenderFrame or Advance.
+            /// </summary>
+            void SetMemoryRequestHandler(std::function<void()> handler) { m_memoryRequestHandler = handler; }
+
+            /// <summary>
+            /// Where to record load times, presented frames and resident memory, or null to record
+            /// nothing. Not owned; must outlive the player.
+            /// </summary>
+            void SetStatistics(GifStatistics *pStatistics) { m_pStatistics = pStatistics; }
+
+            /// <summary>
+            /// Gets the number of bytes held for the current image: the data, decoded and composed
+            /// frames (including a frame set shared through the cache) and frames stored in the backend.
+            /// </summary>
+            size_t GetResidentBytes() const;
+
+            uint32_t GetWidth() const { return m_width; }
+            uint32_t GetHeight() const { return m_height; }
+            uint32_t GetFrameCount() const { return static_cast<uint32_t>(m_delays.size()); }
+            uint32_t GetCurrentFrame() const { return m_currentFrame; }
+            bool IsAnimated() const { return m_isAnimated; }
+            uint16_t GetLoopCount() const { return m_loopCount; }
+
+            /// <summary>
+            /// Gets a frame's delay, in hundredths of a second, exactly as stored in the file.
+            /// </summary>
+            uint16_t GetFrameDelay(uint32_t frameIndex) const { return m_delays.at(frameIndex); }
+
+        private:
+            void LoadIndexed(std::vector<uint8_t> data, GifFrameIndex index, int64_t startTime, const GifCancellation *pCancellation);
+            void LoadFrames(std::vector<uint8_t> data, GifFrameIndex index, int64_t startTime, const GifCancellation *pCancellation);
+            int64_t PrepareFrames(const GifCancellation *pCancellation, bool stream);
+            bool IsOverPrerenderLimit() const;
+            void RestoreFullLevel(std::shared_ptr<const GifFrameSet> pFrameSet);
+            bool UpdatePipeline();
+            void UpdateRebuild();
+            void ResetImage();
+            void UpdateResidentBytes();
+            void AddFrameDelay(uint16_t delay);
+            GifRect GetUpdateRect(uint32_t frameIndex) const;
+            bool PresentFrame(uint32_t frameIndex);
+            void RestoreLostFrames();
+            void PrerenderFrames();
+            void StoreFrames(const uint32_t *pPixels, uint32_t frameCount, const uint32_t *pPrevious);
+            bool IsRepeatFrame(uint32_t frameIndex, const uint32_t *pPrevious, const uint32_t *pPixels) const;
+            uint32_t GetSlotCount() const { return m_frameSlots.empty() ? 0 : m_frameSlots.back() + 1; }
+            const GifFrame &GetRawFrame(uint32_t frameIndex);
+            const uint32_t *ComposeFrame(uint32_t frameIndex);
+
+            GifRenderBackend *m_pBackend;
+            GifStatistics *m_pStatistics;
+
+            uint32_t m_width;
+            uint32_t m_height;
+            bool m_isAnimated;
+            uint16_t m_loopCount;
+
+            // As set, and as the current image was loaded with
+            bool m_nextPrerender;
+            bool m_prerender;
+            bool m_completedPrerender;
+            size_t m_prerenderMemoryLimit;
+            GifFrameStorage m_storage;
+            uint32_t m_maxDecodeWidth;
+            uint32_t m_maxDecodeHeight;
+
+            // Decoded frames, possibly shared with other players through the frame cache.
+            // Released once every frame has been prerendered.
+            std::shared_ptr<const GifFrameSet> m_frameSet;
+            std::vector<uint16_t> m_delays;
+
+            // Time each frame ends at, from the start of the loop
+            std::vector<int64_t> m_frameEnds;
+
+            // The part of the canvas each frame can change from the one before it, worked out from
+            // the frame metadata. Not clipped to the canvas; the first frame's is never used.
+            std::vector<GifRect> m_dirtyRects;
+
+            // Persistent canvas for playback without prerendering
+            std::unique_ptr<GifCompositor> m_compositor;
+            std::unique_ptr<GifCompositorCheckpoints> m_checkpoints;
+            uint32_t m_composedFrame;
+
+            // Indexed and delta frames are expanded or rebuilt into here to be presented
+            GifFrameBuffer m_buffer;
+
+            // The GIF data, kept by the rolling window and by lazy decoding, and to fall back on
+            // while the memory governor has a budget
+            std::vector<uint8_t> m_data;
+
+            // Rolling window state, used when prerendering everything is over budget
+            std::unique_ptr<GifFrameWindow> m_window;
+
+            // Lazy decoding state, used when frames are composed as they're shown and no decoded
+            // frame set was available. Frames are decoded from m_data one at a time.
+            GifFrameIndex m_index;
+            std::unique_ptr<GifDecoder> m_decoder;
+            GifFrame m_decodedFrame;
+
+            // Source of a GIF that is still arriving; null once it has all arrived
+            std::shared_ptr<GifProgressiveSource> m_progressive;
+
+            // Composing frames in the background; null once they've all been composed. Until then,
+            // composed BGRA frames are stored in the backend as they arrive.
+            std::shared_ptr<GifFramePipeline> m_pipeline;
+
+            // Composing the frames again in the background, after the memory governor let an image
+            // it had shrunk back up; null otherwise
+            std::shared_ptr<GifFramePipeline> m_rebuild;
+
+            // The backend slot each stored frame is in, for as many frames as are stored. A frame
+            // identical to the one before it shares that frame's slot rather than being stored
+            // again, so slots go up by one at each frame that changes something.
+            std::vector<uint32_t> m_frameSlots;
+
+            // Frame RenderFrame presents next
+            uint32_t m_currentFrame;
+
+            // Frame on screen, and where playback is within the loop
+            uint32_t m_shownFrame;
+            int64_t m_position;
+
+            // Frame the backend's target holds. Unlike m_shownFrame, only reset with the image, or
+            // when the backend loses its contents.
+            uint32_t m_presentedFrame;
+
+            // Whether Advance has reported reaching the last frame of the current loop
+            bool m_reachedLastFrame;
+
+            // The level this image is held at, and the one the governor last asked for (which it
+            // may do from any thread)
+            GifMemoryLevel m_memoryLevel;
+            std::atomic<uint8_t> m_requestedLevel;
+            std::function<void()> m_memoryRequestHandler;
+        };
+    }
+}
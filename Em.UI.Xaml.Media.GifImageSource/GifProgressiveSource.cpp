@@ -0,0 +1,151 @@
+﻿#include "GifProgressiveSource.h"
+
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+
+using namespace Em::Gif;
+
+GifProgressiveSource::GifProgressiveSource()
+    : m_finished(false),
+    m_maxDecodeWidth(0),
+    m_maxDecodeHeight(0)
+{
+}
+
+void GifProgressiveSource::SetMaxDecodeSize(uint32_t maxWidth, uint32_t maxHeight)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_decoder)
+        throw std::logic_error("decode size set after the header arrived");
+
+    m_maxDecodeWidth = maxWidth;
+    m_maxDecodeHeight = maxHeight;
+}
+
+// Called with the lock held
+void GifProgressiveSource::CreateDecoder()
+{
+    m_decoder.reset(new GifDecoder(m_data.data(), m_data.size()));
+    m_decoder->SetMaxDecodeSize(m_maxDecodeWidth, m_maxDecodeHeight);
+}
+
+void GifProgressiveSource::Reserve(size_t cbTotal)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_data.reserve(cbTotal);
+    if (m_decoder)
+    {
+        m_decoder->SetData(m_data.data(), m_data.size());
+    }
+}
+
+void GifProgressiveSource::Append(const uint8_t *pData, size_t cbData)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_finished)
+        throw GifFormatException("data appended after the end");
+
+    m_data.insert(m_data.end(), pData, pData + cbData);
+
+    if (m_decoder)
+    {
+        m_decoder->SetData(m_data.data(), m_data.size());
+    }
+    else if (GifDecoder::HasCompleteHeader(m_data.data(), m_data.size()))
+    {
+        CreateDecoder();
+    }
+    else if (m_data.size() >= 3 && std::memcmp(m_data.data(), "GIF", 3) != 0)
+    {
+        // Fail as soon as it's clear this isn't a GIF, rather than after the whole download
+        throw GifFormatException("not a GIF");
+    }
+
+    DecodeCompleteFrames();
+}
+
+void GifProgressiveSource::Finish()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_finished)
+        return;
+
+    if (!m_decoder)
+    {
+        // Let the decoder report what's wrong with whatever we got
+        CreateDecoder();
+    }
+
+    m_finished = true;
+
+    // The decoder is lenient with truncated data, so just read whatever is left
+    GifFrame frame;
+    while (m_decoder->ReadFrame(frame))
+    {
+        m_frames.push_back(std::move(frame));
+    }
+}
+
+void GifProgressiveSource::DecodeCompleteFrames()
+{
+    if (!m_decoder)
+        return;
+
+    GifFrame frame;
+    while (m_decoder->HasCompleteFrame() && m_decoder->ReadFrame(frame))
+    {
+        m_frames.push_back(std::move(frame));
+    }
+}
+
+bool GifProgressiveSource::IsFinished() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_finished;
+}
+
+bool GifProgressiveSource::HasInfo() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_decoder != nullptr;
+}
+
+GifImageInfo GifProgressiveSource::GetInfo() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (!m_decoder)
+        return GifImageInfo();
+
+    return m_decoder->GetInfo();
+}
+
+uint32_t GifProgressiveSource::GetFrameCount() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return static_cast<uint32_t>(m_frames.size());
+}
+
+const GifFrame &GifProgressiveSource::GetFrame(uint32_t frameIndex) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_frames.at(frameIndex);
+}
+
+std::shared_ptr<GifFrameSet> GifProgressiveSource::TakeFrameSet()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (!m_finished)
+        throw std::logic_error("data is still arriving");
+
+    std::vector<GifFrame> frames(std::make_move_iterator(m_frames.begin()), std::make_move_iterator(m_frames.end()));
+    m_frames.clear();
+
+    return GifFrameSet::Create(m_decoder->GetInfo(), std::move(frames), false);
+}
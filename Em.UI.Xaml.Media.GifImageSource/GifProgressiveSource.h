@@ -0,0 +1,102 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "GifFrameSet.h"
+
+namespace Em {
+    namespace Gif
+    {
+        /// <summary>
+        /// Decodes a GIF while its data is still arriving. Each frame is decoded as soon as its last
+        /// byte has been appended, so playback can begin with the first frame long before the
+        /// download finishes.
+        /// Data is appended from one thread while frames are read from another; all members are
+        /// thread-safe.
+        /// </summary>
+        class GifProgressiveSource
+        {
+        public:
+            GifProgressiveSource();
+
+            /// <summary>
+            /// Reserves room for the whole GIF, if its size is known up front, so the buffer doesn't
+            /// have to grow as data arrives.
+            /// </summary>
+            void Reserve(size_t cbTotal);
+
+            /// <summary>
+            /// Decodes frames downscaled to fit within the given size, as GifDecoder::SetMaxDecodeSize.
+            /// Call before appending any data.
+            /// </summary>
+            void SetMaxDecodeSize(uint32_t maxWidth, uint32_t maxHeight);
+
+            /// <summary>
+            /// Appends the next chunk of data and decodes every frame it completes. Throws
+            /// GifFormatException if the data turns out not to be a GIF.
+            /// </summary>
+            void Append(const uint8_t *pData, size_t cbData);
+
+            /// <summary>
+            /// Marks the end of the data. Whatever is left of a truncated last frame is decoded as
+            /// far as it goes.
+            /// </summary>
+            void Finish();
+
+            bool IsFinished() const;
+
+            /// <summary>
+            /// Whether the header has arrived, so GetInfo is meaningful.
+            /// </summary>
+            bool HasInfo() const;
+
+            /// <summary>
+            /// Gets the image-wide properties seen so far. Loop information may only show up with
+            /// the first frame.
+            /// </summary>
+            GifImageInfo GetInfo() const;
+
+            /// <summary>
+            /// Gets the number of frames decoded so far.
+            /// </summary>
+            uint32_t GetFrameCount() const;
+
+            /// <summary>
+            /// Gets a decoded frame. The reference stays valid until TakeFrameSet is called.
+            /// </summary>
+            const GifFrame &GetFrame(uint32_t frameIndex) const;
+
+            /// <summary>
+            /// Once finished, moves every frame into a raw frame set. The source is empty afterwards.
+            /// </summary>
+            std::shared_ptr<GifFrameSet> TakeFrameSet();
+
+            /// <summary>
+            /// Gets all of the data appended. Only safe to call once finished.
+            /// </summary>
+            const std::vector<uint8_t> &GetData() const { return m_data; }
+
+        private:
+            void CreateDecoder();
+            void DecodeCompleteFrames();
+
+            mutable std::mutex m_mutex;
+
+            std::vector<uint8_t> m_data;
+            std::unique_ptr<GifDecoder> m_decoder;
+            bool m_finished;
+
+            uint32_t m_maxDecodeWidth;
+            uint32_t m_maxDecodeHeight;
+
+            // Frames never move once decoded, so references handed out by GetFrame stay valid
+            // while more frames are appended
+            std::deque<GifFrame> m_frames;
+        };
+    }
+}
@@ -0,0 +1,100 @@
+﻿#pragma once
+
+#include <cstdint>
+
+namespace Em {
+    namespace Gif
+    {
+        /// <summary>
+        /// A rectangle of the target, in pixels.
+        /// </summary>
+        struct GifRect
+        {
+            uint32_t left;
+            uint32_t top;
+            uint32_t width;
+            uint32_t height;
+        };
+
+        /// <summary>
+        /// Where composed frames end up. The player composes frames on the CPU; a backend keeps
+        /// prerendered frames resident and presents frames to its target.
+        /// All pixels are premultiplied BGRA, width * height, with no row padding.
+        /// </summary>
+        class GifRenderBackend
+        {
+        public:
+            virtual ~GifRenderBackend() {}
+
+            /// <summary>
+            /// Sets the size of every frame that follows. Releases any stored frames, and any spare
+            /// frames if the size changes.
+            /// </summary>
+            virtual void SetSize(uint32_t width, uint32_t height) = 0;
+
+            /// <summary>
+            /// Says how many frames are about to be stored, so their storage can be laid out up
+            /// front. Optional; frames can be stored without it.
+            /// </summary>
+            virtual void ReserveFrames(uint32_t frameCount) = 0;
+
+            /// <summary>
+            /// Keeps a displayable frame resident so it can be presented later with DrawStoredFrame.
+            /// </summary>
+            virtual void StoreFrame(uint32_t frameIndex, const uint32_t *pPixels) = 0;
+
+            /// <summary>
+            /// Stores consecutive frames whose pixels follow each other in memory, as StoreFrame
+            /// would one at a time but in as few copies as the backend's layout allows.
+            /// </summary>
+            virtual void StoreFrames(uint32_t firstFrame, uint32_t frameCount, const uint32_t *pPixels) = 0;
+
+            /// <summary>
+            /// Releases every stored frame. Their surfaces are kept as spares, which StoreFrame
+            /// reuses before allocating new ones, so reloading an image costs no allocations.
+            /// </summary>
+            virtual void ReleaseFrames() = 0;
+
+            /// <summary>
+            /// Frees the spare surfaces left over by ReleaseFrames, and any room reserved for
+            /// frames that were never stored. Frames may not be stored after this until the next
+            /// ReleaseFrames.
+            /// </summary>
+            virtual void ReleaseSpareFrames() = 0;
+
+            /// <summary>
+            /// Starts presenting a frame, updating only the given part of the target, which is
+            /// cleared; the Draw methods leave the rest alone. Outside it the target must still hold
+            /// the frame presented before, so the backend updates all of it instead whenever it
+            /// can't vouch for that, e.g. if nothing has been presented since SetSize.
+            /// </summary>
+            /// <param name="updateRect">A non-empty rectangle within the target.</param>
+            /// <returns>
+            /// False if the target can't be drawn to right now; nothing else may be called then.
+            /// </returns>
+            virtual bool BeginDraw(const GifRect &updateRect) = 0;
+
+            /// <summary>
+            /// Checks whether the stored frames have been lost since the last call, e.g. with the
+            /// device they were on, in which case BeginDraw fails once. They have to be stored again
+            /// before they can be drawn.
+            /// </summary>
+            virtual bool CheckFramesLost() = 0;
+
+            /// <summary>
+            /// Draws a frame previously stored with StoreFrame.
+            /// </summary>
+            virtual void DrawStoredFrame(uint32_t frameIndex) = 0;
+
+            /// <summary>
+            /// Draws a frame straight from memory.
+            /// </summary>
+            virtual void DrawPixels(const uint32_t *pPixels) = 0;
+
+            /// <summary>
+            /// Finishes presenting the frame.
+            /// </summary>
+            virtual void EndDraw() = 0;
+        };
+    }
+}
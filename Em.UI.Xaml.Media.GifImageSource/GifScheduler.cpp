@@ -0,0 +1,148 @@
+﻿#include "GifScheduler.h"
+
+using namespace Em::Gif;
+
+GifScheduler::GifScheduler()
+    : m_nextId(1),
+    m_scheduledCount(0),
+    m_coalesceInterval(DefaultCoalesceInterval),
+    m_maxLag(DefaultMaxLag),
+    m_wakeups(0),
+    m_ticks(0)
+{
+}
+
+uint32_t GifScheduler::Register()
+{
+    auto id = m_nextId++;
+
+    Client client;
+    client.generation = 0;
+    client.scheduled = false;
+    m_clients[id] = client;
+
+    return id;
+}
+
+void GifScheduler::Unregister(uint32_t id)
+{
+    Cancel(id);
+    m_clients.erase(id);
+}
+
+void GifScheduler::Schedule(uint32_t id, int64_t deadline)
+{
+    auto it = m_clients.find(id);
+    if (it == m_clients.end())
+        return;
+
+    auto &client = it->second;
+    if (!client.scheduled)
+    {
+        client.scheduled = true;
+        m_scheduledCount++;
+    }
+
+    Entry entry;
+    entry.deadline = deadline;
+    entry.id = id;
+    entry.generation = ++client.generation;
+    m_queue.push(entry);
+}
+
+void GifScheduler::Cancel(uint32_t id)
+{
+    auto it = m_clients.find(id);
+    if (it == m_clients.end() || !it->second.scheduled)
+        return;
+
+    it->second.generation++;
+    it->second.scheduled = false;
+    m_scheduledCount--;
+
+    // Once nothing is scheduled every queued entry is stale
+    if (m_scheduledCount == 0)
+    {
+        m_queue = decltype(m_queue)();
+    }
+}
+
+bool GifScheduler::IsScheduled(uint32_t id) const
+{
+    auto it = m_clients.find(id);
+    return it != m_clients.end() && it->second.scheduled;
+}
+
+int64_t GifScheduler::GetElapsed(int64_t lastTick, int64_t deadline, int64_t now) const
+{
+    auto time = now - deadline > m_maxLag ? deadline : now;
+    return time - lastTick;
+}
+
+bool GifScheduler::GetNextWakeup(int64_t &wakeup)
+{
+    DiscardStale();
+    if (m_queue.empty())
+        return false;
+
+    wakeup = m_queue.top().deadline;
+    return true;
+}
+
+void GifScheduler::PopDue(int64_t now, std::vector<GifScheduledTick> &due)
+{
+    due.clear();
+
+    DiscardStale();
+    if (m_queue.empty() || m_queue.top().deadline > now)
+        return;
+
+    // Anything falling due before the next refresh would be shown on the same refresh anyway,
+    // so run it now instead of waking up again for it
+    auto limit = now + m_coalesceInterval;
+
+    while (!m_queue.empty() && m_queue.top().deadline < limit)
+    {
+        auto entry = m_queue.top();
+        m_queue.pop();
+
+        if (!IsCurrent(entry))
+            continue;
+
+        auto &client = m_clients[entry.id];
+        client.scheduled = false;
+        m_scheduledCount--;
+
+        GifScheduledTick tick;
+        tick.id = entry.id;
+        tick.deadline = entry.deadline;
+        due.push_back(tick);
+    }
+
+    m_wakeups++;
+    m_ticks += due.size();
+}
+
+GifSchedulerStatistics GifScheduler::GetStatistics() const
+{
+    GifSchedulerStatistics statistics;
+    statistics.wakeups = m_wakeups;
+    statistics.ticks = m_ticks;
+    statistics.clientCount = static_cast<uint32_t>(m_clients.size());
+    statistics.scheduledCount = m_scheduledCount;
+    return statistics;
+}
+
+bool GifScheduler::IsCurrent(const Entry &entry) const
+{
+    auto it = m_clients.find(entry.id);
+    return it != m_clients.end() && it->second.scheduled && it->second.generation == entry.generation;
+}
+
+void GifScheduler::DiscardStale()
+{
+    while (!m_queue.empty() && !IsCurrent(m_queue.top()))
+    {
+        m_queue.pop();
+    }
+}
@@ -0,0 +1,143 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+namespace Em {
+    namespace Gif
+    {
+        /// <summary>
+        /// A client whose deadline came due.
+        /// </summary>
+        struct GifScheduledTick
+        {
+            uint32_t id;
+            int64_t deadline;
+        };
+
+        struct GifSchedulerStatistics
+        {
+            uint64_t wakeups;
+            uint64_t ticks;
+            uint32_t clientCount;
+            uint32_t scheduledCount;
+        };
+
+        /// <summary>
+        /// Tracks the next frame deadline of every running animation so a single clock can drive
+        /// all of them. Deadlines fall due together if they land within one coalescing interval
+        /// (normally the display refresh interval) of the earliest one, so a burst of animations
+        /// costs one wakeup rather than one each.
+        /// Times are in 100ns ticks against whatever monotonic clock the caller uses. Not
+        /// thread-safe; the owner drives it from a single thread.
+        /// </summary>
+        class GifScheduler
+        {
+        public:
+            /// <summary>
+            /// 60Hz, in 100ns ticks.
+            /// </summary>
+            static const int64_t DefaultCoalesceInterval = 166667;
+
+            /// <summary>
+            /// How late a deadline may fall due before the animation gives up catching up, in 100ns
+            /// ticks.
+            /// </summary>
+            static const int64_t DefaultMaxLag = 10000000;
+
+            GifScheduler();
+
+            /// <summary>
+            /// Adds a client and returns its id. New clients have no deadline.
+            /// </summary>
+            uint32_t Register();
+
+            /// <summary>
+            /// Removes a client along with its pending deadline.
+            /// </summary>
+            void Unregister(uint32_t id);
+
+            /// <summary>
+            /// Sets a client's next deadline, replacing any pending one.
+            /// </summary>
+            void Schedule(uint32_t id, int64_t deadline);
+
+            /// <summary>
+            /// Drops a client's pending deadline, if any.
+            /// </summary>
+            void Cancel(uint32_t id);
+
+            bool IsScheduled(uint32_t id) const;
+
+            /// <summary>
+            /// Computes how far an animation moves on at a deadline that just fell due: to now,
+            /// from its last tick, so frames whose time passed while it was late are skipped. A
+            /// deadline more than the maximum lag late (e.g. after the app was suspended) only
+            /// moves it on to the deadline, to the frame that was due then, rather than
+            /// fast-forwarding through the whole stall.
+            /// </summary>
+            int64_t GetElapsed(int64_t lastTick, int64_t deadline, int64_t now) const;
+
+            /// <summary>
+            /// Gets the time the owner should next wake up.
+            /// </summary>
+            /// <returns>
+            /// False if nothing is scheduled.
+            /// </returns>
+            bool GetNextWakeup(int64_t &wakeup);
+
+            /// <summary>
+            /// Removes and returns every deadline that is due at now, in deadline order. Each
+            /// returned client has no deadline until it's scheduled again.
+            /// </summary>
+            void PopDue(int64_t now, std::vector<GifScheduledTick> &due);
+
+            void SetCoalesceInterval(int64_t interval) { m_coalesceInterval = interval; }
+            int64_t GetCoalesceInterval() const { return m_coalesceInterval; }
+
+            void SetMaxLag(int64_t maxLag) { m_maxLag = maxLag; }
+            int64_t GetMaxLag() const { return m_maxLag; }
+
+            GifSchedulerStatistics GetStatistics() const;
+
+        private:
+            struct Entry
+            {
+                int64_t deadline;
+                uint32_t id;
+                uint32_t generation;
+
+                bool operator>(const Entry &other) const
+                {
+                    return deadline > other.deadline || (deadline == other.deadline && id > other.id);
+                }
+            };
+
+            struct Client
+            {
+                uint32_t generation;
+                bool scheduled;
+            };
+
+            bool IsCurrent(const Entry &entry) const;
+            void DiscardStale();
+
+            // Earliest deadline on top. Rescheduling or cancelling bumps the client's generation
+            // rather than searching the heap; stale entries are discarded as they surface.
+            std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> m_queue;
+            std::unordered_map<uint32_t, Client> m_clients;
+
+            uint32_t m_nextId;
+            uint32_t m_scheduledCount;
+            int64_t m_coalesceInterval;
+            int64_t m_maxLag;
+
+            uint64_t m_wakeups;
+            uint64_t m_ticks;
+        };
+    }
+}
@@ -0,0 +1,161 @@
+﻿#include "GifScratchPool.h"
+
+#include <algorithm>
+
+using namespace Em::Gif;
+
+namespace
+{
+    // Constructed during module initialization, so there's no lazy-initialization race
+    GifScratchPool s_instance;
+
+    bool HasSmallerCapacity(const std::vector<uint8_t> &buffer, size_t cbSize)
+    {
+        return buffer.capacity() < cbSize;
+    }
+}
+
+GifScratchPool &GifScratchPool::GetInstance()
+{
+    return s_instance;
+}
+
+GifScratchPool::GifScratchPool()
+    : m_capacity(DefaultCapacity),
+    m_retainedBytes(0),
+    m_reuses(0),
+    m_allocations(0)
+{
+}
+
+std::unique_ptr<GifLzwTable> GifScratchPool::AcquireTable()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_tables.empty())
+        {
+            auto pTable = std::move(m_tables.back());
+            m_tables.pop_back();
+            m_retainedBytes -= sizeof(GifLzwTable);
+            m_reuses++;
+            return pTable;
+        }
+        m_allocations++;
+    }
+
+    // Every entry is written before it's read, so there's no need to clear it
+    return std::unique_ptr<GifLzwTable>(new GifLzwTable);
+}
+
+void GifScratchPool::Release(std::unique_ptr<GifLzwTable> pTable)
+{
+    if (!pTable)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_retainedBytes + sizeof(GifLzwTable) <= m_capacity)
+    {
+        m_tables.push_back(std::move(pTable));
+        m_retainedBytes += sizeof(GifLzwTable);
+    }
+}
+
+void GifScratchPool::Reserve(std::vector<uint8_t> &buffer, size_t cbSize)
+{
+    if (buffer.capacity() >= cbSize)
+        return;
+
+    std::vector<uint8_t> found;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = std::lower_bound(m_buffers.begin(), m_buffers.end(), cbSize, HasSmallerCapacity);
+        if (it != m_buffers.end())
+        {
+            found.swap(*it);
+            m_buffers.erase(it);
+            m_retainedBytes -= found.capacity();
+            m_reuses++;
+        }
+        else
+        {
+            m_allocations++;
+        }
+    }
+
+    // Any allocation happens outside the lock
+    if (found.capacity() < cbSize)
+        found.reserve(cbSize);
+    found.assign(buffer.begin(), buffer.end());
+
+    Release(buffer);
+    buffer.swap(found);
+}
+
+void GifScratchPool::Release(std::vector<uint8_t> &buffer)
+{
+    std::vector<uint8_t> released;
+    released.swap(buffer);
+    released.clear();
+
+    auto cbCapacity = released.capacity();
+    if (cbCapacity == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_retainedBytes + cbCapacity <= m_capacity)
+    {
+        auto it = std::lower_bound(m_buffers.begin(), m_buffers.end(), cbCapacity, HasSmallerCapacity);
+        m_buffers.insert(it, std::vector<uint8_t>())->swap(released);
+        m_retainedBytes += cbCapacity;
+    }
+}
+
+void GifScratchPool::SetCapacity(size_t cbCapacity)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_capacity = cbCapacity;
+    Trim();
+}
+
+size_t GifScratchPool::GetCapacity() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_capacity;
+}
+
+GifScratchStatistics GifScratchPool::GetStatistics() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    GifScratchStatistics statistics;
+    statistics.reuses = m_reuses;
+    statistics.allocations = m_allocations;
+    statistics.retainedBytes = m_retainedBytes;
+    statistics.capacity = m_capacity;
+    return statistics;
+}
+
+void GifScratchPool::Clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_tables.clear();
+    m_buffers.clear();
+    m_retainedBytes = 0;
+}
+
+// Frees the largest buffers first, then tables, until the free lists fit. Must be called with the
+// lock held.
+void GifScratchPool::Trim()
+{
+    while (m_retainedBytes > m_capacity && !m_buffers.empty())
+    {
+        m_retainedBytes -= m_buffers.back().capacity();
+        m_buffers.pop_back();
+    }
+
+    while (m_retainedBytes > m_capacity && !m_tables.empty())
+    {
+        m_retainedBytes -= sizeof(GifLzwTable);
+        m_tables.pop_back();
+    }
+}
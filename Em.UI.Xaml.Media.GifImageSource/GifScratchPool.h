@@ -0,0 +1,81 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "GifDecoder.h"
+
+namespace Em {
+    namespace Gif
+    {
+        struct GifScratchStatistics
+        {
+            uint64_t reuses;        // requests met from the free lists
+            uint64_t allocations;   // requests that had to go to the heap
+            size_t retainedBytes;
+            size_t capacity;
+        };
+
+        /// <summary>
+        /// Process-wide free lists of the memory a load only needs while it runs: LZW code tables,
+        /// compressed image data, de-interlacing and downscaling rows, and the palette indices of
+        /// frames that are composed and dropped. Loads take blocks and give them back when they're
+        /// done, so loading one GIF after another keeps reusing the same blocks instead of going
+        /// back to the heap for every frame. Bounded by a capacity; blocks given back beyond it are
+        /// freed. All members are thread-safe.
+        /// </summary>
+        class GifScratchPool
+        {
+        public:
+            static const size_t DefaultCapacity = 8 * 1024 * 1024;
+
+            static GifScratchPool &GetInstance();
+
+            GifScratchPool();
+
+            std::unique_ptr<GifLzwTable> AcquireTable();
+            void Release(std::unique_ptr<GifLzwTable> pTable);
+
+            /// <summary>
+            /// Makes sure a buffer can hold cbSize bytes without reallocating, trading it for the
+            /// smallest free buffer that's big enough if it can't. The contents are kept.
+            /// </summary>
+            void Reserve(std::vector<uint8_t> &buffer, size_t cbSize);
+
+            /// <summary>
+            /// Gives a buffer back, leaving it empty.
+            /// </summary>
+            void Release(std::vector<uint8_t> &buffer);
+
+            /// <summary>
+            /// Sets how many bytes the free lists may hold. 0 frees everything as it's given back.
+            /// </summary>
+            void SetCapacity(size_t cbCapacity);
+            size_t GetCapacity() const;
+
+            GifScratchStatistics GetStatistics() const;
+
+            /// <summary>
+            /// Frees everything in the free lists.
+            /// </summary>
+            void Clear();
+
+        private:
+            void Trim();
+
+            mutable std::mutex m_mutex;
+            std::vector<std::unique_ptr<GifLzwTable>> m_tables;
+
+            // Sorted by capacity, smallest first
+            std::vector<std::vector<uint8_t>> m_buffers;
+
+            size_t m_capacity;
+            size_t m_retainedBytes;
+            uint64_t m_reuses;
+            uint64_t m_allocations;
+        };
+    }
+}
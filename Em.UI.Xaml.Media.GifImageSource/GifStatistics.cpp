@@ -0,0 +1,154 @@
+﻿#include "GifStatistics.h"
+
+#include <cstring>
+#include <mutex>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <chrono>
+#endif
+
+using namespace Em::Gif;
+
+namespace
+{
+    // Constructed during module initialization, so there's no lazy-initialization race. One
+    // lock covers every instance as well as the totals; updates are a handful of additions.
+    std::mutex s_mutex;
+    GifPlaybackStatistics s_total;
+
+#ifdef _WIN32
+    int64_t QueryFrequency()
+    {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        return frequency.QuadPart;
+    }
+
+    const int64_t s_frequency = QueryFrequency();
+#endif
+
+    // Applies an update to an image's statistics and to the process-wide totals
+    template <typename Update>
+    void Record(GifPlaybackStatistics &statistics, Update update)
+    {
+        std::lock_guard<std::mutex> lock(s_mutex);
+        update(statistics);
+        update(s_total);
+    }
+}
+
+int64_t GifStatistics::Now()
+{
+#ifdef _WIN32
+    // VS2013's steady_clock only ticks with the system time, so use the performance counter
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+
+    // Split the conversion so the multiplication can't overflow
+    auto seconds = counter.QuadPart / s_frequency;
+    auto remainder = counter.QuadPart % s_frequency;
+    return seconds * 10000000 + remainder * 10000000 / s_frequency;
+#else
+    return std::chrono::duration_cast<std::chrono::duration<int64_t, std::ratio<1, 10000000>>>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+GifPlaybackStatistics GifStatistics::GetProcessStatistics()
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    return s_total;
+}
+
+GifStatistics::GifStatistics()
+{
+    std::memset(&m_statistics, 0, sizeof(m_statistics));
+}
+
+GifStatistics::~GifStatistics()
+{
+    SetResidentBytes(0);
+}
+
+GifPlaybackStatistics GifStatistics::Get() const
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    return m_statistics;
+}
+
+void GifStatistics::RecordLoad(int64_t loadTime, int64_t decodeTime)
+{
+    Record(m_statistics, [=](GifPlaybackStatistics &statistics)
+    {
+        statistics.loadCount++;
+        statistics.loadTime += loadTime;
+        statistics.decodeTime += decodeTime;
+    });
+}
+
+void GifStatistics::RecordPrerender(int64_t prerenderTime)
+{
+    Record(m_statistics, [=](GifPlaybackStatistics &statistics)
+    {
+        statistics.prerenderTime += prerenderTime;
+    });
+}
+
+void GifStatistics::SetResidentBytes(size_t cbResident)
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    s_total.residentBytes = s_total.residentBytes - m_statistics.residentBytes + cbResident;
+    m_statistics.residentBytes = cbResident;
+}
+
+void GifStatistics::RecordPresent()
+{
+    Record(m_statistics, [](GifPlaybackStatistics &statistics)
+    {
+        statistics.framesPresented++;
+    });
+}
+
+void GifStatistics::RecordTick(int64_t deadline, int64_t now)
+{
+    // Coalescing can run a tick slightly early, which is as much jitter as running it late
+    auto jitter = now > deadline ? now - deadline : deadline - now;
+    auto late = now - deadline > LateTickThreshold;
+
+    Record(m_statistics, [=](GifPlaybackStatistics &statistics)
+    {
+        statistics.ticks++;
+        statistics.lateTicks += late ? 1 : 0;
+        statistics.totalTickJitter += jitter;
+        if (jitter > statistics.maxTickJitter)
+        {
+            statistics.maxTickJitter = jitter;
+        }
+    });
+}
+
+void GifStatistics::RecordSkippedTick()
+{
+    Record(m_statistics, [](GifPlaybackStatistics &statistics)
+    {
+        statistics.skippedTicks++;
+    });
+}
+
+void GifStatistics::RecordDeviceLost()
+{
+    Record(m_statistics, [](GifPlaybackStatistics &statistics)
+    {
+        statistics.deviceLostRecoveries++;
+    });
+}
+
+void GifStatistics::RecordSwallowedException()
+{
+    Record(m_statistics, [](GifPlaybackStatistics &statistics)
+    {
+        statistics.swallowedExceptions++;
+    });
+}
@@ -0,0 +1,82 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Em {
+    namespace Gif
+    {
+        /// <summary>
+        /// How loading and playback have gone. Times are in 100ns ticks; load, decode and prerender
+        /// times are totals over every load.
+        /// </summary>
+        struct GifPlaybackStatistics
+        {
+            uint32_t loadCount;
+            int64_t loadTime;
+            int64_t decodeTime;
+            int64_t prerenderTime;
+
+            uint64_t residentBytes;     // decoded, composed and stored frames currently held
+            uint64_t framesPresented;
+
+            uint64_t ticks;
+            uint64_t lateTicks;         // ran more than LateTickThreshold after their deadline
+            uint64_t skippedTicks;      // presented nothing: the target couldn't be drawn to, or rendering failed
+            int64_t totalTickJitter;    // sum of every tick's distance from its deadline
+            int64_t maxTickJitter;
+
+            uint32_t deviceLostRecoveries;
+            uint32_t swallowedExceptions;
+        };
+
+        /// <summary>
+        /// Collects one image's statistics. Everything recorded is also added to process-wide
+        /// totals, so the images that cost the most can be picked out of the whole. All members are
+        /// thread-safe.
+        /// </summary>
+        class GifStatistics
+        {
+        public:
+            /// <summary>
+            /// One 60Hz refresh, in 100ns ticks.
+            /// </summary>
+            static const int64_t LateTickThreshold = 166667;
+
+            /// <summary>
+            /// Gets the current time in 100ns ticks of a monotonic clock.
+            /// </summary>
+            static int64_t Now();
+
+            /// <summary>
+            /// Gets the totals over every image, live or gone. Resident bytes only count live ones.
+            /// </summary>
+            static GifPlaybackStatistics GetProcessStatistics();
+
+            GifStatistics();
+            ~GifStatistics();
+
+            GifPlaybackStatistics Get() const;
+
+            void RecordLoad(int64_t loadTime, int64_t decodeTime);
+            void RecordPrerender(int64_t prerenderTime);
+            void SetResidentBytes(size_t cbResident);
+            void RecordPresent();
+
+            /// <summary>
+            /// Records a tick that was due at the deadline running now.
+            /// </summary>
+            void RecordTick(int64_t deadline, int64_t now);
+            void RecordSkippedTick();
+
+            void RecordDeviceLost();
+            void RecordSwallowedException();
+
+        private:
+            GifStatistics(const GifStatistics &);
+            GifStatistics &operator=(const GifStatistics &);
+
+            GifPlaybackStatistics m_statistics;
+        };
+    }
+}
@@ -0,0 +1,136 @@
+﻿#include "GifWorkerPool.h"
+
+#include <algorithm>
+
+using namespace Em::Gif;
+
+namespace
+{
+    // Never destroyed: joining threads while the module unloads can deadlock, and the OS cleans
+    // up after the process anyway
+    GifWorkerPool *s_pInstance = new GifWorkerPool();
+}
+
+GifWorkerPool &GifWorkerPool::GetInstance()
+{
+    return *s_pInstance;
+}
+
+uint32_t GifWorkerPool::GetDefaultWorkerCount()
+{
+    // hardware_concurrency may not know, in which case it returns 0
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+GifWorkerPool::GifWorkerPool() :
+    m_workerCount(GetDefaultWorkerCount()),
+    m_generation(0)
+{
+}
+
+GifWorkerPool::~GifWorkerPool()
+{
+    StopWorkers();
+}
+
+void GifWorkerPool::SetWorkerCount(uint32_t count)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (count == m_workerCount)
+            return;
+        m_workerCount = count;
+    }
+
+    // The new workers start with the next piece of work submitted. If there won't be any, the
+    // queue is drained here so nothing already submitted is stranded.
+    StopWorkers();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_workerCount == 0)
+    {
+        while (!m_queue.empty())
+        {
+            auto work = std::move(m_queue.front());
+            m_queue.pop_front();
+
+            lock.unlock();
+            work();
+            lock.lock();
+        }
+    }
+    else
+    {
+        while (m_workers.size() < m_workerCount && !m_queue.empty())
+        {
+            StartWorker();
+        }
+    }
+}
+
+uint32_t GifWorkerPool::GetWorkerCount() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_workerCount;
+}
+
+void GifWorkerPool::Submit(std::function<void()> work)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_workerCount == 0)
+    {
+        lock.unlock();
+        work();
+        return;
+    }
+
+    m_queue.push_back(std::move(work));
+    if (m_workers.size() < m_workerCount)
+    {
+        StartWorker();
+    }
+    else
+    {
+        m_workAvailable.notify_one();
+    }
+}
+
+void GifWorkerPool::StopWorkers()
+{
+    std::vector<std::thread> workers;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_generation++;
+        workers.swap(m_workers);
+    }
+
+    m_workAvailable.notify_all();
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+// Called with the lock held
+void GifWorkerPool::StartWorker()
+{
+    m_workers.push_back(std::thread(&GifWorkerPool::WorkerMain, this, m_generation));
+}
+
+void GifWorkerPool::WorkerMain(uint32_t generation)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;)
+    {
+        m_workAvailable.wait(lock, [this, generation] { return generation != m_generation || !m_queue.empty(); });
+        if (generation != m_generation)
+            return;
+
+        auto work = std::move(m_queue.front());
+        m_queue.pop_front();
+
+        lock.unlock();
+        work();
+        lock.lock();
+    }
+}
@@ -0,0 +1,62 @@
+﻿#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Em {
+    namespace Gif
+    {
+        /// <summary>
+        /// Process-wide pool of threads for decode work. Threads are started on first use.
+        /// All members are thread-safe.
+        /// </summary>
+        class GifWorkerPool
+        {
+        public:
+            static GifWorkerPool &GetInstance();
+
+            /// <summary>
+            /// Gets the number of workers the pool starts with: one per hardware thread.
+            /// </summary>
+            static uint32_t GetDefaultWorkerCount();
+
+            GifWorkerPool();
+            ~GifWorkerPool();
+
+            /// <summary>
+            /// Sets the number of worker threads. 0 runs all work on the threads that submit it.
+            /// Work already queued is kept and picked up by the new workers.
+            /// </summary>
+            void SetWorkerCount(uint32_t count);
+            uint32_t GetWorkerCount() const;
+
+            /// <summary>
+            /// Queues work to run on a worker, or runs it before returning if there are no
+            /// workers. Work must not throw.
+            /// </summary>
+            void Submit(std::function<void()> work);
+
+        private:
+            GifWorkerPool(const GifWorkerPool &);
+            GifWorkerPool &operator=(const GifWorkerPool &);
+
+            void StopWorkers();
+            void StartWorker();
+            void WorkerMain(uint32_t generation);
+
+            mutable std::mutex m_mutex;
+            std::condition_variable m_workAvailable;
+            std::deque<std::function<void()>> m_queue;
+            std::vector<std::thread> m_workers;
+            uint32_t m_workerCount;
+
+            // Bumped to retire the current workers; each one exits once it sees a newer value
+            uint32_t m_generation;
+        };
+    }
+}
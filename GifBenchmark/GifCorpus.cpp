@@ -0,0 +1,454 @@
+﻿#include "GifCorpus.h"
+
+#include <algorithm>
+
+using namespace Em::Gif;
+
+namespace
+{
+    const uint32_t MinCodeSize = 8;     // palettes are always 256 entries
+    const uint32_t MaxCodes = 4096;
+    const size_t HashSize = 8192;       // power of two, comfortably above MaxCodes
+
+    // Packs variable-width codes least significant bit first and splits them into sub-blocks
+    class CodeWriter
+    {
+    public:
+        explicit CodeWriter(std::vector<uint8_t> &out) : m_out(out), m_bits(0), m_bitCount(0), m_cbBlock(0) {}
+
+        void Write(uint32_t code, uint32_t codeSize)
+        {
+            m_bits |= code << m_bitCount;
+            m_bitCount += codeSize;
+            while (m_bitCount >= 8)
+            {
+                Put(static_cast<uint8_t>(m_bits));
+                m_bits >>= 8;
+                m_bitCount -= 8;
+            }
+        }
+
+        void Finish()
+        {
+            if (m_bitCount > 0)
+            {
+                Put(static_cast<uint8_t>(m_bits));
+            }
+            if (m_cbBlock > 0)
+            {
+                EmitBlock();
+            }
+            m_out.push_back(0);
+        }
+
+    private:
+        void Put(uint8_t value)
+        {
+            m_block[m_cbBlock++] = value;
+            if (m_cbBlock == 255)
+            {
+                EmitBlock();
+            }
+        }
+
+        void EmitBlock()
+        {
+            m_out.push_back(static_cast<uint8_t>(m_cbBlock));
+            m_out.insert(m_out.end(), m_block, m_block + m_cbBlock);
+            m_cbBlock = 0;
+        }
+
+        std::vector<uint8_t> &m_out;
+        uint32_t m_bits;
+        uint32_t m_bitCount;
+        uint8_t m_block[255];
+        size_t m_cbBlock;
+    };
+
+    // Small LCG; the corpus only needs to be repeatable, not random
+    class Random
+    {
+    public:
+        explicit Random(uint32_t seed) : m_state(seed) {}
+
+        uint32_t Next()
+        {
+            m_state = m_state * 1664525u + 1013904223u;
+            return m_state >> 8;
+        }
+
+    private:
+        uint32_t m_state;
+    };
+
+    std::shared_ptr<const GifPalette> MakePalette(uint32_t seed)
+    {
+        auto pPalette = std::make_shared<GifPalette>(256);
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            auto r = (i * 7 + seed * 31) & 0xFF;
+            auto g = (i * 3 + seed * 17) & 0xFF;
+            auto b = (255 - i + seed * 5) & 0xFF;
+            (*pPalette)[i] = 0xFF000000 | (r << 16) | (g << 8) | b;
+        }
+        return pPalette;
+    }
+
+    GifFrame MakeFrame(uint32_t left, uint32_t top, uint32_t width, uint32_t height, uint16_t delay, GifDisposal disposal)
+    {
+        GifFrame frame;
+        frame.left = left;
+        frame.top = top;
+        frame.width = width;
+        frame.height = height;
+        frame.delay = delay;
+        frame.disposal = disposal;
+        frame.hasTransparency = false;
+        frame.transparentIndex = 0;
+        frame.interlaced = false;
+        frame.pixels.resize(static_cast<size_t>(width) * height);
+        return frame;
+    }
+
+    // Banded pattern that drifts with t: compresses about as well as typical GIF artwork. One
+    // pixel in noiseRate is replaced by noise to keep the LZW tables busy.
+    void FillPattern(GifFrame &frame, uint32_t t, uint32_t colorCount, uint32_t firstColor, uint32_t noiseRate, Random &random)
+    {
+        auto pPixel = frame.pixels.data();
+        for (uint32_t y = 0; y < frame.height; y++)
+        {
+            for (uint32_t x = 0; x < frame.width; x++)
+            {
+                auto value = ((frame.left + x + 2 * t) / 6) ^ ((frame.top + y) / 6);
+                if (noiseRate != 0 && random.Next() % noiseRate == 0)
+                {
+                    value = random.Next();
+                }
+                *pPixel++ = static_cast<uint8_t>(firstColor + value % colorCount);
+            }
+        }
+    }
+
+    // 0, 1, ..., range, range - 1, ..., 1, 0, ...
+    uint32_t Bounce(uint32_t t, uint32_t range)
+    {
+        auto phase = t % (2 * range);
+        return phase <= range ? phase : 2 * range - phase;
+    }
+
+    std::vector<uint8_t> MakeSticker()
+    {
+        // A disc bouncing around a small transparent canvas, each frame only covering the disc
+        const uint32_t Size = 160;
+        const uint32_t Radius = 36;
+        GifEncoder encoder(Size, Size, *MakePalette(1), 0);
+        Random random(1);
+        for (uint32_t t = 0; t < 36; t++)
+        {
+            auto left = Bounce(t * 7, Size - 2 * Radius);
+            auto top = Bounce(t * 5, Size - 2 * Radius);
+            auto frame = MakeFrame(left, top, 2 * Radius, 2 * Radius, 4, GifDisposal::RestoreBackground);
+            frame.hasTransparency = true;
+            FillPattern(frame, t, 31, 1, 0, random);
+            for (uint32_t y = 0; y < frame.height; y++)
+            {
+                for (uint32_t x = 0; x < frame.width; x++)
+                {
+                    auto dx = static_cast<int32_t>(2 * x + 1) - static_cast<int32_t>(2 * Radius);
+                    auto dy = static_cast<int32_t>(2 * y + 1) - static_cast<int32_t>(2 * Radius);
+                    if (dx * dx + dy * dy > static_cast<int32_t>(4 * Radius * Radius))
+                    {
+                        frame.pixels[y * frame.width + x] = 0;
+                    }
+                }
+            }
+            encoder.AddFrame(frame);
+        }
+        return encoder.Finish();
+    }
+
+    std::vector<uint8_t> MakeLong()
+    {
+        // Many short frames, each repainting a small region over the previous ones
+        const uint32_t Width = 160;
+        const uint32_t Height = 120;
+        GifEncoder encoder(Width, Height, *MakePalette(2), 0);
+        Random random(2);
+        auto first = MakeFrame(0, 0, Width, Height, 2, GifDisposal::None);
+        FillPattern(first, 0, 64, 0, 32, random);
+        encoder.AddFrame(first);
+        for (uint32_t t = 1; t < 500; t++)
+        {
+            auto frame = MakeFrame(Bounce(t * 3, Width - 32), Bounce(t * 2, Height - 24), 32, 24, 2, GifDisposal::None);
+            FillPattern(frame, t, 64, 64, 32, random);
+            encoder.AddFrame(frame);
+        }
+        return encoder.Finish();
+    }
+
+    std::vector<uint8_t> MakeLarge()
+    {
+        const uint32_t Width = 1280;
+        const uint32_t Height = 720;
+        GifEncoder encoder(Width, Height, *MakePalette(3), 0);
+        Random random(3);
+        for (uint32_t t = 0; t < 16; t++)
+        {
+            auto frame = MakeFrame(0, 0, Width, Height, 8, GifDisposal::None);
+            FillPattern(frame, t, 128, 0, 32, random);
+            encoder.AddFrame(frame);
+        }
+        return encoder.Finish();
+    }
+
+    std::vector<uint8_t> MakeInterlaced()
+    {
+        const uint32_t Width = 640;
+        const uint32_t Height = 480;
+        GifEncoder encoder(Width, Height, *MakePalette(4), 0);
+        Random random(4);
+        for (uint32_t t = 0; t < 40; t++)
+        {
+            auto frame = MakeFrame(0, 0, Width, Height, 5, GifDisposal::None);
+            frame.interlaced = true;
+            FillPattern(frame, t, 96, 0, 16, random);
+            encoder.AddFrame(frame);
+        }
+        return encoder.Finish();
+    }
+
+    std::vector<uint8_t> MakeDisposal()
+    {
+        // A background followed by overlapping patches that cycle through every disposal
+        // method, with holes punched through them and every other one carrying its own palette
+        const uint32_t Width = 320;
+        const uint32_t Height = 240;
+        static const GifDisposal Disposals[] = { GifDisposal::RestorePrevious, GifDisposal::RestoreBackground, GifDisposal::None, GifDisposal::Unspecified };
+        GifEncoder encoder(Width, Height, *MakePalette(5), 0);
+        Random random(5);
+        auto background = MakeFrame(0, 0, Width, Height, 3, GifDisposal::None);
+        FillPattern(background, 0, 48, 0, 0, random);
+        encoder.AddFrame(background);
+        for (uint32_t t = 1; t < 120; t++)
+        {
+            auto left = random.Next() % (Width - 96);
+            auto top = random.Next() % (Height - 72);
+            auto frame = MakeFrame(left, top, 96, 72, 3, Disposals[t % 4]);
+            frame.hasTransparency = true;
+            frame.transparentIndex = 255;
+            if (t % 2 == 0)
+            {
+                frame.palette = MakePalette(5 + t);
+            }
+            FillPattern(frame, t, 64, 48, 64, random);
+            for (uint32_t y = 0; y < frame.height; y++)
+            {
+                for (uint32_t x = 0; x < frame.width; x++)
+                {
+                    if (((x / 8) + (y / 8)) % 3 == 0)
+                    {
+                        frame.pixels[y * frame.width + x] = 255;
+                    }
+                }
+            }
+            encoder.AddFrame(frame);
+        }
+        return encoder.Finish();
+    }
+
+    std::vector<uint8_t> MakeOdd()
+    {
+        // A canvas whose pixel count isn't a multiple of 8, so a frame stored at a byte per pixel
+        // doesn't end on a word boundary, with patches that sometimes bring their own palette
+        const uint32_t Width = 97;
+        const uint32_t Height = 61;
+        GifEncoder encoder(Width, Height, *MakePalette(6), 0);
+        Random random(6);
+        auto first = MakeFrame(0, 0, Width, Height, 4, GifDisposal::None);
+        FillPattern(first, 0, 32, 0, 16, random);
+        encoder.AddFrame(first);
+        for (uint32_t t = 1; t < 24; t++)
+        {
+            auto frame = MakeFrame(Bounce(t * 5, Width - 31), Bounce(t * 3, Height - 23), 31, 23, 4, t % 3 == 0 ? GifDisposal::RestoreBackground : GifDisposal::None);
+            if (t % 8 == 0)
+            {
+                frame.palette = MakePalette(6 + t);
+            }
+            FillPattern(frame, t, 32, 32, 16, random);
+            encoder.AddFrame(frame);
+        }
+        return encoder.Finish();
+    }
+
+    GifCorpusEntry MakeEntry(const char *name, const char *description, std::vector<uint8_t> data)
+    {
+        GifCorpusEntry entry;
+        entry.name = name;
+        entry.description = description;
+        entry.data = std::move(data);
+        return entry;
+    }
+}
+
+GifEncoder::GifEncoder(uint32_t width, uint32_t height, const GifPalette &globalPalette, uint16_t loopCount)
+{
+    static const uint8_t Signature[] = { 'G', 'I', 'F', '8', '9', 'a' };
+    m_data.assign(Signature, Signature + sizeof(Signature));
+
+    WriteWord(static_cast<uint16_t>(width));
+    WriteWord(static_cast<uint16_t>(height));
+    WriteByte(0xF7);    // global color table, 8 bits of color resolution, 256 entries
+    WriteByte(0);       // background index
+    WriteByte(0);       // pixel aspect ratio
+    WritePalette(globalPalette);
+
+    static const uint8_t Netscape[] = { 0x21, 0xFF, 0x0B, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01 };
+    m_data.insert(m_data.end(), Netscape, Netscape + sizeof(Netscape));
+    WriteWord(loopCount);
+    WriteByte(0);
+}
+
+void GifEncoder::AddFrame(const GifFrame &frame)
+{
+    // Graphic control extension
+    WriteByte(0x21);
+    WriteByte(0xF9);
+    WriteByte(4);
+    WriteByte(static_cast<uint8_t>((static_cast<uint8_t>(frame.disposal) << 2) | (frame.hasTransparency ? 1 : 0)));
+    WriteWord(frame.delay);
+    WriteByte(frame.transparentIndex);
+    WriteByte(0);
+
+    // Image descriptor
+    WriteByte(0x2C);
+    WriteWord(static_cast<uint16_t>(frame.left));
+    WriteWord(static_cast<uint16_t>(frame.top));
+    WriteWord(static_cast<uint16_t>(frame.width));
+    WriteWord(static_cast<uint16_t>(frame.height));
+    WriteByte(static_cast<uint8_t>((frame.palette ? 0x87 : 0) | (frame.interlaced ? 0x40 : 0)));
+    if (frame.palette)
+    {
+        WritePalette(*frame.palette);
+    }
+
+    if (!frame.interlaced)
+    {
+        WriteImageData(frame.pixels.data(), frame.pixels.size());
+        return;
+    }
+
+    // Rows go out in the four interlace passes
+    static const uint32_t PassStart[] = { 0, 4, 2, 1 };
+    static const uint32_t PassStep[] = { 8, 8, 4, 2 };
+    std::vector<uint8_t> reordered;
+    reordered.reserve(frame.pixels.size());
+    for (int pass = 0; pass < 4; pass++)
+    {
+        for (auto y = PassStart[pass]; y < frame.height; y += PassStep[pass])
+        {
+            auto pRow = frame.pixels.data() + static_cast<size_t>(y) * frame.width;
+            reordered.insert(reordered.end(), pRow, pRow + frame.width);
+        }
+    }
+    WriteImageData(reordered.data(), reordered.size());
+}
+
+std::vector<uint8_t> GifEncoder::Finish()
+{
+    WriteByte(0x3B);
+    return std::move(m_data);
+}
+
+void GifEncoder::WriteWord(uint16_t value)
+{
+    WriteByte(static_cast<uint8_t>(value));
+    WriteByte(static_cast<uint8_t>(value >> 8));
+}
+
+void GifEncoder::WritePalette(const GifPalette &palette)
+{
+    for (size_t i = 0; i < 256; i++)
+    {
+        auto color = i < palette.size() ? palette[i] : 0;
+        WriteByte(static_cast<uint8_t>(color >> 16));
+        WriteByte(static_cast<uint8_t>(color >> 8));
+        WriteByte(static_cast<uint8_t>(color));
+    }
+}
+
+void GifEncoder::WriteImageData(const uint8_t *pPixels, size_t cPixels)
+{
+    WriteByte(MinCodeSize);
+    CodeWriter writer(m_data);
+
+    const uint32_t clearCode = 1u << MinCodeSize;
+    const uint32_t endCode = clearCode + 1;
+    auto nextCode = endCode + 1;
+    auto codeSize = MinCodeSize + 1;
+
+    // Open-addressed map from (prefix code, next index) to code
+    std::vector<int32_t> keys(HashSize, -1);
+    std::vector<uint16_t> codes(HashSize);
+
+    writer.Write(clearCode, codeSize);
+    if (cPixels != 0)
+    {
+        uint32_t prefix = pPixels[0];
+        for (size_t i = 1; i < cPixels; i++)
+        {
+            auto key = static_cast<int32_t>((prefix << 8) | pPixels[i]);
+            auto slot = (static_cast<uint32_t>(key) * 2654435761u >> 19) & (HashSize - 1);
+            while (keys[slot] != -1 && keys[slot] != key)
+            {
+                slot = (slot + 1) & (HashSize - 1);
+            }
+            if (keys[slot] == key)
+            {
+                prefix = codes[slot];
+                continue;
+            }
+
+            writer.Write(prefix, codeSize);
+            if (nextCode < MaxCodes)
+            {
+                keys[slot] = key;
+                codes[slot] = static_cast<uint16_t>(nextCode++);
+
+                // The decoder adds its entries a code behind, so it widens one code later too
+                if (nextCode > (1u << codeSize) && codeSize < 12)
+                {
+                    codeSize++;
+                }
+            }
+            else
+            {
+                writer.Write(clearCode, codeSize);
+                std::fill(keys.begin(), keys.end(), -1);
+                nextCode = endCode + 1;
+                codeSize = MinCodeSize + 1;
+            }
+            prefix = pPixels[i];
+        }
+        writer.Write(prefix, codeSize);
+
+        // The decoder adds an entry for the last code before reading the end code
+        if (nextCode < MaxCodes && nextCode + 1 > (1u << codeSize) && codeSize < 12)
+        {
+            codeSize++;
+        }
+    }
+    writer.Write(endCode, codeSize);
+    writer.Finish();
+}
+
+std::vector<GifCorpusEntry> Em::Gif::BuildCorpus()
+{
+    std::vector<GifCorpusEntry> corpus;
+    corpus.push_back(MakeEntry("sticker", "160x160, 36 small transparent frames restored to background", MakeSticker()));
+    corpus.push_back(MakeEntry("long", "160x120, 500 frames each repainting a 32x24 region", MakeLong()));
+    corpus.push_back(MakeEntry("large", "1280x720, 16 full frames", MakeLarge()));
+    corpus.push_back(MakeEntry("interlaced", "640x480, 40 full interlaced frames", MakeInterlaced()));
+    corpus.push_back(MakeEntry("disposal", "320x240, 120 frames cycling through every disposal method", MakeDisposal()));
+    corpus.push_back(MakeEntry("odd", "97x61, 24 frames of patches, some with their own palette", MakeOdd()));
+    return corpus;
+}
@@ -0,0 +1,60 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "GifDecoder.h"
+
+// Synthetic GIFs for the benchmark. Everything is generated from fixed seeds, so every run (and
+// every machine) measures exactly the same bytes.
+
+namespace Em {
+    namespace Gif
+    {
+        /// <summary>
+        /// Writes GIF89a files. Palettes are always written with 256 entries; frames without a
+        /// palette of their own use the global one.
+        /// </summary>
+        class GifEncoder
+        {
+        public:
+            /// <param name="loopCount">Written to the NETSCAPE2.0 extension; 0 loops forever.</param>
+            GifEncoder(uint32_t width, uint32_t height, const GifPalette &globalPalette, uint16_t loopCount);
+
+            /// <summary>
+            /// Appends a frame. Pixels are palette indices in row-major order; interlaced frames
+            /// are reordered as they're written.
+            /// </summary>
+            void AddFrame(const GifFrame &frame);
+
+            /// <summary>
+            /// Writes the trailer and hands over the file.
+            /// </summary>
+            std::vector<uint8_t> Finish();
+
+        private:
+            void WriteByte(uint8_t value) { m_data.push_back(value); }
+            void WriteWord(uint16_t value);
+            void WritePalette(const GifPalette &palette);
+            void WriteImageData(const uint8_t *pPixels, size_t cPixels);
+
+            std::vector<uint8_t> m_data;
+        };
+
+        struct GifCorpusEntry
+        {
+            std::string name;
+            std::string description;
+            std::vector<uint8_t> data;
+        };
+
+        /// <summary>
+        /// Builds the standard corpus: a small sticker, a long animation, a large image, an
+        /// interlaced image, one that leans on every disposal method and a small one of an odd
+        /// size.
+        /// </summary>
+        std::vector<GifCorpusEntry> BuildCorpus();
+    }
+}
@@ -0,0 +1,710 @@
+﻿// Headless benchmark for the portable decode, composition and playback code. Runs each GIF in
+// the synthetic corpus (and any files named on the command line) and writes the results as JSON.
+//
+//   GifBenchmark [--iterations N] [--workers N] [--simd scalar|sse2|avx2|neon] [--no-corpus]
+//                [--write-corpus DIR] [--disk-cache DIR] [--output FILE] [file.gif ...]
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#else
+#include <chrono>
+#include <sys/stat.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CpuRenderBackend.h"
+#include "GifCompositor.h"
+#include "GifCorpus.h"
+#include "GifDecoder.h"
+#include "GifDiskCache.h"
+#include "GifFrameCache.h"
+#include "GifFrameSet.h"
+#include "GifPixelKernels.h"
+#include "GifPlayer.h"
+#include "GifWorkerPool.h"
+
+using namespace Em::Gif;
+
+// Results are versioned so scripts comparing runs can tell when fields change meaning
+static const int SchemaVersion = 5;
+
+//
+// Heap accounting. Every allocation goes through the replaced global operator new, which keeps
+// a running total of live bytes and its high-water mark, and counts allocations.
+//
+
+namespace
+{
+    const size_t AllocationHeader = 16;     // keeps the returned block aligned for any type
+
+    std::atomic<int64_t> g_liveBytes;
+    std::atomic<int64_t> g_peakBytes;
+    std::atomic<int64_t> g_allocations;
+
+    void *Allocate(size_t cb)
+    {
+        auto p = static_cast<char *>(std::malloc(cb + AllocationHeader));
+        if (p == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        *reinterpret_cast<size_t *>(p) = cb;
+
+        g_allocations++;
+        auto live = g_liveBytes.fetch_add(static_cast<int64_t>(cb)) + static_cast<int64_t>(cb);
+        auto peak = g_peakBytes.load();
+        while (live > peak && !g_peakBytes.compare_exchange_weak(peak, live))
+        {
+        }
+        return p + AllocationHeader;
+    }
+
+    void Free(void *pBlock)
+    {
+        if (pBlock != nullptr)
+        {
+            auto p = static_cast<char *>(pBlock) - AllocationHeader;
+            g_liveBytes.fetch_sub(static_cast<int64_t>(*reinterpret_cast<size_t *>(p)));
+            std::free(p);
+        }
+    }
+
+    // Starts a new high-water mark at the current usage and returns that usage
+    int64_t ResetPeakBytes()
+    {
+        auto live = g_liveBytes.load();
+        g_peakBytes.store(live);
+        return live;
+    }
+}
+
+void *operator new(size_t cb) { return Allocate(cb); }
+void *operator new[](size_t cb) { return Allocate(cb); }
+void *operator new(size_t cb, const std::nothrow_t &) throw()
+{
+    try { return Allocate(cb); }
+    catch (const std::bad_alloc &) { return nullptr; }
+}
+void *operator new[](size_t cb, const std::nothrow_t &) throw()
+{
+    try { return Allocate(cb); }
+    catch (const std::bad_alloc &) { return nullptr; }
+}
+void operator delete(void *p) throw() { Free(p); }
+void operator delete[](void *p) throw() { Free(p); }
+void operator delete(void *p, const std::nothrow_t &) throw() { Free(p); }
+void operator delete[](void *p, const std::nothrow_t &) throw() { Free(p); }
+
+// C++14 compilers pass the size to delete; the header already has it
+#if defined(__cpp_sized_deallocation) || (defined(_MSC_VER) && _MSC_VER >= 1900)
+void operator delete(void *p, size_t) throw() { Free(p); }
+void operator delete[](void *p, size_t) throw() { Free(p); }
+#endif
+
+// C++17 compilers allocate over-aligned types through these. The aligned block is carved out of
+// an ordinary one, which is counted padding and all, with the ordinary block's address just
+// before it.
+#ifdef __cpp_aligned_new
+namespace
+{
+    void *AllocateAligned(size_t cb, std::align_val_t alignment)
+    {
+        auto cbAlignment = static_cast<size_t>(alignment);
+        auto p = static_cast<char *>(Allocate(cb + cbAlignment + sizeof(void *)));
+        auto address = (reinterpret_cast<uintptr_t>(p) + sizeof(void *) + cbAlignment - 1) & ~(cbAlignment - 1);
+        auto pAligned = reinterpret_cast<void **>(address);
+        pAligned[-1] = p;
+        return pAligned;
+    }
+
+    void FreeAligned(void *pBlock)
+    {
+        if (pBlock != nullptr)
+        {
+            Free(static_cast<void **>(pBlock)[-1]);
+        }
+    }
+}
+
+void *operator new(size_t cb, std::align_val_t alignment) { return AllocateAligned(cb, alignment); }
+void *operator new[](size_t cb, std::align_val_t alignment) { return AllocateAligned(cb, alignment); }
+void *operator new(size_t cb, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    try { return AllocateAligned(cb, alignment); }
+    catch (const std::bad_alloc &) { return nullptr; }
+}
+void *operator new[](size_t cb, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    try { return AllocateAligned(cb, alignment); }
+    catch (const std::bad_alloc &) { return nullptr; }
+}
+void operator delete(void *p, std::align_val_t) noexcept { FreeAligned(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { FreeAligned(p); }
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept { FreeAligned(p); }
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept { FreeAligned(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { FreeAligned(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { FreeAligned(p); }
+#endif
+
+namespace
+{
+    // Seconds on a high-resolution monotonic clock. VS2013's steady_clock only ticks with the
+    // system time, so Windows goes straight to the performance counter.
+    double Now()
+    {
+#ifdef _WIN32
+        LARGE_INTEGER frequency, counter;
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&counter);
+        return static_cast<double>(counter.QuadPart) / static_cast<double>(frequency.QuadPart);
+#else
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    double Median(std::vector<double> values)
+    {
+        std::sort(values.begin(), values.end());
+        auto middle = values.size() / 2;
+        return values.size() % 2 != 0 ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+    }
+
+    struct Options
+    {
+        uint32_t iterations;
+        uint32_t workers;
+        GifSimdLevel simd;
+        bool corpus;
+        std::string corpusDirectory;
+        std::string diskCacheDirectory;
+        std::string outputPath;
+        std::vector<std::string> files;
+    };
+
+    struct PlaybackResult
+    {
+        double timeToFirstFrameMs;
+
+        // Until every frame is ready to present; prerendered frames after the first are composed
+        // in the background
+        double timeToAllFramesMs;
+        double renderTickUs;
+
+        // Share of the target each tick's present redrew; below 1 where frames only change part
+        // of the canvas
+        double updatedArea;
+        int64_t peakHeapBytes;
+
+        // Loading the same GIF again into the same player, which can reuse what the first load
+        // left behind
+        double reloadMs;
+        int64_t reloadAllocations;
+    };
+
+    struct Result
+    {
+        std::string name;
+        std::string description;
+        size_t bytes;
+        uint32_t width;
+        uint32_t height;
+        uint32_t frameCount;
+
+        double decodeMBps;
+        double decodeFramesPerSecond;
+        double parallelDecodeMBps;
+        double parallelDecodeFramesPerSecond;
+        double composeFramesPerSecond;
+        double scalarComposeFramesPerSecond;
+        bool simdMatchesScalar;     // every supported instruction set composes the same pixels
+        bool diskCacheMatches;      // every storage reads back from the disk cache as it was written
+
+        PlaybackResult playback[2];     // indexed by prerender
+    };
+
+    // Decodes every frame's pixels, without composing them. Returns the elapsed seconds.
+    double TimeDecode(const std::vector<uint8_t> &data, GifWorkerPool *pPool)
+    {
+        auto start = Now();
+        GifDecoder decoder(data.data(), data.size());
+        auto pFrameSet = GifFrameSet::Decode(decoder, false, GifFrameStorage::Bgra, pPool);
+        return Now() - start;
+    }
+
+    // Composes already decoded frames, as playback without prerendering does. Returns the
+    // elapsed seconds.
+    double TimeCompose(const GifImageInfo &info, const std::vector<GifFrame> &frames)
+    {
+        auto start = Now();
+        GifCompositor compositor(info.width, info.height);
+        for (auto &frame : frames)
+        {
+            compositor.DrawFrame(frame);
+        }
+        return Now() - start;
+    }
+
+    // Composes the frames once with the plain C++ kernels and once with each vector version,
+    // frame by frame, and checks the canvases stay identical
+    bool CheckKernels(const GifImageInfo &info, const std::vector<GifFrame> &frames, GifSimdLevel level)
+    {
+        auto matches = true;
+        const GifSimdLevel levels[] = { GifSimdLevel::Sse2, GifSimdLevel::Avx2, GifSimdLevel::Neon };
+        for (auto other : levels)
+        {
+            if (!IsSimdLevelSupported(other))
+            {
+                continue;
+            }
+
+            GifCompositor scalar(info.width, info.height);
+            GifCompositor vectorized(info.width, info.height);
+            auto cPixels = static_cast<size_t>(info.width) * info.height;
+            for (size_t i = 0; i < frames.size() && matches; i++)
+            {
+                SetSimdLevel(GifSimdLevel::Scalar);
+                scalar.DrawFrame(frames[i]);
+                SetSimdLevel(other);
+                vectorized.DrawFrame(frames[i]);
+                matches = std::equal(scalar.GetPixels(), scalar.GetPixels() + cPixels, vectorized.GetPixels());
+            }
+        }
+        SetSimdLevel(level);
+        return matches;
+    }
+
+    // Writes the composed frames in each storage to the disk cache, maps them back, and checks
+    // every frame and delay comes back the same
+    bool CheckDiskCache(const std::vector<uint8_t> &data, const std::string &directory)
+    {
+        GifDiskCache cache;
+        cache.SetQuota(UINT64_MAX);
+        cache.SetDirectory(directory);
+
+        auto matches = true;
+        const GifFrameStorage storages[] = { GifFrameStorage::Bgra, GifFrameStorage::Indexed, GifFrameStorage::Delta };
+        for (auto storage : storages)
+        {
+            GifDecoder decoder(data.data(), data.size());
+            auto pWritten = GifFrameSet::Decode(decoder, true, storage);
+            auto key = GifFrameCache::ComputeKey(data.data(), data.size(), pWritten->width, pWritten->height, true, storage);
+            cache.Add(key, *pWritten);
+
+            auto pRead = cache.Find(key);
+            if (!pRead || pRead->delays != pWritten->delays)
+            {
+                matches = false;
+                break;
+            }
+
+            GifFrameBuffer writtenBuffer, readBuffer;
+            auto cPixels = static_cast<size_t>(pWritten->width) * pWritten->height;
+            for (uint32_t i = 0; i < pWritten->GetFrameCount() && matches; i++)
+            {
+                auto pWrittenPixels = pWritten->GetComposedFrame(i, writtenBuffer);
+                matches = std::equal(pWrittenPixels, pWrittenPixels + cPixels, pRead->GetComposedFrame(i, readBuffer));
+            }
+        }
+        cache.Clear();
+        return matches;
+    }
+
+    // Loads into a player, presents the first frame, then keeps playing, then loads it again. The
+    // peak covers everything the player and backend allocate up to the reload, the copy of the
+    // data included.
+    PlaybackResult TimePlayback(const std::vector<uint8_t> &data, bool prerender, uint32_t ticks)
+    {
+        PlaybackResult result;
+        auto baseline = ResetPeakBytes();
+        {
+            CpuRenderBackend backend;
+            GifPlayer player(&backend, 0, 0);
+            player.SetPrerender(prerender);
+
+            auto start = Now();
+            player.Load(data);
+            player.RenderFrame();
+            result.timeToFirstFrameMs = (Now() - start) * 1000;
+
+            // Picked up between ticks, as the owner of a player does
+            while (player.IsStreaming())
+            {
+                std::this_thread::yield();
+                player.Update();
+            }
+            result.timeToAllFramesMs = (Now() - start) * 1000;
+
+            auto presented = backend.GetPresentedFrameCount();
+            auto updated = backend.GetUpdatedPixelCount();
+            start = Now();
+            for (uint32_t i = 0; i < ticks; i++)
+            {
+                player.RenderFrame();
+            }
+            result.renderTickUs = (Now() - start) * 1000000 / ticks;
+
+            auto cPresented = backend.GetPresentedFrameCount() - presented;
+            auto cPixels = static_cast<double>(backend.GetWidth()) * backend.GetHeight();
+            result.updatedArea = cPresented != 0 && cPixels != 0 ? (backend.GetUpdatedPixelCount() - updated) / (cPresented * cPixels) : 1;
+            result.peakHeapBytes = g_peakBytes.load() - baseline;
+
+            auto allocations = g_allocations.load();
+            start = Now();
+            player.Load(data);
+            player.RenderFrame();
+            result.reloadMs = (Now() - start) * 1000;
+            result.reloadAllocations = g_allocations.load() - allocations;
+
+            // A pipeline left running would still be composing when the kernels are switched
+            while (player.IsStreaming())
+            {
+                std::this_thread::yield();
+                player.Update();
+            }
+        }
+        return result;
+    }
+
+    Result Run(const std::string &name, const std::string &description, const std::vector<uint8_t> &data, const Options &options)
+    {
+        Result result;
+        result.name = name;
+        result.description = description;
+        result.bytes = data.size();
+
+        // Read the frames once up front; composition is timed on its own
+        GifDecoder decoder(data.data(), data.size());
+        std::vector<GifFrame> frames;
+        GifFrame frame;
+        while (decoder.ReadFrame(frame))
+        {
+            frames.push_back(std::move(frame));
+        }
+        if (frames.empty())
+        {
+            throw GifFormatException("No frames");
+        }
+        auto &info = decoder.GetInfo();
+        result.width = info.width;
+        result.height = info.height;
+        result.frameCount = static_cast<uint32_t>(frames.size());
+
+        // At least two loops, and enough ticks to time a single-frame image
+        auto ticks = std::max<uint32_t>(2 * result.frameCount, 64);
+
+        std::vector<double> decode, parallelDecode, compose, scalarCompose, firstFrame[2], allFrames[2], tick[2], updatedArea[2], reload[2];
+        int64_t peakBytes[2] = { 0, 0 };
+        int64_t reloadAllocations[2] = { 0, 0 };
+        for (uint32_t i = 0; i < options.iterations; i++)
+        {
+            decode.push_back(TimeDecode(data, nullptr));
+            parallelDecode.push_back(TimeDecode(data, &GifWorkerPool::GetInstance()));
+            compose.push_back(TimeCompose(info, frames));
+            SetSimdLevel(GifSimdLevel::Scalar);
+            scalarCompose.push_back(TimeCompose(info, frames));
+            SetSimdLevel(options.simd);
+            for (int prerender = 0; prerender < 2; prerender++)
+            {
+                auto playback = TimePlayback(data, prerender != 0, ticks);
+                firstFrame[prerender].push_back(playback.timeToFirstFrameMs);
+                allFrames[prerender].push_back(playback.timeToAllFramesMs);
+                tick[prerender].push_back(playback.renderTickUs);
+                updatedArea[prerender].push_back(playback.updatedArea);
+                peakBytes[prerender] = std::max(peakBytes[prerender], playback.peakHeapBytes);
+                reload[prerender].push_back(playback.reloadMs);
+                reloadAllocations[prerender] = std::max(reloadAllocations[prerender], playback.reloadAllocations);
+            }
+        }
+
+        auto megabytes = data.size() / 1e6;
+        result.decodeMBps = megabytes / Median(decode);
+        result.decodeFramesPerSecond = result.frameCount / Median(decode);
+        result.parallelDecodeMBps = megabytes / Median(parallelDecode);
+        result.parallelDecodeFramesPerSecond = result.frameCount / Median(parallelDecode);
+        result.composeFramesPerSecond = result.frameCount / Median(compose);
+        result.scalarComposeFramesPerSecond = result.frameCount / Median(scalarCompose);
+        result.simdMatchesScalar = CheckKernels(info, frames, options.simd);
+        result.diskCacheMatches = CheckDiskCache(data, options.diskCacheDirectory);
+        for (int prerender = 0; prerender < 2; prerender++)
+        {
+            result.playback[prerender].timeToFirstFrameMs = Median(firstFrame[prerender]);
+            result.playback[prerender].timeToAllFramesMs = Median(allFrames[prerender]);
+            result.playback[prerender].renderTickUs = Median(tick[prerender]);
+            result.playback[prerender].updatedArea = Median(updatedArea[prerender]);
+            result.playback[prerender].peakHeapBytes = peakBytes[prerender];
+            result.playback[prerender].reloadMs = Median(reload[prerender]);
+            result.playback[prerender].reloadAllocations = reloadAllocations[prerender];
+        }
+        return result;
+    }
+
+    std::string JsonString(const std::string &value)
+    {
+        std::string json = "\"";
+        for (auto c : value)
+        {
+            if (c == '"' || c == '\\')
+            {
+                json += '\\';
+                json += c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20)
+            {
+                static const char Hex[] = "0123456789abcdef";
+                json += "\\u00";
+                json += Hex[(c >> 4) & 0xF];
+                json += Hex[c & 0xF];
+            }
+            else
+            {
+                json += c;
+            }
+        }
+        return json + "\"";
+    }
+
+    void WriteResults(FILE *pFile, const Options &options, const std::vector<Result> &results)
+    {
+        fprintf(pFile, "{\n");
+        fprintf(pFile, "  \"schemaVersion\": %d,\n", SchemaVersion);
+        fprintf(pFile, "  \"iterations\": %u,\n", options.iterations);
+        fprintf(pFile, "  \"workers\": %u,\n", GifWorkerPool::GetInstance().GetWorkerCount());
+        fprintf(pFile, "  \"simd\": %s,\n", JsonString(GetSimdLevelName(options.simd)).c_str());
+        fprintf(pFile, "  \"results\": [");
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            auto &result = results[i];
+            fprintf(pFile, "%s\n    {\n", i == 0 ? "" : ",");
+            fprintf(pFile, "      \"name\": %s,\n", JsonString(result.name).c_str());
+            fprintf(pFile, "      \"description\": %s,\n", JsonString(result.description).c_str());
+            fprintf(pFile, "      \"bytes\": %llu,\n", static_cast<unsigned long long>(result.bytes));
+            fprintf(pFile, "      \"width\": %u,\n", result.width);
+            fprintf(pFile, "      \"height\": %u,\n", result.height);
+            fprintf(pFile, "      \"frameCount\": %u,\n", result.frameCount);
+            fprintf(pFile, "      \"decodeMBps\": %.3f,\n", result.decodeMBps);
+            fprintf(pFile, "      \"decodeFramesPerSecond\": %.3f,\n", result.decodeFramesPerSecond);
+            fprintf(pFile, "      \"parallelDecodeMBps\": %.3f,\n", result.parallelDecodeMBps);
+            fprintf(pFile, "      \"parallelDecodeFramesPerSecond\": %.3f,\n", result.parallelDecodeFramesPerSecond);
+            fprintf(pFile, "      \"composeFramesPerSecond\": %.3f,\n", result.composeFramesPerSecond);
+            fprintf(pFile, "      \"scalarComposeFramesPerSecond\": %.3f,\n", result.scalarComposeFramesPerSecond);
+            fprintf(pFile, "      \"simdMatchesScalar\": %s,\n", result.simdMatchesScalar ? "true" : "false");
+            fprintf(pFile, "      \"diskCacheMatches\": %s,\n", result.diskCacheMatches ? "true" : "false");
+            fprintf(pFile, "      \"playback\": [");
+            for (int prerender = 0; prerender < 2; prerender++)
+            {
+                auto &playback = result.playback[prerender];
+                fprintf(pFile, "%s\n        {\n", prerender == 0 ? "" : ",");
+                fprintf(pFile, "          \"prerender\": %s,\n", prerender != 0 ? "true" : "false");
+                fprintf(pFile, "          \"timeToFirstFrameMs\": %.3f,\n", playback.timeToFirstFrameMs);
+                fprintf(pFile, "          \"timeToAllFramesMs\": %.3f,\n", playback.timeToAllFramesMs);
+                fprintf(pFile, "          \"renderTickUs\": %.3f,\n", playback.renderTickUs);
+                fprintf(pFile, "          \"updatedArea\": %.3f,\n", playback.updatedArea);
+                fprintf(pFile, "          \"peakHeapBytes\": %lld,\n", static_cast<long long>(playback.peakHeapBytes));
+                fprintf(pFile, "          \"reloadMs\": %.3f,\n", playback.reloadMs);
+                fprintf(pFile, "          \"reloadAllocations\": %lld\n", static_cast<long long>(playback.reloadAllocations));
+                fprintf(pFile, "        }");
+            }
+            fprintf(pFile, "\n      ]\n    }");
+        }
+        fprintf(pFile, "\n  ]\n}\n");
+    }
+
+    bool ReadFile(const std::string &path, std::vector<uint8_t> &data)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+        {
+            return false;
+        }
+        data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    bool WriteFile(const std::string &path, const std::vector<uint8_t> &data)
+    {
+        std::ofstream file(path, std::ios::binary);
+        file.write(reinterpret_cast<const char *>(data.data()), data.size());
+        return static_cast<bool>(file);
+    }
+
+    bool ParseSimdLevel(const std::string &name, GifSimdLevel &level)
+    {
+        const GifSimdLevel levels[] = { GifSimdLevel::Scalar, GifSimdLevel::Sse2, GifSimdLevel::Avx2, GifSimdLevel::Neon };
+        for (auto candidate : levels)
+        {
+            if (name == GetSimdLevelName(candidate))
+            {
+                level = candidate;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Succeeds if the directory is already there. Only makes the last directory in the path.
+    bool MakeDirectory(const std::string &path)
+    {
+#ifdef _WIN32
+        return _mkdir(path.c_str()) == 0 || errno == EEXIST;
+#else
+        return mkdir(path.c_str(), 0777) == 0 || errno == EEXIST;
+#endif
+    }
+
+    // Ends with a separator
+    std::string GetTemporaryDirectory()
+    {
+#ifdef _WIN32
+        char path[MAX_PATH + 1];
+        auto cch = GetTempPathA(MAX_PATH + 1, path);
+        return cch != 0 && cch <= MAX_PATH ? std::string(path, cch) : std::string(".\\");
+#else
+        auto pDirectory = getenv("TMPDIR");
+        std::string directory = pDirectory != nullptr && *pDirectory != '\0' ? pDirectory : "/tmp";
+        return directory.back() == '/' ? directory : directory + "/";
+#endif
+    }
+
+    bool ParseOptions(int argc, char **argv, Options &options)
+    {
+        options.iterations = 5;
+        options.workers = GifWorkerPool::GetDefaultWorkerCount();
+        options.simd = GetSimdLevel();
+        options.corpus = true;
+        options.diskCacheDirectory = GetTemporaryDirectory() + "GifBenchmark";
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            auto hasValue = i + 1 < argc;
+            if (arg == "--iterations" && hasValue)
+            {
+                options.iterations = std::max(1, atoi(argv[++i]));
+            }
+            else if (arg == "--workers" && hasValue)
+            {
+                options.workers = static_cast<uint32_t>(std::max(0, atoi(argv[++i])));
+            }
+            else if (arg == "--simd" && hasValue)
+            {
+                if (!ParseSimdLevel(argv[++i], options.simd))
+                {
+                    return false;
+                }
+            }
+            else if (arg == "--no-corpus")
+            {
+                options.corpus = false;
+            }
+            else if (arg == "--write-corpus" && hasValue)
+            {
+                options.corpusDirectory = argv[++i];
+            }
+            else if (arg == "--disk-cache" && hasValue)
+            {
+                options.diskCacheDirectory = argv[++i];
+            }
+            else if (arg == "--output" && hasValue)
+            {
+                options.outputPath = argv[++i];
+            }
+            else if (arg.compare(0, 2, "--") == 0)
+            {
+                return false;
+            }
+            else
+            {
+                options.files.push_back(arg);
+            }
+        }
+        return true;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        fprintf(stderr, "usage: GifBenchmark [--iterations N] [--workers N] [--simd scalar|sse2|avx2|neon] [--no-corpus] [--write-corpus DIR] [--disk-cache DIR] [--output FILE] [file.gif ...]\n");
+        return 2;
+    }
+    if (!SetSimdLevel(options.simd))
+    {
+        fprintf(stderr, "This processor doesn't support %s\n", GetSimdLevelName(options.simd));
+        return 1;
+    }
+
+    // Repeated loads of the same GIF must decode every time
+    GifFrameCache::GetInstance().SetCapacity(0);
+    GifWorkerPool::GetInstance().SetWorkerCount(options.workers);
+
+    std::vector<Result> results;
+    try
+    {
+        if (options.corpus)
+        {
+            if (!options.corpusDirectory.empty() && !MakeDirectory(options.corpusDirectory))
+            {
+                fprintf(stderr, "Couldn't create %s; its parent directory must already exist\n", options.corpusDirectory.c_str());
+                return 1;
+            }
+
+            auto corpus = BuildCorpus();
+            for (auto &entry : corpus)
+            {
+                if (!options.corpusDirectory.empty() && !WriteFile(options.corpusDirectory + "/" + entry.name + ".gif", entry.data))
+                {
+                    fprintf(stderr, "Couldn't write %s to %s\n", entry.name.c_str(), options.corpusDirectory.c_str());
+                    return 1;
+                }
+                fprintf(stderr, "%s...\n", entry.name.c_str());
+                results.push_back(Run(entry.name, entry.description, entry.data, options));
+            }
+        }
+        for (auto &path : options.files)
+        {
+            std::vector<uint8_t> data;
+            if (!ReadFile(path, data))
+            {
+                fprintf(stderr, "Couldn't read %s\n", path.c_str());
+                return 1;
+            }
+            fprintf(stderr, "%s...\n", path.c_str());
+            results.push_back(Run(path, "", data, options));
+        }
+    }
+    catch (const GifFormatException &e)
+    {
+        fprintf(stderr, "Bad GIF: %s\n", e.what());
+        return 1;
+    }
+
+    auto pFile = options.outputPath.empty() ? stdout : fopen(options.outputPath.c_str(), "w");
+    if (pFile == nullptr)
+    {
+        fprintf(stderr, "Couldn't write %s\n", options.outputPath.c_str());
+        return 1;
+    }
+    WriteResults(pFile, options, results);
+    if (pFile != stdout)
+    {
+        fclose(pFile);
+    }
+    return 0;
+}
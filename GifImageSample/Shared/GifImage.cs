@@ -1,18 +1,18 @@
 ﻿using Em.UI.Xaml.Media;
 using System;
+using System.Collections.Generic;
 using System.Diagnostics;
 using System.IO;
 using System.Runtime.InteropServices.WindowsRuntime;
+using System.Threading;
 using System.Threading.Tasks;
 using Windows.Foundation;
-using Windows.Graphics.Imaging;
 using Windows.Storage;
 using Windows.Storage.Streams;
 using Windows.UI.Core;
 using Windows.UI.Xaml;
 using Windows.UI.Xaml.Controls;
 using Windows.UI.Xaml.Media;
-using Windows.Web.Http;
 
 namespace Em.UI.Xaml.Controls
 {
@@ -26,10 +26,22 @@ namespace Em.UI.Xaml.Controls
             DependencyProperty.Register("CanLoad", typeof(bool), typeof(GifImage),
                 new PropertyMetadata(true, OnCanLoadChanged));
 
+        public static readonly DependencyProperty DecodePixelWidthProperty =
+            DependencyProperty.Register("DecodePixelWidth", typeof(int), typeof(GifImage),
+                new PropertyMetadata(0, OnUriSourceChanged));
+
+        public static readonly DependencyProperty DecodePixelHeightProperty =
+            DependencyProperty.Register("DecodePixelHeight", typeof(int), typeof(GifImage),
+                new PropertyMetadata(0, OnUriSourceChanged));
+
         public static readonly DependencyProperty IsAnimatingProperty =
             DependencyProperty.Register("IsAnimating", typeof(bool), typeof(GifImage),
                 new PropertyMetadata(true, OnIsAnimatingChanged));
 
+        public static readonly DependencyProperty LoadPriorityProperty =
+            DependencyProperty.Register("LoadPriority", typeof(GifLoadPriority), typeof(GifImage),
+                new PropertyMetadata(GifLoadPriority.Normal, OnLoadPriorityChanged));
+
         public event TypedEventHandler<GifImage, ImageOpenedEventArgs> ImageOpened;
 
         private ImageBrush _brush;
@@ -38,6 +50,8 @@ namespace Em.UI.Xaml.Controls
         private TextBlock _progressText;
         private HyperlinkButton _reloadButton;
         private int _progress;
+        private CancellationTokenSource _loadCancellation;
+        private GifLoadTicket _loadTicket;
 
         public GifImage()
         {
@@ -66,12 +80,34 @@ namespace Em.UI.Xaml.Controls
             set { SetValue(CanLoadProperty, value); }
         }
 
+        // Images larger than these are decoded scaled down to fit, which saves memory and drawing
+        // time when showing big GIFs small (e.g. as thumbnails). 0 means no limit.
+        public int DecodePixelWidth
+        {
+            get { return (int)GetValue(DecodePixelWidthProperty); }
+            set { SetValue(DecodePixelWidthProperty, value); }
+        }
+
+        public int DecodePixelHeight
+        {
+            get { return (int)GetValue(DecodePixelHeightProperty); }
+            set { SetValue(DecodePixelHeightProperty, value); }
+        }
+
         public bool IsAnimating
         {
             get { return (bool)GetValue(IsAnimatingProperty); }
             set { SetValue(IsAnimatingProperty, value); }
         }
 
+        // Decides which images GifLoader loads first when more are waiting than it runs at once.
+        // Lists should raise it for items scrolling into view and lower it for ones only prefetched.
+        public GifLoadPriority LoadPriority
+        {
+            get { return (GifLoadPriority)GetValue(LoadPriorityProperty); }
+            set { SetValue(LoadPriorityProperty, value); }
+        }
+
         private static void OnCanLoadChanged(DependencyObject d, DependencyPropertyChangedEventArgs e)
         {
             var gifImage = d as GifImage;
@@ -88,6 +124,23 @@ namespace Em.UI.Xaml.Controls
             gifImage.ShowImage();
         }
 
+        private static void OnLoadPriorityChanged(DependencyObject d, DependencyPropertyChangedEventArgs e)
+        {
+            var gifImage = d as GifImage;
+            if (gifImage == null) return;
+            if (gifImage._loadTicket != null)
+                gifImage._loadTicket.Priority = (GifLoadPriority)e.NewValue;
+            gifImage.UpdateVisibility();
+        }
+
+        // Prefetched images are off screen, so they're the first to give up memory when the app
+        // sets GifImageSource.MemoryBudget
+        private void UpdateVisibility()
+        {
+            if (_source != null)
+                _source.IsVisible = LoadPriority != GifLoadPriority.Prefetch;
+        }
+
         private static void OnIsAnimatingChanged(DependencyObject d, DependencyPropertyChangedEventArgs e)
         {
             var gifImage = d as GifImage;
@@ -158,6 +211,46 @@ namespace Em.UI.Xaml.Controls
             var uriSource = UriSource;
 
             HasImage = true;
+
+            // ResetImage cancels this, stopping the load wherever it has got to
+            var cancellation = new CancellationTokenSource();
+            _loadCancellation = cancellation;
+            var token = cancellation.Token;
+
+            // Wait our turn, so images on screen aren't held up by ones scrolled past or prefetched
+            GifLoadTicket ticket;
+            try
+            {
+                ticket = await GifLoader.AcquireAsync(LoadPriority, token);
+            }
+            catch (OperationCanceledException)
+            {
+                return;
+            }
+
+            _loadTicket = ticket;
+            try
+            {
+                await ShowImageWithSlotAsync(uriSource, token);
+            }
+            finally
+            {
+                // Frees the slot for the next image, unless ResetImage already has
+                ticket.Dispose();
+                if (_loadTicket == ticket)
+                    _loadTicket = null;
+            }
+        }
+
+        private async Task ShowImageWithSlotAsync(Uri uriSource, CancellationToken token)
+        {
+            // Downloads are shown frame by frame as they arrive rather than after they finish
+            if (uriSource.Scheme == "http" || uriSource.Scheme == "https")
+            {
+                await ShowImageProgressivelyAsync(uriSource, token);
+                return;
+            }
+
             using (var stream = await GetImageStreamAsync(uriSource)) // This is not thread-safe!
             {
                 // Technically, at each await exists the possibility that UriSource can be changed.
@@ -174,12 +267,11 @@ namespace Em.UI.Xaml.Controls
 
                 try
                 {
-                    var decoder = await BitmapDecoder.CreateAsync(stream);
-                    var source = new GifImageSource((int)decoder.PixelWidth, (int)decoder.PixelHeight)
-                    {
-                        EnablePrerender = true
-                    };
-                    await source.SetSourceAsync(stream);
+                    // Sizes the source from the same pass over the data that loads it. Completes once
+                    // the first frame is ready, and the rest stream in while it plays. Cancelling
+                    // stops the decode part way; if another control is decoding the same GIF, the
+                    // two share its frames.
+                    var source = await GifImageSource.CreateFromStreamAsync(stream, true, DecodePixelWidth, DecodePixelHeight).AsTask(token);
 
                     // It's possible that the URI changed, or the control has been unloaded, etc. If so,
                     // clear resources and quit.
@@ -193,6 +285,10 @@ namespace Em.UI.Xaml.Controls
                     // Must wait for async operations to complete before setting _source
                     _source = source;
                 }
+                catch (OperationCanceledException)
+                {
+                    return;
+                }
                 catch (Exception)
                 {
                     VisualStateManager.GoToState(this, "Failed", true);
@@ -200,12 +296,136 @@ namespace Em.UI.Xaml.Controls
                 }
             }
 
+            DisplaySource();
+        }
+
+        private async Task ShowImageProgressivelyAsync(Uri uriSource, CancellationToken token)
+        {
+            GifImageSource source = null;
+            try
+            {
+                // Other controls showing the same URI read the same download
+                using (var download = GifLoader.OpenDownload(uriSource))
+                {
+                    ulong receivedBytes = 0;
+
+                    // The image size is in the first 10 bytes, and the GifImageSource can't be
+                    // created without it, so hold on to data until it's all here
+                    var header = new List<byte>();
+
+                    while (true)
+                    {
+                        var buffer = await download.ReadAsync(token);
+                        if (!IsStillWanted(uriSource, source))
+                            return;
+
+                        if (buffer == null)
+                            break;
+
+                        receivedBytes += buffer.Length;
+
+                        if (source == null)
+                        {
+                            header.AddRange(buffer.ToArray());
+                            if (header.Count < 10)
+                                continue;
+
+                            var width = header[6] | (header[7] << 8);
+                            var height = header[8] | (header[9] << 8);
+                            var size = GifImageSource.GetDecodedSize(width, height, DecodePixelWidth, DecodePixelHeight);
+                            source = new GifImageSource((int)size.Width, (int)size.Height)
+                            {
+                                EnablePrerender = true,
+                                DecodePixelWidth = DecodePixelWidth,
+                                DecodePixelHeight = DecodePixelHeight
+                            };
+                            source.BeginProgressiveLoad();
+                            buffer = header.ToArray().AsBuffer();
+                        }
+
+                        await source.AppendDataAsync(buffer);
+                        if (!IsStillWanted(uriSource, source))
+                            return;
+
+                        if (_source == null && source.LoadedFrameCount > 0)
+                        {
+                            // Show the first frame right away; the rest play as they arrive
+                            _source = source;
+                            DisplaySource();
+                        }
+                        else if (_source == null && download.TotalBytes.HasValue && download.TotalBytes.Value > 0)
+                        {
+                            SetProgress((int)(receivedBytes * 100 / download.TotalBytes.Value));
+                        }
+                    }
+                }
+
+                if (source == null)
+                    throw new FormatException("image too short");
+
+                await source.CompleteProgressiveLoadAsync();
+                if (!IsStillWanted(uriSource, source))
+                    return;
+
+                if (_source == null)
+                {
+                    if (source.LoadedFrameCount == 0)
+                        throw new FormatException("image has no frames");
+
+                    _source = source;
+                    DisplaySource();
+                }
+            }
+            catch (OperationCanceledException)
+            {
+                // Reset, or reloaded; the new load takes over the control's state
+                if (source != null && source != _source)
+                {
+                    source.ClearResources();
+                }
+            }
+            catch (Exception ex)
+            {
+                Debug.WriteLine("Failed to get GIF image");
+                Debug.WriteLine(ex);
+
+                if (source != null && source != _source)
+                {
+                    source.ClearResources();
+                }
+
+                if (_source == null && uriSource == UriSource)
+                {
+                    VisualStateManager.GoToState(this, "Failed", true);
+                }
+            }
+        }
+
+        // Checks, after an await, that the image being loaded is still the one we want. If it isn't,
+        // a source that hasn't been shown yet is cleaned up; one that has is cleaned up by ResetImage.
+        private bool IsStillWanted(Uri uriSource, GifImageSource source)
+        {
+            if (uriSource == UriSource && IsLoaded && CanLoad)
+                return true;
+
+            if (source != null && source != _source)
+            {
+                source.ClearResources();
+            }
+
+            return false;
+        }
+
+        private void DisplaySource()
+        {
             _brush = new ImageBrush { ImageSource = _source, Stretch = Stretch.None };
             _surface.Background = _brush;
 
             _surface.Height = _source.Height;
             _surface.Width = _source.Width;
 
+            UpdateVisibility();
+
             // Render one frame so that we show something even if the gif is paused
             _source.RenderFrame();
 
@@ -234,6 +454,18 @@ namespace Em.UI.Xaml.Controls
             if (!HasImage)
                 return;
 
+            if (_loadCancellation != null)
+            {
+                _loadCancellation.Cancel();
+                _loadCancellation = null;
+            }
+
+            if (_loadTicket != null)
+            {
+                _loadTicket.Dispose();
+                _loadTicket = null;
+            }
+
             _surface.Background = null;
 
             if (_brush != null)
@@ -266,53 +498,11 @@ namespace Em.UI.Xaml.Controls
                         await StorageFile.GetFileFromApplicationUriAsync(uriSource).AsTask().ConfigureAwait(false);
                     return await file.OpenReadAsync().AsTask().ConfigureAwait(false);
 
-                case "http":
-                case "https":
-                    var client = new HttpClient();
-                    IAsyncOperationWithProgress<IBuffer, HttpProgress> getOperation = null;
-                    try
-                    {
-                        getOperation = client.GetBufferAsync(uriSource);
-                        getOperation.Progress = OnProgress;
-
-                        var buffer = await getOperation.AsTask().ConfigureAwait(false);
-                        return buffer.AsStream().AsRandomAccessStream();
-                    }
-                    catch (Exception ex)
-                    {
-                        Debug.WriteLine("Failed to get GIF image");
-                        Debug.WriteLine(ex);
-                        return null;
-                    }
-                    finally
-                    {
-                        client.Dispose();
-                        if (getOperation != null)
-                        {
-                            getOperation.Progress = null;
-                        }
-                    }
-
                 default:
                     throw new InvalidOperationException("unsupported uri scheme");
             }
         }
 
-        private async void OnProgress(IAsyncOperationWithProgress<IBuffer, HttpProgress> info, HttpProgress progressInfo)
-        {
-            if (progressInfo.Stage != HttpProgressStage.ReceivingContent || !progressInfo.TotalBytesToReceive.HasValue ||
-                progressInfo.TotalBytesToReceive == 0)
-                return;
-
-            // Fire out an event only if we have made progress in downloading the image
-            var progress = (int)(progressInfo.BytesReceived * 100 / progressInfo.TotalBytesToReceive);
-            if (_progress == progress)
-                return;
-
-            await Dispatcher.RunAsync(CoreDispatcherPriority.Normal, () =>
-                SetProgress(progress));
-        }
-
         private void _reloadButton_Tapped(object sender, Windows.UI.Xaml.Input.TappedRoutedEventArgs e)
         {
             // Don't allow this Tapped event to bubble up
@@ -0,0 +1,336 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Threading;
+using System.Threading.Tasks;
+using Windows.Storage.Streams;
+using Windows.Web.Http;
+
+namespace Em.UI.Xaml.Controls
+{
+    public enum GifLoadPriority
+    {
+        // On screen now
+        Visible = 0,
+        Normal = 1,
+        // Likely to be scrolled to soon
+        Prefetch = 2
+    }
+
+    // Limits how many GIFs load at once, handing free slots to the most important loads first, and
+    // shares a single download between every load of the same URI. All members are safe to call
+    // from any thread.
+    public static class GifLoader
+    {
+        private const uint DownloadChunkSize = 16 * 1024;
+
+        private static readonly object _lock = new object();
+        private static readonly List<GifLoadTicket> _waiting = new List<GifLoadTicket>();
+        private static readonly Dictionary<Uri, SharedDownload> _downloads = new Dictionary<Uri, SharedDownload>();
+        private static int _maxConcurrentLoads = 3;
+        private static int _running;
+        private static long _nextSequence;
+
+        public static int MaxConcurrentLoads
+        {
+            get { lock (_lock) return _maxConcurrentLoads; }
+            set
+            {
+                if (value < 1)
+                    throw new ArgumentOutOfRangeException("value");
+
+                lock (_lock) _maxConcurrentLoads = value;
+                Dispatch();
+            }
+        }
+
+        // Waits for a load slot. Dispose the ticket once the load is finished, or abandoned, to give
+        // the slot to the next load. Among loads of the same priority, the first to ask goes first.
+        public static Task<GifLoadTicket> AcquireAsync(GifLoadPriority priority, CancellationToken token)
+        {
+            var ticket = new GifLoadTicket(priority);
+            lock (_lock)
+            {
+                ticket.Sequence = _nextSequence++;
+                _waiting.Add(ticket);
+            }
+
+            // A cancelled ticket never gets a slot; a granted one keeps it until it's disposed
+            token.Register(() =>
+            {
+                if (Remove(ticket))
+                    ticket.Completion.TrySetCanceled();
+            });
+
+            Dispatch();
+            return ticket.Completion.Task;
+        }
+
+        // Opens a reader over the download of a URI, starting the download unless another load is
+        // already running it. Every reader sees the whole response from the start. The download is
+        // stopped once its last reader is disposed.
+        public static GifDownloadReader OpenDownload(Uri uri)
+        {
+            lock (_lock)
+            {
+                SharedDownload download;
+                if (!_downloads.TryGetValue(uri, out download))
+                {
+                    download = new SharedDownload(uri);
+                    _downloads.Add(uri, download);
+                    var pump = download.PumpAsync();
+                }
+
+                download.Readers++;
+                return new GifDownloadReader(download);
+            }
+        }
+
+        internal static void ReleaseSlot(GifLoadTicket ticket)
+        {
+            if (Remove(ticket))
+            {
+                ticket.Completion.TrySetCanceled();
+            }
+            else
+            {
+                lock (_lock)
+                {
+                    if (!ticket.HasSlot)
+                        return;
+
+                    ticket.HasSlot = false;
+                    _running--;
+                }
+            }
+
+            Dispatch();
+        }
+
+        internal static void CloseDownload(SharedDownload download)
+        {
+            lock (_lock)
+            {
+                if (--download.Readers > 0)
+                    return;
+
+                _downloads.Remove(download.Uri);
+            }
+
+            download.Cancel();
+        }
+
+        private static bool Remove(GifLoadTicket ticket)
+        {
+            lock (_lock)
+            {
+                return _waiting.Remove(ticket);
+            }
+        }
+
+        private static void Dispatch()
+        {
+            while (true)
+            {
+                GifLoadTicket next = null;
+                lock (_lock)
+                {
+                    if (_running >= _maxConcurrentLoads)
+                        return;
+
+                    foreach (var ticket in _waiting)
+                    {
+                        if (next == null || ticket.Priority < next.Priority ||
+                            (ticket.Priority == next.Priority && ticket.Sequence < next.Sequence))
+                        {
+                            next = ticket;
+                        }
+                    }
+
+                    if (next == null)
+                        return;
+
+                    _waiting.Remove(next);
+                    next.HasSlot = true;
+                    _running++;
+                }
+
+                // Outside the lock, since the waiting load may carry on synchronously
+                next.Completion.TrySetResult(next);
+            }
+        }
+
+        internal sealed class SharedDownload
+        {
+            private readonly object _lock = new object();
+            private readonly List<IBuffer> _chunks = new List<IBuffer>();
+            private readonly CancellationTokenSource _cancellation = new CancellationTokenSource();
+            private TaskCompletionSource<bool> _changed = new TaskCompletionSource<bool>();
+            private ulong? _totalBytes;
+            private bool _completed;
+            private Exception _error;
+
+            public SharedDownload(Uri uri)
+            {
+                Uri = uri;
+            }
+
+            public Uri Uri { get; private set; }
+
+            // Guarded by GifLoader's lock
+            public int Readers { get; set; }
+
+            public ulong? TotalBytes
+            {
+                get { lock (_lock) return _totalBytes; }
+            }
+
+            public async Task PumpAsync()
+            {
+                try
+                {
+                    var token = _cancellation.Token;
+                    using (var client = new HttpClient())
+                    using (var response = await client.GetAsync(Uri, HttpCompletionOption.ResponseHeadersRead).AsTask(token))
+                    {
+                        response.EnsureSuccessStatusCode();
+                        lock (_lock) _totalBytes = response.Content.Headers.ContentLength;
+
+                        using (var input = await response.Content.ReadAsInputStreamAsync().AsTask(token))
+                        {
+                            while (true)
+                            {
+                                var buffer = await input.ReadAsync(
+                                    new Windows.Storage.Streams.Buffer(DownloadChunkSize), DownloadChunkSize, InputStreamOptions.Partial).AsTask(token);
+                                if (buffer.Length == 0)
+                                    break;
+
+                                Publish(buffer, false, null);
+                            }
+                        }
+                    }
+
+                    Publish(null, true, null);
+                }
+                catch (Exception ex)
+                {
+                    Publish(null, true, ex);
+                }
+            }
+
+            public void Cancel()
+            {
+                _cancellation.Cancel();
+            }
+
+            // Gets the chunk at the index, waiting for it to arrive. Null once the download is done.
+            public async Task<IBuffer> ReadAsync(int index, CancellationToken token)
+            {
+                while (true)
+                {
+                    Task changed;
+                    lock (_lock)
+                    {
+                        if (index < _chunks.Count)
+                            return _chunks[index];
+                        if (_error != null)
+                            throw new IOException("download failed", _error);
+                        if (_completed)
+                            return null;
+
+                        changed = _changed.Task;
+                    }
+
+                    var cancelled = new TaskCompletionSource<bool>();
+                    using (token.Register(() => cancelled.TrySetCanceled()))
+                    {
+                        await Task.WhenAny(changed, cancelled.Task);
+                    }
+                    token.ThrowIfCancellationRequested();
+                }
+            }
+
+            private void Publish(IBuffer buffer, bool completed, Exception error)
+            {
+                TaskCompletionSource<bool> changed;
+                lock (_lock)
+                {
+                    if (buffer != null)
+                        _chunks.Add(buffer);
+                    _completed = completed;
+                    _error = error;
+
+                    changed = _changed;
+                    _changed = new TaskCompletionSource<bool>();
+                }
+
+                changed.TrySetResult(true);
+            }
+        }
+    }
+
+    // A load's place in GifLoader's queue, and then its slot
+    public sealed class GifLoadTicket : IDisposable
+    {
+        private GifLoadPriority _priority;
+
+        internal GifLoadTicket(GifLoadPriority priority)
+        {
+            _priority = priority;
+            Completion = new TaskCompletionSource<GifLoadTicket>();
+        }
+
+        // Can be changed while the load waits, e.g. as an item scrolls into view
+        public GifLoadPriority Priority
+        {
+            get { return _priority; }
+            set { _priority = value; }
+        }
+
+        internal long Sequence { get; set; }
+        internal bool HasSlot { get; set; }
+        internal TaskCompletionSource<GifLoadTicket> Completion { get; private set; }
+
+        public void Dispose()
+        {
+            GifLoader.ReleaseSlot(this);
+        }
+    }
+
+    // One load's view of a shared download
+    public sealed class GifDownloadReader : IDisposable
+    {
+        private readonly GifLoader.SharedDownload _download;
+        private int _next;
+        private bool _disposed;
+
+        internal GifDownloadReader(GifLoader.SharedDownload download)
+        {
+            _download = download;
+        }
+
+        // Known once the response headers have arrived, if the server sent a length
+        public ulong? TotalBytes
+        {
+            get { return _download.TotalBytes; }
+        }
+
+        // Gets the next piece of the response, waiting for it to arrive. Null at the end.
+        public async Task<IBuffer> ReadAsync(CancellationToken token)
+        {
+            var buffer = await _download.ReadAsync(_next, token);
+            if (buffer != null)
+                _next++;
+            return buffer;
+        }
+
+        public void Dispose()
+        {
+            if (_disposed)
+                return;
+
+            _disposed = true;
+            GifLoader.CloseDownload(_download);
+        }
+    }
+}
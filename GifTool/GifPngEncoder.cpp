@@ -0,0 +1,366 @@
+﻿#include "GifPngEncoder.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+using namespace Em::Gif;
+
+namespace
+{
+    const size_t WindowSize = 32768;        // the most deflate can reach back
+    const size_t MinMatch = 3;
+    const size_t MaxMatch = 258;
+    const uint32_t MaxChain = 64;           // candidates tried per position
+    const uint32_t HashSize = 1 << 15;
+    const size_t BytesPerPixel = 4;
+
+    const uint16_t LengthBase[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    const uint8_t LengthExtra[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    const uint16_t DistanceBase[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    const uint8_t DistanceExtra[] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+    struct CrcTable
+    {
+        CrcTable()
+        {
+            for (uint32_t n = 0; n < 256; n++)
+            {
+                auto c = n;
+                for (int k = 0; k < 8; k++)
+                {
+                    c = (c & 1) != 0 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+                }
+                entries[n] = c;
+            }
+        }
+
+        uint32_t entries[256];
+    };
+
+    // Constructed during module initialization, so there's no lazy-initialization race
+    const CrcTable g_crcTable;
+
+    uint32_t UpdateCrc(uint32_t crc, const uint8_t *pData, size_t cbData)
+    {
+        for (size_t i = 0; i < cbData; i++)
+        {
+            crc = g_crcTable.entries[(crc ^ pData[i]) & 0xFF] ^ (crc >> 8);
+        }
+        return crc;
+    }
+
+    uint32_t Adler32(const std::vector<uint8_t> &data)
+    {
+        const uint32_t Modulus = 65521;
+        const size_t BlockSize = 5552;      // the most bytes that can be summed before b overflows
+
+        uint32_t a = 1;
+        uint32_t b = 0;
+        for (size_t i = 0; i < data.size(); i += BlockSize)
+        {
+            auto end = std::min(data.size(), i + BlockSize);
+            for (auto j = i; j < end; j++)
+            {
+                a += data[j];
+                b += a;
+            }
+            a %= Modulus;
+            b %= Modulus;
+        }
+        return (b << 16) | a;
+    }
+
+    void WriteBigEndian(std::vector<uint8_t> &out, uint32_t value)
+    {
+        out.push_back(static_cast<uint8_t>(value >> 24));
+        out.push_back(static_cast<uint8_t>(value >> 16));
+        out.push_back(static_cast<uint8_t>(value >> 8));
+        out.push_back(static_cast<uint8_t>(value));
+    }
+
+    void WriteChunk(std::vector<uint8_t> &out, const char *pType, const std::vector<uint8_t> &data)
+    {
+        WriteBigEndian(out, static_cast<uint32_t>(data.size()));
+        auto start = out.size();
+        out.insert(out.end(), pType, pType + 4);
+        out.insert(out.end(), data.begin(), data.end());
+        WriteBigEndian(out, UpdateCrc(0xFFFFFFFF, out.data() + start, out.size() - start) ^ 0xFFFFFFFF);
+    }
+
+    // Packs bits least significant first, as deflate wants everything but Huffman codes
+    class BitWriter
+    {
+    public:
+        explicit BitWriter(std::vector<uint8_t> &out) : m_out(out), m_bits(0), m_bitCount(0) {}
+
+        void Write(uint32_t value, uint32_t count)
+        {
+            m_bits |= static_cast<uint64_t>(value) << m_bitCount;
+            m_bitCount += count;
+            while (m_bitCount >= 8)
+            {
+                m_out.push_back(static_cast<uint8_t>(m_bits));
+                m_bits >>= 8;
+                m_bitCount -= 8;
+            }
+        }
+
+        // Huffman codes go most significant bit first
+        void WriteCode(uint32_t code, uint32_t length)
+        {
+            uint32_t reversed = 0;
+            for (uint32_t i = 0; i < length; i++)
+            {
+                reversed |= ((code >> i) & 1) << (length - 1 - i);
+            }
+            Write(reversed, length);
+        }
+
+        void Flush()
+        {
+            if (m_bitCount > 0)
+            {
+                m_out.push_back(static_cast<uint8_t>(m_bits));
+                m_bits = 0;
+                m_bitCount = 0;
+            }
+        }
+
+    private:
+        std::vector<uint8_t> &m_out;
+        uint64_t m_bits;
+        uint32_t m_bitCount;
+    };
+
+    // Writes a literal/length symbol in the fixed code
+    void WriteSymbol(BitWriter &writer, uint32_t symbol)
+    {
+        if (symbol < 144)
+        {
+            writer.WriteCode(0x30 + symbol, 8);
+        }
+        else if (symbol < 256)
+        {
+            writer.WriteCode(0x190 + symbol - 144, 9);
+        }
+        else if (symbol < 280)
+        {
+            writer.WriteCode(symbol - 256, 7);
+        }
+        else
+        {
+            writer.WriteCode(0xC0 + symbol - 280, 8);
+        }
+    }
+
+    void WriteMatch(BitWriter &writer, size_t length, size_t distance)
+    {
+        uint32_t lengthCode = 0;
+        while (lengthCode + 1 < sizeof(LengthBase) / sizeof(LengthBase[0]) && LengthBase[lengthCode + 1] <= length)
+        {
+            lengthCode++;
+        }
+        WriteSymbol(writer, 257 + lengthCode);
+        writer.Write(static_cast<uint32_t>(length - LengthBase[lengthCode]), LengthExtra[lengthCode]);
+
+        uint32_t distanceCode = 0;
+        while (distanceCode + 1 < sizeof(DistanceBase) / sizeof(DistanceBase[0]) && DistanceBase[distanceCode + 1] <= distance)
+        {
+            distanceCode++;
+        }
+        writer.WriteCode(distanceCode, 5);
+        writer.Write(static_cast<uint32_t>(distance - DistanceBase[distanceCode]), DistanceExtra[distanceCode]);
+    }
+
+    // Compresses into a zlib stream holding a single fixed-code block. Matches are found greedily
+    // through hash chains of every earlier position with the same three bytes.
+    std::vector<uint8_t> Deflate(const std::vector<uint8_t> &input)
+    {
+        std::vector<uint8_t> out;
+        out.push_back(0x78);        // deflate, 32K window
+        out.push_back(0x01);        // no preset dictionary; check bits
+
+        BitWriter writer(out);
+        writer.Write(1, 1);         // final block
+        writer.Write(1, 2);         // fixed Huffman codes
+
+        std::vector<int32_t> head(HashSize, -1);
+        std::vector<int32_t> previous(WindowSize, -1);
+        auto hash = [&](size_t i)
+        {
+            return ((static_cast<uint32_t>(input[i]) << 10) ^ (static_cast<uint32_t>(input[i + 1]) << 5) ^ input[i + 2]) & (HashSize - 1);
+        };
+        auto insert = [&](size_t i)
+        {
+            auto h = hash(i);
+            previous[i & (WindowSize - 1)] = head[h];
+            head[h] = static_cast<int32_t>(i);
+        };
+
+        size_t i = 0;
+        auto cbInput = input.size();
+        while (i < cbInput)
+        {
+            size_t bestLength = 0;
+            size_t bestDistance = 0;
+            if (i + MinMatch <= cbInput)
+            {
+                auto maxLength = std::min(MaxMatch, cbInput - i);
+                auto candidate = head[hash(i)];
+                for (uint32_t chain = 0; candidate >= 0 && i - candidate <= WindowSize && chain < MaxChain; chain++)
+                {
+                    auto pCandidate = input.data() + candidate;
+                    auto pCurrent = input.data() + i;
+
+                    // Only a match that beats the best so far is worth measuring
+                    if (pCandidate[bestLength] == pCurrent[bestLength])
+                    {
+                        size_t length = 0;
+                        while (length < maxLength && pCandidate[length] == pCurrent[length])
+                        {
+                            length++;
+                        }
+                        if (length > bestLength)
+                        {
+                            bestLength = length;
+                            bestDistance = i - candidate;
+                            if (length == maxLength)
+                            {
+                                break;
+                            }
+                        }
+                    }
+                    candidate = previous[candidate & (WindowSize - 1)];
+                }
+                insert(i);
+            }
+
+            if (bestLength >= MinMatch)
+            {
+                WriteMatch(writer, bestLength, bestDistance);
+                for (auto j = i + 1; j < i + bestLength && j + MinMatch <= cbInput; j++)
+                {
+                    insert(j);
+                }
+                i += bestLength;
+            }
+            else
+            {
+                WriteSymbol(writer, input[i]);
+                i++;
+            }
+        }
+
+        WriteSymbol(writer, 256);   // end of block
+        writer.Flush();
+        WriteBigEndian(out, Adler32(input));
+        return out;
+    }
+
+    uint8_t Paeth(uint8_t a, uint8_t b, uint8_t c)
+    {
+        auto p = static_cast<int>(a) + b - c;
+        auto pa = std::abs(p - a);
+        auto pb = std::abs(p - b);
+        auto pc = std::abs(p - c);
+        return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+    }
+
+    void FilterRow(uint8_t filter, const uint8_t *pRow, const uint8_t *pAbove, uint8_t *pOut, size_t cbRow)
+    {
+        for (size_t i = 0; i < cbRow; i++)
+        {
+            uint8_t left = i >= BytesPerPixel ? pRow[i - BytesPerPixel] : 0;
+            uint8_t aboveLeft = i >= BytesPerPixel ? pAbove[i - BytesPerPixel] : 0;
+            switch (filter)
+            {
+            case 0:
+                pOut[i] = pRow[i];
+                break;
+            case 1:
+                pOut[i] = static_cast<uint8_t>(pRow[i] - left);
+                break;
+            case 2:
+                pOut[i] = static_cast<uint8_t>(pRow[i] - pAbove[i]);
+                break;
+            default:
+                pOut[i] = static_cast<uint8_t>(pRow[i] - Paeth(left, pAbove[i], aboveLeft));
+                break;
+            }
+        }
+    }
+}
+
+std::vector<uint8_t> Em::Gif::EncodePng(const uint32_t *pPixels, uint32_t width, uint32_t height)
+{
+    auto cbRow = static_cast<size_t>(width) * BytesPerPixel;
+    std::vector<uint8_t> filtered;
+    filtered.reserve((cbRow + 1) * height);
+
+    std::vector<uint8_t> row(cbRow);
+    std::vector<uint8_t> above(cbRow, 0);
+    std::vector<uint8_t> candidate(cbRow);
+    std::vector<uint8_t> best(cbRow);
+    for (uint32_t y = 0; y < height; y++)
+    {
+        auto pSource = pPixels + static_cast<size_t>(y) * width;
+        for (uint32_t x = 0; x < width; x++)
+        {
+            auto pixel = pSource[x];
+            auto alpha = pixel >> 24;
+            auto pDest = row.data() + x * BytesPerPixel;
+            for (int channel = 0; channel < 3; channel++)
+            {
+                // BGRA in memory; PNG wants RGBA
+                auto value = (pixel >> (16 - 8 * channel)) & 0xFF;
+                if (alpha != 0 && alpha != 255)
+                {
+                    value = std::min<uint32_t>(255, (value * 255 + alpha / 2) / alpha);
+                }
+                pDest[channel] = static_cast<uint8_t>(value);
+            }
+            pDest[3] = static_cast<uint8_t>(alpha);
+        }
+
+        // Keep whichever filter leaves the smallest residuals, the usual guess at what will
+        // compress best
+        const uint8_t Filters[] = { 0, 1, 2, 4 };
+        uint8_t bestFilter = 0;
+        auto bestSum = UINT64_MAX;
+        for (auto filter : Filters)
+        {
+            FilterRow(filter, row.data(), above.data(), candidate.data(), cbRow);
+            uint64_t sum = 0;
+            for (auto value : candidate)
+            {
+                sum += static_cast<uint64_t>(std::abs(static_cast<int>(static_cast<int8_t>(value))));
+            }
+            if (sum < bestSum)
+            {
+                bestSum = sum;
+                bestFilter = filter;
+                best.swap(candidate);
+            }
+        }
+
+        filtered.push_back(bestFilter);
+        filtered.insert(filtered.end(), best.begin(), best.end());
+        row.swap(above);
+    }
+
+    const uint8_t Signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    std::vector<uint8_t> png(Signature, Signature + sizeof(Signature));
+
+    std::vector<uint8_t> header;
+    WriteBigEndian(header, width);
+    WriteBigEndian(header, height);
+    header.push_back(8);        // bits per channel
+    header.push_back(6);        // RGBA
+    header.push_back(0);        // deflate
+    header.push_back(0);        // adaptive filtering
+    header.push_back(0);        // not interlaced
+    WriteChunk(png, "IHDR", header);
+    WriteChunk(png, "IDAT", Deflate(filtered));
+    WriteChunk(png, "IEND", std::vector<uint8_t>());
+    return png;
+}
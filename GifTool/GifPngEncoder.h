@@ -0,0 +1,21 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Just enough of a PNG writer for sprite sheets and thumbnails, so the tool needs nothing beyond
+// the standard library. Compression is deflate with the fixed Huffman codes; it trails zlib by a
+// few percent on GIF content, which is mostly long runs that LZ77 alone takes care of.
+
+namespace Em {
+    namespace Gif
+    {
+        /// <summary>
+        /// Encodes premultiplied BGRA pixels as an 8-bit RGBA PNG. PNG alpha is straight, so
+        /// partially transparent pixels are unpremultiplied; GIF pixels are only ever fully opaque
+        /// or fully transparent, so nothing composed from them loses precision.
+        /// </summary>
+        std::vector<uint8_t> EncodePng(const uint32_t *pPixels, uint32_t width, uint32_t height);
+    }
+}
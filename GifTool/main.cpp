@@ -0,0 +1,534 @@
+﻿// Batch tool over the portable decode and composition code, for preparing GIFs off-device. For
+// each file it can write a JSON profile (frames, delays, loop count, how much of the canvas each
+// frame changes and what each way of playing it back would keep resident) and a sprite sheet of
+// the composed frames. Files are spread over threads, one file per thread at a time.
+//
+//   GifTool [--threads N] [--max-size WxH] [--profile] [--sheet png|raw] [--columns N]
+//           [--budget BYTES] [--output DIR] file.gif ...
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <chrono>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "GifDecoder.h"
+#include "GifFrameSet.h"
+#include "GifPngEncoder.h"
+#include "GifWorkerPool.h"
+
+using namespace Em::Gif;
+
+// Profiles are versioned so scripts reading them can tell when fields change meaning
+static const int SchemaVersion = 1;
+
+namespace
+{
+    // Same as GifPlayer: shorter delays than this play as DefaultDelay; in hundredths of a second
+    const uint16_t MinimumDelay = 3;
+    const uint16_t DefaultDelay = 10;
+
+    enum class SheetFormat
+    {
+        None,
+        Png,
+        Raw         // premultiplied BGRA rows, no header
+    };
+
+    struct Options
+    {
+        uint32_t threads;
+        uint32_t maxWidth;
+        uint32_t maxHeight;
+        bool profile;
+        SheetFormat sheet;
+        uint32_t columns;       // 0 picks a roughly square sheet
+        uint64_t budget;        // 0 if there's none
+        std::string outputDirectory;
+        std::vector<std::string> files;
+    };
+
+    struct FrameProfile
+    {
+        uint32_t left;
+        uint32_t top;
+        uint32_t width;
+        uint32_t height;
+        uint16_t delay;
+        GifDisposal disposal;
+        bool hasTransparency;
+        bool interlaced;
+
+        // Smallest rectangle holding every pixel that differs from the previous composed frame;
+        // the whole canvas for the first frame, and empty if nothing changed
+        uint32_t dirtyLeft;
+        uint32_t dirtyTop;
+        uint32_t dirtyWidth;
+        uint32_t dirtyHeight;
+    };
+
+    struct FileResult
+    {
+        std::string path;
+        std::string error;      // empty if the file was processed
+        size_t bytes;
+
+        // The logical screen as encoded, and as decoded after --max-size
+        uint32_t encodedWidth;
+        uint32_t encodedHeight;
+        uint32_t width;
+        uint32_t height;
+
+        bool isAnimated;
+        uint16_t loopCount;
+        uint64_t durationMs;    // one loop, as GifPlayer plays it
+        std::vector<FrameProfile> frames;
+
+        // What a player keeps resident for each way of playing the GIF: every composed frame
+        // prerendered in each storage, composing from the raw frames as it goes, and composing
+        // from the compressed data once the memory budget has degraded the image all the way
+        uint64_t bgraBytes;
+        uint64_t indexedBytes;
+        uint64_t deltaBytes;
+        uint64_t composeOnDemandBytes;
+        uint64_t compressedBytes;
+
+        uint32_t sheetColumns;
+        uint32_t sheetRows;
+
+        double elapsedMs;
+    };
+
+    // Seconds on a high-resolution monotonic clock. VS2013's steady_clock only ticks with the
+    // system time, so Windows goes straight to the performance counter.
+    double Now()
+    {
+#ifdef _WIN32
+        LARGE_INTEGER frequency, counter;
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&counter);
+        return static_cast<double>(counter.QuadPart) / static_cast<double>(frequency.QuadPart);
+#else
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    std::string JsonString(const std::string &value)
+    {
+        std::string json = "\"";
+        for (auto c : value)
+        {
+            if (c == '"' || c == '\\')
+            {
+                json += '\\';
+                json += c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20)
+            {
+                static const char Hex[] = "0123456789abcdef";
+                json += "\\u00";
+                json += Hex[(c >> 4) & 0xF];
+                json += Hex[c & 0xF];
+            }
+            else
+            {
+                json += c;
+            }
+        }
+        return json + "\"";
+    }
+
+    const char *GetDisposalName(GifDisposal disposal)
+    {
+        switch (disposal)
+        {
+        case GifDisposal::None:
+            return "none";
+        case GifDisposal::RestoreBackground:
+            return "restoreBackground";
+        case GifDisposal::RestorePrevious:
+            return "restorePrevious";
+        default:
+            return "unspecified";
+        }
+    }
+
+    bool ReadFile(const std::string &path, std::vector<uint8_t> &data)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+        {
+            return false;
+        }
+        data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    void WriteFile(const std::string &path, const void *pData, size_t cbData)
+    {
+        std::ofstream file(path, std::ios::binary);
+        file.write(static_cast<const char *>(pData), cbData);
+        if (!file)
+        {
+            throw std::runtime_error("Couldn't write " + path);
+        }
+    }
+
+    // Where a file's outputs go: its name, without directory or extension, in the output directory
+    std::string GetOutputStem(const Options &options, const std::string &path)
+    {
+        auto start = path.find_last_of("/\\");
+        auto name = start == std::string::npos ? path : path.substr(start + 1);
+        auto extension = name.find_last_of('.');
+        if (extension != std::string::npos && extension != 0)
+        {
+            name.erase(extension);
+        }
+        return options.outputDirectory + "/" + name;
+    }
+
+    void WriteProfile(FILE *pFile, const Options &options, const FileResult &result)
+    {
+        fprintf(pFile, "{\n");
+        fprintf(pFile, "  \"schemaVersion\": %d,\n", SchemaVersion);
+        fprintf(pFile, "  \"file\": %s,\n", JsonString(result.path).c_str());
+        fprintf(pFile, "  \"bytes\": %llu,\n", static_cast<unsigned long long>(result.bytes));
+        fprintf(pFile, "  \"width\": %u,\n", result.encodedWidth);
+        fprintf(pFile, "  \"height\": %u,\n", result.encodedHeight);
+        fprintf(pFile, "  \"decodedWidth\": %u,\n", result.width);
+        fprintf(pFile, "  \"decodedHeight\": %u,\n", result.height);
+        fprintf(pFile, "  \"frameCount\": %u,\n", static_cast<uint32_t>(result.frames.size()));
+        fprintf(pFile, "  \"isAnimated\": %s,\n", result.isAnimated ? "true" : "false");
+        fprintf(pFile, "  \"loopCount\": %u,\n", result.loopCount);
+        fprintf(pFile, "  \"durationMs\": %llu,\n", static_cast<unsigned long long>(result.durationMs));
+        fprintf(pFile, "  \"elapsedMs\": %.3f,\n", result.elapsedMs);
+        fprintf(pFile, "  \"projectedBytes\": {\n");
+        fprintf(pFile, "    \"bgra\": %llu,\n", static_cast<unsigned long long>(result.bgraBytes));
+        fprintf(pFile, "    \"indexed\": %llu,\n", static_cast<unsigned long long>(result.indexedBytes));
+        fprintf(pFile, "    \"delta\": %llu,\n", static_cast<unsigned long long>(result.deltaBytes));
+        fprintf(pFile, "    \"composeOnDemand\": %llu,\n", static_cast<unsigned long long>(result.composeOnDemandBytes));
+        fprintf(pFile, "    \"compressed\": %llu\n", static_cast<unsigned long long>(result.compressedBytes));
+        fprintf(pFile, "  },\n");
+        if (options.budget != 0)
+        {
+            fprintf(pFile, "  \"budget\": %llu,\n", static_cast<unsigned long long>(options.budget));
+            fprintf(pFile, "  \"exceedsBudget\": %s,\n", result.bgraBytes > options.budget ? "true" : "false");
+        }
+        if (options.sheet != SheetFormat::None)
+        {
+            fprintf(pFile, "  \"sheet\": {\n");
+            fprintf(pFile, "    \"format\": \"%s\",\n", options.sheet == SheetFormat::Png ? "png" : "raw");
+            fprintf(pFile, "    \"columns\": %u,\n", result.sheetColumns);
+            fprintf(pFile, "    \"rows\": %u,\n", result.sheetRows);
+            fprintf(pFile, "    \"width\": %u,\n", result.sheetColumns * result.width);
+            fprintf(pFile, "    \"height\": %u\n", result.sheetRows * result.height);
+            fprintf(pFile, "  },\n");
+        }
+        fprintf(pFile, "  \"frames\": [");
+        for (size_t i = 0; i < result.frames.size(); i++)
+        {
+            auto &frame = result.frames[i];
+            fprintf(pFile, "%s\n    {", i == 0 ? "" : ",");
+            fprintf(pFile, " \"left\": %u, \"top\": %u, \"width\": %u, \"height\": %u,", frame.left, frame.top, frame.width, frame.height);
+            fprintf(pFile, " \"delay\": %u, \"disposal\": \"%s\",", frame.delay, GetDisposalName(frame.disposal));
+            fprintf(pFile, " \"transparent\": %s, \"interlaced\": %s,", frame.hasTransparency ? "true" : "false", frame.interlaced ? "true" : "false");
+            fprintf(pFile, " \"dirty\": { \"left\": %u, \"top\": %u, \"width\": %u, \"height\": %u } }",
+                frame.dirtyLeft, frame.dirtyTop, frame.dirtyWidth, frame.dirtyHeight);
+        }
+        fprintf(pFile, "\n  ]\n}\n");
+    }
+
+    // Lays every composed frame out left to right, top to bottom, and writes the sheet
+    void WriteSheet(const Options &options, const GifFrameSet &frameSet, FileResult &result)
+    {
+        auto cFrames = frameSet.GetFrameCount();
+        result.sheetColumns = options.columns != 0 ? std::min(options.columns, cFrames) : static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(cFrames))));
+        result.sheetRows = (cFrames + result.sheetColumns - 1) / result.sheetColumns;
+
+        uint64_t sheetWidth = static_cast<uint64_t>(result.sheetColumns) * frameSet.width;
+        uint64_t sheetHeight = static_cast<uint64_t>(result.sheetRows) * frameSet.height;
+        if (sheetWidth > INT32_MAX || sheetHeight > INT32_MAX || sheetWidth * sheetHeight > SIZE_MAX / sizeof(uint32_t))
+        {
+            throw std::runtime_error("Sprite sheet too large; try --max-size or --columns");
+        }
+
+        std::vector<uint32_t> sheet(static_cast<size_t>(sheetWidth * sheetHeight));
+        GifFrameBuffer buffer;
+        for (uint32_t i = 0; i < cFrames; i++)
+        {
+            auto pFrame = frameSet.GetComposedFrame(i, buffer);
+            auto pCell = sheet.data() + (i / result.sheetColumns) * frameSet.height * sheetWidth + (i % result.sheetColumns) * frameSet.width;
+            for (uint32_t y = 0; y < frameSet.height; y++)
+            {
+                std::copy(pFrame + y * frameSet.width, pFrame + (y + 1) * frameSet.width, pCell + y * sheetWidth);
+            }
+        }
+
+        auto stem = GetOutputStem(options, result.path);
+        if (options.sheet == SheetFormat::Png)
+        {
+            auto png = EncodePng(sheet.data(), static_cast<uint32_t>(sheetWidth), static_cast<uint32_t>(sheetHeight));
+            WriteFile(stem + ".png", png.data(), png.size());
+        }
+        else
+        {
+            WriteFile(stem + ".bgra", sheet.data(), sheet.size() * sizeof(uint32_t));
+        }
+    }
+
+    void ProcessFile(const Options &options, FileResult &result)
+    {
+        auto start = Now();
+
+        std::vector<uint8_t> data;
+        if (!ReadFile(result.path, data))
+        {
+            throw std::runtime_error("Couldn't read " + result.path);
+        }
+        result.bytes = data.size();
+
+        GifDecoder decoder(data.data(), data.size());
+        result.encodedWidth = decoder.GetInfo().width;
+        result.encodedHeight = decoder.GetInfo().height;
+        decoder.SetMaxDecodeSize(options.maxWidth, options.maxHeight);
+
+        auto pRaw = GifFrameSet::Decode(decoder, false);
+        if (pRaw->frames.empty())
+        {
+            throw GifFormatException("No frames");
+        }
+
+        // The set settles the canvas size, zero-sized logical screens included
+        auto &info = decoder.GetInfo();
+        result.width = pRaw->width;
+        result.height = pRaw->height;
+        result.isAnimated = pRaw->isAnimated;
+        result.loopCount = pRaw->loopCount;
+
+        uint64_t cbFrame = static_cast<uint64_t>(pRaw->width) * pRaw->height * sizeof(uint32_t);
+        result.bgraBytes = cbFrame * pRaw->frames.size();
+        result.composeOnDemandBytes = pRaw->GetByteSize() + cbFrame;
+        result.compressedBytes = data.size() + cbFrame;
+        result.indexedBytes = options.profile ? GifFrameSet::Create(info, pRaw->frames, true, GifFrameStorage::Indexed)->GetByteSize() : 0;
+
+        result.durationMs = 0;
+        for (auto &frame : pRaw->frames)
+        {
+            FrameProfile profile = {};
+            profile.left = frame.left;
+            profile.top = frame.top;
+            profile.width = frame.width;
+            profile.height = frame.height;
+            profile.delay = frame.delay;
+            profile.disposal = frame.disposal;
+            profile.hasTransparency = frame.hasTransparency;
+            profile.interlaced = frame.interlaced;
+            result.frames.push_back(profile);
+            result.durationMs += 10 * (frame.delay < MinimumDelay ? DefaultDelay : frame.delay);
+        }
+
+        // Delta storage works out the dirty rectangles as it composes, and rebuilding the frames
+        // for the sheet from it holds the least memory
+        auto pComposed = GifFrameSet::Create(info, std::move(pRaw->frames), true, GifFrameStorage::Delta);
+        pRaw.reset();
+        result.deltaBytes = pComposed->GetByteSize();
+        result.frames[0].dirtyWidth = pComposed->width;
+        result.frames[0].dirtyHeight = pComposed->height;
+        for (size_t i = 1; i < result.frames.size(); i++)
+        {
+            auto &delta = pComposed->deltas[i];
+            result.frames[i].dirtyLeft = delta.left;
+            result.frames[i].dirtyTop = delta.top;
+            result.frames[i].dirtyWidth = delta.width;
+            result.frames[i].dirtyHeight = delta.height;
+        }
+
+        if (options.sheet != SheetFormat::None)
+        {
+            WriteSheet(options, *pComposed, result);
+        }
+        result.elapsedMs = (Now() - start) * 1000;
+
+        if (options.profile)
+        {
+            auto path = GetOutputStem(options, result.path) + ".json";
+            auto pFile = fopen(path.c_str(), "w");
+            if (pFile == nullptr)
+            {
+                throw std::runtime_error("Couldn't write " + path);
+            }
+            WriteProfile(pFile, options, result);
+            fclose(pFile);
+        }
+    }
+
+    bool ParseSize(const std::string &size, uint32_t &width, uint32_t &height)
+    {
+        auto separator = size.find('x');
+        if (separator == std::string::npos)
+        {
+            return false;
+        }
+        width = static_cast<uint32_t>(std::max(0, atoi(size.substr(0, separator).c_str())));
+        height = static_cast<uint32_t>(std::max(0, atoi(size.substr(separator + 1).c_str())));
+        return true;
+    }
+
+    bool ParseOptions(int argc, char **argv, Options &options)
+    {
+        options.threads = GifWorkerPool::GetDefaultWorkerCount();
+        options.maxWidth = 0;
+        options.maxHeight = 0;
+        options.profile = false;
+        options.sheet = SheetFormat::None;
+        options.columns = 0;
+        options.budget = 0;
+        options.outputDirectory = ".";
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            auto hasValue = i + 1 < argc;
+            if (arg == "--threads" && hasValue)
+            {
+                options.threads = static_cast<uint32_t>(std::max(1, atoi(argv[++i])));
+            }
+            else if (arg == "--max-size" && hasValue)
+            {
+                if (!ParseSize(argv[++i], options.maxWidth, options.maxHeight))
+                {
+                    return false;
+                }
+            }
+            else if (arg == "--profile")
+            {
+                options.profile = true;
+            }
+            else if (arg == "--sheet" && hasValue)
+            {
+                std::string format = argv[++i];
+                if (format == "png")
+                {
+                    options.sheet = SheetFormat::Png;
+                }
+                else if (format == "raw")
+                {
+                    options.sheet = SheetFormat::Raw;
+                }
+                else
+                {
+                    return false;
+                }
+            }
+            else if (arg == "--columns" && hasValue)
+            {
+                options.columns = static_cast<uint32_t>(std::max(0, atoi(argv[++i])));
+            }
+            else if (arg == "--budget" && hasValue)
+            {
+                options.budget = strtoull(argv[++i], nullptr, 10);
+            }
+            else if (arg == "--output" && hasValue)
+            {
+                options.outputDirectory = argv[++i];
+            }
+            else if (arg.compare(0, 2, "--") == 0)
+            {
+                return false;
+            }
+            else
+            {
+                options.files.push_back(arg);
+            }
+        }
+
+        // With nothing else asked for, profiling is what's wanted
+        if (options.sheet == SheetFormat::None)
+        {
+            options.profile = true;
+        }
+        return !options.files.empty();
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        fprintf(stderr, "usage: GifTool [--threads N] [--max-size WxH] [--profile] [--sheet png|raw] [--columns N] [--budget BYTES] [--output DIR] file.gif ...\n");
+        return 2;
+    }
+
+    std::vector<FileResult> results(options.files.size());
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        results[i].path = options.files[i];
+    }
+
+    // Each thread takes the next file until there are none left. Files are independent, so this
+    // scales with cores without splitting any one file's work up.
+    auto start = Now();
+    std::atomic<size_t> next(0);
+    auto work = [&]
+    {
+        for (auto i = next++; i < results.size(); i = next++)
+        {
+            try
+            {
+                ProcessFile(options, results[i]);
+            }
+            catch (const std::exception &e)
+            {
+                results[i].error = e.what();
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    auto cThreads = std::min<size_t>(options.threads, results.size());
+    for (size_t i = 1; i < cThreads; i++)
+    {
+        threads.push_back(std::thread(work));
+    }
+    work();
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    auto elapsed = Now() - start;
+
+    // One line per file, in the order given, so the output can be diffed and grepped
+    auto failed = false;
+    uint64_t cFrames = 0;
+    for (auto &result : results)
+    {
+        if (!result.error.empty())
+        {
+            fprintf(stderr, "%s: %s\n", result.path.c_str(), result.error.c_str());
+            failed = true;
+            continue;
+        }
+
+        cFrames += result.frames.size();
+        printf("%s: %u frames, %ux%u, %.1f MB prerendered%s\n", result.path.c_str(), static_cast<uint32_t>(result.frames.size()),
+            result.width, result.height, result.bgraBytes / 1e6, options.budget != 0 && result.bgraBytes > options.budget ? ", over budget" : "");
+    }
+    fprintf(stderr, "%u files, %llu frames in %.2f s on %u threads\n", static_cast<uint32_t>(results.size()),
+        static_cast<unsigned long long>(cFrames), elapsed, static_cast<uint32_t>(cThreads));
+    return failed ? 1 : 0;
+}